@@ -87,6 +87,18 @@ struct acism {
     SYMBOL symv[256];
 };
 
+// Header of a serialised trie: followed by struct acism, tranv[] and hashv[]
+#define ACISM_MAGIC "acism\0\0\2"
+#define ACISM_ID_MAX 64
+
+typedef struct {
+    char magic[8];
+    uint8_t id[ACISM_ID_MAX]; // Caller supplied id of the patterns set
+    uint32_t id_len;
+    uint32_t hdr_size, trie_size, tran_bytes;
+    uint32_t tran_size, hash_size, nstrs, pad;
+} ACISM_HDR;
+
 #include "acism.h"
 
 // p_size: size of tranv + hashv
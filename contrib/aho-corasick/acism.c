@@ -21,6 +21,8 @@
 
 #include "_acism.h"
 #include "unix-std.h"
+#include <errno.h>
+#include <string.h>
 
 #define BACK ((SYMBOL)0)
 #define ROOT ((STATE) 0)
@@ -116,9 +118,106 @@ acism_destroy(ac_trie_t *psp)
 {
 	if (!psp) return;
 	if (psp->flags & IS_MMAP)
-		munmap((char*)psp->tranv - sizeof(ac_trie_t),
-				sizeof(ac_trie_t) + p_size(psp));
+		munmap((char*)psp->tranv - sizeof(ac_trie_t) - sizeof(ACISM_HDR),
+				sizeof(ACISM_HDR) + sizeof(ac_trie_t) + p_size(psp));
 	else g_free(psp->tranv);
 	g_free(psp);
 }
+
+// Writes the header with (id) and the dimensions of the trie followed by
+//  the trie itself, tranv[] and hashv[], so the result can be mapped back
+//  by acism_mmap.
+int
+acism_dump(ac_trie_t const *psp, int fd, void const *id, size_t idlen)
+{
+    char const *cp;
+    size_t left;
+    ssize_t r;
+    ACISM_HDR hdr;
+
+    if (idlen > ACISM_ID_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ACISM_MAGIC, sizeof(hdr.magic));
+    memcpy(hdr.id, id, idlen);
+    hdr.id_len = idlen;
+    hdr.hdr_size = sizeof(hdr);
+    hdr.trie_size = sizeof(*psp);
+    hdr.tran_bytes = sizeof(TRAN);
+    hdr.tran_size = psp->tran_size;
+    hdr.hash_size = psp->hash_size;
+    hdr.nstrs = psp->nstrs;
+
+    struct { char const *ptr; size_t len; } parts[3] = {
+        {(char const *)&hdr, sizeof(hdr)},
+        {(char const *)psp, sizeof(*psp)},
+        {(char const *)psp->tranv, p_size(psp)},
+    };
+
+    for (unsigned i = 0; i < 3; i++) {
+        for (cp = parts[i].ptr, left = parts[i].len; left > 0; cp += r, left -= r) {
+            r = write(fd, cp, left);
+            if (r == -1) {
+                if (errno == EINTR) { r = 0; continue; }
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Creates a trie from a memory map of a file written by acism_dump.
+//  The header must match (id), (nstrs) and the layout of this build,
+//  the trie owns the map on success and unmaps it on acism_destroy.
+ac_trie_t*
+acism_mmap(void *map, size_t len, void const *id, size_t idlen, int nstrs)
+{
+    ACISM_HDR const *hdr = map;
+    ACISM const *mp;
+    ACISM *psp;
+    unsigned i;
+
+    if (len < sizeof(*hdr) + sizeof(*mp) || idlen > ACISM_ID_MAX)
+        return NULL;
+
+    if (memcmp(hdr->magic, ACISM_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->hdr_size != sizeof(*hdr) || hdr->trie_size != sizeof(*mp) ||
+            hdr->tran_bytes != sizeof(TRAN) ||
+            hdr->id_len != idlen || memcmp(hdr->id, id, idlen) != 0 ||
+            nstrs < 0 || hdr->nstrs != (unsigned)nstrs)
+        return NULL;
+
+    mp = (ACISM const *)((char const *)map + sizeof(*hdr));
+
+    if (mp->tran_size != hdr->tran_size || mp->hash_size != hdr->hash_size ||
+            mp->nstrs != hdr->nstrs || mp->tran_size == 0 ||
+            (mp->hash_size > 0 && mp->hash_mod == 0) ||
+            mp->nsyms > sizeof(mp->symv) / sizeof(mp->symv[0]) + 1)
+        return NULL;
+
+#if ACISM_SIZE < 8
+    if (mp->sym_bits == 0 || mp->sym_bits >= 8 * sizeof(TRAN) - 2 ||
+            mp->sym_mask != ((TRAN)1 << mp->sym_bits) - 1)
+        return NULL;
+#endif
+
+    for (i = 0; i < sizeof(mp->symv) / sizeof(mp->symv[0]); i++) {
+        if (mp->symv[i] >= mp->nsyms)
+            return NULL;
+    }
+
+    if (len - sizeof(*hdr) - sizeof(*mp) != p_size(mp))
+        return NULL;
+
+    psp = g_malloc(sizeof(*psp));
+    *psp = *mp;
+    psp->flags |= IS_MMAP;
+    set_tranv(psp, (char*)map + sizeof(*hdr) + sizeof(*psp));
+
+    return psp;
+}
 //EOF
@@ -34,6 +34,14 @@ typedef struct ac_trie_pat_s MEMREF;
 ac_trie_t* acism_create(ac_trie_pat_t const *strv, int nstrs);
 void   acism_destroy(ac_trie_t*);
 
+// Serialised form: acism_dump writes a trie to (fd) with a header holding
+//  an opaque (id) of the patterns set (at most 64 bytes) and returns 0 on
+//  success. acism_mmap takes ownership of a (map) of such a file or returns
+//  NULL if its header does not match (id), (nstrs) or the trie dimensions.
+int    acism_dump(ac_trie_t const*, int fd, void const *id, size_t idlen);
+ac_trie_t* acism_mmap(void *map, size_t len, void const *id, size_t idlen,
+           int nstrs);
+
 // For each match, acism_scan calls its ACISM_ACTION fn,
 //  giving it the strv[] index of the matched string,
 //  and the text[] offset of the byte PAST the end of the string.
@@ -172,6 +172,23 @@ struct rdns_upstream_context {
 	void (*fail)(struct rdns_upstream_elt *elt, void *ups_data, const char *reason);
 };
 
+/**
+ * External cache of replies, it is checked before sending a request with a
+ * single name and it is filled with every reply received from network
+ */
+struct rdns_cache_context {
+	void *data;
+	/*
+	 * Returns true if there is a cached reply, entries must be allocated by
+	 * malloc as they are freed with the reply
+	 */
+	bool (*lookup)(const char *name, size_t len, enum rdns_request_type type,
+			enum dns_rcode *rcode, struct rdns_reply_entry **entries,
+			bool *authenticated, void *cache_data);
+	void (*store)(const char *name, size_t len, enum rdns_request_type type,
+			const struct rdns_reply *reply, void *cache_data);
+};
+
 /**
  * Type of rdns plugin
  */
@@ -319,6 +336,16 @@ void rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 		struct rdns_upstream_context *ups_ctx,
 		void *ups_data);
 
+/**
+ * Set external cache for DNS replies
+ * @param resolver resolver object
+ * @param cache_ctx cache functions
+ * @param cache_data opaque data
+ */
+void rdns_resolver_set_cache_lib (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data);
+
 /**
  * Set maximum number of dns requests to be sent to a socket to be refreshed
  * @param resolver resolver object
@@ -309,6 +309,14 @@ rdns_process_read (int fd, void *arg)
 
 			rdns_request_unschedule (req);
 			req->state = RDNS_REQUEST_REPLIED;
+
+			if (resolver->cache && req->qcount == 1) {
+				resolver->cache->store (req->requested_names[0].name,
+						req->requested_names[0].len,
+						req->requested_names[0].type,
+						rep, resolver->cache->data);
+			}
+
 			req->func (rep, req->arg);
 			REF_RELEASE (req);
 		}
@@ -519,7 +527,7 @@ rdns_process_retransmit (int fd, void *arg)
 			req->async_event);
 	req->async_event = NULL;
 
-	if (req->state == RDNS_REQUEST_FAKE) {
+	if (req->state == RDNS_REQUEST_FAKE || req->state == RDNS_REQUEST_CACHED) {
 		/* Reply is ready */
 		req->func (req->reply, req->arg);
 		REF_RELEASE (req);
@@ -749,7 +757,29 @@ rdns_make_request_full (
 
 	va_end (args);
 
-	if (req->state != RDNS_REQUEST_FAKE) {
+	if (req->state != RDNS_REQUEST_FAKE && queries == 1 && resolver->cache) {
+		enum dns_rcode rcode;
+		struct rdns_reply_entry *entries = NULL;
+		bool authenticated = false;
+
+		if (resolver->cache->lookup (req->requested_names[0].name,
+				req->requested_names[0].len, req->requested_names[0].type,
+				&rcode, &entries, &authenticated, resolver->cache->data)) {
+			/* Reply is delivered the same way as a fake one */
+			req->reply = rdns_make_reply (req, rcode);
+
+			if (req->reply == NULL) {
+				REF_RELEASE (req);
+				return NULL;
+			}
+
+			req->reply->entries = entries;
+			req->reply->authenticated = authenticated;
+			req->state = RDNS_REQUEST_CACHED;
+		}
+	}
+
+	if (req->state != RDNS_REQUEST_FAKE && req->state != RDNS_REQUEST_CACHED) {
 		rdns_allocate_packet (req, tlen);
 		rdns_make_dns_header (req, queries);
 
@@ -797,7 +827,7 @@ rdns_make_request_full (
 	/* Select random IO channel */
 	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
 
-	if (req->state == RDNS_REQUEST_FAKE) {
+	if (req->state == RDNS_REQUEST_FAKE || req->state == RDNS_REQUEST_CACHED) {
 		req->async_event = resolver->async->add_write (resolver->async->data,
 				req->io->sock, req);
 	}
@@ -995,6 +1025,15 @@ rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 }
 
 
+void
+rdns_resolver_set_cache_lib (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data)
+{
+	resolver->cache = cache_ctx;
+	resolver->cache->data = cache_data;
+}
+
 void
 rdns_resolver_set_max_io_uses (struct rdns_resolver *resolver,
 		uint64_t max_ioc_uses, double check_time)
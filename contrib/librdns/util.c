@@ -468,7 +468,8 @@ rdns_request_free (struct rdns_request *req)
 				HASH_DEL (req->io->requests, req);
 				req->async_event = NULL;
 			}
-			else if (req->state == RDNS_REQUEST_FAKE) {
+			else if (req->state == RDNS_REQUEST_FAKE ||
+					req->state == RDNS_REQUEST_CACHED) {
 				req->async->del_write (req->async->data,
 						req->async_event);
 				req->async_event = NULL;
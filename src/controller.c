@@ -2737,6 +2737,21 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 			ucl_object_fromint (mem_st.fragmented_size), "fragmented", 0, false);
 
+	if (session->ctx->cfg->dns_cache) {
+		guint64 hits, misses, inserts;
+
+		rspamd_dns_cache_stat (session->ctx->cfg->dns_cache, &hits, &misses,
+				&inserts);
+		sub = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (sub, ucl_object_fromint (hits), "hits", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (misses), "misses", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (inserts), "inserts", 0,
+				false);
+		ucl_object_insert_key (sub, ucl_object_fromdouble (hits + misses > 0 ?
+				(gdouble)hits / (hits + misses) : 0.0), "hit_ratio", 0, false);
+		ucl_object_insert_key (top, sub, "dns_cache", 0, false);
+	}
+
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
 		session->ctx->srv->stat->messages_learned = 0;
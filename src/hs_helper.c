@@ -39,6 +39,8 @@ worker_t hs_helper_worker = {
 
 static const gdouble default_max_time = 1.0;
 static const gdouble default_recompile_time = 60.0;
+/* Cached acism tries that have not been used for this time are removed */
+static const time_t acism_max_unused_time = 86400 * 7;
 static const guint64 rspamd_hs_helper_magic = 0x22d310157a2288a0ULL;
 
 /*
@@ -221,6 +223,41 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 		ret = FALSE;
 	}
 
+	globfree (&globbuf);
+
+	/*
+	 * Acism tries are cached by hash of patterns, so they cannot be checked
+	 * here: remove those that are not loaded for a long time (loading touches
+	 * a file) and temporary files left by crashed processes
+	 */
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.acmp*");
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		time_t now = time (NULL);
+
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (stat (globbuf.gl_pathv[i], &st) == -1) {
+				continue;
+			}
+
+			if (forced || now - st.st_mtime > acism_max_unused_time) {
+				if (unlink (globbuf.gl_pathv[i]) == -1) {
+					msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+							strerror (errno));
+					ret = FALSE;
+				}
+				else {
+					msg_notice ("successfully removed outdated acism file: %s",
+							globbuf.gl_pathv[i]);
+				}
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		ret = FALSE;
+	}
+
 	globfree (&globbuf);
 	g_free (pattern);
 
@@ -21,8 +21,10 @@
 #include "ucl.h"
 #include "khash.h"
 #include "libstemmer.h"
+#include "libutil/hash.h"
 
 #include <glob.h>
+#include <sys/mman.h>
 #include <unicode/utf8.h>
 #include <unicode/utf16.h>
 #include <unicode/ucnv.h>
@@ -30,8 +32,13 @@
 #include <unicode/ustring.h>
 #include <math.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 static const gsize default_short_text_limit = 10;
 static const gsize default_words = 80;
+static const gsize default_stem_cache_size = 32768;
 static const gdouble update_prob = 0.6;
 static const gchar *default_languages_path = RSPAMD_SHAREDIR "/languages";
 
@@ -82,6 +89,7 @@ struct rspamd_language_elt {
 	const gchar *name; /* e.g. "en" or "ru" */
 	gint flags; /* enum rspamd_language_elt_flags */
 	enum rspamd_language_category category;
+	guint trigramms_idx; /* column in the category's trigramms table */
 	guint trigramms_words;
 	guint stop_words;
 	gdouble mean;
@@ -123,6 +131,39 @@ struct rspamd_stop_word_elt {
 
 INIT_LOG_MODULE(langdet)
 
+struct rspamd_stem_cache_elt {
+	rspamd_ftok_t lang;
+	rspamd_ftok_t word;
+	rspamd_ftok_t stemmed;
+	/* Data follows */
+};
+
+static guint
+rspamd_stem_cache_hash (gconstpointer p)
+{
+	const struct rspamd_stem_cache_elt *elt = (const struct rspamd_stem_cache_elt *)p;
+
+	return rspamd_cryptobox_fast_hash (elt->word.begin, elt->word.len,
+			rspamd_cryptobox_fast_hash (elt->lang.begin, elt->lang.len,
+					rspamd_hash_seed ()));
+}
+
+static gboolean
+rspamd_stem_cache_equal (gconstpointer p1, gconstpointer p2)
+{
+	const struct rspamd_stem_cache_elt *e1 = (const struct rspamd_stem_cache_elt *)p1,
+			*e2 = (const struct rspamd_stem_cache_elt *)p2;
+
+	return rspamd_ftok_cmp (&e1->word, &e2->word) == 0 &&
+			rspamd_ftok_cmp (&e1->lang, &e2->lang) == 0;
+}
+
+static GQuark
+rspamd_language_detector_quark (void)
+{
+	return g_quark_from_static_string ("language-detector");
+}
+
 static const struct rspamd_language_unicode_match *
 rspamd_language_search_unicode_match (const gchar *key,
 		const struct rspamd_language_unicode_match *elts, size_t nelts)
@@ -166,6 +207,8 @@ rspamd_trigram_equal_func (gconstpointer v, gconstpointer v2)
 
 KHASH_INIT (rspamd_trigram_hash, const UChar32 *, struct rspamd_ngramm_chain, true,
 		rspamd_trigram_hash_func, rspamd_trigram_equal_func);
+KHASH_INIT (rspamd_trigram_idx_hash, const UChar32 *, guint32, true,
+		rspamd_trigram_hash_func, rspamd_trigram_equal_func);
 KHASH_INIT (rspamd_candidates_hash, const gchar *,
 		struct rspamd_lang_detector_res *, true,
 		rspamd_str_hash, rspamd_str_equal);
@@ -173,14 +216,68 @@ KHASH_INIT (rspamd_stopwords_hash, rspamd_ftok_t *,
 		char, false,
 		rspamd_ftok_hash, rspamd_ftok_equal);
 
+/*
+ * Combined trigramms table for a languages category: each trigramm is mapped
+ * to a row of frequencies for all languages in this category, so a trigramm
+ * is looked up once and all languages are scored at once
+ */
+struct rspamd_trigramms_table {
+	khash_t(rspamd_trigram_idx_hash) *rows; /* trigramm -> row number */
+	gdouble *freqs; /* nrows * stride matrix */
+	guint stride; /* number of languages padded for vectorised access */
+	guint nrows;
+	GPtrArray *languages; /* language by column */
+};
+
+/*
+ * Compiled languages database, all numbers are in host byte order:
+ * header | languages | per category: keys (3 UChar32 per row), freqs
+ */
+#define RSPAMD_LANGDB_MAGIC "rslangdb"
+#define RSPAMD_LANGDB_VERSION 3
+
+struct rspamd_langdb_table {
+	guint32 nlangs;
+	guint32 stride;
+	guint32 nrows;
+	guint32 reserved;
+	guint64 keys_offset;
+	guint64 freqs_offset;
+};
+
+struct rspamd_langdb_header {
+	gchar magic[8];
+	guint32 version;
+	guint32 ncategories;
+	guint32 nlanguages;
+	guint32 reserved;
+	struct rspamd_langdb_table tables[RSPAMD_LANGUAGE_MAX];
+};
+
+struct rspamd_langdb_language {
+	gchar name[16];
+	guint32 flags;
+	guint32 category;
+	guint32 trigramms_idx;
+	guint32 trigramms_words;
+	gdouble mean;
+	gdouble std;
+};
+
 struct rspamd_lang_detector {
 	GPtrArray *languages;
-	khash_t(rspamd_trigram_hash) *trigramms[RSPAMD_LANGUAGE_MAX]; /* trigramms frequencies */
+	khash_t(rspamd_trigram_hash) *trigramms[RSPAMD_LANGUAGE_MAX]; /* used on load only */
+	struct rspamd_trigramms_table tables[RSPAMD_LANGUAGE_MAX];
 	struct rspamd_stop_word_elt stop_words[RSPAMD_LANGUAGE_MAX];
 	khash_t(rspamd_stopwords_hash) *stop_words_norm;
 	UConverter *uchar_converter;
 	gsize short_text_limit;
 	gsize total_occurencies; /* number of all languages found */
+	gpointer compiled_map; /* mmapped compiled database if used */
+	gsize compiled_len;
+	rspamd_lru_hash_t *stem_cache; /* (language, word) -> stemmed word */
+	guint64 stem_cache_hits;
+	guint64 stem_cache_misses;
 	ref_entry_t ref;
 };
 
@@ -338,6 +435,95 @@ rspamd_language_detector_cmp_ngramm (gconstpointer a, gconstpointer b)
 	return (gint)e2->freq - (gint)e1->freq;
 }
 
+static void
+rspamd_language_detector_read_stop_words (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		struct rspamd_language_elt *nelt,
+		enum rspamd_language_category cat,
+		const ucl_object_t *stop_words)
+{
+	ucl_object_iter_t it = NULL;
+
+	if (stop_words) {
+		const ucl_object_t *specific_stop_words;
+
+		specific_stop_words = ucl_object_lookup (stop_words, nelt->name);
+
+		if (specific_stop_words) {
+			struct sb_stemmer *stem = NULL;
+			it = NULL;
+			const ucl_object_t *w;
+			guint start, stop;
+
+			stem = sb_stemmer_new (nelt->name, "UTF_8");
+			start = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
+
+			while ((w = ucl_object_iterate (specific_stop_words, &it, true)) != NULL) {
+				gsize wlen;
+				const char *word = ucl_object_tolstring (w, &wlen);
+				const char *saved;
+				guint mp_flags = RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8;
+
+				if (rspamd_multipattern_has_hyperscan ()) {
+					mp_flags |= RSPAMD_MULTIPATTERN_RE;
+				}
+
+				rspamd_multipattern_add_pattern_len (d->stop_words[cat].mp,
+						word, wlen,
+						mp_flags);
+				nelt->stop_words ++;
+
+				/* Also lemmatise and store normalised */
+				if (stem) {
+					const char *nw = sb_stemmer_stem (stem, word, wlen);
+
+
+					if (nw) {
+						saved = nw;
+						wlen = strlen (nw);
+					}
+					else {
+						saved = word;
+					}
+				}
+				else {
+					saved = word;
+				}
+
+				if (saved) {
+					gint rc;
+					rspamd_ftok_t *tok;
+					gchar *dst;
+
+					tok = rspamd_mempool_alloc (cfg->cfg_pool,
+							sizeof (*tok) + wlen + 1);
+					dst = ((gchar *)tok) + sizeof (*tok);
+					rspamd_strlcpy (dst, saved, wlen + 1);
+					tok->begin = dst;
+					tok->len = wlen;
+
+					kh_put (rspamd_stopwords_hash, d->stop_words_norm,
+							tok, &rc);
+				}
+			}
+
+			if (stem) {
+				sb_stemmer_delete (stem);
+			}
+
+			stop = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
+
+			struct rspamd_stop_word_range r;
+
+			r.start = start;
+			r.stop = stop;
+			r.elt = nelt;
+
+			g_array_append_val (d->stop_words[cat].ranges, r);
+		}
+	}
+}
+
 static void
 rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		struct rspamd_lang_detector *d,
@@ -354,7 +540,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 	khash_t (rspamd_trigram_hash) *htb = NULL;
 	gchar *pos;
 	guint total = 0, total_latin = 0, total_ngramms = 0, i, skipped,
-			loaded, nstop = 0;
+			loaded;
 	gdouble mean = 0, std = 0, delta = 0, delta2 = 0, m2 = 0;
 	enum rspamd_language_category cat = RSPAMD_LANGUAGE_MAX;
 
@@ -459,88 +645,11 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		}
 	}
 
-	if (stop_words) {
-		const ucl_object_t *specific_stop_words;
-
-		specific_stop_words = ucl_object_lookup (stop_words, nelt->name);
-
-		if (specific_stop_words) {
-			struct sb_stemmer *stem = NULL;
-			it = NULL;
-			const ucl_object_t *w;
-			guint start, stop;
-
-			stem = sb_stemmer_new (nelt->name, "UTF_8");
-			start = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
-
-			while ((w = ucl_object_iterate (specific_stop_words, &it, true)) != NULL) {
-				gsize wlen;
-				const char *word = ucl_object_tolstring (w, &wlen);
-				const char *saved;
-				guint mp_flags = RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8;
-
-				if (rspamd_multipattern_has_hyperscan ()) {
-					mp_flags |= RSPAMD_MULTIPATTERN_RE;
-				}
-
-				rspamd_multipattern_add_pattern_len (d->stop_words[cat].mp,
-						word, wlen,
-						mp_flags);
-				nelt->stop_words ++;
-				nstop ++;
-
-				/* Also lemmatise and store normalised */
-				if (stem) {
-					const char *nw = sb_stemmer_stem (stem, word, wlen);
-
-
-					if (nw) {
-						saved = nw;
-						wlen = strlen (nw);
-					}
-					else {
-						saved = word;
-					}
-				}
-				else {
-					saved = word;
-				}
-
-				if (saved) {
-					gint rc;
-					rspamd_ftok_t *tok;
-					gchar *dst;
-
-					tok = rspamd_mempool_alloc (cfg->cfg_pool,
-							sizeof (*tok) + wlen + 1);
-					dst = ((gchar *)tok) + sizeof (*tok);
-					rspamd_strlcpy (dst, saved, wlen + 1);
-					tok->begin = dst;
-					tok->len = wlen;
-
-					kh_put (rspamd_stopwords_hash, d->stop_words_norm,
-							tok, &rc);
-				}
-			}
-
-			if (stem) {
-				sb_stemmer_delete (stem);
-			}
-
-			stop = rspamd_multipattern_get_npatterns (d->stop_words[cat].mp);
-
-			struct rspamd_stop_word_range r;
-
-			r.start = start;
-			r.stop = stop;
-			r.elt = nelt;
-
-			g_array_append_val (d->stop_words[cat].ranges, r);
-			it = NULL;
-		}
-	}
+	rspamd_language_detector_read_stop_words (cfg, d, nelt, cat, stop_words);
 
 	nelt->category = cat;
+	nelt->trigramms_idx = d->tables[cat].languages->len;
+	g_ptr_array_add (d->tables[cat].languages, nelt);
 	htb = d->trigramms[cat];
 
 	GPtrArray *ngramms;
@@ -751,12 +860,60 @@ rspamd_language_detector_process_chain (struct rspamd_config *cfg,
 	}
 }
 
+/*
+ * Converts chains of a category to the combined frequencies table
+ */
+static void
+rspamd_language_detector_build_table (struct rspamd_config *cfg,
+		khash_t(rspamd_trigram_hash) *htb,
+		struct rspamd_trigramms_table *tbl)
+{
+	const UChar32 *key;
+	struct rspamd_ngramm_chain chain;
+	struct rspamd_ngramm_elt *elt;
+	guint row = 0, i;
+	gint ret;
+	khiter_t k;
+
+	tbl->stride = (tbl->languages->len + 3) & ~3u;
+	tbl->nrows = kh_size (htb);
+
+	if (tbl->stride == 0 || tbl->nrows == 0) {
+		return;
+	}
+
+	kh_resize (rspamd_trigram_idx_hash, tbl->rows, tbl->nrows);
+	tbl->freqs = g_malloc0 (sizeof (gdouble) * tbl->stride * tbl->nrows);
+
+	kh_foreach (htb, key, chain, {
+		gdouble *freqs = &tbl->freqs[row * tbl->stride];
+
+		PTR_ARRAY_FOREACH (chain.languages, i, elt) {
+			freqs[elt->elt->trigramms_idx] = elt->prob;
+		}
+
+		k = kh_put (rspamd_trigram_idx_hash, tbl->rows, key, &ret);
+		kh_value (tbl->rows, k) = row;
+		row ++;
+	});
+
+	msg_debug_lang_det_cfg ("built trigramms table: %d rows, %d languages",
+			(gint)tbl->nrows, (gint)tbl->languages->len);
+}
+
 static void
 rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 {
 	if (d) {
 		for (guint i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 			kh_destroy (rspamd_trigram_hash, d->trigramms[i]);
+			kh_destroy (rspamd_trigram_idx_hash, d->tables[i].rows);
+
+			if (d->compiled_map == NULL) {
+				g_free (d->tables[i].freqs);
+			}
+
+			g_ptr_array_free (d->tables[i].languages, TRUE);
 			rspamd_multipattern_destroy (d->stop_words[i].mp);
 			g_array_free (d->stop_words[i].ranges, TRUE);
 		}
@@ -766,7 +923,348 @@ rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 		}
 
 		kh_destroy (rspamd_stopwords_hash, d->stop_words_norm);
+
+		if (d->compiled_map) {
+			munmap (d->compiled_map, d->compiled_len);
+		}
+
+		if (d->stem_cache) {
+			guint64 total = d->stem_cache_hits + d->stem_cache_misses;
+
+			if (total > 0) {
+				msg_info ("stem cache: %L hits, %L misses (%.2f%% hit rate)",
+						d->stem_cache_hits, d->stem_cache_misses,
+						d->stem_cache_hits * 100.0 / total);
+			}
+
+			rspamd_lru_hash_destroy (d->stem_cache);
+		}
+	}
+}
+
+static void
+rspamd_language_detector_stem_cache_preload (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		const gchar *language,
+		const gchar *path)
+{
+	struct sb_stemmer *stem;
+	FILE *f;
+	gchar *line = NULL;
+	gsize linecap = 0;
+	gssize r;
+	guint nwords = 0;
+
+	stem = sb_stemmer_new (language, "UTF_8");
+
+	if (stem == NULL) {
+		msg_warn_config ("cannot preload stem cache for %s: no stemmer",
+				language);
+
+		return;
+	}
+
+	f = fopen (path, "r");
+
+	if (f == NULL) {
+		msg_warn_config ("cannot preload stem cache for %s from %s: %s",
+				language, path, strerror (errno));
+		sb_stemmer_delete (stem);
+
+		return;
+	}
+
+	/* Each line is a normalised word optionally followed by its frequency */
+	while ((r = getline (&line, &linecap, f)) > 0) {
+		const gchar *stemmed;
+		gsize wlen = strcspn (line, " \t\r\n");
+
+		if (wlen == 0) {
+			continue;
+		}
+
+		stemmed = sb_stemmer_stem (stem, line, wlen);
+		rspamd_language_detector_stem_cache_insert (d, language, line, wlen,
+				stemmed, stemmed ? strlen (stemmed) : 0);
+		nwords ++;
 	}
+
+	free (line);
+	fclose (f);
+	sb_stemmer_delete (stem);
+
+	msg_info_config ("preloaded %ud words to stem cache for %s from %s",
+			nwords, language, path);
+}
+
+static gboolean
+rspamd_language_detector_load_compiled (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		const gchar *path,
+		const ucl_object_t *stop_words,
+		const ucl_object_t *languages_enable,
+		const ucl_object_t *languages_disable)
+{
+	const struct rspamd_langdb_header *hdr;
+	const struct rspamd_langdb_language *langs;
+	struct rspamd_language_elt *nelt;
+	struct rspamd_trigramms_table *tbl;
+	const guchar *map;
+	gsize len;
+	guint i, j, ncols[RSPAMD_LANGUAGE_MAX];
+	gint ret;
+	khiter_t k;
+
+	map = rspamd_file_xmap (path, PROT_READ, &len, TRUE);
+
+	if (map == NULL) {
+		msg_err_config ("cannot map compiled languages %s: %s", path,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_langdb_header *)map;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, RSPAMD_LANGDB_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->version != RSPAMD_LANGDB_VERSION ||
+			hdr->ncategories != RSPAMD_LANGUAGE_MAX ||
+			len < sizeof (*hdr) + hdr->nlanguages * sizeof (*langs)) {
+		msg_err_config ("invalid or incompatible compiled languages %s", path);
+		munmap ((gpointer)map, len);
+
+		return FALSE;
+	}
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		const struct rspamd_langdb_table *t = &hdr->tables[i];
+
+		/* Offsets are checked against the mapping size first to avoid overflows */
+		if (t->stride < t->nlangs || (t->stride & 3) != 0 ||
+				t->keys_offset < sizeof (*hdr) ||
+				t->keys_offset > len ||
+				(t->keys_offset & (sizeof (UChar32) - 1)) != 0 ||
+				(guint64)t->nrows * 3 * sizeof (UChar32) > len - t->keys_offset ||
+				t->freqs_offset < sizeof (*hdr) ||
+				t->freqs_offset > len ||
+				(t->freqs_offset & 15) != 0 ||
+				(t->nrows > 0 && (guint64)t->stride >
+						(len - t->freqs_offset) / sizeof (gdouble) / t->nrows)) {
+			msg_err_config ("invalid table %d in compiled languages %s", i, path);
+			munmap ((gpointer)map, len);
+
+			return FALSE;
+		}
+	}
+
+	langs = (const struct rspamd_langdb_language *)(map + sizeof (*hdr));
+	memset (ncols, 0, sizeof (ncols));
+
+	/* Validate everything before modifying the detector */
+	for (i = 0; i < hdr->nlanguages; i ++) {
+		const struct rspamd_langdb_language *l = &langs[i];
+
+		if (l->category >= RSPAMD_LANGUAGE_MAX ||
+				l->trigramms_idx != ncols[l->category] ||
+				memchr (l->name, '\0', sizeof (l->name)) == NULL) {
+			msg_err_config ("invalid language %d in compiled languages %s", i, path);
+			munmap ((gpointer)map, len);
+
+			return FALSE;
+		}
+
+		ncols[l->category] ++;
+	}
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		if (ncols[i] != hdr->tables[i].nlangs) {
+			msg_err_config ("invalid languages count for table %d "
+					"in compiled languages %s", i, path);
+			munmap ((gpointer)map, len);
+
+			return FALSE;
+		}
+	}
+
+	for (i = 0; i < hdr->nlanguages; i ++) {
+		const struct rspamd_langdb_language *l = &langs[i];
+		gchar fname[sizeof (l->name) + sizeof (".json")];
+
+		nelt = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*nelt));
+		nelt->name = rspamd_mempool_strdup (cfg->cfg_pool, l->name);
+		nelt->flags = l->flags;
+		nelt->category = l->category;
+		nelt->trigramms_idx = l->trigramms_idx;
+		nelt->trigramms_words = l->trigramms_words;
+		nelt->mean = l->mean;
+		nelt->std = l->std;
+
+		rspamd_snprintf (fname, sizeof (fname), "%s.json", nelt->name);
+
+		if (!rspamd_ucl_array_find_str (fname, languages_disable) ||
+				(languages_enable == NULL ||
+				 rspamd_ucl_array_find_str (fname, languages_enable))) {
+			rspamd_language_detector_read_stop_words (cfg, d, nelt,
+					nelt->category, stop_words);
+			g_ptr_array_add (d->tables[l->category].languages, nelt);
+			g_ptr_array_add (d->languages, nelt);
+		}
+		else {
+			/* Column is still here but it is never converted to a candidate */
+			msg_info_config ("skip language %s: disabled", nelt->name);
+			g_ptr_array_add (d->tables[l->category].languages, NULL);
+		}
+	}
+
+	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+		const struct rspamd_langdb_table *t = &hdr->tables[i];
+		const UChar32 *keys = (const UChar32 *)(map + t->keys_offset);
+
+		tbl = &d->tables[i];
+		tbl->stride = t->stride;
+		tbl->nrows = t->nrows;
+		/* Frequencies are used directly from the shared mapping */
+		tbl->freqs = (gdouble *)(map + t->freqs_offset);
+		kh_resize (rspamd_trigram_idx_hash, tbl->rows, t->nrows);
+
+		for (j = 0; j < t->nrows; j ++) {
+			k = kh_put (rspamd_trigram_idx_hash, tbl->rows, &keys[j * 3], &ret);
+			kh_value (tbl->rows, k) = j;
+		}
+	}
+
+	d->compiled_map = (gpointer)map;
+	d->compiled_len = len;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_language_detector_save (struct rspamd_lang_detector *d,
+		const gchar *path, GError **err)
+{
+	struct rspamd_langdb_header hdr;
+	struct rspamd_langdb_language l;
+	struct rspamd_language_elt *elt;
+	struct rspamd_trigramms_table *tbl;
+	gchar tmp_path[PATH_MAX];
+	static const guchar zeroes[16] = {0};
+	const UChar32 *key;
+	UChar32 *keys;
+	guint32 row;
+	guint64 off;
+	guint i, cat;
+	FILE *f;
+
+	g_assert (d != NULL);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_LANGDB_MAGIC, sizeof (hdr.magic));
+	hdr.version = RSPAMD_LANGDB_VERSION;
+	hdr.ncategories = RSPAMD_LANGUAGE_MAX;
+	hdr.nlanguages = 0;
+
+	for (cat = 0; cat < RSPAMD_LANGUAGE_MAX; cat ++) {
+		PTR_ARRAY_FOREACH (d->tables[cat].languages, i, elt) {
+			if (elt == NULL) {
+				g_set_error (err, rspamd_language_detector_quark (), EINVAL,
+						"cannot save detector with disabled languages");
+
+				return FALSE;
+			}
+		}
+
+		hdr.nlanguages += d->tables[cat].languages->len;
+	}
+
+	off = sizeof (hdr) + hdr.nlanguages * sizeof (l);
+
+	for (cat = 0; cat < RSPAMD_LANGUAGE_MAX; cat ++) {
+		tbl = &d->tables[cat];
+		hdr.tables[cat].nlangs = tbl->languages->len;
+		hdr.tables[cat].stride = tbl->stride;
+		hdr.tables[cat].nrows = tbl->nrows;
+		off = (off + 15) & ~((guint64)15);
+		hdr.tables[cat].keys_offset = off;
+		off += (guint64)tbl->nrows * 3 * sizeof (UChar32);
+		off = (off + 15) & ~((guint64)15);
+		hdr.tables[cat].freqs_offset = off;
+		off += (guint64)tbl->nrows * tbl->stride * sizeof (gdouble);
+	}
+
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", path);
+	f = fopen (tmp_path, "w");
+
+	if (f == NULL) {
+		g_set_error (err, rspamd_language_detector_quark (), errno,
+				"cannot open %s: %s", tmp_path, strerror (errno));
+
+		return FALSE;
+	}
+
+	fwrite (&hdr, sizeof (hdr), 1, f);
+
+	for (cat = 0; cat < RSPAMD_LANGUAGE_MAX; cat ++) {
+		PTR_ARRAY_FOREACH (d->tables[cat].languages, i, elt) {
+			memset (&l, 0, sizeof (l));
+			rspamd_strlcpy (l.name, elt->name, sizeof (l.name));
+			l.flags = elt->flags;
+			l.category = elt->category;
+			l.trigramms_idx = elt->trigramms_idx;
+			l.trigramms_words = elt->trigramms_words;
+			l.mean = elt->mean;
+			l.std = elt->std;
+			fwrite (&l, sizeof (l), 1, f);
+		}
+	}
+
+	for (cat = 0; cat < RSPAMD_LANGUAGE_MAX; cat ++) {
+		tbl = &d->tables[cat];
+
+		if ((guint64)ftell (f) < hdr.tables[cat].keys_offset) {
+			fwrite (zeroes, hdr.tables[cat].keys_offset - ftell (f), 1, f);
+		}
+
+		if (tbl->nrows > 0) {
+			/* Restore rows order */
+			keys = g_malloc (tbl->nrows * 3 * sizeof (UChar32));
+
+			kh_foreach (tbl->rows, key, row, {
+				memcpy (&keys[row * 3], key, 3 * sizeof (UChar32));
+			});
+
+			fwrite (keys, tbl->nrows * 3 * sizeof (UChar32), 1, f);
+			g_free (keys);
+		}
+
+		if ((guint64)ftell (f) < hdr.tables[cat].freqs_offset) {
+			fwrite (zeroes, hdr.tables[cat].freqs_offset - ftell (f), 1, f);
+		}
+
+		if (tbl->nrows > 0) {
+			fwrite (tbl->freqs, (gsize)tbl->nrows * tbl->stride * sizeof (gdouble),
+					1, f);
+		}
+	}
+
+	if (ferror (f) || fclose (f) != 0) {
+		g_set_error (err, rspamd_language_detector_quark (), errno,
+				"cannot write %s: %s", tmp_path, strerror (errno));
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	if (rename (tmp_path, path) == -1) {
+		g_set_error (err, rspamd_language_detector_quark (), errno,
+				"cannot rename %s to %s: %s", tmp_path, path, strerror (errno));
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 struct rspamd_lang_detector*
@@ -774,7 +1272,10 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 {
 	const ucl_object_t *section, *elt, *languages_enable = NULL,
 			*languages_disable = NULL;
-	const gchar *languages_path = default_languages_path;
+	const gchar *languages_path = default_languages_path,
+			*compiled_path = NULL;
+	const ucl_object_t *stem_cache_preload = NULL;
+	gsize stem_cache_size = default_stem_cache_size;
 	glob_t gl;
 	size_t i, short_text_limit = default_short_text_limit, total = 0;
 	UErrorCode uc_err = U_ZERO_ERROR;
@@ -800,6 +1301,20 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			short_text_limit = ucl_object_toint (elt);
 		}
 
+		elt = ucl_object_lookup (section, "stem_cache_size");
+
+		if (elt) {
+			stem_cache_size = ucl_object_toint (elt);
+		}
+
+		stem_cache_preload = ucl_object_lookup (section, "stem_cache_preload");
+
+		elt = ucl_object_lookup (section, "languages_compiled");
+
+		if (elt) {
+			compiled_path = ucl_object_tostring (elt);
+		}
+
 		languages_enable = ucl_object_lookup (section, "languages_enable");
 		languages_disable = ucl_object_lookup (section, "languages_disable");
 	}
@@ -821,16 +1336,10 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 	ucl_parser_free (parser);
 	languages_pattern->len = 0;
 
-	rspamd_printf_gstring (languages_pattern, "%s/*.json", languages_path);
 	memset (&gl, 0, sizeof (gl));
 
-	if (glob (languages_pattern->str, 0, NULL, &gl) != 0) {
-		msg_err_config ("cannot read any files matching %v", languages_pattern);
-		goto end;
-	}
-
 	ret = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*ret));
-	ret->languages = g_ptr_array_sized_new (gl.gl_pathc);
+	ret->languages = g_ptr_array_new ();
 	ret->uchar_converter = rspamd_get_utf8_converter ();
 	ret->short_text_limit = short_text_limit;
 	ret->stop_words_norm = kh_init (rspamd_stopwords_hash);
@@ -838,6 +1347,8 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 	/* Map from ngramm in ucs32 to GPtrArray of rspamd_language_elt */
 	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 		ret->trigramms[i] = kh_init (rspamd_trigram_hash);
+		ret->tables[i].rows = kh_init (rspamd_trigram_idx_hash);
+		ret->tables[i].languages = g_ptr_array_new ();
 #ifdef WITH_HYPERSCAN
 		ret->stop_words[i].mp = rspamd_multipattern_create (
 				RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8|
@@ -853,37 +1364,83 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 
 	g_assert (uc_err == U_ZERO_ERROR);
 
-	for (i = 0; i < gl.gl_pathc; i ++) {
-		fname = g_path_get_basename (gl.gl_pathv[i]);
+	if (stem_cache_size > 0) {
+		ret->stem_cache = rspamd_lru_hash_new_full (stem_cache_size, NULL,
+				g_free, rspamd_stem_cache_hash, rspamd_stem_cache_equal);
 
-		if (!rspamd_ucl_array_find_str (fname, languages_disable) ||
-				(languages_enable == NULL ||
-						rspamd_ucl_array_find_str (fname, languages_enable))) {
-			rspamd_language_detector_read_file (cfg, ret, gl.gl_pathv[i],
-					stop_words);
+		if (stem_cache_preload && ucl_object_type (stem_cache_preload) == UCL_OBJECT) {
+			ucl_object_iter_t it = NULL;
+			const ucl_object_t *cur;
+
+			while ((cur = ucl_object_iterate (stem_cache_preload, &it, true)) != NULL) {
+				if (ucl_object_type (cur) == UCL_STRING) {
+					rspamd_language_detector_stem_cache_preload (cfg, ret,
+							ucl_object_key (cur), ucl_object_tostring (cur));
+				}
+			}
 		}
-		else {
-			msg_info_config ("skip language file %s: disabled", fname);
+	}
+
+	if (compiled_path && rspamd_language_detector_load_compiled (cfg, ret,
+			compiled_path, stop_words, languages_enable, languages_disable)) {
+		msg_info_config ("use compiled languages from %s", compiled_path);
+	}
+	else {
+		if (compiled_path) {
+			msg_warn_config ("cannot use compiled languages from %s, "
+					"fallback to %s", compiled_path, languages_path);
 		}
 
-		g_free (fname);
+		rspamd_printf_gstring (languages_pattern, "%s/*.json", languages_path);
+
+		if (glob (languages_pattern->str, 0, NULL, &gl) != 0) {
+			msg_err_config ("cannot read any files matching %v", languages_pattern);
+			rspamd_language_detector_dtor (ret);
+			ret = NULL;
+
+			goto end;
+		}
+
+		for (i = 0; i < gl.gl_pathc; i ++) {
+			fname = g_path_get_basename (gl.gl_pathv[i]);
+
+			if (!rspamd_ucl_array_find_str (fname, languages_disable) ||
+					(languages_enable == NULL ||
+							rspamd_ucl_array_find_str (fname, languages_enable))) {
+				rspamd_language_detector_read_file (cfg, ret, gl.gl_pathv[i],
+						stop_words);
+			}
+			else {
+				msg_info_config ("skip language file %s: disabled", fname);
+			}
+
+			g_free (fname);
+		}
+
+		for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
+			kh_foreach_value (ret->trigramms[i], schain, {
+				chain = &schain;
+				rspamd_language_detector_process_chain (cfg, chain);
+			});
+
+			rspamd_language_detector_build_table (cfg, ret->trigramms[i],
+					&ret->tables[i]);
+		}
 	}
 
 	for (i = 0; i < RSPAMD_LANGUAGE_MAX; i ++) {
 		GError *err = NULL;
 
-		kh_foreach_value (ret->trigramms[i], schain, {
-			chain = &schain;
-			rspamd_language_detector_process_chain (cfg, chain);
-		});
-
 		if (!rspamd_multipattern_compile (ret->stop_words[i].mp, &err)) {
 			msg_err_config ("cannot compile stop words for %z language group: %e",
 					i, err);
 			g_error_free (err);
 		}
 
-		total += kh_size (ret->trigramms[i]);
+		total += ret->tables[i].nrows;
+		/* Chains are no longer needed */
+		kh_destroy (rspamd_trigram_hash, ret->trigramms[i]);
+		ret->trigramms[i] = NULL;
 	}
 
 	msg_info_config ("loaded %d languages, "
@@ -901,6 +1458,10 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			ret);
 
 end:
+	if (stop_words && ret == NULL) {
+		ucl_object_unref (stop_words);
+	}
+
 	if (gl.gl_pathc > 0) {
 		globfree (&gl);
 	}
@@ -1045,6 +1606,27 @@ rspamd_language_detector_next_ngramm (rspamd_stat_token_t *tok, UChar32 *window,
 	return cur_off + 1;
 }
 
+static inline void
+rspamd_language_detector_accumulate (gdouble *scores, const gdouble *freqs,
+		guint stride)
+{
+	guint i = 0;
+
+#ifdef __x86_64__
+	/* Stride is always aligned to 4, so it is processed by pairs */
+	for (; i + 2 <= stride; i += 2) {
+		__m128d acc = _mm_loadu_pd (&scores[i]);
+
+		acc = _mm_add_pd (acc, _mm_loadu_pd (&freqs[i]));
+		_mm_storeu_pd (&scores[i], acc);
+	}
+#endif
+
+	for (; i < stride; i ++) {
+		scores[i] += freqs[i];
+	}
+}
+
 /*
  * Do full guess for a specific ngramm, checking all languages defined
  */
@@ -1052,56 +1634,17 @@ static void
 rspamd_language_detector_process_ngramm_full (struct rspamd_task *task,
 											  struct rspamd_lang_detector *d,
 											  UChar32 *window,
-											  khash_t(rspamd_candidates_hash) *candidates,
-											  khash_t(rspamd_trigram_hash) *trigramms)
+											  const struct rspamd_trigramms_table *tbl,
+											  gdouble *scores)
 {
-	guint i;
-	gint ret;
-	struct rspamd_ngramm_chain *chain = NULL;
-	struct rspamd_ngramm_elt *elt;
-	struct rspamd_lang_detector_res *cand;
 	khiter_t k;
-	gdouble prob;
-
-	k = kh_get (rspamd_trigram_hash, trigramms, window);
-	if (k != kh_end (trigramms)) {
-		chain = &kh_value (trigramms, k);
-	}
 
-	if (chain) {
-		PTR_ARRAY_FOREACH (chain->languages, i, elt) {
-			prob = elt->prob;
-
-			if (prob < chain->mean) {
-				continue;
-			}
-
-			k = kh_get (rspamd_candidates_hash, candidates, elt->elt->name);
-			if (k != kh_end (candidates)) {
-				cand = kh_value (candidates, k);
-			}
-			else {
-				cand = NULL;
-			}
+	k = kh_get (rspamd_trigram_idx_hash, tbl->rows, window);
 
-#ifdef NGRAMMS_DEBUG
-			msg_err ("gramm: %s, lang: %s, prob: %.3f", chain->utf,
-					elt->elt->name, log2 (elt->prob));
-#endif
-			if (cand == NULL) {
-				cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
-				cand->elt = elt->elt;
-				cand->lang = elt->elt->name;
-				cand->prob = prob;
-
-				k = kh_put (rspamd_candidates_hash, candidates, elt->elt->name,
-						&ret);
-				kh_value (candidates, k) = cand;
-			} else {
-				/* Update guess */
-				cand->prob += prob;
-			}
-		}
+	if (k != kh_end (tbl->rows)) {
+		rspamd_language_detector_accumulate (scores,
+				&tbl->freqs[kh_value (tbl->rows, k) * tbl->stride],
+				tbl->stride);
 	}
 }
 
@@ -1109,8 +1652,8 @@ static void
 rspamd_language_detector_detect_word (struct rspamd_task *task,
 									  struct rspamd_lang_detector *d,
 									  rspamd_stat_token_t *tok,
-									  khash_t(rspamd_candidates_hash) *candidates,
-									  khash_t(rspamd_trigram_hash) *trigramms)
+									  const struct rspamd_trigramms_table *tbl,
+									  gdouble *scores)
 {
 	const guint wlen = 3;
 	UChar32 window[3];
@@ -1120,7 +1663,43 @@ rspamd_language_detector_detect_word (struct rspamd_task *task,
 	while ((cur = rspamd_language_detector_next_ngramm (tok, window, wlen, cur))
 			!= -1) {
 		rspamd_language_detector_process_ngramm_full (task,
-				d, window, candidates, trigramms);
+				d, window, tbl, scores);
+	}
+}
+
+/*
+ * Converts accumulated scores to the candidates
+ */
+static void
+rspamd_language_detector_scores_to_candidates (struct rspamd_task *task,
+		const struct rspamd_trigramms_table *tbl,
+		const gdouble *scores,
+		khash_t(rspamd_candidates_hash) *candidates)
+{
+	struct rspamd_language_elt *elt;
+	struct rspamd_lang_detector_res *cand;
+	khiter_t k;
+	guint i;
+	gint ret;
+
+	PTR_ARRAY_FOREACH (tbl->languages, i, elt) {
+		if (elt == NULL || scores[i] <= 0) {
+			continue;
+		}
+
+		k = kh_put (rspamd_candidates_hash, candidates, elt->name, &ret);
+
+		if (ret == 0) {
+			/* Update guess */
+			kh_value (candidates, k)->prob += scores[i];
+		}
+		else {
+			cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
+			cand->elt = elt;
+			cand->lang = elt->name;
+			cand->prob = scores[i];
+			kh_value (candidates, k) = cand;
+		}
 	}
 }
 
@@ -1203,9 +1782,12 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 	guint nparts = MIN (words->len, nwords);
 	goffset *selected_words;
 	rspamd_stat_token_t *tok;
+	const struct rspamd_trigramms_table *tbl = &d->tables[cat];
+	gdouble *scores;
 	guint i;
 
 	selected_words = g_new0 (goffset, nparts);
+	scores = g_new0 (gdouble, tbl->stride);
 	rspamd_language_detector_random_select (words, nparts, selected_words);
 	msg_debug_lang_det ("randomly selected %d words", nparts);
 
@@ -1214,14 +1796,16 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 				selected_words[i]);
 
 		if (tok->unicode.len >= 3) {
-			rspamd_language_detector_detect_word (task, d, tok, candidates,
-					d->trigramms[cat]);
+			rspamd_language_detector_detect_word (task, d, tok, tbl, scores);
 		}
 	}
 
+	rspamd_language_detector_scores_to_candidates (task, tbl, scores,
+			candidates);
 	/* Filter negligible candidates */
 	rspamd_language_detector_filter_negligible (task, candidates);
 	g_free (selected_words);
+	g_free (scores);
 }
 
 static gint
@@ -1957,6 +2541,85 @@ rspamd_language_detector_is_stop_word (struct rspamd_lang_detector *d,
 	return FALSE;
 }
 
+const rspamd_ftok_t *
+rspamd_language_detector_stem_cache_lookup (struct rspamd_lang_detector *d,
+											const gchar *language,
+											const gchar *word, gsize wlen)
+{
+	struct rspamd_stem_cache_elt search, *found;
+
+	if (d->stem_cache == NULL) {
+		return NULL;
+	}
+
+	search.lang.begin = language;
+	search.lang.len = strlen (language);
+	search.word.begin = word;
+	search.word.len = wlen;
+
+	found = rspamd_lru_hash_lookup (d->stem_cache, &search, time (NULL));
+
+	if (found) {
+		d->stem_cache_hits ++;
+
+		return &found->stemmed;
+	}
+
+	d->stem_cache_misses ++;
+
+	return NULL;
+}
+
+void
+rspamd_language_detector_stem_cache_insert (struct rspamd_lang_detector *d,
+											const gchar *language,
+											const gchar *word, gsize wlen,
+											const gchar *stemmed, gsize slen)
+{
+	struct rspamd_stem_cache_elt *elt, search;
+	gsize llen;
+	gchar *p;
+
+	if (d->stem_cache == NULL) {
+		return;
+	}
+
+	llen = strlen (language);
+	search.lang.begin = language;
+	search.lang.len = llen;
+	search.word.begin = word;
+	search.word.len = wlen;
+
+	if (rspamd_lru_hash_lookup (d->stem_cache, &search, time (NULL)) != NULL) {
+		/* Keys are owned by elements, so we must not replace them */
+		return;
+	}
+
+	elt = g_malloc (sizeof (*elt) + llen + wlen + slen + 3);
+	p = ((gchar *)elt) + sizeof (*elt);
+
+	rspamd_strlcpy (p, language, llen + 1);
+	elt->lang.begin = p;
+	elt->lang.len = llen;
+	p += llen + 1;
+
+	memcpy (p, word, wlen);
+	p[wlen] = '\0';
+	elt->word.begin = p;
+	elt->word.len = wlen;
+	p += wlen + 1;
+
+	if (slen > 0) {
+		memcpy (p, stemmed, slen);
+	}
+
+	p[slen] = '\0';
+	elt->stemmed.begin = p;
+	elt->stemmed.len = slen;
+
+	rspamd_lru_hash_insert (d->stem_cache, elt, elt, time (NULL), 0);
+}
+
 gint
 rspamd_language_detector_elt_flags (const struct rspamd_language_elt *elt)
 {
@@ -76,6 +76,17 @@ struct rspamd_lang_detector *rspamd_language_detector_ref (struct rspamd_lang_de
 
 void rspamd_language_detector_unref (struct rspamd_lang_detector *d);
 
+/**
+ * Saves trigramms tables of the detector to a compiled file that can be
+ * mapped by workers directly (see `languages_compiled` option)
+ * @param d
+ * @param path
+ * @param err
+ * @return TRUE if the file has been written
+ */
+gboolean rspamd_language_detector_save (struct rspamd_lang_detector *d,
+										const gchar *path, GError **err);
+
 /**
  * Try to detect language of words
  * @param d
@@ -97,6 +108,34 @@ gboolean rspamd_language_detector_detect (struct rspamd_task *task,
 gboolean rspamd_language_detector_is_stop_word (struct rspamd_lang_detector *d,
 												const gchar *word, gsize wlen);
 
+/**
+ * Returns stemmed form of a normalised word from the per process stem cache
+ * @param d
+ * @param language
+ * @param word
+ * @param wlen
+ * @return cached stemmed word (zero length if the word cannot be stemmed)
+ * or NULL if a word is not cached; valid until the next insertion
+ */
+const rspamd_ftok_t *rspamd_language_detector_stem_cache_lookup (
+		struct rspamd_lang_detector *d,
+		const gchar *language,
+		const gchar *word, gsize wlen);
+
+/**
+ * Stores stemmed form of a normalised word in the stem cache
+ * @param d
+ * @param language
+ * @param word
+ * @param wlen
+ * @param stemmed
+ * @param slen
+ */
+void rspamd_language_detector_stem_cache_insert (struct rspamd_lang_detector *d,
+												 const gchar *language,
+												 const gchar *word, gsize wlen,
+												 const gchar *stemmed, gsize slen);
+
 /**
  * Return language flags for a specific language elt
  * @param elt
@@ -48,6 +48,7 @@ struct worker_s;
 struct rspamd_external_libs_ctx;
 struct rspamd_cryptobox_pubkey;
 struct rspamd_dns_resolver;
+struct rspamd_dns_cache;
 
 /**
  * Types of rspamd bind lines
@@ -432,6 +433,8 @@ struct rspamd_config {
 	gdouble map_timeout;                            /**< maps watch timeout									*/
 	gdouble map_file_watch_multiplier;              /**< multiplier for watch timeout when maps are files	*/
 	gchar *maps_cache_dir;                          /**< where to save HTTP cached data						*/
+	guint map_compact_threshold;                    /**< use compact storage for hash maps larger than this	*/
+	gboolean map_background_build;                  /**< parse maps data outside of the event loop			*/
 
 	gdouble monitored_interval;                     /**< interval between monitored checks					*/
 	gboolean disable_monitored;                     /**< disable monitoring completely						*/
@@ -457,6 +460,10 @@ struct rspamd_config {
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
 	gboolean enable_dnssec;                         /**< enable dnssec stub resolver						*/
+	guint32 dns_cache_size;                         /**< number of elements in the shared DNS cache			*/
+	gdouble dns_cache_max_ttl;                      /**< maximum time to cache DNS replies					*/
+	gdouble dns_cache_negative_ttl;                 /**< time to cache negative DNS replies					*/
+	struct rspamd_dns_cache *dns_cache;             /**< shared DNS cache									*/
 
 	guint upstream_max_errors;                        /**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;                    /**< rate of upstream errors							*/
@@ -487,6 +494,9 @@ struct rspamd_config {
 	struct rspamd_external_libs_ctx *libs_ctx;        /**< context for external libraries						*/
 	struct rspamd_monitored_ctx *monitored_ctx;        /**< context for monitored resources					*/
 	struct rspamd_redis_pool *redis_pool;            /**< redis connection pool								*/
+	guint redis_pool_shared_conns;                  /**< multiplexed redis connections per server			*/
+	guint redis_pool_max_inflight;                  /**< commands in-flight per multiplexed connection		*/
+	gboolean redis_pool_coalesce_writes;            /**< write redis commands once per loop iteration		*/
 
 	struct rspamd_re_cache *re_cache;                /**< static regexp cache								*/
 
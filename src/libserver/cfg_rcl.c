@@ -1825,6 +1825,19 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, maps_cache_dir),
 				0,
 				"Directory to save maps cached data (default: $DBDIR)");
+		rspamd_rcl_add_default_handler (sub,
+				"map_compact_threshold",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, map_compact_threshold),
+				RSPAMD_CL_FLAG_UINT,
+				"Use compact immutable storage for hash maps with more elements "
+				"than this value (0 to disable)");
+		rspamd_rcl_add_default_handler (sub,
+				"map_background_build",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, map_background_build),
+				0,
+				"Parse and build hash and radix maps in a separate thread");
 		rspamd_rcl_add_default_handler (sub,
 				"monitoring_watch_interval",
 				rspamd_rcl_parse_struct_time,
@@ -1939,6 +1952,24 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, hs_cache_dir),
 				RSPAMD_CL_FLAG_STRING_PATH,
 				"Path directory where rspamd would save hyperscan cache");
+		rspamd_rcl_add_default_handler (sub,
+				"redis_shared_connections",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, redis_pool_shared_conns),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of multiplexed connections per Redis server used by Lua requests (0 to disable multiplexing)");
+		rspamd_rcl_add_default_handler (sub,
+				"redis_max_inflight",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, redis_pool_max_inflight),
+				RSPAMD_CL_FLAG_UINT,
+				"Maximum number of pipelined commands per multiplexed Redis connection");
+		rspamd_rcl_add_default_handler (sub,
+				"redis_coalesce_writes",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, redis_pool_coalesce_writes),
+				0,
+				"Send all Redis commands issued during one event loop iteration in a single write");
 		rspamd_rcl_add_default_handler (sub,
 				"history_rows",
 				rspamd_rcl_parse_struct_integer,
@@ -2155,7 +2186,8 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				rspamd_rcl_parse_struct_string,
 				G_STRUCT_OFFSET (struct rspamd_config, events_backend),
 				0,
-				"Events backend to use: kqueue, epoll, select, poll or auto (default: auto)");
+				"Events backend to use: kqueue, epoll, iouring, select, poll or auto "
+				"(default: auto, iouring falls back to epoll if unavailable)");
 
 		/* Neighbours configuration */
 		rspamd_rcl_add_section_doc (&sub->subsections, "neighbours", "name",
@@ -2211,6 +2243,24 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, enable_dnssec),
 				0,
 				"Enable DNSSEC support in Rspamd");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+				RSPAMD_CL_FLAG_INT_32,
+				"Number of replies in the DNS cache shared between workers (0 to disable, default)");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_max_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Maximum time to cache DNS replies (lower TTL of records is respected)");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_negative_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time to cache negative DNS replies (NXDOMAIN or no records)");
 
 
 		/* New upstreams configuration */
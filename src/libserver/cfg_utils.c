@@ -25,6 +25,7 @@
 #include "maps/map_helpers.h"
 #include "maps/map_private.h"
 #include "dynamic_cfg.h"
+#include "dns.h"
 #include "utlist.h"
 #include "stat_api.h"
 #include "unix-std.h"
@@ -67,6 +68,7 @@
 #define DEFAULT_RLIMIT_MAXCORE 0
 #define DEFAULT_MAP_TIMEOUT 60.0 * 5
 #define DEFAULT_MAP_FILE_WATCH_MULTIPLIER 1
+#define DEFAULT_MAP_COMPACT_THRESHOLD 1000000
 #define DEFAULT_MIN_WORD 0
 #define DEFAULT_MAX_WORD 40
 #define DEFAULT_WORDS_DECAY 600
@@ -171,6 +173,12 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->dns_retransmits = 5;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	/* Shared DNS cache is disabled by default */
+	cfg->dns_cache_size = 0;
+	cfg->dns_cache_max_ttl = 300.0;
+	cfg->dns_cache_negative_ttl = 30.0;
+	cfg->redis_pool_max_inflight = 64;
+	cfg->redis_pool_coalesce_writes = TRUE;
 
 	/* Add all internal actions to keep compatibility */
 	for (int i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
@@ -213,6 +221,8 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 
 	cfg->map_timeout = DEFAULT_MAP_TIMEOUT;
 	cfg->map_file_watch_multiplier = DEFAULT_MAP_FILE_WATCH_MULTIPLIER;
+	cfg->map_compact_threshold = DEFAULT_MAP_COMPACT_THRESHOLD;
+	cfg->map_background_build = FALSE;
 
 	cfg->log_level = G_LOG_LEVEL_WARNING;
 	cfg->log_flags = RSPAMD_LOG_FLAG_DEFAULT;
@@ -904,6 +914,11 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 	if (opts & RSPAMD_CONFIG_INIT_LIBS) {
 		/* Config other libraries */
 		rspamd_config_libs (cfg->libs_ctx, cfg);
+
+		if (cfg->dns_cache_size > 0) {
+			/* Shared between all workers forked after this point */
+			cfg->dns_cache = rspamd_dns_cache_new (cfg);
+		}
 	}
 
 	/* Validate cache */
@@ -2508,9 +2523,15 @@ rspamd_config_ev_backend_get (struct rspamd_config *cfg)
 			return AUTO_BACKEND;
 		}
 	}
-	else if (strcmp (cfg->events_backend, "iouring") == 0) {
+	else if (strcmp (cfg->events_backend, "iouring") == 0 ||
+			strcmp (cfg->events_backend, "io_uring") == 0) {
 		if (ev_supported_backends () & EVBACKEND_IOURING) {
-			return EVBACKEND_IOURING;
+			/*
+			 * io_uring might be unavailable in runtime (old kernel, seccomp,
+			 * memlock limits), so let libev fall back to epoll in this case
+			 */
+			return EVBACKEND_IOURING |
+				(ev_supported_backends () & EVBACKEND_EPOLL);
 		}
 		else {
 			msg_warn_config ("unsupported events_backend: %s; defaulting to auto",
@@ -2556,13 +2577,6 @@ rspamd_config_ev_backend_to_string (int ev_backend, gboolean *effective)
 		SET_EFFECTIVE (TRUE);
 		return "epoll+io_uring";
 	}
-	if (ev_backend & EVBACKEND_LINUXAIO) {
-		SET_EFFECTIVE (TRUE);
-		return "epoll+aio";
-	}if (ev_backend & EVBACKEND_IOURING) {
-		SET_EFFECTIVE (TRUE);
-		return "epoll+io_uring";
-	}
 	if (ev_backend & EVBACKEND_LINUXAIO) {
 		SET_EFFECTIVE (TRUE);
 		return "epoll+aio";
@@ -19,6 +19,8 @@
 #include "css_parser.hxx"
 #include "libserver/html/html_tag.hxx"
 #include "libserver/html/html_block.hxx"
+#include "libutil/hash.h"
+#include "libcryptobox/cryptobox.h"
 
 /* Keep unit tests implementation here (it'll possibly be moved outside one day) */
 #define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
@@ -103,7 +105,8 @@ css_style_sheet::add_selector_rule(std::unique_ptr<css_selector> &&selector,
 }
 
 auto
-css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag) ->
+css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag,
+								 rspamd_mempool_t *pool) ->
 		rspamd::html::html_block *
 {
 	std::optional<std::string_view> id_comp, class_comp;
@@ -224,4 +227,182 @@ css_parse_style(rspamd_mempool_t *pool,
 	return std::make_pair(nullptr, parse_res.error());
 }
 
+/* Limits for the worker wide cache of the parsed style sheets */
+static constexpr const auto css_cache_max_elts = 1024;
+static constexpr const auto css_cache_max_input = 64 * 1024;
+
+struct css_cache_key {
+	std::uint64_t hash;
+	const std::vector<std::string_view> *inputs;
+};
+
+/*
+ * Cached sheet owns its own memory pool as parsed selectors and values
+ * reference the processed input allocated there
+ */
+struct css_cached_sheet {
+	css_cache_key key;
+	rspamd_mempool_t *pool;
+	std::vector<std::string_view> inputs;
+	std::shared_ptr<css_style_sheet> sheet;
+	css_parse_error error;
+
+	explicit css_cached_sheet(std::uint64_t hash) {
+		pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "css", 0);
+		key.hash = hash;
+		key.inputs = &inputs;
+	}
+
+	~css_cached_sheet() {
+		/* Sheet must be destroyed before the pool */
+		sheet.reset();
+		rspamd_mempool_delete(pool);
+	}
+};
+
+static auto
+css_cache_hash(gconstpointer p) -> guint
+{
+	const auto *key = reinterpret_cast<const css_cache_key *>(p);
+
+	return static_cast<guint>(key->hash);
+}
+
+static auto
+css_cache_equal(gconstpointer p1, gconstpointer p2) -> gboolean
+{
+	const auto *k1 = reinterpret_cast<const css_cache_key *>(p1),
+		*k2 = reinterpret_cast<const css_cache_key *>(p2);
+
+	return k1->hash == k2->hash && *k1->inputs == *k2->inputs;
+}
+
+static auto
+css_cache_get(void) -> rspamd_lru_hash_t *
+{
+	/* Intentionally never destroyed, lives as long as the worker process */
+	static rspamd_lru_hash_t *cache = nullptr;
+
+	if (cache == nullptr) {
+		cache = rspamd_lru_hash_new_full(css_cache_max_elts, nullptr,
+				[](gpointer p) {
+					delete reinterpret_cast<std::shared_ptr<css_cached_sheet> *>(p);
+				},
+				css_cache_hash, css_cache_equal);
+	}
+
+	return cache;
+}
+
+auto
+css_parse_style_cached(rspamd_mempool_t *pool,
+					   const std::vector<std::string_view> &inputs) -> css_return_pair
+{
+	std::uint64_t hash = 0xdeadbabe;
+	std::size_t total_len = 0;
+
+	for (const auto &inp : inputs) {
+		hash = rspamd_cryptobox_fast_hash(inp.data(), inp.size(), hash);
+		total_len += inp.size();
+	}
+
+	if (total_len > css_cache_max_input) {
+		/* Do not pollute cache with huge sheets, parse them in the task's pool */
+		std::shared_ptr<css_style_sheet> sheet;
+		css_parse_error err;
+
+		for (const auto &inp : inputs) {
+			auto res = css_parse_style(pool, inp, std::shared_ptr(sheet));
+
+			if (res.first) {
+				sheet = std::move(res.first);
+			}
+			else {
+				err = std::move(res.second);
+			}
+		}
+
+		return std::make_pair(sheet, err);
+	}
+
+	auto *cache = css_cache_get();
+	css_cache_key search{hash, &inputs};
+	auto *found = reinterpret_cast<std::shared_ptr<css_cached_sheet> *>(
+			rspamd_lru_hash_lookup(cache, &search, time(nullptr)));
+
+	if (found == nullptr) {
+		auto elt = std::make_shared<css_cached_sheet>(hash);
+		auto *epool = elt->pool;
+
+		elt->inputs.reserve(inputs.size());
+
+		for (const auto &inp : inputs) {
+			auto *copy = rspamd_mempool_alloc_buffer(epool, inp.size());
+
+			memcpy(copy, inp.data(), inp.size());
+			elt->inputs.emplace_back(copy, inp.size());
+		}
+
+		/*
+		 * Parse in the element's pool, so the sheet is independent of the
+		 * task's lifetime; failed blocks leave the previous sheet intact
+		 */
+		for (const auto &inp : elt->inputs) {
+			auto res = css_parse_style(epool, inp, std::shared_ptr(elt->sheet));
+
+			if (res.first) {
+				elt->sheet = std::move(res.first);
+			}
+			else {
+				elt->error = std::move(res.second);
+			}
+		}
+
+		found = new std::shared_ptr<css_cached_sheet>(std::move(elt));
+		rspamd_lru_hash_insert(cache, &(*found)->key, found, time(nullptr), 0);
+	}
+	else {
+		msg_debug_css("found cached css sheet for %d blocks", (int)inputs.size());
+	}
+
+	const auto &elt = *found;
+
+	if (!elt->sheet) {
+		return std::make_pair(nullptr, elt->error);
+	}
+
+	/* Aliased pointer keeps the whole element alive even if it is evicted */
+	return std::make_pair(std::shared_ptr<css_style_sheet>(elt, elt->sheet.get()),
+			elt->error);
+}
+
+TEST_SUITE("css") {
+	TEST_CASE("css cache") {
+		rspamd_mempool_t *pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
+				"css", 0);
+		std::vector<std::string_view> inputs{
+			"p { color: red; } .cls { display: none; }",
+			"#id { color: #ff0000; }"
+		};
+		std::vector<std::string_view> other_inputs{
+			"p { color: red; } .cls { display: none; }"
+		};
+
+		auto first = css_parse_style_cached(pool, inputs);
+		auto second = css_parse_style_cached(pool, inputs);
+		auto third = css_parse_style_cached(pool, other_inputs);
+
+		CHECK(first.first.get() != nullptr);
+		CHECK(first.first.get() == second.first.get());
+		CHECK(third.first.get() != nullptr);
+		CHECK(third.first.get() != first.first.get());
+
+		std::vector<std::string_view> bad_inputs{"{{{"};
+		auto bad = css_parse_style_cached(pool, bad_inputs);
+		CHECK(bad.first.get() == nullptr);
+
+		rspamd_mempool_delete(pool);
+	}
+}
+
 }
\ No newline at end of file
@@ -20,6 +20,7 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 #include "logger.h"
 #include "css_rule.hxx"
 #include "css_selector.hxx"
@@ -50,7 +51,13 @@ public:
 	auto add_selector_rule(std::unique_ptr<css_selector> &&selector,
 						   css_declarations_block_ptr decls) -> void;
 
-	auto check_tag_block(const rspamd::html::html_tag *tag) ->
+	/*
+	 * Compiles the matching rules for a tag into a html block allocated
+	 * in the specified pool (that could differ from the sheet's own pool
+	 * for the shared sheets)
+	 */
+	auto check_tag_block(const rspamd::html::html_tag *tag,
+						 rspamd_mempool_t *pool) ->
 		rspamd::html::html_block *;
 private:
 	class impl;
@@ -64,6 +71,16 @@ auto css_parse_style(rspamd_mempool_t *pool,
 					 std::shared_ptr<css_style_sheet> &&existing) ->
 					 css_return_pair;
 
+/*
+ * Parses a sequence of style blocks (e.g. all <style> tags of a document)
+ * using a worker wide cache of the parsed sheets keyed by hash of the inputs.
+ * Sheets returned from the cache are shared between tasks, so they must
+ * not be modified by a caller
+ */
+auto css_parse_style_cached(rspamd_mempool_t *pool,
+							const std::vector<std::string_view> &inputs) ->
+							css_return_pair;
+
 }
 
 #endif //RSPAMD_CSS_H
\ No newline at end of file
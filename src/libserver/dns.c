@@ -60,6 +60,8 @@ struct rspamd_dns_request_ud {
 	struct rspamd_symcache_item *item;
 	struct rdns_request *req;
 	struct rdns_reply *reply;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_request_ud *prev, *next;
 };
 
 struct rspamd_dns_fail_cache_entry {
@@ -68,6 +70,18 @@ struct rspamd_dns_fail_cache_entry {
 	enum rdns_request_type type;
 };
 
+/*
+ * Outstanding request shared by all session requests for the same name and
+ * type, each waiter holds its own reference of the rdns request
+ */
+struct rspamd_dns_inflight {
+	struct rspamd_dns_fail_cache_entry key;
+	struct rspamd_dns_resolver *resolver;
+	struct rdns_request *req;
+	struct rspamd_dns_request_ud *waiters;
+	gboolean replied; /* Removed from the resolver hash, waiters are replied */
+};
+
 static const gint8 ascii_dns_table[128]={
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -113,6 +127,19 @@ rspamd_dns_fin_cb (gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
 
+	if (reqdata->inflight) {
+		/* Session is terminated before reply, leave the waiters list */
+		struct rspamd_dns_inflight *inflight = reqdata->inflight;
+
+		DL_DELETE (inflight->waiters, reqdata);
+		reqdata->inflight = NULL;
+
+		if (inflight->waiters == NULL && !inflight->replied) {
+			/* Request is cancelled by the release below */
+			g_hash_table_remove (inflight->resolver->inflight, &inflight->key);
+		}
+	}
+
 	if (reqdata->item) {
 		rspamd_symcache_set_cur_item (reqdata->task, reqdata->item);
 	}
@@ -145,54 +172,82 @@ rspamd_dns_fin_cb (gpointer arg)
 }
 
 static void
-rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+rspamd_dns_session_reply (struct rdns_reply *reply,
+		struct rspamd_dns_request_ud *reqdata)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
-
 	reqdata->reply = reply;
 
+	if (reply->code == RDNS_RC_SERVFAIL &&
+		reqdata->task &&
+		reqdata->task->resolver->fails_cache) {
+
+		/* Add to cache... */
+		const gchar *name = reqdata->req->requested_names[0].name;
+		gchar *target;
+		gsize namelen;
+		struct rspamd_dns_fail_cache_entry *nentry;
+
+		/* Allocate in a single entry to allow further free in a single call */
+		namelen = strlen (name);
+		nentry = g_malloc (sizeof (nentry) + namelen + 1);
+		target = ((gchar *)nentry) + sizeof (nentry);
+		rspamd_strlcpy (target, name, namelen + 1);
+		nentry->type = reqdata->req->requested_names[0].type;
+		nentry->name = target;
+		nentry->namelen = namelen;
+
+		/* Rdns request is retained there */
+		rspamd_lru_hash_insert (reqdata->task->resolver->fails_cache,
+				nentry, rdns_request_retain (reply->request),
+				reqdata->task->task_timestamp,
+				reqdata->task->resolver->fails_cache_time);
+	}
 
-	if (reqdata->session) {
-		if (reply->code == RDNS_RC_SERVFAIL &&
-			reqdata->task &&
-			reqdata->task->resolver->fails_cache) {
-
-			/* Add to cache... */
-			const gchar *name = reqdata->req->requested_names[0].name;
-			gchar *target;
-			gsize namelen;
-			struct rspamd_dns_fail_cache_entry *nentry;
-
-			/* Allocate in a single entry to allow further free in a single call */
-			namelen = strlen (name);
-			nentry = g_malloc (sizeof (nentry) + namelen + 1);
-			target = ((gchar *)nentry) + sizeof (nentry);
-			rspamd_strlcpy (target, name, namelen + 1);
-			nentry->type = reqdata->req->requested_names[0].type;
-			nentry->name = target;
-			nentry->namelen = namelen;
-
-			/* Rdns request is retained there */
-			rspamd_lru_hash_insert (reqdata->task->resolver->fails_cache,
-					nentry, rdns_request_retain (reply->request),
-					reqdata->task->task_timestamp,
-					reqdata->task->resolver->fails_cache_time);
-		}
+	rspamd_session_remove_event (reqdata->session,
+			rspamd_dns_fin_cb, reqdata);
+}
 
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
-		rspamd_session_remove_event (reqdata->session,
-				rspamd_dns_fin_cb, reqdata);
+static void
+rspamd_dns_inflight_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_inflight *inflight = ud;
+	struct rspamd_dns_request_ud *cur;
+
+	/* New requests for the same name should go to network from now */
+	g_hash_table_steal (inflight->resolver->inflight, &inflight->key);
+	inflight->replied = TRUE;
+
+	/*
+	 * Ref event to avoid double unref by
+	 * event removing: waiters hold one reference each and rdns releases
+	 * one after this callback
+	 */
+	rdns_request_retain (reply->request);
+
+	/*
+	 * Callbacks can destroy sessions of other waiters, so they are detached
+	 * one by one: destroyed waiters leave the list in rspamd_dns_fin_cb
+	 */
+	while ((cur = inflight->waiters) != NULL) {
+		DL_DELETE (inflight->waiters, cur);
+		cur->inflight = NULL;
+		rspamd_dns_session_reply (reply, cur);
 	}
-	else {
-		reqdata->cb (reply, reqdata->ud);
 
-		if (reqdata->pool == NULL) {
-			g_free (reqdata);
-		}
+	g_free (inflight);
+}
+
+static void
+rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+
+	/* Requests without session, session requests go via inflight callback */
+	reqdata->reply = reply;
+	reqdata->cb (reply, reqdata->ud);
+
+	if (reqdata->pool == NULL) {
+		g_free (reqdata);
 	}
 }
 
@@ -262,9 +317,55 @@ rspamd_dns_resolver_request (struct rspamd_dns_resolver *resolver,
 	reqdata->cb = cb;
 	reqdata->ud = ud;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
+	if (session) {
+		/* Coalesce identical outstanding requests */
+		struct rspamd_dns_inflight *inflight;
+		struct rspamd_dns_fail_cache_entry search;
+
+		search.name = name;
+		search.namelen = nlen;
+		search.type = type;
+
+		inflight = g_hash_table_lookup (resolver->inflight, &search);
+
+		if (inflight) {
+			req = rdns_request_retain (inflight->req);
+		}
+		else {
+			inflight = g_malloc0 (sizeof (*inflight) + nlen + 1);
+			inflight->key.name = ((gchar *)inflight) + sizeof (*inflight);
+			rspamd_strlcpy ((gchar *)inflight->key.name, name, nlen + 1);
+			inflight->key.namelen = nlen;
+			inflight->key.type = type;
+			inflight->resolver = resolver;
+
+			req = rdns_make_request_full (resolver->r,
+					rspamd_dns_inflight_callback, inflight,
+					resolver->request_timeout, resolver->max_retransmits, 1,
+					name, type);
+
+			if (req != NULL) {
+				inflight->req = req;
+				g_hash_table_insert (resolver->inflight, &inflight->key,
+						inflight);
+			}
+			else {
+				g_free (inflight);
+				inflight = NULL;
+			}
+		}
+
+		if (inflight) {
+			reqdata->inflight = inflight;
+			DL_APPEND (inflight->waiters, reqdata);
+		}
+	}
+	else {
+		req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
+				resolver->request_timeout, resolver->max_retransmits, 1, name,
+				type);
+	}
+
 	reqdata->req = req;
 
 	if (session) {
@@ -870,6 +971,544 @@ rspamd_dns_resolver_config_ucl (struct rspamd_config *cfg,
 	}
 }
 
+/*
+ * Shared answer cache: it is allocated in the main process before forking,
+ * so all workers share the same slots. Slots are grouped in small buckets,
+ * each bucket is protected by one of the striped shared mutexes.
+ */
+#define RSPAMD_DNS_CACHE_WAYS 4
+#define RSPAMD_DNS_CACHE_LOCKS 64
+#define RSPAMD_DNS_CACHE_MAX_NAME 256
+#define RSPAMD_DNS_CACHE_MAX_DATA 512
+/* Each element takes almost 1Kb of shared memory */
+#define RSPAMD_DNS_CACHE_MAX_SIZE (1u << 20u)
+
+struct rspamd_dns_cache_elt {
+	guint64 hash;
+	gdouble stored;
+	gdouble expire;
+	guint16 type;
+	gint16 rcode;
+	guint16 name_len;
+	guint16 data_len;
+	guint8 authenticated;
+	guint8 nentries;
+	gchar name[RSPAMD_DNS_CACHE_MAX_NAME];
+	guchar data[RSPAMD_DNS_CACHE_MAX_DATA];
+};
+
+struct rspamd_dns_cache {
+	guint nbuckets;
+	gdouble max_ttl;
+	gdouble negative_ttl;
+	guint64 hits;
+	guint64 misses;
+	guint64 inserts;
+	rspamd_mempool_mutex_t *locks[RSPAMD_DNS_CACHE_LOCKS];
+	struct rspamd_dns_cache_elt *elts;
+};
+
+static struct rdns_cache_context rspamd_dns_cache_ctx = {
+		.lookup = rspamd_dns_cache_lookup,
+		.store = rspamd_dns_cache_store,
+		.data = NULL
+};
+
+#ifndef HAVE_ATOMIC_BUILTINS
+#define RSPAMD_DNS_CACHE_INC(v) (v)++
+#else
+#define RSPAMD_DNS_CACHE_INC(v) __atomic_add_fetch (&(v), 1, __ATOMIC_RELEASE)
+#endif
+
+struct rspamd_dns_cache *
+rspamd_dns_cache_new (struct rspamd_config *cfg)
+{
+	struct rspamd_dns_cache *cache;
+	guint nbuckets = 1, i, size = cfg->dns_cache_size;
+
+	if (size > RSPAMD_DNS_CACHE_MAX_SIZE) {
+		msg_warn_config ("too large DNS cache size: %ud, limit it to %ud",
+				size, RSPAMD_DNS_CACHE_MAX_SIZE);
+		size = RSPAMD_DNS_CACHE_MAX_SIZE;
+	}
+
+	while (nbuckets * RSPAMD_DNS_CACHE_WAYS < size) {
+		nbuckets <<= 1;
+	}
+
+	cache = rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*cache));
+	cache->elts = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (struct rspamd_dns_cache_elt) * nbuckets *
+			RSPAMD_DNS_CACHE_WAYS);
+	cache->nbuckets = nbuckets;
+	cache->max_ttl = cfg->dns_cache_max_ttl;
+	cache->negative_ttl = cfg->dns_cache_negative_ttl;
+
+	for (i = 0; i < G_N_ELEMENTS (cache->locks); i ++) {
+		cache->locks[i] = rspamd_mempool_get_mutex (cfg->cfg_pool);
+	}
+
+	msg_info_config ("initialised shared DNS cache with %ud elements",
+			nbuckets * RSPAMD_DNS_CACHE_WAYS);
+
+	return cache;
+}
+
+void
+rspamd_dns_cache_stat (struct rspamd_dns_cache *cache,
+		guint64 *hits, guint64 *misses, guint64 *inserts)
+{
+	*hits = cache->hits;
+	*misses = cache->misses;
+	*inserts = cache->inserts;
+}
+
+static inline guint64
+rspamd_dns_cache_hash (const char *name, size_t len, enum rdns_request_type type)
+{
+	return rspamd_icase_hash (name, len, rspamd_hash_seed () ^ type);
+}
+
+static inline struct rspamd_dns_cache_elt *
+rspamd_dns_cache_bucket (struct rspamd_dns_cache *cache, guint64 h,
+		rspamd_mempool_mutex_t **plock)
+{
+	guint64 idx = h & (cache->nbuckets - 1);
+
+	*plock = cache->locks[idx % RSPAMD_DNS_CACHE_LOCKS];
+
+	return &cache->elts[idx * RSPAMD_DNS_CACHE_WAYS];
+}
+
+/* Serialisation of reply entries to the flat slot storage */
+struct rspamd_dns_cache_buf {
+	guchar *p;
+	gsize remain;
+};
+
+static inline gboolean
+rspamd_dns_cache_write (struct rspamd_dns_cache_buf *buf, const void *data,
+		gsize len)
+{
+	if (buf->remain < len) {
+		return FALSE;
+	}
+
+	memcpy (buf->p, data, len);
+	buf->p += len;
+	buf->remain -= len;
+
+	return TRUE;
+}
+
+static inline gboolean
+rspamd_dns_cache_write_str (struct rspamd_dns_cache_buf *buf, const gchar *str)
+{
+	guint16 slen = str ? strlen (str) : 0;
+
+	return rspamd_dns_cache_write (buf, &slen, sizeof (slen)) &&
+		rspamd_dns_cache_write (buf, str, slen);
+}
+
+static inline gboolean
+rspamd_dns_cache_read (struct rspamd_dns_cache_buf *buf, void *data, gsize len)
+{
+	if (buf->remain < len) {
+		return FALSE;
+	}
+
+	memcpy (data, buf->p, len);
+	buf->p += len;
+	buf->remain -= len;
+
+	return TRUE;
+}
+
+static inline gboolean
+rspamd_dns_cache_read_str (struct rspamd_dns_cache_buf *buf, gchar **str)
+{
+	guint16 slen;
+
+	if (!rspamd_dns_cache_read (buf, &slen, sizeof (slen)) ||
+			buf->remain < slen) {
+		return FALSE;
+	}
+
+	*str = malloc (slen + 1);
+
+	if (*str == NULL) {
+		return FALSE;
+	}
+
+	memcpy (*str, buf->p, slen);
+	(*str)[slen] = '\0';
+	buf->p += slen;
+	buf->remain -= slen;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_dns_cache_serialise_entry (struct rspamd_dns_cache_buf *buf,
+		const struct rdns_reply_entry *entry)
+{
+	guint8 type = entry->type;
+	const union rdns_reply_element_un *c = &entry->content;
+
+	if (!rspamd_dns_cache_write (buf, &type, sizeof (type)) ||
+			!rspamd_dns_cache_write (buf, &entry->ttl, sizeof (entry->ttl))) {
+		return FALSE;
+	}
+
+	switch (entry->type) {
+	case RDNS_REQUEST_A:
+		return rspamd_dns_cache_write (buf, &c->a.addr, sizeof (c->a.addr));
+	case RDNS_REQUEST_AAAA:
+		return rspamd_dns_cache_write (buf, &c->aaa.addr, sizeof (c->aaa.addr));
+	case RDNS_REQUEST_PTR:
+		return rspamd_dns_cache_write_str (buf, c->ptr.name);
+	case RDNS_REQUEST_NS:
+		return rspamd_dns_cache_write_str (buf, c->ns.name);
+	case RDNS_REQUEST_MX:
+		return rspamd_dns_cache_write (buf, &c->mx.priority,
+				sizeof (c->mx.priority)) &&
+			rspamd_dns_cache_write_str (buf, c->mx.name);
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		return rspamd_dns_cache_write_str (buf, c->txt.data);
+	case RDNS_REQUEST_SRV:
+		return rspamd_dns_cache_write (buf, &c->srv.priority,
+				sizeof (c->srv.priority)) &&
+			rspamd_dns_cache_write (buf, &c->srv.weight,
+				sizeof (c->srv.weight)) &&
+			rspamd_dns_cache_write (buf, &c->srv.port, sizeof (c->srv.port)) &&
+			rspamd_dns_cache_write_str (buf, c->srv.target);
+	case RDNS_REQUEST_SOA:
+		return rspamd_dns_cache_write_str (buf, c->soa.mname) &&
+			rspamd_dns_cache_write_str (buf, c->soa.admin) &&
+			rspamd_dns_cache_write (buf, &c->soa.serial, sizeof (c->soa.serial)) &&
+			rspamd_dns_cache_write (buf, &c->soa.refresh, sizeof (c->soa.refresh)) &&
+			rspamd_dns_cache_write (buf, &c->soa.retry, sizeof (c->soa.retry)) &&
+			rspamd_dns_cache_write (buf, &c->soa.expire, sizeof (c->soa.expire)) &&
+			rspamd_dns_cache_write (buf, &c->soa.minimum, sizeof (c->soa.minimum));
+	case RDNS_REQUEST_TLSA:
+		return rspamd_dns_cache_write (buf, &c->tlsa.usage,
+				sizeof (c->tlsa.usage)) &&
+			rspamd_dns_cache_write (buf, &c->tlsa.selector,
+				sizeof (c->tlsa.selector)) &&
+			rspamd_dns_cache_write (buf, &c->tlsa.match_type,
+				sizeof (c->tlsa.match_type)) &&
+			rspamd_dns_cache_write (buf, &c->tlsa.datalen,
+				sizeof (c->tlsa.datalen)) &&
+			rspamd_dns_cache_write (buf, c->tlsa.data, c->tlsa.datalen);
+	default:
+		/* Do not cache unknown records */
+		return FALSE;
+	}
+}
+
+static void
+rspamd_dns_cache_free_entries (struct rdns_reply_entry *entries)
+{
+	struct rdns_reply_entry *entry, *tmp;
+
+	LL_FOREACH_SAFE (entries, entry, tmp) {
+		switch (entry->type) {
+		case RDNS_REQUEST_PTR:
+			free (entry->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			free (entry->content.ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			free (entry->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			free (entry->content.txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			free (entry->content.srv.target);
+			break;
+		case RDNS_REQUEST_TLSA:
+			free (entry->content.tlsa.data);
+			break;
+		case RDNS_REQUEST_SOA:
+			free (entry->content.soa.mname);
+			free (entry->content.soa.admin);
+			break;
+		default:
+			break;
+		}
+
+		free (entry);
+	}
+}
+
+static struct rdns_reply_entry *
+rspamd_dns_cache_deserialise_entry (struct rspamd_dns_cache_buf *buf,
+		gint32 ttl_passed)
+{
+	struct rdns_reply_entry *entry;
+	union rdns_reply_element_un *c;
+	guint8 type;
+	gboolean ret;
+
+	entry = calloc (1, sizeof (*entry));
+
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	c = &entry->content;
+
+	if (!rspamd_dns_cache_read (buf, &type, sizeof (type)) ||
+			!rspamd_dns_cache_read (buf, &entry->ttl, sizeof (entry->ttl))) {
+		free (entry);
+
+		return NULL;
+	}
+
+	entry->type = type;
+	entry->ttl = MAX (entry->ttl - ttl_passed, 0);
+
+	switch (entry->type) {
+	case RDNS_REQUEST_A:
+		ret = rspamd_dns_cache_read (buf, &c->a.addr, sizeof (c->a.addr));
+		break;
+	case RDNS_REQUEST_AAAA:
+		ret = rspamd_dns_cache_read (buf, &c->aaa.addr, sizeof (c->aaa.addr));
+		break;
+	case RDNS_REQUEST_PTR:
+		ret = rspamd_dns_cache_read_str (buf, &c->ptr.name);
+		break;
+	case RDNS_REQUEST_NS:
+		ret = rspamd_dns_cache_read_str (buf, &c->ns.name);
+		break;
+	case RDNS_REQUEST_MX:
+		ret = rspamd_dns_cache_read (buf, &c->mx.priority,
+				sizeof (c->mx.priority)) &&
+			rspamd_dns_cache_read_str (buf, &c->mx.name);
+		break;
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		ret = rspamd_dns_cache_read_str (buf, &c->txt.data);
+		break;
+	case RDNS_REQUEST_SRV:
+		ret = rspamd_dns_cache_read (buf, &c->srv.priority,
+				sizeof (c->srv.priority)) &&
+			rspamd_dns_cache_read (buf, &c->srv.weight,
+				sizeof (c->srv.weight)) &&
+			rspamd_dns_cache_read (buf, &c->srv.port, sizeof (c->srv.port)) &&
+			rspamd_dns_cache_read_str (buf, &c->srv.target);
+		break;
+	case RDNS_REQUEST_SOA:
+		ret = rspamd_dns_cache_read_str (buf, &c->soa.mname) &&
+			rspamd_dns_cache_read_str (buf, &c->soa.admin) &&
+			rspamd_dns_cache_read (buf, &c->soa.serial, sizeof (c->soa.serial)) &&
+			rspamd_dns_cache_read (buf, &c->soa.refresh, sizeof (c->soa.refresh)) &&
+			rspamd_dns_cache_read (buf, &c->soa.retry, sizeof (c->soa.retry)) &&
+			rspamd_dns_cache_read (buf, &c->soa.expire, sizeof (c->soa.expire)) &&
+			rspamd_dns_cache_read (buf, &c->soa.minimum, sizeof (c->soa.minimum));
+		break;
+	case RDNS_REQUEST_TLSA:
+		ret = rspamd_dns_cache_read (buf, &c->tlsa.usage,
+				sizeof (c->tlsa.usage)) &&
+			rspamd_dns_cache_read (buf, &c->tlsa.selector,
+				sizeof (c->tlsa.selector)) &&
+			rspamd_dns_cache_read (buf, &c->tlsa.match_type,
+				sizeof (c->tlsa.match_type)) &&
+			rspamd_dns_cache_read (buf, &c->tlsa.datalen,
+				sizeof (c->tlsa.datalen)) &&
+			buf->remain >= c->tlsa.datalen;
+
+		if (ret) {
+			c->tlsa.data = malloc (MAX (c->tlsa.datalen, 1));
+			rspamd_dns_cache_read (buf, c->tlsa.data, c->tlsa.datalen);
+		}
+		break;
+	default:
+		ret = FALSE;
+		break;
+	}
+
+	if (!ret) {
+		/* Partially read strings are owned by the entry */
+		entry->next = NULL;
+		rspamd_dns_cache_free_entries (entry);
+
+		return NULL;
+	}
+
+	return entry;
+}
+
+bool
+rspamd_dns_cache_lookup (const char *name, size_t len,
+		enum rdns_request_type type, enum dns_rcode *rcode,
+		struct rdns_reply_entry **entries, bool *authenticated,
+		void *cache_data)
+{
+	struct rspamd_dns_cache *cache = (struct rspamd_dns_cache *)cache_data;
+	struct rspamd_dns_cache_elt *bucket, *elt;
+	struct rdns_reply_entry *res = NULL, *entry;
+	struct rspamd_dns_cache_buf buf;
+	rspamd_mempool_mutex_t *lock;
+	gdouble now;
+	guint64 h;
+	guint i, j;
+	bool found = false;
+
+	if (len >= RSPAMD_DNS_CACHE_MAX_NAME) {
+		return false;
+	}
+
+	h = rspamd_dns_cache_hash (name, len, type);
+	bucket = rspamd_dns_cache_bucket (cache, h, &lock);
+	now = rspamd_get_calendar_ticks ();
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_WAYS; i ++) {
+		elt = &bucket[i];
+
+		if (elt->hash != h || elt->type != type || elt->name_len != len ||
+				elt->expire <= now ||
+				rspamd_lc_cmp (elt->name, name, len) != 0) {
+			continue;
+		}
+
+		buf.p = elt->data;
+		buf.remain = elt->data_len;
+		found = true;
+
+		for (j = 0; j < elt->nentries; j ++) {
+			entry = rspamd_dns_cache_deserialise_entry (&buf,
+					(gint32)(now - elt->stored));
+
+			if (entry == NULL) {
+				found = false;
+				break;
+			}
+
+			DL_APPEND (res, entry);
+		}
+
+		if (found) {
+			*rcode = elt->rcode;
+			*authenticated = elt->authenticated;
+		}
+
+		break;
+	}
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	if (found) {
+		*entries = res;
+		RSPAMD_DNS_CACHE_INC (cache->hits);
+	}
+	else {
+		rspamd_dns_cache_free_entries (res);
+		RSPAMD_DNS_CACHE_INC (cache->misses);
+	}
+
+	return found;
+}
+
+void
+rspamd_dns_cache_store (const char *name, size_t len,
+		enum rdns_request_type type, const struct rdns_reply *reply,
+		void *cache_data)
+{
+	struct rspamd_dns_cache *cache = (struct rspamd_dns_cache *)cache_data;
+	struct rspamd_dns_cache_elt *bucket, *elt, *victim = NULL;
+	const struct rdns_reply_entry *entry;
+	struct rspamd_dns_cache_buf buf;
+	guchar data[RSPAMD_DNS_CACHE_MAX_DATA];
+	rspamd_mempool_mutex_t *lock;
+	gdouble now, ttl;
+	guint64 h;
+	guint i, nentries = 0;
+
+	if (len >= RSPAMD_DNS_CACHE_MAX_NAME) {
+		return;
+	}
+
+	buf.p = data;
+	buf.remain = sizeof (data);
+
+	switch (reply->code) {
+	case RDNS_RC_NOERROR:
+		ttl = cache->max_ttl;
+
+		DL_FOREACH (reply->entries, entry) {
+			if (nentries == G_MAXUINT8 ||
+					!rspamd_dns_cache_serialise_entry (&buf, entry)) {
+				/* Too large reply */
+				return;
+			}
+
+			ttl = MIN (ttl, entry->ttl);
+			nentries ++;
+		}
+
+		if (nentries == 0) {
+			ttl = cache->negative_ttl;
+		}
+		break;
+	case RDNS_RC_NXDOMAIN:
+	case RDNS_RC_NOREC:
+		ttl = cache->negative_ttl;
+		break;
+	default:
+		/* Temporary failures are not cached */
+		return;
+	}
+
+	if (ttl <= 0) {
+		return;
+	}
+
+	h = rspamd_dns_cache_hash (name, len, type);
+	bucket = rspamd_dns_cache_bucket (cache, h, &lock);
+	now = rspamd_get_calendar_ticks ();
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_WAYS; i ++) {
+		elt = &bucket[i];
+
+		if (elt->hash == h && elt->type == type && elt->name_len == len &&
+				rspamd_lc_cmp (elt->name, name, len) == 0) {
+			/* Replace the same element */
+			victim = elt;
+			break;
+		}
+
+		/* Otherwise evict the element that expires first */
+		if (victim == NULL || elt->expire < victim->expire) {
+			victim = elt;
+		}
+	}
+
+	victim->hash = h;
+	victim->stored = now;
+	victim->expire = now + ttl;
+	victim->type = type;
+	victim->rcode = reply->code;
+	victim->authenticated = reply->authenticated;
+	victim->nentries = nentries;
+	victim->name_len = len;
+	memcpy (victim->name, name, len);
+	victim->data_len = buf.p - data;
+	memcpy (victim->data, data, victim->data_len);
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	RSPAMD_DNS_CACHE_INC (cache->inserts);
+}
+
 struct rspamd_dns_resolver *
 rspamd_dns_resolver_init (rspamd_logger_t *logger,
 						  struct ev_loop *ev_base,
@@ -879,6 +1518,8 @@ rspamd_dns_resolver_init (rspamd_logger_t *logger,
 
 	dns_resolver = g_malloc0 (sizeof (struct rspamd_dns_resolver));
 	dns_resolver->event_loop = ev_base;
+	dns_resolver->inflight = g_hash_table_new_full (rspamd_dns_fail_hash,
+			rspamd_dns_fail_equal, NULL, g_free);
 
 	if (cfg != NULL) {
 		dns_resolver->request_timeout = cfg->dns_timeout;
@@ -946,6 +1587,12 @@ rspamd_dns_resolver_init (rspamd_logger_t *logger,
 				dns_resolver);
 		rdns_resolver_set_upstream_lib (dns_resolver->r, &rspamd_ups_ctx,
 				dns_resolver->ups);
+
+		if (cfg->dns_cache) {
+			rdns_resolver_set_cache_lib (dns_resolver->r, &rspamd_dns_cache_ctx,
+					cfg->dns_cache);
+		}
+
 		cfg->dns_resolver = dns_resolver;
 
 		if (cfg->rcl_obj) {
@@ -990,6 +1637,8 @@ rspamd_dns_resolver_deinit (struct rspamd_dns_resolver *resolver)
 			rspamd_lru_hash_destroy (resolver->fails_cache);
 		}
 
+		g_hash_table_unref (resolver->inflight);
+
 		uidna_close (resolver->uidna);
 
 		g_free (resolver);
@@ -36,6 +36,7 @@ struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct ev_loop *event_loop;
 	rspamd_lru_hash_t *fails_cache;
+	GHashTable *inflight;
 	void *uidna;
 	ev_tstamp fails_cache_time;
 	struct upstream_list *ups;
@@ -88,6 +89,56 @@ gboolean rspamd_dns_resolver_request_task_forced (struct rspamd_task *task,
 												  enum rdns_request_type type,
 												  const char *name);
 
+struct rspamd_dns_cache;
+
+/**
+ * Creates DNS answers cache in the shared memory, must be called before forking
+ * workers to share the cache between them
+ * @param cfg config with cache options
+ * @return new cache
+ */
+struct rspamd_dns_cache *rspamd_dns_cache_new (struct rspamd_config *cfg);
+
+/**
+ * Returns counters for the DNS cache
+ * @param cache
+ * @param hits
+ * @param misses
+ * @param inserts
+ */
+void rspamd_dns_cache_stat (struct rspamd_dns_cache *cache,
+							guint64 *hits, guint64 *misses, guint64 *inserts);
+
+/**
+ * Looks up a DNS answer in the cache (rdns cache lookup callback)
+ * @param name name requested
+ * @param len length of name
+ * @param type request type
+ * @param rcode reply code of the cached answer
+ * @param entries list of the cached entries (malloc'ed) with the remaining ttl
+ * @param authenticated authenticated flag of the cached answer
+ * @param cache_data cache
+ * @return true if an answer has been found
+ */
+bool rspamd_dns_cache_lookup (const char *name, size_t len,
+							  enum rdns_request_type type, enum dns_rcode *rcode,
+							  struct rdns_reply_entry **entries, bool *authenticated,
+							  void *cache_data);
+
+/**
+ * Stores a DNS answer in the cache (rdns cache store callback), positive
+ * answers are cached for the minimum ttl of entries but no longer than
+ * `cache_max_ttl`, negative ones for `cache_negative_ttl`
+ * @param name name requested
+ * @param len length of name
+ * @param type request type
+ * @param reply reply received
+ * @param cache_data cache
+ */
+void rspamd_dns_cache_store (const char *name, size_t len,
+							 enum rdns_request_type type, const struct rdns_reply *reply,
+							 void *cache_data);
+
 /**
  * Converts a name into idna from UTF8
  * @param resolver resolver (must be initialised)
@@ -1325,6 +1325,7 @@ html_process_input(rspamd_mempool_t *pool,
 	gint href_offset = -1;
 	struct html_tag *cur_tag = nullptr, *parent_tag = nullptr, cur_closing_tag;
 	struct tag_content_parser_state content_parser_env;
+	std::vector<std::string_view> css_inputs;
 
 	enum {
 		parse_start = 0,
@@ -1933,23 +1934,8 @@ html_process_input(rspamd_mempool_t *pool,
 
 					if (opening_tag && opening_tag->id == Tag_STYLE &&
 						(int)opening_tag->content_offset < opening_tag->closing.start) {
-						auto ret_maybe = rspamd::css::parse_css(pool,
-								{start + opening_tag->content_offset,
-								 opening_tag->closing.start - opening_tag->content_offset},
-								std::move(hc->css_style));
-
-						if (!ret_maybe.has_value()) {
-							if (ret_maybe.error().is_fatal()) {
-								auto err_str = fmt::format(
-										"cannot parse css (error code: {}): {}",
-										static_cast<int>(ret_maybe.error().type),
-										ret_maybe.error().description.value_or("unknown error"));
-								msg_info_pool ("%*s", (int) err_str.size(), err_str.data());
-							}
-						}
-						else {
-							hc->css_style = ret_maybe.value();
-						}
+						css_inputs.emplace_back(start + opening_tag->content_offset,
+								opening_tag->closing.start - opening_tag->content_offset);
 					}
 				}
 
@@ -2012,11 +1998,26 @@ html_process_input(rspamd_mempool_t *pool,
 				end - start, end - start);
 	}
 
+	if (!css_inputs.empty()) {
+		/* All style blocks are parsed at once to allow caching of the whole sheet */
+		auto ret = rspamd::css::css_parse_style_cached(pool, css_inputs);
+
+		if (ret.second.is_fatal()) {
+			auto err_str = fmt::format(
+					"cannot parse css (error code: {}): {}",
+					static_cast<int>(ret.second.type),
+					ret.second.description.value_or("unknown error"));
+			msg_info_pool ("%*s", (int) err_str.size(), err_str.data());
+		}
+
+		hc->css_style = std::move(ret.first);
+	}
+
 	/* Propagate styles */
 	hc->traverse_block_tags([&hc, &pool](const html_tag *tag) -> bool {
 
 		if (hc->css_style) {
-			auto *css_block = hc->css_style->check_tag_block(tag);
+			auto *css_block = hc->css_style->check_tag_block(tag, pool);
 
 			if (css_block) {
 				if (tag->block) {
@@ -76,6 +76,10 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	/* Body length passed to the body handler of a streamed message */
+	gsize streamed_len;
+	/* Data of the next requests received with the current one */
+	rspamd_fstring_t *pipelined;
 };
 
 static const rspamd_ftok_t key_header = {
@@ -388,7 +392,8 @@ rspamd_http_on_headers_complete (http_parser * parser)
 			return -1;
 		}
 
-		if (!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
+		if ((!(conn->opts & RSPAMD_HTTP_BODY_STREAM) || IS_CONN_ENCRYPTED (priv)) &&
+				!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
 			return -1;
 		}
 	}
@@ -397,6 +402,7 @@ rspamd_http_on_headers_complete (http_parser * parser)
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
 
+	priv->streamed_len = 0;
 
 	msg->method = parser->method;
 	msg->code = parser->status_code;
@@ -427,6 +433,23 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 	pbuf = priv->buf;
 	p = at;
 
+	if ((conn->opts & RSPAMD_HTTP_BODY_STREAM) && !IS_CONN_ENCRYPTED (priv)) {
+		/* Body is not stored, data portions are passed directly from the buffer */
+		if (conn->finished) {
+			return 0;
+		}
+
+		if (conn->max_size > 0 &&
+				priv->streamed_len + length > conn->max_size) {
+			priv->flags |= RSPAMD_HTTP_CONN_FLAG_TOO_LARGE;
+			return -1;
+		}
+
+		priv->streamed_len += length;
+
+		return conn->body_handler ? conn->body_handler (conn, msg, at, length) : 0;
+	}
+
 	if (!(msg->flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
 		if (!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
 			return -1;
@@ -681,7 +704,8 @@ rspamd_http_on_message_complete (http_parser * parser)
 			rspamd_http_connection_unref (conn);
 		}
 	}
-	else if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) == 0 && conn->body_handler) {
+	else if ((conn->opts & (RSPAMD_HTTP_BODY_PARTIAL|RSPAMD_HTTP_BODY_STREAM)) == 0 &&
+			conn->body_handler) {
 		g_assert (conn->body_handler != NULL);
 		rspamd_http_connection_ref (conn);
 		ret = conn->body_handler (conn,
@@ -705,6 +729,14 @@ rspamd_http_on_message_complete (http_parser * parser)
 			conn->finished = TRUE;
 		}
 
+		if (conn->type == RSPAMD_HTTP_SERVER) {
+			/*
+			 * Stop parsing here, the rest of data belongs to the next
+			 * pipelined request that is read after the reply is written
+			 */
+			http_parser_pause (parser, 1);
+		}
+
 		rspamd_http_connection_unref (conn);
 	}
 
@@ -894,7 +926,23 @@ rspamd_http_try_read (gint fd,
 		}
 	}
 
-	if (priv->ssl) {
+	if (priv->pipelined) {
+		/* Data has been read with the previous request */
+		r = MIN (len, priv->pipelined->len);
+		memcpy (data, priv->pipelined->str, r);
+
+		if (r < priv->pipelined->len) {
+			priv->pipelined->len -= r;
+			memmove (priv->pipelined->str, priv->pipelined->str + r,
+					priv->pipelined->len);
+			ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+		}
+		else {
+			rspamd_fstring_free (priv->pipelined);
+			priv->pipelined = NULL;
+		}
+	}
+	else if (priv->ssl) {
 		r = rspamd_ssl_read (priv->ssl, data, len);
 	}
 	else {
@@ -921,6 +969,45 @@ rspamd_http_try_read (gint fd,
 	return r;
 }
 
+/*
+ * Parses data read from a connection, data left after a complete request
+ * is kept to be parsed as the next request
+ */
+static gboolean
+rspamd_http_parse_read_data (struct rspamd_http_connection_private *priv,
+		const gchar *d, gsize len)
+{
+	struct rspamd_http_message *msg = priv->msg;
+	rspamd_fstring_t *pipelined;
+	gsize nparsed;
+
+	/* Message body can be used as a read buffer */
+	rspamd_http_message_ref (msg);
+	nparsed = http_parser_execute (&priv->parser, &priv->parser_cb, d, len);
+
+	if (priv->parser.http_errno == HPE_PAUSED) {
+		http_parser_pause (&priv->parser, 0);
+
+		if (nparsed < len) {
+			pipelined = rspamd_fstring_new_init (d + nparsed, len - nparsed);
+
+			if (priv->pipelined) {
+				pipelined = rspamd_fstring_append (pipelined,
+						priv->pipelined->str, priv->pipelined->len);
+				rspamd_fstring_free (priv->pipelined);
+			}
+
+			priv->pipelined = pipelined;
+		}
+
+		nparsed = len;
+	}
+
+	rspamd_http_message_unref (msg);
+
+	return nparsed == len && priv->parser.http_errno == 0;
+}
+
 static void
 rspamd_http_ssl_err_handler (gpointer ud, GError *err)
 {
@@ -950,8 +1037,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			if (!rspamd_http_parse_read_data (priv, d, r)) {
 				if (priv->flags & RSPAMD_HTTP_CONN_FLAG_TOO_LARGE) {
 					err = g_error_new (HTTP_ERROR, 413,
 							"Request entity too large: %zu",
@@ -1034,8 +1120,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			if (!rspamd_http_parse_read_data (priv, d, r)) {
 				err = g_error_new (HTTP_ERROR, 400,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
@@ -1256,6 +1341,11 @@ rspamd_http_connection_new_keepalive (struct rspamd_http_context *ctx,
 	conn = rspamd_http_context_check_keepalive (ctx, addr, host);
 
 	if (conn) {
+		/* Connection might have been created by another user or pre-warmed */
+		conn->body_handler = body_handler;
+		conn->error_handler = error_handler;
+		conn->finish_handler = finish_handler;
+
 		return conn;
 	}
 
@@ -1271,6 +1361,44 @@ rspamd_http_connection_new_keepalive (struct rspamd_http_context *ctx,
 	return conn;
 }
 
+struct rspamd_http_connection *
+rspamd_http_connection_new_keepalive_queued (struct rspamd_http_context *ctx,
+											 rspamd_http_body_handler_t body_handler,
+											 rspamd_http_error_handler_t error_handler,
+											 rspamd_http_finish_handler_t finish_handler,
+											 rspamd_inet_addr_t *addr,
+											 const gchar *host,
+											 ev_tstamp timeout,
+											 rspamd_http_keepalive_ready_handler_t ready_handler,
+											 gpointer ud,
+											 struct rspamd_http_keepalive_waiter **pwaiter)
+{
+	if (ctx == NULL) {
+		ctx = rspamd_http_context_default ();
+	}
+
+	*pwaiter = NULL;
+
+	if (!rspamd_http_context_keepalive_available (ctx, addr, host)) {
+		*pwaiter = rspamd_http_context_queue_keepalive (ctx,
+				body_handler, error_handler, finish_handler,
+				addr, host, timeout, ready_handler, ud);
+
+		return NULL;
+	}
+
+	return rspamd_http_connection_new_keepalive (ctx,
+			body_handler, error_handler, finish_handler,
+			addr, host);
+}
+
+void
+rspamd_http_connection_cancel_keepalive_waiter (
+		struct rspamd_http_keepalive_waiter *waiter)
+{
+	rspamd_http_context_dequeue_keepalive (waiter);
+}
+
 void
 rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 {
@@ -1398,16 +1526,13 @@ rspamd_http_connection_copy_msg (struct rspamd_http_message *msg, GError **err)
 					(msg->body_buf.begin - msg->body_buf.str);
 		}
 		else {
+			/* Share body with the original message to avoid copying */
 			old_body = rspamd_http_message_get_body (msg, &old_len);
-
-			if (!rspamd_http_message_set_body (new_msg, old_body, old_len)) {
-				g_set_error (err, http_error_quark (), errno,
-						"cannot set body for message, length: %zd",
-						old_len);
-				rspamd_http_message_unref (new_msg);
-
-				return NULL;
-			}
+			new_msg->body_owner = rspamd_http_message_ref (
+					msg->body_owner ? msg->body_owner : msg);
+			new_msg->body_buf.begin = old_body;
+			new_msg->body_buf.len = old_len;
+			new_msg->flags |= RSPAMD_HTTP_FLAG_HAS_BODY;
 		}
 	}
 
@@ -1473,6 +1598,10 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 	if (priv != NULL) {
 		rspamd_http_connection_reset (conn);
 
+		if (conn->keepalive_active) {
+			rspamd_http_context_release_keepalive (priv->ctx, conn);
+		}
+
 		if (priv->ssl) {
 			rspamd_ssl_connection_free (priv->ssl);
 			priv->ssl = NULL;
@@ -1485,6 +1614,10 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			rspamd_pubkey_unref (priv->peer_key);
 		}
 
+		if (priv->pipelined) {
+			rspamd_fstring_free (priv->pipelined);
+		}
+
 		if (priv->flags & RSPAMD_HTTP_CONN_OWN_SOCKET) {
 			/* Fd is owned by a connection */
 			close (conn->fd);
@@ -1531,6 +1664,11 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 			rspamd_http_event_handler, conn);
 	rspamd_ev_watcher_start (priv->ctx->event_loop, &priv->ev, priv->timeout);
 
+	if (priv->pipelined) {
+		/* Request has been already received */
+		ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+	}
+
 	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
 }
 
@@ -1676,6 +1814,10 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 	const gchar *conn_type = "close";
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
+		if (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) {
+			conn_type = "keep-alive";
+		}
+
 		/* Format reply */
 		if (msg->method < HTTP_SYMBOLS) {
 			rspamd_ftok_t status;
@@ -1753,12 +1895,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type, priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1766,11 +1908,11 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type, priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen);
 				}
@@ -2005,9 +2147,10 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 		}
 	}
 
-	if (encrypted && (msg->flags &
-			(RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE|RSPAMD_HTTP_FLAG_SHMEM))) {
-		/* We cannot use immutable body to encrypt message in place */
+	if (encrypted && ((msg->flags &
+			(RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE|RSPAMD_HTTP_FLAG_SHMEM)) ||
+			msg->body_owner != NULL)) {
+		/* We cannot use immutable or shared body to encrypt message in place */
 		allow_shared = FALSE;
 		rspamd_http_detach_shared (msg);
 	}
@@ -2554,6 +2697,27 @@ rspamd_http_message_unref (struct rspamd_http_message *msg)
 	REF_RELEASE (msg);
 }
 
+void
+rspamd_http_connection_pause_reading (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (priv) {
+		rspamd_ev_watcher_stop (priv->ctx->event_loop, &priv->ev);
+	}
+}
+
+void
+rspamd_http_connection_resume_reading (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (priv && !conn->finished) {
+		rspamd_ev_watcher_start (priv->ctx->event_loop, &priv->ev,
+				priv->timeout);
+	}
+}
+
 void
 rspamd_http_connection_disable_encryption (struct rspamd_http_connection *conn)
 {
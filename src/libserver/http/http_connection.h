@@ -83,6 +83,10 @@ struct rspamd_storage_shmem {
  * Body has been set for a message
  */
 #define RSPAMD_HTTP_FLAG_HAS_HOST_HEADER (1 << 7)
+/**
+ * Keep server connection alive after this reply
+ */
+#define RSPAMD_HTTP_FLAG_KEEP_ALIVE (1 << 8)
 /**
  * Options for HTTP connection
  */
@@ -93,6 +97,7 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SHARED = 1u << 3, /**< Store reply in shared memory */
 	RSPAMD_HTTP_REQUIRE_ENCRYPTION = 1u << 4,
 	RSPAMD_HTTP_CLIENT_KEEP_ALIVE = 1u << 5,
+	RSPAMD_HTTP_BODY_STREAM = 1u << 6, /**< Pass body data portions to body handler without storing them */
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -106,6 +111,13 @@ typedef void (*rspamd_http_error_handler_t) (struct rspamd_http_connection *conn
 typedef int (*rspamd_http_finish_handler_t) (struct rspamd_http_connection *conn,
 											 struct rspamd_http_message *msg);
 
+/* Called with a connection or with NULL and an error for queued requests */
+typedef void (*rspamd_http_keepalive_ready_handler_t) (struct rspamd_http_connection *conn,
+													   const gchar *err,
+													   gpointer ud);
+
+struct rspamd_http_keepalive_waiter;
+
 /**
  * HTTP connection structure
  */
@@ -118,6 +130,7 @@ struct rspamd_http_connection {
 	const gchar *log_tag;
 	/* Used for keepalive */
 	struct rspamd_keepalive_hash_key *keepalive_hash_key;
+	gboolean keepalive_active;
 	gsize max_size;
 	unsigned opts;
 	enum rspamd_http_connection_type type;
@@ -162,6 +175,42 @@ struct rspamd_http_connection *rspamd_http_connection_new_keepalive (
 		rspamd_inet_addr_t *addr,
 		const gchar *host);
 
+/**
+ * Same as `rspamd_http_connection_new_keepalive` but respects the per destination
+ * connections limit: if the limit is reached, the request is queued and
+ * `ready_handler` is called once a connection is available or when `timeout`
+ * expires
+ * @param ctx
+ * @param body_handler
+ * @param error_handler
+ * @param finish_handler
+ * @param addr
+ * @param host
+ * @param timeout
+ * @param ready_handler
+ * @param ud
+ * @param pwaiter set to a queued request, connection returned is NULL in this case
+ * @return
+ */
+struct rspamd_http_connection *rspamd_http_connection_new_keepalive_queued (
+		struct rspamd_http_context *ctx,
+		rspamd_http_body_handler_t body_handler,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		rspamd_inet_addr_t *addr,
+		const gchar *host,
+		ev_tstamp timeout,
+		rspamd_http_keepalive_ready_handler_t ready_handler,
+		gpointer ud,
+		struct rspamd_http_keepalive_waiter **pwaiter);
+
+/**
+ * Removes a queued request, ready handler is not called
+ * @param waiter
+ */
+void rspamd_http_connection_cancel_keepalive_waiter (
+		struct rspamd_http_keepalive_waiter *waiter);
+
 /**
  * Creates an ordinary connection using the address specified (if proxy is not set)
  * @param ctx
@@ -309,6 +358,21 @@ void rspamd_http_connection_set_max_size (struct rspamd_http_connection *conn,
 
 void rspamd_http_connection_disable_encryption (struct rspamd_http_connection *conn);
 
+/**
+ * Stops reading from a connection, so a body handler of a streamed message
+ * can apply back-pressure until the data already received is consumed.
+ * Data that has been read already is still passed to the body handler.
+ * @param conn
+ */
+void rspamd_http_connection_pause_reading (struct rspamd_http_connection *conn);
+
+/**
+ * Resumes reading from a connection paused by
+ * `rspamd_http_connection_pause_reading`
+ * @param conn
+ */
+void rspamd_http_connection_resume_reading (struct rspamd_http_connection *conn);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -39,9 +39,43 @@ struct rspamd_http_keepalive_cbdata {
 	struct rspamd_http_context *ctx;
 	GQueue *queue;
 	GList *link;
+	GList *lru_link;
 	struct rspamd_io_ev ev;
 };
 
+struct rspamd_http_keepalive_waiter {
+	struct rspamd_http_context *ctx;
+	struct rspamd_keepalive_hash_key *hk;
+	rspamd_http_body_handler_t body_handler;
+	rspamd_http_error_handler_t error_handler;
+	rspamd_http_finish_handler_t finish_handler;
+	rspamd_http_keepalive_ready_handler_t ready_handler;
+	gpointer ud;
+	GList *link;
+	ev_timer tm;
+	gboolean woken;
+};
+
+static void
+rspamd_http_keepalive_waiters_cleanup (GQueue *waiters)
+{
+	GList *cur;
+
+	cur = waiters->head;
+
+	while (cur) {
+		struct rspamd_http_keepalive_waiter *waiter;
+
+		waiter = (struct rspamd_http_keepalive_waiter *)cur->data;
+		ev_timer_stop (waiter->ctx->event_loop, &waiter->tm);
+		g_free (waiter);
+
+		cur = cur->next;
+	}
+
+	g_queue_clear (waiters);
+}
+
 static void
 rspamd_http_keepalive_queue_cleanup (GQueue *conns)
 {
@@ -116,6 +150,7 @@ rspamd_http_context_new_default (struct rspamd_config *cfg,
 	ctx->event_loop = ev_base;
 
 	ctx->keep_alive_hash = kh_init (rspamd_keep_alive_hash);
+	g_queue_init (&ctx->keepalive_lru);
 
 	return ctx;
 }
@@ -265,6 +300,30 @@ rspamd_http_context_create (struct rspamd_config *cfg,
 				ctx->config.keepalive_interval = ucl_object_todouble (keepalive_interval);
 			}
 
+			const ucl_object_t *keepalive_max_conns;
+
+			keepalive_max_conns = ucl_object_lookup (client_obj, "keepalive_max_conns");
+
+			if (keepalive_max_conns) {
+				ctx->config.keepalive_max_conns = ucl_object_toint (keepalive_max_conns);
+			}
+
+			const ucl_object_t *keepalive_max_idle;
+
+			keepalive_max_idle = ucl_object_lookup (client_obj, "keepalive_max_idle");
+
+			if (keepalive_max_idle) {
+				ctx->config.keepalive_max_idle = ucl_object_toint (keepalive_max_idle);
+			}
+
+			const ucl_object_t *keepalive_prewarm;
+
+			keepalive_prewarm = ucl_object_lookup (client_obj, "keepalive_prewarm");
+
+			if (keepalive_prewarm) {
+				ctx->config.keepalive_prewarm = ucl_object_toint (keepalive_prewarm);
+			}
+
 			const ucl_object_t *http_proxy;
 			http_proxy = ucl_object_lookup (client_obj, "http_proxy");
 
@@ -328,10 +387,12 @@ rspamd_http_context_free (struct rspamd_http_context *ctx)
 
 		rspamd_inet_address_free (hk->addr);
 		rspamd_http_keepalive_queue_cleanup (&hk->conns);
+		rspamd_http_keepalive_waiters_cleanup (&hk->waiters);
 		g_free (hk);
 	});
 
 	kh_destroy (rspamd_keep_alive_hash, ctx->keep_alive_hash);
+	g_queue_clear (&ctx->keepalive_lru);
 
 	if (ctx->http_proxies) {
 		rspamd_upstreams_destroy (ctx->http_proxies);
@@ -393,12 +454,12 @@ rspamd_keep_alive_key_equal (struct rspamd_keepalive_hash_key *k1,
 	return false;
 }
 
-struct rspamd_http_connection*
-rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
+static struct rspamd_keepalive_hash_key *
+rspamd_http_context_find_keepalive (struct rspamd_http_context *ctx,
 		const rspamd_inet_addr_t *addr,
 		const gchar *host)
 {
-	struct rspamd_keepalive_hash_key hk, *phk;
+	struct rspamd_keepalive_hash_key hk;
 	khiter_t k;
 
 	hk.addr = (rspamd_inet_addr_t *)addr;
@@ -407,7 +468,22 @@ rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 	k = kh_get (rspamd_keep_alive_hash, ctx->keep_alive_hash, &hk);
 
 	if (k != kh_end (ctx->keep_alive_hash)) {
-		phk = kh_key (ctx->keep_alive_hash, k);
+		return kh_key (ctx->keep_alive_hash, k);
+	}
+
+	return NULL;
+}
+
+struct rspamd_http_connection*
+rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
+		const rspamd_inet_addr_t *addr,
+		const gchar *host)
+{
+	struct rspamd_keepalive_hash_key *phk;
+
+	phk = rspamd_http_context_find_keepalive (ctx, addr, host);
+
+	if (phk != NULL) {
 		GQueue *conns = &phk->conns;
 
 		/* Use stack based approach */
@@ -419,6 +495,7 @@ rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 			socklen_t len = sizeof (gint);
 
 			cbd = g_queue_pop_head (conns);
+			g_queue_delete_link (&ctx->keepalive_lru, cbd->lru_link);
 			rspamd_ev_watcher_stop (ctx->event_loop, &cbd->ev);
 			conn = cbd->conn;
 			g_free (cbd);
@@ -444,6 +521,9 @@ rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 			msg_debug_http_context ("reused keepalive element %s (%s), %d connections queued",
 					rspamd_inet_address_to_string_pretty (phk->addr),
 					phk->host, conns->length);
+			conn->keepalive_active = TRUE;
+			phk->active ++;
+			ctx->keepalive_stat.conns_reused ++;
 
 			/* We transfer refcount here! */
 			return conn;
@@ -458,23 +538,82 @@ rspamd_http_context_check_keepalive (struct rspamd_http_context *ctx,
 	return NULL;
 }
 
+static void rspamd_http_context_push_idle (struct rspamd_http_context *ctx,
+		struct rspamd_http_connection *conn,
+		gdouble timeout,
+		struct ev_loop *event_loop);
+
+/* Handlers of pre-warmed connections are replaced when they are reused */
+static void
+rspamd_http_prewarm_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+}
+
+static gint
+rspamd_http_prewarm_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	return 0;
+}
+
+/*
+ * Opens connections to a new destination in advance, so the subsequent
+ * requests would not need to wait for connect
+ */
+static void
+rspamd_http_context_prewarm_keepalive (struct rspamd_http_context *ctx,
+		struct rspamd_keepalive_hash_key *phk)
+{
+	struct rspamd_http_connection *conn;
+	guint i, nconns = ctx->config.keepalive_prewarm;
+
+	if (ctx->config.keepalive_max_conns > 0) {
+		nconns = MIN (nconns, ctx->config.keepalive_max_conns);
+	}
+
+	/* The current request has already opened one connection */
+	for (i = 1; i < nconns; i ++) {
+		conn = rspamd_http_connection_new_client (ctx, NULL,
+				rspamd_http_prewarm_error_handler,
+				rspamd_http_prewarm_finish_handler,
+				RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
+				phk->addr);
+
+		if (conn == NULL) {
+			break;
+		}
+
+		conn->keepalive_hash_key = phk;
+		ctx->keepalive_stat.conns_created ++;
+		rspamd_http_context_push_idle (ctx, conn, ctx->config.keepalive_interval,
+				ctx->event_loop);
+		/* Keepalive pool owns this connection now */
+		rspamd_http_connection_unref (conn);
+	}
+
+	msg_debug_http_context ("prewarmed %d connections to %s (%s)",
+			i - 1,
+			rspamd_inet_address_to_string_pretty (phk->addr),
+			phk->host);
+}
+
 void
 rspamd_http_context_prepare_keepalive (struct rspamd_http_context *ctx,
 											struct rspamd_http_connection *conn,
 											const rspamd_inet_addr_t *addr,
 											const gchar *host)
 {
-	struct rspamd_keepalive_hash_key hk, *phk;
-	khiter_t k;
+	struct rspamd_keepalive_hash_key *phk;
 
-	hk.addr = (rspamd_inet_addr_t *)addr;
-	hk.host = (gchar *)host;
+	phk = rspamd_http_context_find_keepalive (ctx, addr, host);
 
-	k = kh_get (rspamd_keep_alive_hash, ctx->keep_alive_hash, &hk);
-
-	if (k != kh_end (ctx->keep_alive_hash)) {
+	if (phk != NULL) {
 		/* Reuse existing */
-		conn->keepalive_hash_key = kh_key (ctx->keep_alive_hash, k);
+		conn->keepalive_hash_key = phk;
+		phk->active ++;
+		conn->keepalive_active = TRUE;
+		ctx->keepalive_stat.conns_created ++;
 		msg_debug_http_context ("use existing keepalive element %s (%s)",
 				rspamd_inet_address_to_string_pretty (conn->keepalive_hash_key->addr),
 				conn->keepalive_hash_key->host);
@@ -484,30 +623,33 @@ rspamd_http_context_prepare_keepalive (struct rspamd_http_context *ctx,
 		GQueue empty_init = G_QUEUE_INIT;
 		gint r;
 
-		phk = g_malloc (sizeof (*phk));
+		phk = g_malloc0 (sizeof (*phk));
 		phk->conns = empty_init;
+		phk->waiters = empty_init;
 		phk->host = g_strdup (host);
 		phk->addr = rspamd_inet_address_copy (addr);
 
 		kh_put (rspamd_keep_alive_hash, ctx->keep_alive_hash, phk, &r);
 		conn->keepalive_hash_key = phk;
+		phk->active ++;
+		conn->keepalive_active = TRUE;
+		ctx->keepalive_stat.conns_created ++;
 
 		msg_debug_http_context ("create new keepalive element %s (%s)",
 				rspamd_inet_address_to_string_pretty (conn->keepalive_hash_key->addr),
 				conn->keepalive_hash_key->host);
+
+		if (ctx->config.keepalive_prewarm > 1) {
+			rspamd_http_context_prewarm_keepalive (ctx, phk);
+		}
 	}
 }
 
 static void
-rspamd_http_keepalive_handler (gint fd, short what, gpointer ud)
+rspamd_http_keepalive_remove (struct rspamd_http_keepalive_cbdata *cbdata)
 {
-	struct rspamd_http_keepalive_cbdata *cbdata =
-			(struct rspamd_http_keepalive_cbdata *)ud;/*
-	 * We can get here if a remote side reported something or it has
-	 * timed out. In both cases we just terminate keepalive connection.
-	 */
-
 	g_queue_delete_link (cbdata->queue, cbdata->link);
+	g_queue_delete_link (&cbdata->ctx->keepalive_lru, cbdata->lru_link);
 	msg_debug_http_context ("remove keepalive element %s (%s), %d connections left",
 			rspamd_inet_address_to_string_pretty (cbdata->conn->keepalive_hash_key->addr),
 			cbdata->conn->keepalive_hash_key->host,
@@ -518,13 +660,290 @@ rspamd_http_keepalive_handler (gint fd, short what, gpointer ud)
 	g_free (cbdata);
 }
 
+static void
+rspamd_http_keepalive_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_http_keepalive_cbdata *cbdata =
+			(struct rspamd_http_keepalive_cbdata *)ud;/*
+	 * We can get here if a remote side reported something or it has
+	 * timed out. In both cases we just terminate keepalive connection.
+	 */
+
+	rspamd_http_keepalive_remove (cbdata);
+}
+
+static void
+rspamd_http_context_push_idle (struct rspamd_http_context *ctx,
+		struct rspamd_http_connection *conn,
+		gdouble timeout,
+		struct ev_loop *event_loop)
+{
+	struct rspamd_http_keepalive_cbdata *cbdata;
+	struct rspamd_keepalive_hash_key *phk = conn->keepalive_hash_key;
+
+	/* Move connection to the keepalive pool */
+	cbdata = g_malloc0 (sizeof (*cbdata));
+
+	cbdata->conn = rspamd_http_connection_ref (conn);
+	/* Use stack like approach to that would easy reading */
+	g_queue_push_head (&phk->conns, cbdata);
+	cbdata->link = phk->conns.head;
+	g_queue_push_head (&ctx->keepalive_lru, cbdata);
+	cbdata->lru_link = ctx->keepalive_lru.head;
+
+	cbdata->queue = &phk->conns;
+	cbdata->ctx = ctx;
+	conn->finished = FALSE;
+
+	rspamd_ev_watcher_init (&cbdata->ev, conn->fd, EV_READ,
+			rspamd_http_keepalive_handler,
+			cbdata);
+	rspamd_ev_watcher_start (event_loop, &cbdata->ev, timeout);
+
+	msg_debug_http_context ("push keepalive element %s (%s), %d connections queued, %.1f timeout",
+			rspamd_inet_address_to_string_pretty (phk->addr),
+			phk->host,
+			cbdata->queue->length,
+			timeout);
+
+	/* Evict least recently used idle connections */
+	if (ctx->config.keepalive_max_conns > 0 &&
+			phk->conns.length > ctx->config.keepalive_max_conns) {
+		ctx->keepalive_stat.conns_evicted ++;
+		rspamd_http_keepalive_remove (phk->conns.tail->data);
+	}
+
+	if (ctx->config.keepalive_max_idle > 0 &&
+			ctx->keepalive_lru.length > ctx->config.keepalive_max_idle) {
+		ctx->keepalive_stat.conns_evicted ++;
+		rspamd_http_keepalive_remove (ctx->keepalive_lru.tail->data);
+	}
+}
+
+static void
+rspamd_http_keepalive_wake (struct rspamd_keepalive_hash_key *phk)
+{
+	GList *cur;
+
+	for (cur = phk->waiters.head; cur != NULL; cur = cur->next) {
+		struct rspamd_http_keepalive_waiter *waiter =
+				(struct rspamd_http_keepalive_waiter *)cur->data;
+
+		if (!waiter->woken) {
+			/* Handler is called from the event loop to avoid reentrancy */
+			waiter->woken = TRUE;
+			ev_timer_stop (waiter->ctx->event_loop, &waiter->tm);
+			ev_timer_set (&waiter->tm, 0.0, 0.0);
+			ev_timer_start (waiter->ctx->event_loop, &waiter->tm);
+
+			break;
+		}
+	}
+}
+
+void
+rspamd_http_context_release_keepalive (struct rspamd_http_context *ctx,
+									   struct rspamd_http_connection *conn)
+{
+	struct rspamd_keepalive_hash_key *phk = conn->keepalive_hash_key;
+
+	if (phk == NULL || !conn->keepalive_active) {
+		return;
+	}
+
+	conn->keepalive_active = FALSE;
+
+	if (phk->active > 0) {
+		phk->active --;
+	}
+
+	rspamd_http_keepalive_wake (phk);
+}
+
+gboolean
+rspamd_http_context_keepalive_available (struct rspamd_http_context *ctx,
+										 const rspamd_inet_addr_t *addr,
+										 const gchar *host)
+{
+	struct rspamd_keepalive_hash_key *phk;
+
+	if (ctx->config.keepalive_max_conns == 0) {
+		return TRUE;
+	}
+
+	phk = rspamd_http_context_find_keepalive (ctx, addr, host);
+
+	if (phk == NULL) {
+		return TRUE;
+	}
+
+	if (phk->waiters.length > 0) {
+		/* Preserve order of the queued requests */
+		return FALSE;
+	}
+
+	return phk->conns.length > 0 || phk->active < ctx->config.keepalive_max_conns;
+}
+
+static void
+rspamd_http_keepalive_waiter_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct rspamd_http_keepalive_waiter *waiter =
+			(struct rspamd_http_keepalive_waiter *)w->data;
+	struct rspamd_http_context *ctx = waiter->ctx;
+	struct rspamd_keepalive_hash_key *phk = waiter->hk;
+	struct rspamd_http_connection *conn;
+	rspamd_http_keepalive_ready_handler_t ready_handler = waiter->ready_handler;
+	gpointer ud = waiter->ud;
+
+	ev_timer_stop (loop, w);
+	g_queue_delete_link (&phk->waiters, waiter->link);
+
+	if (waiter->woken) {
+		conn = rspamd_http_connection_new_keepalive (ctx,
+				waiter->body_handler, waiter->error_handler,
+				waiter->finish_handler,
+				phk->addr, phk->host);
+		g_free (waiter);
+
+		if (conn) {
+			ready_handler (conn, NULL, ud);
+		}
+		else {
+			/* Give this slot to the next request */
+			rspamd_http_keepalive_wake (phk);
+			ready_handler (NULL, strerror (errno), ud);
+		}
+	}
+	else {
+		ctx->keepalive_stat.queue_timeouts ++;
+		msg_debug_http_context ("timeout while waiting for a keepalive connection "
+						  "to %s (%s), %d requests queued",
+				rspamd_inet_address_to_string_pretty (phk->addr),
+				phk->host, phk->waiters.length);
+		g_free (waiter);
+		ready_handler (NULL, "timeout while waiting for a free connection", ud);
+	}
+}
+
+struct rspamd_http_keepalive_waiter *
+rspamd_http_context_queue_keepalive (struct rspamd_http_context *ctx,
+									 rspamd_http_body_handler_t body_handler,
+									 rspamd_http_error_handler_t error_handler,
+									 rspamd_http_finish_handler_t finish_handler,
+									 const rspamd_inet_addr_t *addr,
+									 const gchar *host,
+									 ev_tstamp timeout,
+									 rspamd_http_keepalive_ready_handler_t ready_handler,
+									 gpointer ud)
+{
+	struct rspamd_http_keepalive_waiter *waiter;
+	struct rspamd_keepalive_hash_key *phk;
+
+	phk = rspamd_http_context_find_keepalive (ctx, addr, host);
+	/* We queue merely when there are active connections */
+	g_assert (phk != NULL);
+
+	waiter = g_malloc0 (sizeof (*waiter));
+	waiter->ctx = ctx;
+	waiter->hk = phk;
+	waiter->body_handler = body_handler;
+	waiter->error_handler = error_handler;
+	waiter->finish_handler = finish_handler;
+	waiter->ready_handler = ready_handler;
+	waiter->ud = ud;
+
+	g_queue_push_tail (&phk->waiters, waiter);
+	waiter->link = phk->waiters.tail;
+	ctx->keepalive_stat.requests_queued ++;
+
+	waiter->tm.data = waiter;
+	ev_timer_init (&waiter->tm, rspamd_http_keepalive_waiter_cb, timeout, 0.0);
+	ev_timer_start (ctx->event_loop, &waiter->tm);
+
+	msg_debug_http_context ("queue request to %s (%s), %d active connections, "
+							"%d requests queued",
+			rspamd_inet_address_to_string_pretty (phk->addr),
+			phk->host, phk->active, phk->waiters.length);
+
+	return waiter;
+}
+
+void
+rspamd_http_context_dequeue_keepalive (struct rspamd_http_keepalive_waiter *waiter)
+{
+	struct rspamd_keepalive_hash_key *phk = waiter->hk;
+
+	ev_timer_stop (waiter->ctx->event_loop, &waiter->tm);
+	g_queue_delete_link (&phk->waiters, waiter->link);
+
+	if (waiter->woken) {
+		/* Pass our slot to the next request */
+		rspamd_http_keepalive_wake (phk);
+	}
+
+	g_free (waiter);
+}
+
+ucl_object_t *
+rspamd_http_context_keepalive_stat (struct rspamd_http_context *ctx)
+{
+	ucl_object_t *top, *dests, *elt;
+	struct rspamd_keepalive_hash_key *hk;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (ctx->keepalive_stat.conns_created),
+			"connections_created", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (ctx->keepalive_stat.conns_reused),
+			"connections_reused", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (ctx->keepalive_stat.conns_evicted),
+			"connections_evicted", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (ctx->keepalive_stat.requests_queued),
+			"requests_queued", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (ctx->keepalive_stat.queue_timeouts),
+			"queue_timeouts", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (ctx->keepalive_lru.length),
+			"idle", 0, false);
+
+	dests = ucl_object_typed_new (UCL_ARRAY);
+
+	kh_foreach_key (ctx->keep_alive_hash, hk, {
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt,
+				ucl_object_fromstring (rspamd_inet_address_to_string_pretty (hk->addr)),
+				"addr", 0, false);
+
+		if (hk->host) {
+			ucl_object_insert_key (elt, ucl_object_fromstring (hk->host),
+					"host", 0, false);
+		}
+
+		ucl_object_insert_key (elt, ucl_object_fromint (hk->active),
+				"active", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (hk->conns.length),
+				"idle", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (hk->waiters.length),
+				"queued", 0, false);
+		ucl_array_append (dests, elt);
+	});
+
+	ucl_object_insert_key (top, dests, "destinations", 0, false);
+
+	return top;
+}
+
 void
 rspamd_http_context_push_keepalive (struct rspamd_http_context *ctx,
 									struct rspamd_http_connection *conn,
 									struct rspamd_http_message *msg,
 									struct ev_loop *event_loop)
 {
-	struct rspamd_http_keepalive_cbdata *cbdata;
 	gdouble timeout = ctx->config.keepalive_interval;
 
 	g_assert (conn->keepalive_hash_key != NULL);
@@ -584,26 +1003,7 @@ rspamd_http_context_push_keepalive (struct rspamd_http_context *ctx,
 		}
 	}
 
-	/* Move connection to the keepalive pool */
-	cbdata = g_malloc0 (sizeof (*cbdata));
-
-	cbdata->conn = rspamd_http_connection_ref (conn);
-	/* Use stack like approach to that would easy reading */
-	g_queue_push_head (&conn->keepalive_hash_key->conns, cbdata);
-	cbdata->link = conn->keepalive_hash_key->conns.head;
-
-	cbdata->queue = &conn->keepalive_hash_key->conns;
-	cbdata->ctx = ctx;
-	conn->finished = FALSE;
-
-	rspamd_ev_watcher_init (&cbdata->ev, conn->fd, EV_READ,
-			rspamd_http_keepalive_handler,
-			cbdata);
-	rspamd_ev_watcher_start (event_loop, &cbdata->ev, timeout);
-
-	msg_debug_http_context ("push keepalive element %s (%s), %d connections queued, %.1f timeout",
-			rspamd_inet_address_to_string_pretty (cbdata->conn->keepalive_hash_key->addr),
-			cbdata->conn->keepalive_hash_key->host,
-			cbdata->queue->length,
-			timeout);
+	rspamd_http_context_push_idle (ctx, conn, timeout, event_loop);
+	/* Connection is idle now, so a queued request can use it */
+	rspamd_http_context_release_keepalive (ctx, conn);
 }
\ No newline at end of file
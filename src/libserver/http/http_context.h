@@ -37,12 +37,23 @@ struct rspamd_http_context_cfg {
 	guint kp_cache_size_server;
 	guint ssl_cache_size;
 	gdouble keepalive_interval;
+	guint keepalive_max_conns;
+	guint keepalive_max_idle;
+	guint keepalive_prewarm;
 	gdouble client_key_rotate_time;
 	const gchar *user_agent;
 	const gchar *http_proxy;
 	const gchar *server_hdr;
 };
 
+struct rspamd_http_keepalive_stat {
+	guint64 conns_created;
+	guint64 conns_reused;
+	guint64 conns_evicted;
+	guint64 requests_queued;
+	guint64 queue_timeouts;
+};
+
 /**
  * Creates and configures new HTTP context
  * @param root_conf configuration object
@@ -103,6 +114,34 @@ void rspamd_http_context_push_keepalive (struct rspamd_http_context *ctx,
 										 struct rspamd_http_message *msg,
 										 struct ev_loop *ev_base);
 
+/**
+ * Returns connection slot to the keepalive pool when a connection is no longer
+ * used by a request and wakes up the next queued request if any
+ * @param ctx
+ * @param conn
+ */
+void rspamd_http_context_release_keepalive (struct rspamd_http_context *ctx,
+											struct rspamd_http_connection *conn);
+
+/**
+ * Checks if a request to the specific destination can get a keepalive
+ * connection now or it should be queued due to the per destination limit
+ * @param ctx
+ * @param addr
+ * @param host
+ * @return
+ */
+gboolean rspamd_http_context_keepalive_available (struct rspamd_http_context *ctx,
+												  const rspamd_inet_addr_t *addr,
+												  const gchar *host);
+
+/**
+ * Returns statistics of the keepalive pool
+ * @param ctx
+ * @return new ucl object
+ */
+ucl_object_t *rspamd_http_context_keepalive_stat (struct rspamd_http_context *ctx);
+
 #ifdef  __cplusplus
 }
 #endif
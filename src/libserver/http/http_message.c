@@ -344,6 +344,19 @@ rspamd_http_message_set_body_from_fstring_copy (struct rspamd_http_message *msg,
 }
 
 
+/*
+ * Copies body shared with another message, so it could be modified
+ */
+static gboolean
+rspamd_http_message_own_body (struct rspamd_http_message *msg)
+{
+	rspamd_fstring_t *cpy;
+
+	cpy = rspamd_fstring_new_init (msg->body_buf.begin, msg->body_buf.len);
+
+	return rspamd_http_message_set_body_from_fstring_steal (msg, cpy);
+}
+
 gboolean
 rspamd_http_message_grow_body (struct rspamd_http_message *msg, gsize len)
 {
@@ -351,6 +364,10 @@ rspamd_http_message_grow_body (struct rspamd_http_message *msg, gsize len)
 	union _rspamd_storage_u *storage;
 	gsize newlen;
 
+	if (msg->body_owner && !rspamd_http_message_own_body (msg)) {
+		return FALSE;
+	}
+
 	storage = &msg->body_buf.c;
 
 	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
@@ -406,6 +423,10 @@ rspamd_http_message_append_body (struct rspamd_http_message *msg,
 {
 	union _rspamd_storage_u *storage;
 
+	if (msg->body_owner && !rspamd_http_message_own_body (msg)) {
+		return FALSE;
+	}
+
 	storage = &msg->body_buf.c;
 
 	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
@@ -435,7 +456,15 @@ rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg)
 	union _rspamd_storage_u *storage;
 	struct stat st;
 
-	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
+	if (msg->body_owner) {
+		/* Body is borrowed from another message */
+		rspamd_http_message_unref (msg->body_owner);
+		msg->body_owner = NULL;
+		msg->body_buf.begin = NULL;
+		msg->body_buf.str = NULL;
+		msg->body_buf.allocated_len = 0;
+	}
+	else if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
 		storage = &msg->body_buf.c;
 
 		if (storage->shared.shm_fd > 0) {
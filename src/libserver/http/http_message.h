@@ -42,7 +42,11 @@ struct rspamd_http_message *rspamd_http_connection_steal_msg (
 		struct rspamd_http_connection *conn);
 
 /**
- * Copy the current message from a connection to deal with separately
+ * Copy the current message from a connection to deal with separately.
+ * Body of the message is not copied but shared with the original message
+ * (that is retained by the copy), so the original body must not be modified
+ * while copies are alive. Body is detached from the original if a copy is
+ * about to be modified (e.g. encrypted in place)
  * @param conn
  * @return
  */
@@ -73,6 +73,8 @@ struct rspamd_http_message {
 	} body_buf;
 
 	struct rspamd_cryptobox_pubkey *peer_key;
+	/* Message that owns the body if it is shared (see copy_msg) */
+	struct rspamd_http_message *body_owner;
 	time_t date;
 	time_t last_modified;
 	unsigned port;
@@ -86,7 +88,9 @@ struct rspamd_http_message {
 struct rspamd_keepalive_hash_key {
 	rspamd_inet_addr_t *addr;
 	gchar *host;
-	GQueue conns;
+	GQueue conns; /* idle connections, most recently used first */
+	GQueue waiters; /* requests waiting for a connection */
+	guint active; /* connections currently used by requests */
 };
 
 gint32 rspamd_keep_alive_key_hash (struct rspamd_keepalive_hash_key *k);
@@ -109,6 +113,8 @@ struct rspamd_http_context {
 	struct ev_loop *event_loop;
 	ev_timer client_rotate_ev;
 	khash_t (rspamd_keep_alive_hash) *keep_alive_hash;
+	GQueue keepalive_lru; /* all idle connections, least recently used last */
+	struct rspamd_http_keepalive_stat keepalive_stat;
 };
 
 #define HTTP_ERROR http_error_quark ()
@@ -117,6 +123,25 @@ GQuark http_error_quark (void);
 
 void rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg);
 
+/**
+ * Queues a request for a keepalive connection to the specific destination
+ */
+struct rspamd_http_keepalive_waiter *rspamd_http_context_queue_keepalive (
+		struct rspamd_http_context *ctx,
+		rspamd_http_body_handler_t body_handler,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		const rspamd_inet_addr_t *addr,
+		const gchar *host,
+		ev_tstamp timeout,
+		rspamd_http_keepalive_ready_handler_t ready_handler,
+		gpointer ud);
+
+/**
+ * Removes a queued request without calling its handler
+ */
+void rspamd_http_context_dequeue_keepalive (struct rspamd_http_keepalive_waiter *waiter);
+
 gboolean rspamd_http_message_grow_body (struct rspamd_http_message *msg,
 										gsize len);
 
@@ -20,6 +20,7 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_helpers.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "rspamd.h"
@@ -66,16 +67,31 @@ static gboolean read_map_file_chunks (struct rspamd_map *map,
 									  const gchar *fname,
 									  gsize len,
 									  goffset off);
+static void rspamd_map_cache_serialise_cb (struct ev_loop *loop, ev_timer *w,
+		int revents);
 static gboolean rspamd_map_save_http_cached_file (struct rspamd_map *map,
 												  struct rspamd_map_backend *bk,
 												  struct http_map_data *htdata,
 												  const guchar *data,
 												  gsize len);
+static gboolean rspamd_map_shared_attach (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic);
+static void rspamd_map_shared_publish (struct rspamd_map *map);
+static void rspamd_map_read_data (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic,
+		gchar *data, gsize len);
 static gboolean rspamd_map_update_http_cached_file (struct rspamd_map *map,
 												  struct rspamd_map_backend *bk,
 												  struct http_map_data *htdata);
+static gboolean rspamd_map_delta_allowed (struct rspamd_map *map,
+		struct rspamd_map_backend *bk,
+		struct map_periodic_cbdata *periodic);
+static gboolean rspamd_map_apply_delta (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic,
+		const gchar *delta, gsize len);
 
 guint rspamd_map_log_id = (guint)-1;
+static const guint64 map_shared_seed = 0xdeadbabeULL;
 RSPAMD_CONSTRUCTOR(rspamd_map_log_init)
 {
 	rspamd_map_log_id = rspamd_logger_add_debug_module("map");
@@ -115,6 +131,17 @@ write_http_request (struct http_callback_data *cbd)
 					cbd->data->etag->str, cbd->data->etag->len);
 		}
 	}
+	else if (cbd->data->etag &&
+			rspamd_map_delta_allowed (cbd->map, cbd->bk, cbd->periodic)) {
+		/*
+		 * Ask for the changes since the version we have (RFC 3229), server
+		 * replies with 226 and `+key value`/`-key` lines or with the full data
+		 */
+		rspamd_http_message_add_header (msg, "A-IM", "rspamd-delta");
+		rspamd_http_message_add_header_len (msg, "If-None-Match",
+				cbd->data->etag->str, cbd->data->etag->len);
+		cbd->delta = TRUE;
+	}
 
 	msg->url = rspamd_fstring_append (msg->url, cbd->data->rest,
 			strlen (cbd->data->rest));
@@ -231,6 +258,22 @@ http_map_error (struct rspamd_http_connection *conn,
 	MAP_RELEASE (cbd, "http_callback_data");
 }
 
+static void
+rspamd_map_cache_cbd_free (struct rspamd_http_map_cached_cbdata *cache_cbd)
+{
+	if (cache_cbd->shm) {
+		MAP_RELEASE (cache_cbd->shm, "rspamd_http_map_cached_cbdata");
+	}
+
+	if (cache_cbd->delta_shm) {
+		MAP_RELEASE (cache_cbd->delta_shm, "rspamd_http_map_cached_cbdata");
+	}
+
+	ev_timer_stop (cache_cbd->event_loop, &cache_cbd->timeout);
+	ev_timer_stop (cache_cbd->event_loop, &cache_cbd->serialise_ev);
+	g_free (cache_cbd);
+}
+
 static void
 rspamd_map_cache_cb (struct ev_loop *loop, ev_timer *w, int revents)
 {
@@ -250,9 +293,7 @@ rspamd_map_cache_cb (struct ev_loop *loop, ev_timer *w, int revents)
 		 */
 		msg_info_map ("cached data is now expired (gen mismatch %L != %L) for %s",
 				cache_cbd->gen, cache_cbd->data->gen, map->name);
-		MAP_RELEASE (cache_cbd->shm, "rspamd_http_map_cached_cbdata");
-		ev_timer_stop (loop, &cache_cbd->timeout);
-		g_free (cache_cbd);
+		rspamd_map_cache_cbd_free (cache_cbd);
 	}
 	else if (cache_cbd->data->last_checked >= cache_cbd->last_checked) {
 		/*
@@ -283,11 +324,173 @@ rspamd_map_cache_cb (struct ev_loop *loop, ev_timer *w, int revents)
 	else {
 		data->cur_cache_cbd = NULL;
 		g_atomic_int_set (&data->cache->available, 0);
-		MAP_RELEASE (cache_cbd->shm, "rspamd_http_map_cached_cbdata");
 		msg_info_map ("cached data is now expired for %s", map->name);
-		ev_timer_stop (loop, &cache_cbd->timeout);
-		g_free (cache_cbd);
+		rspamd_map_cache_cbd_free (cache_cbd);
+	}
+}
+
+struct rspamd_map_serialise_cbdata {
+	rspamd_fstring_t *buf;
+	const gchar *bad_key;
+};
+
+static gboolean
+rspamd_map_serialise_cb (gconstpointer key, gconstpointer value, gsize hits,
+		gpointer ud)
+{
+	struct rspamd_map_serialise_cbdata *cbd =
+			(struct rspamd_map_serialise_cbdata *)ud;
+	const gchar *k = (const gchar *)key, *v = (const gchar *)value;
+	gsize klen = strlen (k), i;
+	gboolean need_quote = (klen == 0), quotable = TRUE;
+
+	for (i = 0; i < klen; i ++) {
+		if (g_ascii_isspace (k[i]) || k[i] == '#' ||
+				(i == 0 && (k[i] == '"' || k[i] == '/'))) {
+			need_quote = TRUE;
+		}
+
+		/* Quoted keys are stored as is, so quotes must be escaped already */
+		if (k[i] == '"' && (i == 0 || k[i - 1] != '\\')) {
+			quotable = FALSE;
+		}
+	}
+
+	if (klen > 0 && k[klen - 1] == '\\') {
+		quotable = FALSE;
+	}
+
+	if (need_quote && !quotable) {
+		/* Key cannot be written to be read back as is, stop */
+		cbd->bad_key = k;
+
+		return FALSE;
+	}
+
+	/* Values are read up to a comment or end of line, so they are safe */
+	if (!need_quote) {
+		rspamd_printf_fstring (&cbd->buf, "%s %s\n", k, v);
 	}
+	else {
+		rspamd_printf_fstring (&cbd->buf, "\"%s\" %s\n", k, v);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Converts the current map data to the textual form, used when data is
+ * modified by a delta and other processes need the full data; returns NULL
+ * if some key cannot be represented in the map format
+ */
+static rspamd_fstring_t *
+rspamd_map_serialise_data (struct rspamd_map *map)
+{
+	struct rspamd_map_serialise_cbdata cbd;
+
+	cbd.buf = rspamd_fstring_sized_new (map->nelts * 32 + 1);
+	cbd.bad_key = NULL;
+
+	if (map->traverse_function && *map->user_data) {
+		map->traverse_function (*map->user_data, rspamd_map_serialise_cb,
+				&cbd, FALSE);
+	}
+
+	if (cbd.bad_key) {
+		msg_info_map ("cannot serialise key '%s' of %s", cbd.bad_key,
+				map->name);
+		rspamd_fstring_free (cbd.buf);
+
+		return NULL;
+	}
+
+	if (cbd.buf->len == 0) {
+		/* Empty data cannot be stored in the shared memory */
+		cbd.buf = rspamd_fstring_append (cbd.buf, "\n", 1);
+	}
+
+	return cbd.buf;
+}
+
+static struct rspamd_storage_shmem *
+rspamd_map_shmem_from_data (const gchar *data, gsize len)
+{
+	struct rspamd_http_message *msg;
+	struct rspamd_storage_shmem *shm = NULL;
+
+	/* Reuse HTTP messages shared storage */
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->flags |= RSPAMD_HTTP_FLAG_SHMEM;
+
+	if (rspamd_http_message_set_body (msg, data, len)) {
+		shm = rspamd_http_message_shmem_ref (msg);
+	}
+
+	rspamd_http_message_unref (msg);
+
+	return shm;
+}
+
+/*
+ * Publishes the full data modified by deltas to the cache, so other
+ * processes and restarts can use it
+ */
+static void
+rspamd_map_cache_serialise_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct rspamd_http_map_cached_cbdata *cache_cbd =
+			(struct rspamd_http_map_cached_cbdata *)w->data;
+	struct rspamd_storage_shmem *full_shm;
+	struct rspamd_map *map = cache_cbd->map;
+	struct http_map_data *data = cache_cbd->data;
+	rspamd_fstring_t *full;
+
+	ev_timer_stop (loop, w);
+
+	if (!g_atomic_int_compare_and_exchange (map->locked, 0, 1)) {
+		/* Map is being updated, try again later */
+		ev_timer_set (w, 1.0, 0.0);
+		ev_timer_start (loop, w);
+
+		return;
+	}
+
+	/* Cache might be replaced by another process */
+	if (data->cache->version == cache_cbd->version) {
+		full = rspamd_map_serialise_data (map);
+
+		if (full == NULL) {
+			/*
+			 * Full data is left unavailable in the cache, so processes that
+			 * cannot apply deltas load the whole map themselves
+			 */
+			msg_info_map ("%s modified by deltas is not serialised, other "
+					"processes will reload it", map->name);
+		}
+		else {
+			full_shm = rspamd_map_shmem_from_data (full->str, full->len);
+
+			if (full_shm == NULL) {
+				msg_err_map ("cannot store serialised map data: %s",
+						strerror (errno));
+			}
+			else {
+				rspamd_strlcpy (data->cache->shmem_name, full_shm->shm_name,
+						sizeof (data->cache->shmem_name));
+				data->cache->len = full->len;
+				cache_cbd->shm = full_shm;
+				rspamd_map_save_http_cached_file (map, cache_cbd->bk, data,
+						full->str, full->len);
+				msg_info_map ("serialised %z bytes of %s modified by deltas",
+						full->len, map->name);
+			}
+
+			rspamd_fstring_free (full);
+		}
+	}
+
+	data->serialise_after = 0;
+	g_atomic_int_set (map->locked, 0);
 }
 
 static int
@@ -303,12 +506,14 @@ http_map_finish (struct rspamd_http_connection *conn,
 	char next_check_date[128];
 	guchar *in = NULL;
 	gsize dlen = 0;
+	gboolean is_delta;
 
 	map = cbd->map;
 	bk = cbd->bk;
 	data = bk->data.hd;
+	is_delta = (msg->code == 226 && cbd->delta && !cbd->check);
 
-	if (msg->code == 200) {
+	if (msg->code == 200 || is_delta) {
 
 		if (cbd->check) {
 			msg_info_map ("need to reread map from %s", cbd->bk->uri);
@@ -355,6 +560,27 @@ http_map_finish (struct rspamd_http_connection *conn,
 			goto err;
 		}
 
+		if (is_delta) {
+			if (!rspamd_map_apply_delta (map, cbd->periodic, in, cbd->data_len)) {
+				msg_err_map ("%s(%s): cannot apply delta of %z bytes",
+						cbd->bk->uri,
+						rspamd_inet_address_to_string_pretty (cbd->addr),
+						cbd->data_len);
+				munmap (in, dlen);
+
+				/* Keep the current data and request the full data next time */
+				cbd->periodic->need_modify = FALSE;
+				cbd->data->last_modified = 0;
+
+				if (cbd->data->etag) {
+					rspamd_fstring_free (cbd->data->etag);
+					cbd->data->etag = NULL;
+				}
+
+				goto err;
+			}
+		}
+
 		/* Check for expires */
 		double cached_timeout = map->poll_timeout * 2;
 
@@ -403,26 +629,77 @@ http_map_finish (struct rspamd_http_connection *conn,
 		 * We know that a map is in the locked state
 		 */
 		g_atomic_int_set (&data->cache->available, 1);
+		cache_cbd = g_malloc0 (sizeof (*cache_cbd));
+
 		/* Store cached data */
-		rspamd_strlcpy (data->cache->shmem_name, cbd->shmem_data->shm_name,
-				sizeof (data->cache->shmem_name));
-		data->cache->len = cbd->data_len;
+		if (is_delta) {
+			/* Processes that have the previous version can apply delta */
+			rspamd_strlcpy (data->cache->delta_shmem_name,
+					cbd->shmem_data->shm_name,
+					sizeof (data->cache->delta_shmem_name));
+			data->cache->delta_len = cbd->data_len;
+			data->cache->delta_base = data->cache->version;
+			/*
+			 * The full data is serialised later, so processes that cannot
+			 * apply delta will request the data themselves meanwhile
+			 */
+			data->cache->shmem_name[0] = '\0';
+			data->cache->len = 0;
+			cache_cbd->delta_shm = cbd->shmem_data;
+			MAP_RETAIN (cache_cbd->delta_shm, "shmem_data");
+		}
+		else {
+			rspamd_strlcpy (data->cache->shmem_name, cbd->shmem_data->shm_name,
+					sizeof (data->cache->shmem_name));
+			data->cache->len = cbd->data_len;
+			data->cache->delta_len = 0;
+			cache_cbd->shm = cbd->shmem_data;
+			MAP_RETAIN (cache_cbd->shm, "shmem_data");
+			data->serialise_after = 0;
+		}
+
+		data->cache->version ++;
+		data->cache_version = data->cache->version;
 		data->cache->last_modified = cbd->data->last_modified;
-		cache_cbd = g_malloc0 (sizeof (*cache_cbd));
-		cache_cbd->shm = cbd->shmem_data;
 		cache_cbd->event_loop = cbd->event_loop;
 		cache_cbd->map = map;
 		cache_cbd->data = cbd->data;
 		cache_cbd->last_checked = cbd->data->last_checked;
 		cache_cbd->gen = cbd->data->gen;
-		MAP_RETAIN (cache_cbd->shm, "shmem_data");
+		cache_cbd->version = data->cache->version;
+		cache_cbd->bk = bk;
 
 		ev_timer_init (&cache_cbd->timeout, rspamd_map_cache_cb, cached_timeout,
 				0.0);
 		ev_timer_start (cbd->event_loop, &cache_cbd->timeout);
 		cache_cbd->timeout.data = cache_cbd;
+		ev_timer_init (&cache_cbd->serialise_ev, rspamd_map_cache_serialise_cb,
+				0.0, 0.0);
+		cache_cbd->serialise_ev.data = cache_cbd;
+
+		if (data->cur_cache_cbd) {
+			/* Previous data is released on its timeout but is not serialised */
+			ev_timer_stop (cbd->event_loop, &data->cur_cache_cbd->serialise_ev);
+		}
+
 		data->cur_cache_cbd = cache_cbd;
 
+		if (is_delta) {
+			/*
+			 * Deltas are accumulated in the current data, it is serialised
+			 * no earlier than after a poll interval since the first delta
+			 */
+			if (data->serialise_after == 0) {
+				data->serialise_after = rspamd_get_calendar_ticks () +
+						map->poll_timeout;
+			}
+
+			ev_timer_set (&cache_cbd->serialise_ev,
+					MAX (data->serialise_after - rspamd_get_calendar_ticks (),
+							0.0), 0.0);
+			ev_timer_start (cbd->event_loop, &cache_cbd->serialise_ev);
+		}
+
 		if (map->next_check) {
 			rspamd_http_date_format (next_check_date, sizeof (next_check_date),
 					map->next_check);
@@ -433,7 +710,13 @@ http_map_finish (struct rspamd_http_connection *conn,
 		}
 
 
-		if (cbd->bk->is_compressed) {
+		if (is_delta) {
+			msg_info_map ("%s(%s): read map delta %z bytes, next check at %s",
+					cbd->bk->uri,
+					rspamd_inet_address_to_string_pretty (cbd->addr),
+					dlen, next_check_date);
+		}
+		else if (cbd->bk->is_compressed) {
 			ZSTD_DStream *zstream;
 			ZSTD_inBuffer zin;
 			ZSTD_outBuffer zout;
@@ -485,9 +768,8 @@ http_map_finish (struct rspamd_http_connection *conn,
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
 					dlen, zout.pos, next_check_date);
-			map->read_callback (out, zout.pos, &cbd->periodic->cbdata, TRUE);
 			rspamd_map_save_http_cached_file (map, bk, cbd->data, out, zout.pos);
-			g_free (out);
+			rspamd_map_read_data_owned (map, cbd->periodic, (gchar *)out, zout.pos, 0);
 		}
 		else {
 			msg_info_map ("%s(%s): read map data %z bytes, next check at %s",
@@ -495,13 +777,20 @@ http_map_finish (struct rspamd_http_connection *conn,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
 					dlen, next_check_date);
 			rspamd_map_save_http_cached_file (map, bk, cbd->data, in, cbd->data_len);
-			map->read_callback (in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
+			/* Mapping is kept until data is parsed */
+			rspamd_map_read_data_owned (map, cbd->periodic, (gchar *)in, cbd->data_len,
+					dlen);
+			in = NULL;
 		}
 
 		MAP_RELEASE (cbd->shmem_data, "shmem_data");
 
 		cbd->periodic->cur_backend ++;
-		munmap (in, dlen);
+
+		if (in) {
+			munmap (in, dlen);
+		}
+
 		rspamd_map_process_periodic (cbd->periodic);
 	}
 	else if (msg->code == 304 && cbd->check) {
@@ -652,6 +941,156 @@ read_map_file_chunks (struct rspamd_map *map, struct map_cb_data *cbdata,
 	return TRUE;
 }
 
+/* A piece of map data saved to be parsed in a separate thread */
+struct rspamd_map_bg_chunk {
+	gchar *begin;
+	gsize len;
+	gsize mapped_len; /* if not zero, then data is mmapped */
+};
+
+static void
+rspamd_map_bg_chunk_free (struct rspamd_map_bg_chunk *chunk)
+{
+	if (chunk->begin) {
+		if (chunk->mapped_len > 0) {
+			munmap (chunk->begin, chunk->mapped_len);
+		}
+		else {
+			g_free (chunk->begin);
+		}
+	}
+
+	g_free (chunk);
+}
+
+/*
+ * Passes a complete piece of map data to the read callback or saves it to be
+ * parsed in a separate thread; data is owned by this function and it is
+ * either freed (mapped_len == 0) or unmapped when no longer needed
+ */
+static void
+rspamd_map_read_data_owned (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic,
+		gchar *data, gsize len, gsize mapped_len)
+{
+	struct rspamd_map_bg_chunk *chunk;
+	gdouble start;
+
+	chunk = g_malloc0 (sizeof (*chunk));
+	chunk->begin = data;
+	chunk->len = len;
+	chunk->mapped_len = mapped_len;
+
+	if (periodic->background) {
+		if (periodic->bg_data == NULL) {
+			periodic->bg_data = g_ptr_array_new ();
+		}
+
+		g_ptr_array_add (periodic->bg_data, chunk);
+
+		return;
+	}
+
+	start = rspamd_get_ticks (FALSE);
+	map->read_callback (data, len, &periodic->cbdata, TRUE);
+	periodic->build_time += rspamd_get_ticks (FALSE) - start;
+	rspamd_map_bg_chunk_free (chunk);
+}
+
+/*
+ * Same as the previous but data is not owned, so it is copied if it needs to
+ * be parsed in a separate thread
+ */
+static void
+rspamd_map_read_data (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic,
+		gchar *data, gsize len)
+{
+	gdouble start;
+
+	if (periodic->background) {
+		gchar *copy = NULL;
+
+		if (len > 0) {
+			copy = g_malloc (len);
+			memcpy (copy, data, len);
+		}
+
+		rspamd_map_read_data_owned (map, periodic, copy, len, 0);
+
+		return;
+	}
+
+	start = rspamd_get_ticks (FALSE);
+	map->read_callback (data, len, &periodic->cbdata, TRUE);
+	periodic->build_time += rspamd_get_ticks (FALSE) - start;
+}
+
+/*
+ * Deltas are supported merely for maps with a single plain source and for
+ * the data that can be modified in place
+ */
+static gboolean
+rspamd_map_delta_allowed (struct rspamd_map *map,
+		struct rspamd_map_backend *bk,
+		struct map_periodic_cbdata *periodic)
+{
+	struct map_cb_data cbdata;
+
+	if (map->delta_callback == NULL || map->shared ||
+			map->backends->len != 1 ||
+			bk->is_compressed || bk->is_signed ||
+			periodic == NULL || periodic->cbdata.prev_data == NULL) {
+		return FALSE;
+	}
+
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.map = map;
+	cbdata.cur_data = periodic->cbdata.prev_data;
+
+	return map->delta_callback (NULL, 0, &cbdata);
+}
+
+/*
+ * Applies delta to the current data, so fin callback just keeps it in place
+ */
+static gboolean
+rspamd_map_apply_delta (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic,
+		const gchar *delta, gsize len)
+{
+	gdouble start;
+	gpointer old = periodic->cbdata.prev_data;
+
+	periodic->cbdata.cur_data = old;
+	periodic->cbdata.prev_data = NULL;
+	start = rspamd_get_ticks (FALSE);
+
+	if (!map->delta_callback (delta, len, &periodic->cbdata)) {
+		periodic->cbdata.cur_data = NULL;
+		periodic->cbdata.prev_data = old;
+
+		return FALSE;
+	}
+
+	periodic->build_time += rspamd_get_ticks (FALSE) - start;
+
+	return TRUE;
+}
+
+static void
+rspamd_map_bg_data_free (GPtrArray *bg_data)
+{
+	struct rspamd_map_bg_chunk *chunk;
+	guint i;
+
+	PTR_ARRAY_FOREACH (bg_data, i, chunk) {
+		rspamd_map_bg_chunk_free (chunk);
+	}
+
+	g_ptr_array_free (bg_data, TRUE);
+}
+
 static gboolean
 rspamd_map_check_sig_pk_mem (const guchar *sig,
 							 gsize siglen,
@@ -873,23 +1312,37 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 				msg_info_map ("%s: read map data, %z bytes compressed, "
 							  "%z uncompressed)", data->filename,
 						len, zout.pos);
-				map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-				g_free (out);
+				rspamd_map_read_data_owned (map, periodic, (gchar *)out, zout.pos, 0);
 
 				munmap (bytes, len);
 			}
+			else if (periodic->background) {
+				/* The file is mapped until it is parsed in a separate thread */
+				bytes = rspamd_file_xmap (data->filename, PROT_READ, &len, TRUE);
+
+				if (bytes == NULL) {
+					msg_err_map ("can't open map %s: %s", data->filename, strerror (errno));
+					return FALSE;
+				}
+
+				rspamd_map_read_data_owned (map, periodic, bytes, len, len);
+			}
 			else {
+				gdouble start = rspamd_get_ticks (FALSE);
+
 				/* Perform buffered read: fail-safe */
 				if (!read_map_file_chunks (map, &periodic->cbdata, data->filename,
 						len, 0)) {
 					return FALSE;
 				}
+
+				periodic->build_time += rspamd_get_ticks (FALSE) - start;
 			}
 		}
 	}
 	else {
 		/* Empty map */
-		map->read_callback (NULL, 0, &periodic->cbdata, TRUE);
+		rspamd_map_read_data (map, periodic, NULL, 0);
 	}
 
 	return TRUE;
@@ -962,17 +1415,16 @@ read_map_static (struct rspamd_map *map, struct static_map_data *data,
 					"%z uncompressed)",
 					map->name,
 					len, zout.pos);
-			map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-			g_free (out);
+			rspamd_map_read_data_owned (map, periodic, (gchar *)out, zout.pos, 0);
 		}
 		else {
 			msg_info_map ("%s: read map data, %z bytes",
 					map->name, len);
-			map->read_callback (bytes, len, &periodic->cbdata, TRUE);
+			rspamd_map_read_data (map, periodic, bytes, len);
 		}
 	}
 	else {
-		map->read_callback (NULL, 0, &periodic->cbdata, TRUE);
+		rspamd_map_read_data (map, periodic, NULL, 0);
 	}
 
 	data->processed = TRUE;
@@ -980,34 +1432,500 @@ read_map_static (struct rspamd_map *map, struct static_map_data *data,
 	return TRUE;
 }
 
+/*
+ * Stamp identifies the current state of all map sources, so a process can
+ * tell if the shared storage has been built from the same data without
+ * reading and parsing it
+ */
+static gboolean
+rspamd_map_sources_stamp (struct rspamd_map *map, guint64 *stamp)
+{
+	rspamd_cryptobox_fast_hash_state_t st;
+	struct rspamd_map_backend *bk;
+	struct http_map_data *hdata;
+	struct stat fst;
+	guint i;
+
+	rspamd_cryptobox_fast_hash_init (&st, map_shared_seed);
+
+	PTR_ARRAY_FOREACH (map->backends, i, bk) {
+		rspamd_cryptobox_fast_hash_update (&st, &bk->id, sizeof (bk->id));
+
+		switch (bk->protocol) {
+		case MAP_PROTO_FILE:
+			if (stat (bk->data.fd->filename, &fst) == -1) {
+				/* Missing file is also a valid state */
+				memset (&fst, 0, sizeof (fst));
+			}
+
+			rspamd_cryptobox_fast_hash_update (&st, &fst.st_ino,
+					sizeof (fst.st_ino));
+			rspamd_cryptobox_fast_hash_update (&st, &fst.st_size,
+					sizeof (fst.st_size));
+			rspamd_cryptobox_fast_hash_update (&st, &fst.st_mtime,
+					sizeof (fst.st_mtime));
+			break;
+		case MAP_PROTO_HTTP:
+		case MAP_PROTO_HTTPS:
+			hdata = bk->data.hd;
+
+			if (g_atomic_int_get (&hdata->cache->available) != 1) {
+				/* We have no idea about the remote state */
+				return FALSE;
+			}
+
+			rspamd_cryptobox_fast_hash_update (&st, &hdata->cache->last_modified,
+					sizeof (hdata->cache->last_modified));
+			rspamd_cryptobox_fast_hash_update (&st, &hdata->cache->len,
+					sizeof (hdata->cache->len));
+			break;
+		case MAP_PROTO_STATIC:
+			/* Static data never changes */
+			break;
+		}
+	}
+
+	*stamp = rspamd_cryptobox_fast_hash_final (&st);
+
+	return TRUE;
+}
+
+static void
+rspamd_map_shared_unlink (const gchar *shm_name)
+{
+#ifdef HAVE_SANE_SHMEM
+	shm_unlink (shm_name);
+#else
+	unlink (shm_name);
+#endif
+}
+
+/*
+ * Attaches immutable data published by another process instead of reading
+ * and parsing map sources. Must be called with the map locked.
+ */
+static gboolean
+rspamd_map_shared_attach (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map_shared_storage *shared = map->shared;
+	struct rspamd_map_backend *bk;
+	struct http_map_data *hdata;
+	guint64 stamp;
+	gpointer data;
+	gint fd;
+	guint i;
+
+	if (g_atomic_int_get (&shared->available) != 1 ||
+			!rspamd_map_sources_stamp (map, &stamp) ||
+			stamp != shared->stamp) {
+		return FALSE;
+	}
+
+#ifdef HAVE_SANE_SHMEM
+	fd = shm_open (shared->shm_name, O_RDONLY, 0);
+#else
+	fd = open (shared->shm_name, O_RDONLY);
+#endif
+
+	if (fd == -1) {
+		msg_info_map ("cannot open shared storage %s for map %s: %s; "
+				"read map directly", shared->shm_name, map->name,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	/* Attach function takes ownership of fd on success */
+	data = map->shared_attach (map, fd, shared->nelts, shared->digest);
+
+	if (data == NULL) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	periodic->cbdata.cur_data = data;
+	periodic->shared_attached = TRUE;
+
+	/* We have the same data as the cache, so pretend we have read it */
+	PTR_ARRAY_FOREACH (map->backends, i, bk) {
+		if (bk->protocol == MAP_PROTO_HTTP || bk->protocol == MAP_PROTO_HTTPS) {
+			hdata = bk->data.hd;
+			hdata->last_modified = hdata->cache->last_modified;
+		}
+	}
+
+	msg_info_map ("attached shared storage %s for map %s: %z elements, %z bytes",
+			shared->shm_name, map->name, shared->nelts, shared->len);
+
+	return TRUE;
+}
+
+/*
+ * Writes the current map data to the shared memory so other processes can
+ * attach it. Must be called with the map locked.
+ */
+static void
+rspamd_map_shared_publish (struct rspamd_map *map)
+{
+	struct rspamd_map_shared_storage *shared = map->shared;
+	gchar shm_name[sizeof (shared->shm_name)];
+	struct stat st;
+	guint64 stamp;
+	gint fd;
+
+	if (*map->user_data == NULL || !rspamd_map_sources_stamp (map, &stamp)) {
+		return;
+	}
+
+	if (g_atomic_int_get (&shared->available) == 1 && shared->stamp == stamp) {
+		/* Already published by someone else */
+		return;
+	}
+
+#ifdef HAVE_SANE_SHMEM
+	rspamd_strlcpy (shm_name, "/rmap.XXXXXXXXXXXXXXXXXXXX", sizeof (shm_name));
+	fd = rspamd_shmem_mkstemp (shm_name);
+#else
+	rspamd_strlcpy (shm_name, "/tmp/rmap.XXXXXXXXXXXXXXXXXXXX", sizeof (shm_name));
+	fd = mkstemp (shm_name);
+#endif
+
+	if (fd == -1) {
+		msg_err_map ("cannot create shared storage for map %s: %s",
+				map->name, strerror (errno));
+
+		return;
+	}
+
+	if (!map->shared_export (*map->user_data, fd) || fstat (fd, &st) == -1) {
+		msg_err_map ("cannot write shared storage %s for map %s: %s",
+				shm_name, map->name, strerror (errno));
+		close (fd);
+		rspamd_map_shared_unlink (shm_name);
+
+		return;
+	}
+
+	close (fd);
+
+	if (g_atomic_int_compare_and_exchange (&shared->available, 1, 0)) {
+		/* Processes that have attached the old storage still keep it mapped */
+		rspamd_map_shared_unlink (shared->shm_name);
+	}
+
+	rspamd_strlcpy (shared->shm_name, shm_name, sizeof (shared->shm_name));
+	shared->stamp = stamp;
+	shared->digest = map->digest;
+	shared->nelts = map->nelts;
+	shared->len = st.st_size;
+	shared->pid = getpid ();
+	g_atomic_int_set (&shared->available, 1);
+
+	msg_info_map ("published shared storage %s for map %s: %z elements, %z bytes",
+			shm_name, map->name, map->nelts, (gsize)st.st_size);
+}
+
+static void
+rspamd_map_unlock (struct rspamd_map *map)
+{
+	g_atomic_int_set (map->locked, 0);
+	msg_debug_map ("unlocked map %s", map->name);
+
+	if (map->wrk->state == rspamd_worker_state_running) {
+		rspamd_map_schedule_periodic (map,
+				RSPAMD_SYMBOL_RESULT_NORMAL);
+	}
+	else {
+		msg_debug_map ("stop scheduling periodics for %s; terminating state",
+				map->name);
+	}
+}
+
+/*
+ * Data is built in two stages in a separate thread: the first one parses the
+ * read data to key/value pairs, then pairs are inserted to the map structures
+ * in the event loop and the second stage builds lookup structures (if any).
+ * Threads use neither memory pools nor logging, their errors are logged in
+ * the event loop.
+ */
+struct rspamd_map_build_cbdata {
+	struct rspamd_map *map;
+	struct map_cb_data cbdata;
+	GPtrArray *bg_data;
+	GPtrArray *pairs;
+	GPtrArray *errors;
+	ev_async ev;
+	gboolean locked;
+	gboolean built;
+	gdouble build_time;
+};
+
+static void
+rspamd_map_build_cbdata_free (struct rspamd_map_build_cbdata *bcbd)
+{
+	if (bcbd->bg_data) {
+		rspamd_map_bg_data_free (bcbd->bg_data);
+	}
+
+	if (bcbd->pairs) {
+		g_ptr_array_free (bcbd->pairs, TRUE);
+	}
+
+	g_ptr_array_free (bcbd->errors, TRUE);
+	g_free (bcbd);
+}
+
+static gpointer
+rspamd_map_parse_thread (gpointer ud)
+{
+	struct rspamd_map_build_cbdata *bcbd = ud;
+	struct rspamd_map *map = bcbd->map;
+	struct rspamd_map_bg_chunk *chunk;
+	struct map_cb_data pcbdata;
+	gdouble start;
+	guint i;
+
+	start = rspamd_get_ticks (FALSE);
+	memset (&pcbdata, 0, sizeof (pcbdata));
+	pcbdata.map = map;
+	pcbdata.cur_data = bcbd->pairs;
+	pcbdata.errors = bcbd->errors;
+
+	PTR_ARRAY_FOREACH (bcbd->bg_data, i, chunk) {
+		map->parse_callback (chunk->begin, chunk->len, &pcbdata, TRUE);
+	}
+
+	/* Free read data as soon as possible */
+	rspamd_map_bg_data_free (bcbd->bg_data);
+	bcbd->bg_data = NULL;
+
+	bcbd->build_time += rspamd_get_ticks (FALSE) - start;
+	/* Build data must not be touched after this point */
+	ev_async_send (map->event_loop, &bcbd->ev);
+
+	return NULL;
+}
+
+static gpointer
+rspamd_map_build_thread (gpointer ud)
+{
+	struct rspamd_map_build_cbdata *bcbd = ud;
+	struct rspamd_map *map = bcbd->map;
+	gdouble start;
+
+	start = rspamd_get_ticks (FALSE);
+	map->build_callback (&bcbd->cbdata);
+	bcbd->build_time += rspamd_get_ticks (FALSE) - start;
+	bcbd->built = TRUE;
+	ev_async_send (map->event_loop, &bcbd->ev);
+
+	return NULL;
+}
+
+/*
+ * Waits for the build thread and drops the data being built, used when
+ * map is destroyed
+ */
+static void
+rspamd_map_build_cancel (struct rspamd_map *map)
+{
+	struct rspamd_map_build_cbdata *bcbd = map->bg_cbd;
+
+	if (bcbd == NULL) {
+		return;
+	}
+
+	if (map->bg_thread) {
+		g_thread_join (map->bg_thread);
+		map->bg_thread = NULL;
+	}
+
+	if (map->event_loop) {
+		ev_async_stop (map->event_loop, &bcbd->ev);
+	}
+
+	if (bcbd->cbdata.cur_data && map->dtor) {
+		bcbd->cbdata.prev_data = NULL;
+		map->dtor (&bcbd->cbdata);
+	}
+
+	map->bg_cbd = NULL;
+	rspamd_map_build_cbdata_free (bcbd);
+}
+
+static void
+rspamd_map_build_done (struct ev_loop *loop, ev_async *w, int revents)
+{
+	struct rspamd_map_build_cbdata *bcbd =
+			(struct rspamd_map_build_cbdata *)w->data;
+	struct rspamd_map *map = bcbd->map;
+	GError *err = NULL;
+	const gchar *errmsg;
+	gdouble start;
+	guint i;
+
+	/* Thread has finished its work, so join should not block for long */
+	g_thread_join (map->bg_thread);
+	map->bg_thread = NULL;
+
+	if (bcbd->pairs) {
+		PTR_ARRAY_FOREACH (bcbd->errors, i, errmsg) {
+			msg_err_map ("%s", errmsg);
+		}
+
+		start = rspamd_get_ticks (FALSE);
+		map->insert_callback (&bcbd->cbdata, bcbd->pairs);
+		bcbd->build_time += rspamd_get_ticks (FALSE) - start;
+		g_ptr_array_free (bcbd->pairs, TRUE);
+		bcbd->pairs = NULL;
+
+		if (map->build_callback && !bcbd->built) {
+			map->bg_thread = rspamd_create_thread ("map",
+					rspamd_map_build_thread, bcbd, &err);
+
+			if (map->bg_thread != NULL) {
+				/* Wait for the second stage */
+				return;
+			}
+
+			msg_err_map ("cannot create thread to build map %s: %e; build it "
+					"in place", map->name, err);
+			g_error_free (err);
+			start = rspamd_get_ticks (FALSE);
+			map->build_callback (&bcbd->cbdata);
+			bcbd->build_time += rspamd_get_ticks (FALSE) - start;
+		}
+	}
+
+	ev_async_stop (loop, w);
+	map->bg_cbd = NULL;
+	/* Previous data might be changed since the data has been read */
+	bcbd->cbdata.prev_data = *map->user_data;
+
+	start = rspamd_get_ticks (FALSE);
+	map->fin_callback (&bcbd->cbdata, map->user_data);
+	map->build_time = bcbd->build_time + (rspamd_get_ticks (FALSE) - start);
+	msg_info_map ("built map %s in a separate thread in %.2f ms",
+			map->name, map->build_time * 1000.0);
+
+	if (map->shared) {
+		rspamd_map_shared_publish (map);
+	}
+
+	if (bcbd->locked) {
+		rspamd_map_unlock (map);
+	}
+
+	rspamd_map_build_cbdata_free (bcbd);
+}
+
+/*
+ * Starts parsing of the read data in a separate thread, the rest of the
+ * periodic finalisation is done in the event loop when it is finished
+ */
+static gboolean
+rspamd_map_build_background (struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map *map = periodic->map;
+	struct rspamd_map_build_cbdata *bcbd;
+	GError *err = NULL;
+
+	g_assert (map->bg_cbd == NULL);
+
+	bcbd = g_malloc0 (sizeof (*bcbd));
+	bcbd->map = map;
+	bcbd->cbdata = periodic->cbdata;
+	bcbd->bg_data = periodic->bg_data;
+	bcbd->locked = periodic->locked;
+	bcbd->pairs = g_ptr_array_new_with_free_func (g_free);
+	bcbd->errors = g_ptr_array_new_with_free_func (g_free);
+
+	ev_async_init (&bcbd->ev, rspamd_map_build_done);
+	bcbd->ev.data = bcbd;
+	ev_async_start (map->event_loop, &bcbd->ev);
+	map->bg_cbd = bcbd;
+
+	map->bg_thread = rspamd_create_thread ("map", rspamd_map_parse_thread,
+			bcbd, &err);
+
+	if (map->bg_thread == NULL) {
+		msg_err_map ("cannot create thread to build map %s: %e; build it "
+				"in place", map->name, err);
+		g_error_free (err);
+		ev_async_stop (map->event_loop, &bcbd->ev);
+		map->bg_cbd = NULL;
+		/* Data is still owned by periodic */
+		bcbd->bg_data = NULL;
+		rspamd_map_build_cbdata_free (bcbd);
+
+		return FALSE;
+	}
+
+	periodic->bg_data = NULL;
+	periodic->locked = FALSE;
+
+	return TRUE;
+}
+
 static void
 rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 {
 	struct rspamd_map *map;
+	struct rspamd_map_bg_chunk *chunk;
+	gdouble start;
+	guint i;
 
 	map = periodic->map;
 	msg_debug_map ("periodic dtor %p", periodic);
 
 	if (periodic->need_modify) {
+		if (periodic->bg_data) {
+			if (!periodic->errored && rspamd_map_build_background (periodic)) {
+				/* Finalisation and unlocking are done when build is finished */
+				g_free (periodic);
+
+				return;
+			}
+
+			/* Parse data in place */
+			start = rspamd_get_ticks (FALSE);
+
+			PTR_ARRAY_FOREACH (periodic->bg_data, i, chunk) {
+				map->read_callback (chunk->begin, chunk->len,
+						&periodic->cbdata, TRUE);
+			}
+
+			periodic->build_time += rspamd_get_ticks (FALSE) - start;
+			rspamd_map_bg_data_free (periodic->bg_data);
+			periodic->bg_data = NULL;
+		}
+
 		/* We are done */
+		start = rspamd_get_ticks (FALSE);
 		periodic->map->fin_callback (&periodic->cbdata, periodic->map->user_data);
+
+		if (!periodic->shared_attached) {
+			map->build_time = periodic->build_time +
+					(rspamd_get_ticks (FALSE) - start);
+			msg_info_map ("built map %s in %.2f ms", map->name,
+					map->build_time * 1000.0);
+		}
+
+		if (map->shared && !periodic->shared_attached && !periodic->errored) {
+			rspamd_map_shared_publish (map);
+		}
 	}
 	else {
 		/* Not modified */
+		if (periodic->bg_data) {
+			rspamd_map_bg_data_free (periodic->bg_data);
+		}
 	}
 
 	if (periodic->locked) {
-		g_atomic_int_set (periodic->map->locked, 0);
-		msg_debug_map ("unlocked map %s", periodic->map->name);
-
-		if (periodic->map->wrk->state == rspamd_worker_state_running) {
-			rspamd_map_schedule_periodic (periodic->map,
-					RSPAMD_SYMBOL_RESULT_NORMAL);
-		}
-		else {
-			msg_debug_map ("stop scheduling periodics for %s; terminating state",
-					periodic->map->name);
-		}
+		rspamd_map_unlock (periodic->map);
 	}
 
 	g_free (periodic);
@@ -1148,6 +2066,7 @@ rspamd_map_schedule_periodic (struct rspamd_map *map, int how)
 	cbd->cbdata.cur_data = NULL;
 	cbd->cbdata.map = map;
 	cbd->map = map;
+	cbd->background = map->bg_build;
 	map->scheduled_check = cbd;
 	REF_INIT_RETAIN (cbd, rspamd_map_periodic_dtor);
 
@@ -1319,6 +2238,34 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 
 	data = bk->data.hd;
 
+	if (data->cache->delta_len > 0 &&
+			data->cache_version == data->cache->delta_base &&
+			rspamd_map_delta_allowed (map, bk, periodic)) {
+		in = rspamd_shmem_xmap (data->cache->delta_shmem_name, PROT_READ, &len);
+
+		if (in != NULL) {
+			if (len >= data->cache->delta_len &&
+					rspamd_map_apply_delta (map, periodic, in,
+							data->cache->delta_len)) {
+				msg_info_map ("%s: read map delta cached %z bytes", bk->uri,
+						data->cache->delta_len);
+				munmap (in, len);
+				data->cache_version = data->cache->version;
+
+				return TRUE;
+			}
+
+			munmap (in, len);
+		}
+
+		/* Fallback to the full data */
+	}
+
+	if (data->cache->len == 0) {
+		/* Only delta is available, full data is not serialised yet */
+		return FALSE;
+	}
+
 	in = rspamd_shmem_xmap (data->cache->shmem_name, PROT_READ, &len);
 
 	if (in == NULL) {
@@ -1385,16 +2332,16 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 		msg_info_map ("%s: read map data cached %z bytes compressed, "
 				"%z uncompressed", bk->uri,
 				len, zout.pos);
-		map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-		g_free (out);
+		rspamd_map_read_data_owned (map, periodic, (gchar *)out, zout.pos, 0);
+		munmap (in, len);
 	}
 	else {
 		msg_info_map ("%s: read map data cached %z bytes", bk->uri,
 				len);
-		map->read_callback (in, len, &periodic->cbdata, TRUE);
+		rspamd_map_read_data_owned (map, periodic, in, len, len);
 	}
 
-	munmap (in, len);
+	data->cache_version = data->cache->version;
 
 	return TRUE;
 }
@@ -1979,7 +2926,17 @@ rspamd_map_process_periodic (struct map_periodic_cbdata *cbd)
 	map = cbd->map;
 	map->scheduled_check = NULL;
 
-	if (!map->file_only && !cbd->locked) {
+	if (map->bg_cbd && cbd->cur_backend == 0 && !cbd->locked) {
+		/* Wait for the previous data to be built */
+		msg_debug_map ("don't try to reread map %s as it is being built, "
+				"will reread it later", map->name);
+		rspamd_map_schedule_periodic (map, RSPAMD_MAP_SCHEDULE_LOCKED);
+		MAP_RELEASE (cbd, "periodic");
+
+		return;
+	}
+
+	if ((!map->file_only || map->shared) && !cbd->locked) {
 		if (!g_atomic_int_compare_and_exchange (cbd->map->locked,
 				0, 1)) {
 			msg_debug_map (
@@ -2027,6 +2984,16 @@ rspamd_map_process_periodic (struct map_periodic_cbdata *cbd)
 		g_assert (bk != NULL);
 
 		if (cbd->need_modify) {
+			if (map->shared && cbd->cur_backend == 0 &&
+					!cbd->shared_attached &&
+					rspamd_map_shared_attach (map, cbd)) {
+				/* Data is attached, no need to read any backend */
+				cbd->cur_backend = map->backends->len;
+				rspamd_map_process_periodic (cbd);
+
+				return;
+			}
+
 			/* Load data from the next backend */
 			switch (bk->protocol) {
 			case MAP_PROTO_HTTP:
@@ -2268,7 +3235,16 @@ rspamd_map_preload (struct rspamd_config *cfg)
 			}
 
 			if (succeed) {
+				gdouble start = rspamd_get_ticks (FALSE);
+
 				map->fin_callback (&fake_cbd.cbdata, map->user_data);
+				map->build_time = fake_cbd.build_time +
+						(rspamd_get_ticks (FALSE) - start);
+
+				if (map->shared) {
+					/* Workers will attach preloaded data instead of reading it */
+					rspamd_map_shared_publish (map);
+				}
 			}
 			else {
 				msg_info_map ("preload of %s failed", map->name);
@@ -2296,6 +3272,9 @@ rspamd_map_remove_all (struct rspamd_config *cfg)
 			map->tmp_dtor (map->tmp_dtor_data);
 		}
 
+		/* Build thread must be finished before map data is destroyed */
+		rspamd_map_build_cancel (map);
+
 		if (map->dtor) {
 			cbdata.prev_data = NULL;
 			cbdata.map = map;
@@ -2314,6 +3293,12 @@ rspamd_map_remove_all (struct rspamd_config *cfg)
 		if (map->fallback_backend) {
 			MAP_RELEASE (map->fallback_backend, "rspamd_map_backend");
 		}
+
+		if (map->shared && map->shared->pid == getpid () &&
+				g_atomic_int_compare_and_exchange (&map->shared->available, 1, 0)) {
+			/* Storage lives as long as its publisher */
+			rspamd_map_shared_unlink (map->shared->shm_name);
+		}
 	}
 
 	g_list_free (cfg->maps);
@@ -2502,11 +3487,7 @@ rspamd_map_backend_dtor (struct rspamd_map_backend *bk)
 
 			if (g_atomic_int_compare_and_exchange (&data->cache->available, 1, 0)) {
 				if (data->cur_cache_cbd) {
-					MAP_RELEASE (data->cur_cache_cbd->shm,
-							"rspamd_http_map_cached_cbdata");
-					ev_timer_stop (data->cur_cache_cbd->event_loop,
-							&data->cur_cache_cbd->timeout);
-					g_free (data->cur_cache_cbd);
+					rspamd_map_cache_cbd_free (data->cur_cache_cbd);
 					data->cur_cache_cbd = NULL;
 				}
 
@@ -2775,6 +3756,7 @@ rspamd_map_add (struct rspamd_config *cfg,
 		map->description = rspamd_mempool_strdup (cfg->cfg_pool, description);
 	}
 
+	rspamd_map_background_init (cfg, map);
 	rspamd_map_calculate_hash (map);
 	msg_info_map ("added map %s", bk->uri);
 
@@ -2819,6 +3801,57 @@ rspamd_map_add_backend (struct rspamd_map *map, struct rspamd_map_backend *bk)
 	}
 }
 
+static void
+rspamd_map_background_init (struct rspamd_config *cfg, struct rspamd_map *map)
+{
+	if (!cfg->map_background_build) {
+		return;
+	}
+
+	/* Only helpers that use neither Lua, nor regexps cache nor DNS are allowed */
+	if (map->read_callback == rspamd_kv_list_read) {
+		map->bg_build = true;
+		map->parse_callback = rspamd_kv_list_parse;
+		map->insert_callback = rspamd_kv_list_insert;
+		map->build_callback = rspamd_kv_list_build;
+	}
+	else if (map->read_callback == rspamd_radix_read) {
+		map->bg_build = true;
+		map->parse_callback = rspamd_radix_parse;
+		map->insert_callback = rspamd_radix_insert;
+	}
+}
+
+static void
+rspamd_map_shared_init (struct rspamd_config *cfg, struct rspamd_map *map)
+{
+	if (map->read_callback == rspamd_kv_list_read) {
+		map->shared_export = rspamd_map_helper_export_hash;
+		map->shared_attach = rspamd_map_helper_attach_hash;
+	}
+	else {
+		msg_warn_config ("map %s: shared storage is supported for hash maps "
+				"only, ignore `shared` option", map->name);
+
+		return;
+	}
+
+	map->shared = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*map->shared));
+}
+
+static void
+rspamd_map_delta_init (struct rspamd_config *cfg, struct rspamd_map *map)
+{
+	if (map->read_callback == rspamd_kv_list_read) {
+		map->delta_callback = rspamd_kv_list_delta;
+	}
+	else {
+		msg_warn_config ("map %s: delta updates are supported for hash maps "
+				"only, ignore `delta` option", map->name);
+	}
+}
+
 struct rspamd_map*
 rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 						 const ucl_object_t *obj,
@@ -2834,6 +3867,7 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	const ucl_object_t *cur, *elt;
 	struct rspamd_map *map;
 	struct rspamd_map_backend *bk;
+	gboolean shared = FALSE, delta = FALSE;
 	guint i;
 
 	g_assert (obj != NULL);
@@ -2909,6 +3943,16 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 			map->poll_timeout = ucl_object_todouble (elt);
 		}
 
+		elt = ucl_object_lookup (obj, "shared");
+		if (elt) {
+			shared = ucl_object_toboolean (elt);
+		}
+
+		elt = ucl_object_lookup (obj, "delta");
+		if (elt) {
+			delta = ucl_object_toboolean (elt);
+		}
+
 		elt = ucl_object_lookup_any (obj, "upstreams", "url", "urls", NULL);
 		if (elt == NULL) {
 			msg_err_config ("map has no urls to be loaded: no elt");
@@ -3029,6 +4073,16 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 							 cfg->map_file_watch_multiplier);
 	}
 
+	if (shared) {
+		rspamd_map_shared_init (cfg, map);
+	}
+
+	if (delta) {
+		rspamd_map_delta_init (cfg, map);
+	}
+
+	rspamd_map_background_init (cfg, map);
+
 	rspamd_map_calculate_hash (map);
 	msg_debug_map ("added map from ucl");
 
@@ -52,6 +52,7 @@ struct map_cb_data {
 	gint state;
 	void *prev_data;
 	void *cur_data;
+	GPtrArray *errors; /* if not NULL, parse errors are stored here instead of logging */
 };
 
 /**
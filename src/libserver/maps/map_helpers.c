@@ -58,11 +58,40 @@ struct rspamd_radix_map_helper {
 	rspamd_cryptobox_fast_hash_state_t hst;
 };
 
+/*
+ * Compact immutable storage for large hash maps: keys (lowercased) and values
+ * are packed into a single arena as
+ * <klen:4><vlen:4><key><\0><value><\0>, whilst open addressing table
+ * (robin hood ordered) stores 64 bit hashes as fingerprints, so negative
+ * lookups almost never touch the arena
+ */
+struct rspamd_map_compact_slot {
+	guint64 fp; /* 0 means empty slot */
+	guint64 off;
+};
+
+struct rspamd_map_compact_hash {
+	struct rspamd_map_compact_slot *slots;
+	guint64 mask;
+	gchar *arena;
+	gsize arena_len;
+};
+
+#define RSPAMD_MAP_COMPACT_HDR (sizeof (guint32) * 2)
+
 struct rspamd_hash_map_helper {
 	rspamd_mempool_t *pool;
 	khash_t(rspamd_map_hash) *htb;
 	struct rspamd_map *map;
 	rspamd_cryptobox_fast_hash_state_t hst;
+	/* Shared immutable storage, used instead of htb if not NULL */
+	struct cdb *cdb;
+	/* Compact immutable storage, used instead of htb if not NULL */
+	struct rspamd_map_compact_hash *compact;
+	gsize nelts;
+	guint64 digest;
+	/* Number of replaced or removed elements still allocated in the pool */
+	gsize garbage;
 };
 
 struct rspamd_cdb_map_helper {
@@ -72,6 +101,28 @@ struct rspamd_cdb_map_helper {
 	gsize total_size;
 };
 
+#ifdef WITH_HYPERSCAN
+/* How a specific pattern of regexp map is matched */
+enum rspamd_regexp_map_hs_mode {
+	RSPAMD_RE_MAP_HS_EXACT = 0, /* Hyperscan match is final */
+	RSPAMD_RE_MAP_HS_PREFILTER, /* Hyperscan match is confirmed by PCRE */
+	RSPAMD_RE_MAP_HS_NONE, /* Pattern is always matched by PCRE */
+};
+
+#define RSPAMD_RE_MAP_CACHE_MAGIC "rsremap1"
+
+/*
+ * Cached hyperscan data: header, modes of all patterns and then the
+ * serialized database
+ */
+struct rspamd_re_map_cache_header {
+	gchar magic[8];
+	guint32 npatterns;
+	guint32 unused;
+	guint64 db_len;
+};
+#endif
+
 struct rspamd_regexp_map_helper {
 	rspamd_cryptobox_hash_state_t hst;
 	guchar re_digest[rspamd_cryptobox_HASHBYTES];
@@ -86,7 +137,9 @@ struct rspamd_regexp_map_helper {
 	hs_scratch_t *hs_scratch;
 	gchar **patterns;
 	gint *flags;
-	gint *ids;
+	guchar *hs_modes;
+	guint *pcre_ids; /* Patterns that are not compiled to hyperscan */
+	guint npcre;
 #endif
 };
 
@@ -108,6 +161,27 @@ struct rspamd_regexp_map_helper {
 	stripped_value = g_strstrip (value); \
 } while (0)
 
+/*
+ * Parser can be called outside of the event loop, so errors are collected
+ * to be logged later in this case
+ */
+#define MAP_PARSE_ERR(...) do { \
+	if (data->errors) { \
+		gchar errbuf[128]; \
+		rspamd_snprintf (errbuf, sizeof (errbuf), __VA_ARGS__); \
+		g_ptr_array_add (data->errors, g_strdup (errbuf)); \
+	} \
+	else { \
+		msg_err_map (__VA_ARGS__); \
+	} \
+} while (0)
+
+#define MAP_PARSE_DEBUG(...) do { \
+	if (data->errors == NULL) { \
+		msg_debug_map (__VA_ARGS__); \
+	} \
+} while (0)
+
 gchar *
 rspamd_parse_kv_list (
 		gchar * chunk,
@@ -172,7 +246,7 @@ rspamd_parse_kv_list (
 					/* Store a single key */
 					MAP_STORE_KEY;
 					func (data->cur_data, stripped_key, default_value);
-					msg_debug_map ("insert key only pair: %s -> %s; line: %d",
+					MAP_PARSE_DEBUG ("insert key only pair: %s -> %s; line: %d",
 							stripped_key, default_value, line_number);
 					g_free (key);
 				}
@@ -185,7 +259,7 @@ rspamd_parse_kv_list (
 					/* Store a single key */
 					MAP_STORE_KEY;
 					func (data->cur_data, stripped_key, default_value);
-					msg_debug_map ("insert key only pair: %s -> %s; line: %d",
+					MAP_PARSE_DEBUG ("insert key only pair: %s -> %s; line: %d",
 							stripped_key, default_value, line_number);
 					g_free (key);
 				}
@@ -199,7 +273,7 @@ rspamd_parse_kv_list (
 					data->state = map_skip_spaces_after_key;
 				}
 				else {
-					msg_err_map ("empty or invalid key found on line %d", line_number);
+					MAP_PARSE_ERR ("empty or invalid key found on line %d", line_number);
 					data->state = map_skip_comment;
 				}
 			}
@@ -255,7 +329,7 @@ rspamd_parse_kv_list (
 					/* Store a single key */
 					MAP_STORE_KEY;
 					func (data->cur_data, stripped_key, default_value);
-					msg_debug_map ("insert key only pair: %s -> %s; line: %d",
+					MAP_PARSE_DEBUG ("insert key only pair: %s -> %s; line: %d",
 							stripped_key, default_value, line_number);
 					g_free (key);
 					key = NULL;
@@ -269,7 +343,7 @@ rspamd_parse_kv_list (
 					MAP_STORE_KEY;
 					func (data->cur_data, stripped_key, default_value);
 
-					msg_debug_map ("insert key only pair: %s -> %s; line: %d",
+					MAP_PARSE_DEBUG ("insert key only pair: %s -> %s; line: %d",
 							stripped_key, default_value, line_number);
 					g_free (key);
 					key = NULL;
@@ -284,7 +358,7 @@ rspamd_parse_kv_list (
 					data->state = map_skip_spaces_after_key;
 				}
 				else {
-					msg_err_map ("empty or invalid key found on line %d", line_number);
+					MAP_PARSE_ERR ("empty or invalid key found on line %d", line_number);
 					data->state = map_skip_comment;
 				}
 			}
@@ -312,7 +386,7 @@ rspamd_parse_kv_list (
 		case map_read_value:
 			if (key == NULL) {
 				/* Ignore line */
-				msg_err_map ("empty or invalid key found on line %d", line_number);
+				MAP_PARSE_ERR ("empty or invalid key found on line %d", line_number);
 				data->state = map_skip_comment;
 			}
 			else {
@@ -321,7 +395,7 @@ rspamd_parse_kv_list (
 						/* Store a single key */
 						MAP_STORE_VALUE;
 						func (data->cur_data, stripped_key, stripped_value);
-						msg_debug_map ("insert key value pair: %s -> %s; line: %d",
+						MAP_PARSE_DEBUG ("insert key value pair: %s -> %s; line: %d",
 								stripped_key, stripped_value, line_number);
 						g_free (key);
 						g_free (value);
@@ -329,7 +403,7 @@ rspamd_parse_kv_list (
 						value = NULL;
 					} else {
 						func (data->cur_data, stripped_key, default_value);
-						msg_debug_map ("insert key only pair: %s -> %s; line: %d",
+						MAP_PARSE_DEBUG ("insert key only pair: %s -> %s; line: %d",
 								stripped_key, default_value, line_number);
 						g_free (key);
 						key = NULL;
@@ -341,7 +415,7 @@ rspamd_parse_kv_list (
 						/* Store a single key */
 						MAP_STORE_VALUE;
 						func (data->cur_data, stripped_key, stripped_value);
-						msg_debug_map ("insert key value pair: %s -> %s",
+						MAP_PARSE_DEBUG ("insert key value pair: %s -> %s",
 								stripped_key, stripped_value);
 						g_free (key);
 						g_free (value);
@@ -349,7 +423,7 @@ rspamd_parse_kv_list (
 						value = NULL;
 					} else {
 						func (data->cur_data, stripped_key, default_value);
-						msg_debug_map ("insert key only pair: %s -> %s",
+						MAP_PARSE_DEBUG ("insert key only pair: %s -> %s",
 								stripped_key, default_value);
 						g_free (key);
 						key = NULL;
@@ -409,7 +483,7 @@ rspamd_parse_kv_list (
 				/* Store a single key */
 				MAP_STORE_KEY;
 				func (data->cur_data, stripped_key, default_value);
-				msg_debug_map ("insert key only pair: %s -> %s",
+				MAP_PARSE_DEBUG ("insert key only pair: %s -> %s",
 						stripped_key, default_value);
 				g_free (key);
 				key = NULL;
@@ -418,7 +492,7 @@ rspamd_parse_kv_list (
 		case map_read_value:
 			if (key == NULL) {
 				/* Ignore line */
-				msg_err_map ("empty or invalid key found on line %d", line_number);
+				MAP_PARSE_ERR ("empty or invalid key found on line %d", line_number);
 				data->state = map_skip_comment;
 			}
 			else {
@@ -426,7 +500,7 @@ rspamd_parse_kv_list (
 					/* Store a single key */
 					MAP_STORE_VALUE;
 					func (data->cur_data, stripped_key, stripped_value);
-					msg_debug_map ("insert key value pair: %s -> %s",
+					MAP_PARSE_DEBUG ("insert key value pair: %s -> %s",
 							stripped_key, stripped_value);
 					g_free (key);
 					g_free (value);
@@ -434,7 +508,7 @@ rspamd_parse_kv_list (
 					value = NULL;
 				} else {
 					func (data->cur_data, stripped_key, default_value);
-					msg_debug_map ("insert key only pair: %s -> %s",
+					MAP_PARSE_DEBUG ("insert key only pair: %s -> %s",
 							stripped_key, default_value);
 					g_free (key);
 					key = NULL;
@@ -726,6 +800,172 @@ rspamd_map_helper_traverse_regexp (void *data,
 	});
 }
 
+static inline guint64
+rspamd_map_compact_fp (const gchar *key, gsize len)
+{
+	guint64 fp = rspamd_icase_hash (key, len, map_hash_seed);
+
+	return fp != 0 ? fp : 1;
+}
+
+static void
+rspamd_map_compact_insert (struct rspamd_map_compact_hash *ch,
+		guint64 fp, guint64 off)
+{
+	struct rspamd_map_compact_slot *slot, tmp;
+	guint64 idx = fp & ch->mask, dist = 0, slot_dist;
+
+	for (;;) {
+		slot = &ch->slots[idx];
+
+		if (slot->fp == 0) {
+			slot->fp = fp;
+			slot->off = off;
+
+			return;
+		}
+
+		slot_dist = (idx - (slot->fp & ch->mask)) & ch->mask;
+
+		if (slot_dist < dist) {
+			/* Take the slot from the element that is closer to its bucket */
+			tmp = *slot;
+			slot->fp = fp;
+			slot->off = off;
+			fp = tmp.fp;
+			off = tmp.off;
+			dist = slot_dist;
+		}
+
+		idx = (idx + 1) & ch->mask;
+		dist ++;
+	}
+}
+
+static const gchar *
+rspamd_map_compact_lookup_fp (const struct rspamd_map_compact_hash *ch,
+		const gchar *in, gsize len, guint64 fp)
+{
+	const struct rspamd_map_compact_slot *slot;
+	const gchar *entry;
+	guint64 idx, dist = 0;
+	guint32 klen;
+
+	idx = fp & ch->mask;
+
+	for (;;) {
+		slot = &ch->slots[idx];
+
+		if (slot->fp == 0 || ((idx - (slot->fp & ch->mask)) & ch->mask) < dist) {
+			/* Robin hood invariant: our element cannot be further */
+			return NULL;
+		}
+
+		if (slot->fp == fp) {
+			entry = ch->arena + slot->off;
+			memcpy (&klen, entry, sizeof (klen));
+
+			if (klen == len &&
+				rspamd_lc_cmp (entry + RSPAMD_MAP_COMPACT_HDR, in, len) == 0) {
+				return entry + RSPAMD_MAP_COMPACT_HDR + klen + 1;
+			}
+		}
+
+		idx = (idx + 1) & ch->mask;
+		dist ++;
+	}
+}
+
+static inline const gchar *
+rspamd_map_compact_lookup (const struct rspamd_map_compact_hash *ch,
+		const gchar *in, gsize len)
+{
+	return rspamd_map_compact_lookup_fp (ch, in, len,
+			rspamd_map_compact_fp (in, len));
+}
+
+/*
+ * Iterates over arena entries, returns FALSE when there are no more entries
+ */
+static gboolean
+rspamd_map_compact_next (const struct rspamd_map_compact_hash *ch,
+		gsize *off, const gchar **key, guint32 *klen,
+		const gchar **value, guint32 *vlen)
+{
+	const gchar *entry;
+
+	if (*off >= ch->arena_len) {
+		return FALSE;
+	}
+
+	entry = ch->arena + *off;
+	memcpy (klen, entry, sizeof (*klen));
+	memcpy (vlen, entry + sizeof (*klen), sizeof (*vlen));
+	*key = entry + RSPAMD_MAP_COMPACT_HDR;
+	*value = *key + *klen + 1;
+	*off += RSPAMD_MAP_COMPACT_HDR + *klen + *vlen + 2;
+
+	return TRUE;
+}
+
+static struct rspamd_map_compact_hash *
+rspamd_map_compact_build (khash_t(rspamd_map_hash) *htb)
+{
+	struct rspamd_map_compact_hash *ch;
+	struct rspamd_map_helper_value *val;
+	rspamd_ftok_t tok;
+	gsize arena_len = 0, nslots = 2, off = 0;
+	guint32 klen, vlen;
+	gchar *entry;
+
+	kh_foreach (htb, tok, val, {
+		arena_len += RSPAMD_MAP_COMPACT_HDR + tok.len + strlen (val->value) + 2;
+	});
+
+	/* Load factor is at most 0.8 */
+	while (nslots < kh_size (htb) + kh_size (htb) / 4 + 1) {
+		nslots <<= 1;
+	}
+
+	ch = g_malloc0 (sizeof (*ch));
+	ch->slots = g_malloc0 (nslots * sizeof (*ch->slots));
+	ch->mask = nslots - 1;
+	ch->arena = g_malloc (MAX (arena_len, 1));
+	ch->arena_len = arena_len;
+
+	kh_foreach (htb, tok, val, {
+		entry = ch->arena + off;
+		klen = tok.len;
+		vlen = strlen (val->value);
+		memcpy (entry, &klen, sizeof (klen));
+		memcpy (entry + sizeof (klen), &vlen, sizeof (vlen));
+		entry += RSPAMD_MAP_COMPACT_HDR;
+		rspamd_str_copy_lc (tok.begin, entry, klen);
+		entry[klen] = '\0';
+		memcpy (entry + klen + 1, val->value, vlen + 1);
+
+		rspamd_map_compact_insert (ch, rspamd_map_compact_fp (tok.begin, klen),
+				off);
+		off += RSPAMD_MAP_COMPACT_HDR + klen + vlen + 2;
+	});
+
+	return ch;
+}
+
+static void
+rspamd_map_compact_destroy (struct rspamd_map_compact_hash *ch)
+{
+	g_free (ch->slots);
+	g_free (ch->arena);
+	g_free (ch);
+}
+
+static gsize
+rspamd_map_compact_size (const struct rspamd_map_compact_hash *ch)
+{
+	return ch->arena_len + (ch->mask + 1) * sizeof (*ch->slots);
+}
+
 struct rspamd_hash_map_helper *
 rspamd_map_helper_new_hash (struct rspamd_map *map)
 {
@@ -757,12 +997,173 @@ rspamd_map_helper_destroy_hash (struct rspamd_hash_map_helper *r)
 		return;
 	}
 
+	if (r->cdb) {
+		cdb_free (r->cdb);
+		close (r->cdb->cdb_fd);
+		g_free (r->cdb);
+	}
+
+	if (r->compact) {
+		rspamd_map_compact_destroy (r->compact);
+	}
+
 	rspamd_mempool_t *pool = r->pool;
 	kh_destroy (rspamd_map_hash, r->htb);
 	memset (r, 0, sizeof (*r));
 	rspamd_mempool_delete (pool);
 }
 
+/*
+ * Replaces hash map helper with a new one that uses compact storage
+ */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_compact_hash (struct rspamd_hash_map_helper *r)
+{
+	struct rspamd_hash_map_helper *nr;
+
+	nr = rspamd_map_helper_new_hash (r->map);
+
+	if (r->compact) {
+		/* Already built in a separate thread */
+		nr->compact = r->compact;
+		r->compact = NULL;
+	}
+	else {
+		nr->compact = rspamd_map_compact_build (r->htb);
+	}
+
+	nr->nelts = kh_size (r->htb);
+	nr->digest = rspamd_cryptobox_fast_hash_final (&r->hst);
+	rspamd_map_helper_destroy_hash (r);
+
+	return nr;
+}
+
+gboolean
+rspamd_map_helper_export_hash (gpointer data, gint fd)
+{
+	struct rspamd_hash_map_helper *ht = data;
+	struct rspamd_map_helper_value *val;
+	struct cdb_make cdbm;
+	rspamd_ftok_t tok;
+	gchar *kbuf = NULL;
+	gsize kbuflen = 0;
+	gboolean ret = TRUE;
+
+	if (ht->cdb != NULL) {
+		/* Attached data cannot be exported again */
+		return FALSE;
+	}
+
+	cdb_make_start (&cdbm, fd);
+
+	if (ht->compact) {
+		const gchar *key, *value;
+		guint32 klen, vlen;
+		gsize off = 0;
+
+		/* Keys are already lowercased */
+		while (rspamd_map_compact_next (ht->compact, &off, &key, &klen,
+				&value, &vlen)) {
+			if (cdb_make_add (&cdbm, key, klen, value, vlen + 1) == -1) {
+				ret = FALSE;
+				break;
+			}
+		}
+
+		if (cdb_make_finish (&cdbm) == -1) {
+			ret = FALSE;
+		}
+
+		return ret;
+	}
+
+	kh_foreach (ht->htb, tok, val, {
+		if (tok.len > kbuflen) {
+			kbuflen = MAX (tok.len, kbuflen * 2);
+			kbuf = g_realloc (kbuf, kbuflen);
+		}
+
+		/*
+		 * Keys are stored lowercased as cdb lookup is case sensitive,
+		 * values are stored with the trailing zero to be returned as is
+		 */
+		rspamd_str_copy_lc (tok.begin, kbuf, tok.len);
+
+		if (cdb_make_add (&cdbm, kbuf, tok.len, val->value,
+				strlen (val->value) + 1) == -1) {
+			ret = FALSE;
+			break;
+		}
+	});
+
+	if (cdb_make_finish (&cdbm) == -1) {
+		ret = FALSE;
+	}
+
+	g_free (kbuf);
+
+	return ret;
+}
+
+gpointer
+rspamd_map_helper_attach_hash (struct rspamd_map *map, gint fd,
+		gsize nelts, guint64 digest)
+{
+	struct rspamd_hash_map_helper *htb;
+	struct cdb *cdb;
+
+	cdb = g_malloc0 (sizeof (*cdb));
+
+	if (cdb_init (cdb, fd) == -1) {
+		msg_err_map ("cannot attach shared storage for map %s: %s",
+				map->name, strerror (errno));
+		g_free (cdb);
+
+		return NULL;
+	}
+
+	htb = rspamd_map_helper_new_hash (map);
+	htb->cdb = cdb;
+	htb->nelts = nelts;
+	htb->digest = digest;
+
+	return htb;
+}
+
+static void
+rspamd_map_helper_traverse_hash_shared (struct rspamd_hash_map_helper *ht,
+		rspamd_map_traverse_cb cb,
+		gpointer cbdata)
+{
+	struct cdb *cdb = ht->cdb;
+	gchar *kbuf = NULL;
+	gsize kbuflen = 0;
+	guint pos, klen;
+
+	cdb_seqinit (&pos, cdb);
+
+	while (cdb_seqnext (&pos, cdb) > 0) {
+		klen = cdb_keylen (cdb);
+
+		if (klen >= kbuflen) {
+			kbuflen = MAX (klen + 1, kbuflen * 2);
+			kbuf = g_realloc (kbuf, kbuflen);
+		}
+
+		/* Keys are not zero terminated in cdb */
+		memcpy (kbuf, cdb->cdb_mem + cdb_keypos (cdb), klen);
+		kbuf[klen] = '\0';
+
+		/* Hits are not tracked for the read-only storage */
+		if (!cb (kbuf, cdb->cdb_mem + cdb_datapos (cdb), 0, cbdata)) {
+			break;
+		}
+	}
+
+	g_free (kbuf);
+}
+
 static void
 rspamd_map_helper_traverse_hash (void *data,
 		rspamd_map_traverse_cb cb,
@@ -773,6 +1174,28 @@ rspamd_map_helper_traverse_hash (void *data,
 	struct rspamd_map_helper_value *val;
 	struct rspamd_hash_map_helper *ht = data;
 
+	if (ht->cdb) {
+		rspamd_map_helper_traverse_hash_shared (ht, cb, cbdata);
+
+		return;
+	}
+
+	if (ht->compact) {
+		const gchar *key, *value;
+		guint32 klen, vlen;
+		gsize off = 0;
+
+		/* Hits are not tracked for the compact storage */
+		while (rspamd_map_compact_next (ht->compact, &off, &key, &klen,
+				&value, &vlen)) {
+			if (!cb (key, value, 0, cbdata)) {
+				break;
+			}
+		}
+
+		return;
+	}
+
 	kh_foreach (ht->htb, tok, val, {
 		if (!cb (tok.begin, val->value, val->hits, cbdata)) {
 			break;
@@ -895,8 +1318,11 @@ rspamd_map_helper_destroy_regexp (struct rspamd_regexp_map_helper *re_map)
 	if (re_map->flags) {
 		g_free (re_map->flags);
 	}
-	if (re_map->ids) {
-		g_free (re_map->ids);
+	if (re_map->hs_modes) {
+		g_free (re_map->hs_modes);
+	}
+	if (re_map->pcre_ids) {
+		g_free (re_map->pcre_ids);
 	}
 #endif
 
@@ -934,6 +1360,60 @@ rspamd_kv_list_read (
 			final);
 }
 
+/*
+ * Stores a parsed pair to be inserted later, does not use memory pools, so it
+ * is safe to be used outside of the event loop
+ */
+static void
+rspamd_map_helper_insert_pair (gpointer st, gconstpointer key, gconstpointer value)
+{
+	GPtrArray *pairs = (GPtrArray *)st;
+
+	g_ptr_array_add (pairs, g_strdup (key));
+	g_ptr_array_add (pairs, g_strdup (value));
+}
+
+static void
+rspamd_map_helper_insert_pairs (gpointer st, GPtrArray *pairs,
+		rspamd_map_insert_func func)
+{
+	guint i;
+
+	for (i = 0; i + 1 < pairs->len; i += 2) {
+		func (st, g_ptr_array_index (pairs, i),
+				g_ptr_array_index (pairs, i + 1));
+	}
+}
+
+gchar *
+rspamd_kv_list_parse (
+		gchar * chunk,
+		gint len,
+		struct map_cb_data *data,
+		gboolean final)
+{
+	g_assert (data->cur_data != NULL);
+
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			rspamd_map_helper_insert_pair,
+			"",
+			final);
+}
+
+void
+rspamd_kv_list_insert (struct map_cb_data *data, GPtrArray *pairs)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_map_helper_new_hash (data->map);
+	}
+
+	rspamd_map_helper_insert_pairs (data->cur_data, pairs,
+			rspamd_map_helper_insert_hash);
+}
+
 void
 rspamd_kv_list_fin (struct map_cb_data *data, void **target)
 {
@@ -942,11 +1422,33 @@ rspamd_kv_list_fin (struct map_cb_data *data, void **target)
 
 	if (data->cur_data) {
 		htb = (struct rspamd_hash_map_helper *)data->cur_data;
-		msg_info_map ("read hash of %d elements from %s", kh_size (htb->htb),
-				map->name);
+
+		if (htb->cdb) {
+			msg_info_map ("attached shared hash of %z elements from %s",
+					htb->nelts, map->name);
+			data->map->nelts = htb->nelts;
+			data->map->digest = htb->digest;
+		}
+		else if (htb->compact || (map->cfg->map_compact_threshold > 0 &&
+				kh_size (htb->htb) >= map->cfg->map_compact_threshold)) {
+			htb = rspamd_map_helper_compact_hash (htb);
+			data->cur_data = htb;
+			msg_info_map ("read hash of %z elements from %s, "
+					"use compact storage of %z bytes",
+					htb->nelts, map->name, rspamd_map_compact_size (htb->compact));
+			data->map->nelts = htb->nelts;
+			data->map->digest = htb->digest;
+		}
+		else {
+			msg_info_map ("read hash of %d elements from %s", kh_size (htb->htb),
+					map->name);
+			data->map->nelts = kh_size (htb->htb);
+			/* Hash state can be updated further by deltas */
+			rspamd_cryptobox_fast_hash_state_t st = htb->hst;
+			data->map->digest = rspamd_cryptobox_fast_hash_final (&st);
+		}
+
 		data->map->traverse_function = rspamd_map_helper_traverse_hash;
-		data->map->nelts = kh_size (htb->htb);
-		data->map->digest = rspamd_cryptobox_fast_hash_final (&htb->hst);
 	}
 
 	if (target) {
@@ -959,6 +1461,191 @@ rspamd_kv_list_fin (struct map_cb_data *data, void **target)
 	}
 }
 
+void
+rspamd_kv_list_build (struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *htb;
+
+	if (data->cur_data) {
+		htb = (struct rspamd_hash_map_helper *)data->cur_data;
+
+		/* Compact storage does not use memory pool, so it can be built here */
+		if (htb->cdb == NULL && htb->compact == NULL &&
+				map->cfg->map_compact_threshold > 0 &&
+				kh_size (htb->htb) >= map->cfg->map_compact_threshold) {
+			htb->compact = rspamd_map_compact_build (htb->htb);
+		}
+	}
+}
+
+/* Hash is rebuilt after deltas if it has more garbage than this */
+static const gsize map_delta_garbage_min = 1024;
+
+/*
+ * Copies live elements of a hash modified by deltas to a new pool, hits
+ * and hash state are preserved
+ */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_rebuild_hash (struct rspamd_hash_map_helper *r)
+{
+	struct rspamd_hash_map_helper *nr;
+	struct rspamd_map_helper_value *val, *nval;
+	rspamd_ftok_t tok;
+	gsize vlen;
+	khiter_t k;
+	gint ret;
+
+	nr = rspamd_map_helper_new_hash (r->map);
+	kh_resize (rspamd_map_hash, nr->htb, kh_size (r->htb));
+
+	kh_foreach (r->htb, tok, val, {
+		vlen = strlen (val->value);
+		nval = rspamd_mempool_alloc0 (nr->pool, sizeof (*nval) + vlen + 1);
+		memcpy (nval->value, val->value, vlen);
+		nval->hits = val->hits;
+		tok.begin = rspamd_mempool_strdup (nr->pool, tok.begin);
+		nval->key = tok.begin;
+		k = kh_put (rspamd_map_hash, nr->htb, tok, &ret);
+		kh_value (nr->htb, k) = nval;
+	});
+
+	nr->hst = r->hst;
+
+	return nr;
+}
+
+gboolean
+rspamd_kv_list_delta (const gchar *delta, gsize len, struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *htb;
+	struct rspamd_map_helper_value *val;
+	const gchar *p, *end, *eol, *key, *value;
+	gsize klen, vlen;
+	guint nadd = 0, ndel = 0;
+	gchar *buf = NULL;
+	gsize buflen = 0;
+	rspamd_ftok_t tok;
+	khiter_t k;
+
+	htb = (struct rspamd_hash_map_helper *)data->cur_data;
+
+	/* Immutable storages cannot be modified */
+	if (htb == NULL || htb->cdb != NULL || htb->compact != NULL) {
+		return FALSE;
+	}
+
+	if (delta == NULL) {
+		return TRUE;
+	}
+
+	p = delta;
+	end = delta + len;
+
+	while (p < end) {
+		eol = memchr (p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		while (p < eol && g_ascii_isspace (*p)) {
+			p ++;
+		}
+
+		if (p == eol || *p == '#') {
+			p = eol + 1;
+			continue;
+		}
+
+		if (*p != '+' && *p != '-') {
+			msg_err_map ("%s: invalid delta line, '+' or '-' expected: %*s",
+					map->name, (gint)(eol - p), p);
+
+			g_free (buf);
+
+			return FALSE;
+		}
+
+		key = p + 1;
+		klen = rspamd_memcspn (key, " \t\r", eol - key);
+		value = key + klen;
+
+		while (value < eol && g_ascii_isspace (*value)) {
+			value ++;
+		}
+
+		/* Comments are stripped from values like in full maps */
+		vlen = rspamd_memcspn (value, "#", eol - value);
+
+		while (vlen > 0 && g_ascii_isspace (value[vlen - 1])) {
+			vlen --;
+		}
+
+		if (klen == 0) {
+			p = eol + 1;
+			continue;
+		}
+
+		if (klen + vlen + 2 > buflen) {
+			buflen = MAX (klen + vlen + 2, buflen * 2);
+			buf = g_realloc (buf, buflen);
+		}
+
+		/* Both key and value must be zero terminated */
+		memcpy (buf, key, klen);
+		buf[klen] = '\0';
+		memcpy (buf + klen + 1, value, vlen);
+		buf[klen + vlen + 1] = '\0';
+		tok.begin = buf;
+		tok.len = klen;
+		k = kh_get (rspamd_map_hash, htb->htb, tok);
+
+		if (*p == '+') {
+			if (k != kh_end (htb->htb)) {
+				/* Replace value, old one is released when hash is rebuilt */
+				val = rspamd_mempool_alloc0 (htb->pool, sizeof (*val) + vlen + 1);
+				memcpy (val->value, value, vlen);
+				val->key = kh_key (htb->htb, k).begin;
+				kh_value (htb->htb, k) = val;
+				rspamd_cryptobox_fast_hash_update (&htb->hst, buf, klen);
+				htb->garbage ++;
+			}
+			else {
+				rspamd_map_helper_insert_hash (htb, buf, buf + klen + 1);
+			}
+
+			nadd ++;
+		}
+		else if (k != kh_end (htb->htb)) {
+			/* Key memory is released when hash is rebuilt */
+			kh_del (rspamd_map_hash, htb->htb, k);
+			rspamd_cryptobox_fast_hash_update (&htb->hst, buf, klen);
+			htb->garbage ++;
+			ndel ++;
+		}
+
+		p = eol + 1;
+	}
+
+	g_free (buf);
+	msg_info_map ("applied delta to %s: %ud keys added or updated, "
+			"%ud keys removed", map->name, nadd, ndel);
+
+	if (htb->garbage > map_delta_garbage_min &&
+			htb->garbage > kh_size (htb->htb)) {
+		/* Pool memory cannot be released by elements, so copy live ones */
+		msg_info_map ("rebuild %s after deltas: %z elements, %z garbage",
+				map->name, (gsize)kh_size (htb->htb), htb->garbage);
+		data->cur_data = rspamd_map_helper_rebuild_hash (htb);
+		/* Old data is destroyed by fin callback */
+		data->prev_data = htb;
+	}
+
+	return TRUE;
+}
+
 void
 rspamd_kv_list_dtor (struct map_cb_data *data)
 {
@@ -994,6 +1681,35 @@ rspamd_radix_read (
 			final);
 }
 
+gchar *
+rspamd_radix_parse (
+		gchar * chunk,
+		gint len,
+		struct map_cb_data *data,
+		gboolean final)
+{
+	g_assert (data->cur_data != NULL);
+
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			rspamd_map_helper_insert_pair,
+			hash_fill,
+			final);
+}
+
+void
+rspamd_radix_insert (struct map_cb_data *data, GPtrArray *pairs)
+{
+	if (data->cur_data == NULL) {
+		data->cur_data = rspamd_map_helper_new_radix (data->map);
+	}
+
+	rspamd_map_helper_insert_pairs (data->cur_data, pairs,
+			rspamd_map_helper_insert_radix);
+}
+
 void
 rspamd_radix_fin (struct map_cb_data *data, void **target)
 {
@@ -1002,6 +1718,7 @@ rspamd_radix_fin (struct map_cb_data *data, void **target)
 
 	if (data->cur_data) {
 		r = (struct rspamd_radix_map_helper *)data->cur_data;
+		radix_build_flat_compressed (r->trie);
 		msg_info_map ("read radix trie of %z elements: %s",
 				radix_get_size (r->trie), radix_get_info (r->trie));
 		data->map->traverse_function = rspamd_map_helper_traverse_radix;
@@ -1131,6 +1848,20 @@ rspamd_re_map_cache_update (const gchar *fname, struct rspamd_config *cfg)
 	g_hash_table_insert (valid_re_hashes, g_path_get_basename (fname), "1");
 }
 
+static void
+rspamd_re_map_set_pcre_ids (struct rspamd_regexp_map_helper *re_map)
+{
+	guint i;
+
+	re_map->npcre = 0;
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		if (re_map->hs_modes[i] == RSPAMD_RE_MAP_HS_NONE) {
+			re_map->pcre_ids[re_map->npcre ++] = i;
+		}
+	}
+}
+
 static gboolean
 rspamd_try_load_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 {
@@ -1138,6 +1869,9 @@ rspamd_try_load_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 	gpointer data;
 	gsize len;
 	struct rspamd_map *map;
+	struct rspamd_re_map_cache_header hdr;
+	const guchar *modes;
+	guint i;
 
 	map = re_map->map;
 
@@ -1150,14 +1884,31 @@ rspamd_try_load_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
 
 	if ((data = rspamd_file_xmap (fp, PROT_READ, &len, TRUE)) != NULL) {
-		if (hs_deserialize_database (data, len, &re_map->hs_db) == HS_SUCCESS) {
-			rspamd_re_map_cache_update (fp, map->cfg);
-			munmap (data, len);
+		if (len >= sizeof (hdr)) {
+			memcpy (&hdr, data, sizeof (hdr));
+			modes = ((const guchar *)data) + sizeof (hdr);
+
+			if (memcmp (hdr.magic, RSPAMD_RE_MAP_CACHE_MAGIC,
+					sizeof (hdr.magic)) == 0 &&
+					hdr.npatterns == re_map->regexps->len &&
+					len == sizeof (hdr) + hdr.npatterns + hdr.db_len &&
+					(hdr.db_len == 0 ||
+					 hs_deserialize_database ((const gchar *)modes + hdr.npatterns,
+							hdr.db_len, &re_map->hs_db) == HS_SUCCESS)) {
+
+				for (i = 0; i < hdr.npatterns; i ++) {
+					re_map->hs_modes[i] = MIN (modes[i], RSPAMD_RE_MAP_HS_NONE);
+				}
+
+				rspamd_re_map_set_pcre_ids (re_map);
+				rspamd_re_map_cache_update (fp, map->cfg);
+				munmap (data, len);
 
-			msg_info_map ("loaded hypersan cache from %s (%Hz length) for %s",
-					fp, len, map->name);
+				msg_info_map ("loaded hypersan cache from %s (%Hz length) for %s",
+						fp, len, map->name);
 
-			return TRUE;
+				return TRUE;
+			}
 		}
 
 		msg_info_map ("invalid hypersan cache in %s (%Hz length) for %s, removing file",
@@ -1174,10 +1925,11 @@ static gboolean
 rspamd_try_save_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 {
 	gchar fp[PATH_MAX], np[PATH_MAX];
-	gsize len;
+	gsize len = 0;
 	gint fd;
 	char *bytes = NULL;
 	struct rspamd_map *map;
+	struct rspamd_re_map_cache_header hdr;
 
 	map = re_map->map;
 
@@ -1190,15 +1942,29 @@ rspamd_try_save_re_map_cache (struct rspamd_regexp_map_helper *re_map)
 			(gint)rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
 
 	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) != -1) {
-		if (hs_serialize_database (re_map->hs_db, &bytes, &len) == HS_SUCCESS) {
-			if (write (fd, bytes, len) == -1) {
+		if (re_map->hs_db == NULL ||
+				hs_serialize_database (re_map->hs_db, &bytes, &len) == HS_SUCCESS) {
+			memset (&hdr, 0, sizeof (hdr));
+			memcpy (hdr.magic, RSPAMD_RE_MAP_CACHE_MAGIC, sizeof (hdr.magic));
+			hdr.npatterns = re_map->regexps->len;
+			hdr.db_len = len;
+
+			if (write (fd, &hdr, sizeof (hdr)) == -1 ||
+					write (fd, re_map->hs_modes, hdr.npatterns) == -1 ||
+					(len > 0 && write (fd, bytes, len) == -1)) {
 				msg_warn_map ("cannot write hyperscan cache to %s: %s",
 						fp, strerror (errno));
 				unlink (fp);
-				free (bytes);
+
+				if (bytes) {
+					free (bytes);
+				}
 			}
 			else {
-				free (bytes);
+				if (bytes) {
+					free (bytes);
+				}
+
 				fsync (fd);
 
 				rspamd_snprintf (np, sizeof (np), "%s/%*xs.hsmc",
@@ -1269,13 +2035,120 @@ rspamd_re_map_cache_cleanup_old (struct rspamd_regexp_map_helper *old_re_map)
 
 #endif
 
+#ifdef WITH_HYPERSCAN
+/*
+ * Compiles all patterns that hyperscan can take: patterns that it cannot
+ * compile exactly are used as prefilters confirmed by PCRE and those that
+ * cannot be used even as prefilters are matched by PCRE only
+ */
+static gboolean
+rspamd_re_map_compile_hs (struct rspamd_regexp_map_helper *re_map,
+		hs_platform_info_t *plt)
+{
+	struct rspamd_map *map = re_map->map;
+	hs_compile_error_t *err;
+	hs_expr_info_t *info;
+	const gchar **pats;
+	gint *flags, *ids;
+	guint i, n, idx;
+	gboolean ret = TRUE;
+
+	pats = g_new (const gchar *, re_map->regexps->len);
+	flags = g_new (gint, re_map->regexps->len);
+	ids = g_new (gint, re_map->regexps->len);
+
+	/* Cheap check that finds unsupported constructions (e.g. backreferences) */
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		if (hs_expression_info (re_map->patterns[i], re_map->flags[i],
+				&info, &err) != HS_SUCCESS) {
+			hs_free_compile_error (err);
+
+			if (hs_expression_info (re_map->patterns[i],
+					re_map->flags[i] | HS_FLAG_PREFILTER, &info, &err) != HS_SUCCESS) {
+				hs_free_compile_error (err);
+				re_map->hs_modes[i] = RSPAMD_RE_MAP_HS_NONE;
+			}
+			else {
+				free (info);
+				re_map->hs_modes[i] = RSPAMD_RE_MAP_HS_PREFILTER;
+			}
+		}
+		else {
+			free (info);
+		}
+	}
+
+	for (;;) {
+		n = 0;
+
+		for (i = 0; i < re_map->regexps->len; i ++) {
+			if (re_map->hs_modes[i] == RSPAMD_RE_MAP_HS_NONE) {
+				continue;
+			}
+
+			pats[n] = re_map->patterns[i];
+			flags[n] = re_map->flags[i];
+
+			if (re_map->hs_modes[i] == RSPAMD_RE_MAP_HS_PREFILTER) {
+				flags[n] |= HS_FLAG_PREFILTER;
+			}
+
+			ids[n] = i;
+			n ++;
+		}
+
+		if (n == 0) {
+			/* Nothing to compile */
+			break;
+		}
+
+		if (hs_compile_multi (pats, flags, ids, n, HS_MODE_BLOCK,
+				plt, &re_map->hs_db, &err) == HS_SUCCESS) {
+			break;
+		}
+
+		re_map->hs_db = NULL;
+
+		if (err->expression < 0) {
+			msg_err_map ("cannot create tree of regexp for %s: %s",
+					map->name, err->message);
+			hs_free_compile_error (err);
+			ret = FALSE;
+
+			break;
+		}
+
+		/* Demote the failed pattern and try again */
+		idx = ids[err->expression];
+
+		if (re_map->hs_modes[idx] == RSPAMD_RE_MAP_HS_EXACT) {
+			msg_info_map ("cannot compile '%s' to hyperscan: %s, use it as "
+					"prefilter", re_map->patterns[idx], err->message);
+			re_map->hs_modes[idx] = RSPAMD_RE_MAP_HS_PREFILTER;
+		}
+		else {
+			msg_info_map ("cannot compile '%s' to hyperscan: %s, use pcre",
+					re_map->patterns[idx], err->message);
+			re_map->hs_modes[idx] = RSPAMD_RE_MAP_HS_NONE;
+		}
+
+		hs_free_compile_error (err);
+	}
+
+	g_free (pats);
+	g_free (flags);
+	g_free (ids);
+
+	return ret;
+}
+#endif
+
 static void
 rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 {
 #ifdef WITH_HYPERSCAN
 	guint i;
 	hs_platform_info_t plt;
-	hs_compile_error_t *err;
 	struct rspamd_map *map;
 	rspamd_regexp_t *re;
 	gint pcre_flags;
@@ -1296,8 +2169,10 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 	}
 
 	re_map->patterns = g_new (gchar *, re_map->regexps->len);
-	re_map->flags = g_new (gint, re_map->regexps->len);
-	re_map->ids = g_new (gint, re_map->regexps->len);
+	re_map->flags = g_new0 (gint, re_map->regexps->len);
+	re_map->hs_modes = g_new0 (guchar, re_map->regexps->len);
+	re_map->pcre_ids = g_new (guint, re_map->regexps->len);
+	re_map->npcre = 0;
 
 	for (i = 0; i < re_map->regexps->len; i ++) {
 		const gchar *pat;
@@ -1308,6 +2183,7 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 		pcre_flags = rspamd_regexp_get_pcre_flags (re);
 		pat = rspamd_regexp_get_pattern (re);
 		pat_flags = rspamd_regexp_get_flags (re);
+		re_map->flags[i] = HS_FLAG_SINGLEMATCH;
 
 		if (pat_flags & RSPAMD_REGEXP_FLAG_UTF) {
 			escaped = rspamd_str_regexp_escape (pat, strlen (pat), NULL,
@@ -1320,7 +2196,6 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 		}
 
 		re_map->patterns[i] = escaped;
-		re_map->flags[i] = HS_FLAG_SINGLEMATCH;
 
 #ifndef WITH_PCRE2
 		if (pcre_flags & PCRE_FLAG(UTF8)) {
@@ -1340,11 +2215,6 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 		if (pcre_flags & PCRE_FLAG(DOTALL)) {
 			re_map->flags[i] |= HS_FLAG_DOTALL;
 		}
-		if (rspamd_regexp_get_maxhits (re) == 1) {
-			re_map->flags[i] |= HS_FLAG_SINGLEMATCH;
-		}
-
-		re_map->ids[i] = i;
 	}
 
 	if (re_map->regexps->len > 0 && re_map->patterns) {
@@ -1352,28 +2222,21 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 		if (!rspamd_try_load_re_map_cache (re_map)) {
 			gdouble ts1 = rspamd_get_ticks (FALSE);
 
-			if (hs_compile_multi ((const gchar **) re_map->patterns,
-					re_map->flags,
-					re_map->ids,
-					re_map->regexps->len,
-					HS_MODE_BLOCK,
-					&plt,
-					&re_map->hs_db,
-					&err) != HS_SUCCESS) {
-
-				msg_err_map ("cannot create tree of regexp when processing '%s': %s",
-						err->expression >= 0 ?
-						re_map->patterns[err->expression] :
-						"unknown regexp", err->message);
-				re_map->hs_db = NULL;
-				hs_free_compile_error (err);
+			if (!rspamd_re_map_compile_hs (re_map, &plt)) {
+				/* Everything is matched by PCRE */
+				memset (re_map->hs_modes, RSPAMD_RE_MAP_HS_NONE,
+						re_map->regexps->len);
+				rspamd_re_map_set_pcre_ids (re_map);
 
 				return;
 			}
 
+			rspamd_re_map_set_pcre_ids (re_map);
 			ts1 = (rspamd_get_ticks (FALSE) - ts1) * 1000.0;
-			msg_info_map ("hyperscan compiled %d regular expressions from %s in %.1f ms",
-					re_map->regexps->len, re_map->map->name, ts1);
+			msg_info_map ("hyperscan compiled %d regular expressions from %s in %.1f ms, "
+					"%ud are matched by pcre only",
+					re_map->regexps->len - re_map->npcre, re_map->map->name, ts1,
+					re_map->npcre);
 			rspamd_try_save_re_map_cache (re_map);
 		}
 		else {
@@ -1381,7 +2244,8 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 					re_map->regexps->len, re_map->map->name);
 		}
 
-		if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
+		if (re_map->hs_db &&
+				hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
 			msg_err_map ("cannot allocate scratch space for hyperscan");
 			hs_free_database (re_map->hs_db);
 			re_map->hs_db = NULL;
@@ -1496,6 +2360,9 @@ rspamd_regexp_list_fin (struct map_cb_data *data, void **target)
 
 	if (data->cur_data) {
 		re_map = data->cur_data;
+		/* Glob and regexp maps with the same content must differ */
+		rspamd_cryptobox_hash_update (&re_map->hst,
+				(const guchar *)&re_map->map_flags, sizeof (re_map->map_flags));
 		rspamd_cryptobox_hash_final (&re_map->hst, re_map->re_digest);
 		memcpy (&data->map->digest, re_map->re_digest, sizeof (data->map->digest));
 		rspamd_re_map_finalize (re_map);
@@ -1532,17 +2399,51 @@ rspamd_regexp_list_dtor (struct map_cb_data *data)
 }
 
 #ifdef WITH_HYPERSCAN
+struct rspamd_re_map_match_cbdata {
+	struct rspamd_regexp_map_helper *map;
+	const gchar *in;
+	gsize len;
+	GPtrArray *ar; /* For multiple matches */
+	guint id; /* For a single match */
+	gboolean matched;
+};
+
+/* Confirms prefilter matches */
+static inline gboolean
+rspamd_re_map_hs_confirm (struct rspamd_re_map_match_cbdata *cbd, guint id)
+{
+	rspamd_regexp_t *re;
+
+	if (id >= cbd->map->regexps->len) {
+		return FALSE;
+	}
+
+	if (cbd->map->hs_modes[id] == RSPAMD_RE_MAP_HS_PREFILTER) {
+		re = g_ptr_array_index (cbd->map->regexps, id);
+
+		return rspamd_regexp_search (re, cbd->in, cbd->len, NULL, NULL,
+				FALSE, NULL);
+	}
+
+	return TRUE;
+}
+
 static int
 rspamd_match_hs_single_handler (unsigned int id, unsigned long long from,
 		unsigned long long to,
 		unsigned int flags, void *context)
 {
-	guint *i = context;
-	/* Always return non-zero as we need a single match here */
+	struct rspamd_re_map_match_cbdata *cbd = context;
 
-	*i = id;
+	if (rspamd_re_map_hs_confirm (cbd, id)) {
+		cbd->id = id;
+		cbd->matched = TRUE;
 
-	return 1;
+		/* Non-zero return value terminates scan as we need a single match */
+		return 1;
+	}
+
+	return 0;
 }
 #endif
 
@@ -1576,16 +2477,36 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map_helper *map,
 	if (map->hs_db && map->hs_scratch) {
 
 		if (validated) {
+			struct rspamd_re_map_match_cbdata cbd;
+
+			memset (&cbd, 0, sizeof (cbd));
+			cbd.map = map;
+			cbd.in = in;
+			cbd.len = len;
 
-			res = hs_scan (map->hs_db, in, len, 0, map->hs_scratch,
-					rspamd_match_hs_single_handler, (void *)&i);
+			hs_scan (map->hs_db, in, len, 0, map->hs_scratch,
+					rspamd_match_hs_single_handler, (void *)&cbd);
 
-			if (res == HS_SCAN_TERMINATED) {
-				res = 1;
-				val = g_ptr_array_index (map->values, i);
+			if (cbd.matched) {
+				val = g_ptr_array_index (map->values, cbd.id);
 
 				ret = val->value;
 				val->hits ++;
+
+				return ret;
+			}
+
+			/* Patterns that are not in hyperscan database */
+			for (i = 0; i < map->npcre; i ++) {
+				re = g_ptr_array_index (map->regexps, map->pcre_ids[i]);
+
+				if (rspamd_regexp_search (re, in, len, NULL, NULL, FALSE, NULL)) {
+					val = g_ptr_array_index (map->values, map->pcre_ids[i]);
+
+					ret = val->value;
+					val->hits ++;
+					break;
+				}
 			}
 
 			return ret;
@@ -1612,21 +2533,16 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map_helper *map,
 }
 
 #ifdef WITH_HYPERSCAN
-struct rspamd_multiple_cbdata {
-	GPtrArray *ar;
-	struct rspamd_regexp_map_helper *map;
-};
-
 static int
 rspamd_match_hs_multiple_handler (unsigned int id, unsigned long long from,
 		unsigned long long to,
 		unsigned int flags, void *context)
 {
-	struct rspamd_multiple_cbdata *cbd = context;
+	struct rspamd_re_map_match_cbdata *cbd = context;
 	struct rspamd_map_helper_value *val;
 
 
-	if (id < cbd->map->values->len) {
+	if (id < cbd->map->values->len && rspamd_re_map_hs_confirm (cbd, id)) {
 		val = g_ptr_array_index (cbd->map->values, id);
 		val->hits ++;
 		g_ptr_array_add (cbd->ar, val->value);
@@ -1669,14 +2585,33 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 	if (map->hs_db && map->hs_scratch) {
 
 		if (validated) {
-			struct rspamd_multiple_cbdata cbd;
+			struct rspamd_re_map_match_cbdata cbd;
 
+			memset (&cbd, 0, sizeof (cbd));
 			cbd.ar = ret;
 			cbd.map = map;
+			cbd.in = in;
+			cbd.len = len;
 
 			if (hs_scan (map->hs_db, in, len, 0, map->hs_scratch,
 					rspamd_match_hs_multiple_handler, &cbd) == HS_SUCCESS) {
 				res = 1;
+
+				/* Patterns that are not in hyperscan database */
+				for (i = 0; i < map->npcre; i ++) {
+					re = g_ptr_array_index (map->regexps, map->pcre_ids[i]);
+
+					if (rspamd_regexp_search (re, in, len, NULL, NULL,
+							FALSE, NULL)) {
+						val = g_ptr_array_index (map->values, map->pcre_ids[i]);
+						val->hits ++;
+						g_ptr_array_add (ret, val->value);
+					}
+				}
+			}
+			else {
+				/* Start from scratch with PCRE */
+				g_ptr_array_set_size (ret, 0);
 			}
 		}
 	}
@@ -1705,6 +2640,27 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 	return NULL;
 }
 
+static gconstpointer
+rspamd_match_hash_map_shared (struct rspamd_hash_map_helper *map,
+		const gchar *in, gsize len)
+{
+	gchar keybuf[256], *lc;
+	gconstpointer ret = NULL;
+
+	lc = len <= sizeof (keybuf) ? keybuf : g_malloc (len);
+	rspamd_str_copy_lc (in, lc, len);
+
+	if (cdb_find (map->cdb, lc, len) > 0) {
+		ret = map->cdb->cdb_mem + cdb_datapos (map->cdb);
+	}
+
+	if (lc != keybuf) {
+		g_free (lc);
+	}
+
+	return ret;
+}
+
 gconstpointer
 rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in,
 		gsize len)
@@ -1717,6 +2673,14 @@ rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in,
 		return NULL;
 	}
 
+	if (map->cdb) {
+		return rspamd_match_hash_map_shared (map, in, len);
+	}
+
+	if (map->compact) {
+		return rspamd_map_compact_lookup (map->compact, in, len);
+	}
+
 	tok.begin = in;
 	tok.len = len;
 
@@ -1732,6 +2696,104 @@ rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in,
 	return NULL;
 }
 
+/*
+ * Resolves a single key in a hash table using a precomputed hash,
+ * this is the same probing as kh_get does
+ */
+static inline khint_t
+rspamd_map_hash_get_hashed (const khash_t(rspamd_map_hash) *h,
+		rspamd_ftok_t key, khint_t k)
+{
+	khint_t i, last, mask, step = 0;
+
+	mask = h->n_buckets - 1;
+	i = k & mask;
+	last = i;
+
+	while (!__ac_isempty (h->flags, i) &&
+		   (__ac_isdel (h->flags, i) || !rspamd_map_ftok_equal (h->keys[i], key))) {
+		i = (i + (++step)) & mask;
+
+		if (i == last) {
+			return h->n_buckets;
+		}
+	}
+
+	return __ac_iseither (h->flags, i) ? h->n_buckets : i;
+}
+
+void
+rspamd_match_hash_map_batch (struct rspamd_hash_map_helper *map,
+		const rspamd_ftok_t *keys, gsize nkeys,
+		gconstpointer *results)
+{
+	khash_t(rspamd_map_hash) *htb;
+	struct rspamd_map_helper_value *val;
+	guint64 hashes[32];
+	khint_t k;
+	gsize i, j, blk;
+
+	if (map == NULL || map->htb == NULL || map->cdb) {
+		/* Shared storage has no locality to exploit */
+		for (i = 0; i < nkeys; i ++) {
+			results[i] = rspamd_match_hash_map (map, keys[i].begin, keys[i].len);
+		}
+
+		return;
+	}
+
+	htb = map->htb;
+
+	for (i = 0; i < nkeys; i += G_N_ELEMENTS (hashes)) {
+		blk = MIN (nkeys - i, G_N_ELEMENTS (hashes));
+
+		/*
+		 * Hash all keys in a block first and prefetch their buckets, so
+		 * the memory loads for different keys overlap with each other
+		 */
+		if (map->compact) {
+			for (j = 0; j < blk; j ++) {
+				hashes[j] = rspamd_map_compact_fp (keys[i + j].begin,
+						keys[i + j].len);
+				__builtin_prefetch (&map->compact->slots[hashes[j] &
+						map->compact->mask]);
+			}
+
+			for (j = 0; j < blk; j ++) {
+				results[i + j] = rspamd_map_compact_lookup_fp (map->compact,
+						keys[i + j].begin, keys[i + j].len, hashes[j]);
+			}
+		}
+		else if (htb->n_buckets == 0) {
+			for (j = 0; j < blk; j ++) {
+				results[i + j] = NULL;
+			}
+		}
+		else {
+			for (j = 0; j < blk; j ++) {
+				hashes[j] = rspamd_map_ftok_hash (keys[i + j]);
+				k = hashes[j] & (htb->n_buckets - 1);
+				__builtin_prefetch (&htb->flags[k >> 4]);
+				__builtin_prefetch (&htb->keys[k]);
+			}
+
+			for (j = 0; j < blk; j ++) {
+				k = rspamd_map_hash_get_hashed (htb, keys[i + j],
+						(khint_t)hashes[j]);
+
+				if (k != kh_end (htb)) {
+					val = kh_value (htb, k);
+					val->hits ++;
+					results[i + j] = val->value;
+				}
+				else {
+					results[i + j] = NULL;
+				}
+			}
+		}
+	}
+}
+
 gconstpointer
 rspamd_match_radix_map (struct rspamd_radix_map_helper *map,
 		const guchar *in, gsize inlen)
@@ -1775,6 +2837,41 @@ rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 	return NULL;
 }
 
+void
+rspamd_match_radix_map_addr_batch (struct rspamd_radix_map_helper *map,
+		const rspamd_inet_addr_t * const *addrs, gsize naddrs,
+		gconstpointer *results)
+{
+	struct rspamd_map_helper_value *val;
+	uintptr_t vals[32];
+	gsize i, j, blk;
+
+	for (i = 0; i < naddrs; i += G_N_ELEMENTS (vals)) {
+		blk = MIN (naddrs - i, G_N_ELEMENTS (vals));
+
+		if (map == NULL || map->trie == NULL) {
+			for (j = 0; j < blk; j ++) {
+				results[i + j] = NULL;
+			}
+
+			continue;
+		}
+
+		radix_find_compressed_addr_batch (map->trie, addrs + i, blk, vals);
+
+		for (j = 0; j < blk; j ++) {
+			if (vals[j] != RADIX_NO_VALUE) {
+				val = (struct rspamd_map_helper_value *)vals[j];
+				val->hits ++;
+				results[i + j] = val->value;
+			}
+			else {
+				results[i + j] = NULL;
+			}
+		}
+	}
+}
+
 
 /*
  * CBD stuff
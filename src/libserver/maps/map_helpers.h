@@ -20,6 +20,7 @@
 #include "config.h"
 #include "map.h"
 #include "addr.h"
+#include "fstring.h"
 
 /**
  * @file map_helpers.h
@@ -59,6 +60,21 @@ gchar *rspamd_radix_read (
 		struct map_cb_data *data,
 		gboolean final);
 
+/**
+ * Parses radix list to an array of key/value pairs in `cur_data`, uses
+ * neither memory pools nor logging, so it can be called from a separate thread
+ */
+gchar *rspamd_radix_parse (
+		gchar *chunk,
+		gint len,
+		struct map_cb_data *data,
+		gboolean final);
+
+/**
+ * Inserts pairs parsed by `rspamd_radix_parse` to the radix data
+ */
+void rspamd_radix_insert (struct map_cb_data *data, GPtrArray *pairs);
+
 void rspamd_radix_fin (struct map_cb_data *data, void **target);
 
 void rspamd_radix_dtor (struct map_cb_data *data);
@@ -72,8 +88,37 @@ gchar *rspamd_kv_list_read (
 		struct map_cb_data *data,
 		gboolean final);
 
+/**
+ * Parses kv list to an array of key/value pairs in `cur_data`, uses
+ * neither memory pools nor logging, so it can be called from a separate thread
+ */
+gchar *rspamd_kv_list_parse (
+		gchar *chunk,
+		gint len,
+		struct map_cb_data *data,
+		gboolean final);
+
+/**
+ * Inserts pairs parsed by `rspamd_kv_list_parse` to the hash data
+ */
+void rspamd_kv_list_insert (struct map_cb_data *data, GPtrArray *pairs);
+
 void rspamd_kv_list_fin (struct map_cb_data *data, void **target);
 
+/**
+ * Prepares the read hash data, uses neither memory pools nor logging, so
+ * it can be called from a separate thread
+ */
+void rspamd_kv_list_build (struct map_cb_data *data);
+
+/**
+ * Applies delta that consists of `+key value` and `-key` lines to the current
+ * hash data in place; if delta is NULL, then it just checks if the current
+ * data can be modified
+ */
+gboolean rspamd_kv_list_delta (const gchar *delta, gsize len,
+		struct map_cb_data *data);
+
 void rspamd_kv_list_dtor (struct map_cb_data *data);
 
 /**
@@ -164,6 +209,19 @@ GPtrArray *rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 gconstpointer rspamd_match_hash_map (struct rspamd_hash_map_helper *map,
 									 const gchar *in, gsize len);
 
+/**
+ * Find values for many keys in a hash map at once, hashing is done per block
+ * of keys and buckets are prefetched before being compared
+ * @param map
+ * @param keys array of `nkeys` keys
+ * @param nkeys number of keys
+ * @param results array of `nkeys` values, NULL for not found
+ */
+void rspamd_match_hash_map_batch (struct rspamd_hash_map_helper *map,
+								  const rspamd_ftok_t *keys,
+								  gsize nkeys,
+								  gconstpointer *results);
+
 /**
  * Find value matching specific key in a cdb map
  * @param map
@@ -187,6 +245,18 @@ gconstpointer rspamd_match_radix_map (struct rspamd_radix_map_helper *map,
 gconstpointer rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 										   const rspamd_inet_addr_t *addr);
 
+/**
+ * Find many addresses in a radix map at once
+ * @param map
+ * @param addrs array of addresses
+ * @param naddrs number of addresses
+ * @param results array of `naddrs` values, NULL for not found
+ */
+void rspamd_match_radix_map_addr_batch (struct rspamd_radix_map_helper *map,
+										const rspamd_inet_addr_t * const *addrs,
+										gsize naddrs,
+										gconstpointer *results);
+
 /**
  * Creates radix map helper
  * @param map
@@ -239,6 +309,27 @@ void rspamd_map_helper_insert_hash (gpointer st, gconstpointer key, gconstpointe
  */
 void rspamd_map_helper_destroy_hash (struct rspamd_hash_map_helper *r);
 
+/**
+ * Writes hash map helper to the specified fd as an immutable cdb, so it could
+ * be shared between processes (keys are lowercased)
+ * @param data hash map helper
+ * @param fd
+ * @return
+ */
+gboolean rspamd_map_helper_export_hash (gpointer data, gint fd);
+
+/**
+ * Creates hash map helper from the data written by `rspamd_map_helper_export_hash`,
+ * fd is owned by the helper on success
+ * @param map
+ * @param fd
+ * @param nelts number of elements in the exported helper
+ * @param digest digest of the exported helper
+ * @return new hash map helper or NULL
+ */
+gpointer rspamd_map_helper_attach_hash (struct rspamd_map *map, gint fd,
+		gsize nelts, guint64 digest);
+
 /**
  * Create new regexp map
  * @param map
@@ -68,11 +68,15 @@ struct http_map_data;
 
 struct rspamd_http_map_cached_cbdata {
 	ev_timer timeout;
+	ev_timer serialise_ev; /* to publish the full data modified by deltas */
 	struct ev_loop *event_loop;
 	struct rspamd_storage_shmem *shm;
+	struct rspamd_storage_shmem *delta_shm;
 	struct rspamd_map *map;
+	struct rspamd_map_backend *bk;
 	struct http_map_data *data;
 	guint64 gen;
+	guint64 version; /* version of the cache published */
 	time_t last_checked;
 };
 
@@ -80,7 +84,12 @@ struct rspamd_map_cachepoint {
 	gint available;
 	gsize len;
 	time_t last_modified;
+	guint64 version; /* Incremented each time cached data is changed */
+	/* Delta from the `delta_base` version to the current one, if any */
+	guint64 delta_base;
+	gsize delta_len;
 	gchar shmem_name[256];
+	gchar delta_shmem_name[256];
 };
 
 /**
@@ -98,6 +107,8 @@ struct http_map_data {
 	rspamd_fstring_t *etag;
 	time_t last_modified;
 	time_t last_checked;
+	guint64 cache_version; /* Version of the cached data we have loaded */
+	gdouble serialise_after; /* when data modified by deltas is serialised */
 	gboolean request_sent;
 	guint64 gen;
 	guint16 port;
@@ -128,7 +139,42 @@ struct rspamd_map_backend {
 	ref_entry_t ref;
 };
 
+/**
+ * Immutable map data shared between processes (only for maps with
+ * `shared = true`), allocated in the shared memory
+ */
+struct rspamd_map_shared_storage {
+	gint available;
+	pid_t pid; /* Process that has published the current storage */
+	guint64 stamp; /* Sources state the storage has been built from */
+	guint64 digest;
+	gsize nelts;
+	gsize len;
+	gchar shm_name[256];
+};
+
+typedef gboolean (*rspamd_map_shared_export_t) (gpointer data, gint fd);
+typedef gpointer (*rspamd_map_shared_attach_t) (struct rspamd_map *map, gint fd,
+		gsize nelts, guint64 digest);
+
+/*
+ * Called after all data is read, might be called outside of the event loop,
+ * so it must use neither memory pools nor logging
+ */
+typedef void (*map_build_cb_t) (struct map_cb_data *data);
+
+/* Inserts key/value pairs parsed outside of the event loop to `cur_data` */
+typedef void (*map_insert_cb_t) (struct map_cb_data *data, GPtrArray *pairs);
+
+/*
+ * Applies delta to the current data (`cur_data`) in place, if delta is NULL
+ * then it just checks if the current data supports deltas
+ */
+typedef gboolean (*map_delta_cb_t) (const gchar *delta, gsize len,
+		struct map_cb_data *data);
+
 struct map_periodic_cbdata;
+struct rspamd_map_build_cbdata;
 
 struct rspamd_map {
 	struct rspamd_dns_resolver *r;
@@ -138,6 +184,10 @@ struct rspamd_map {
 	map_cb_t read_callback;
 	map_fin_cb_t fin_callback;
 	map_dtor_t dtor;
+	map_cb_t parse_callback; /* parses data to pairs outside of the event loop */
+	map_insert_cb_t insert_callback;
+	map_build_cb_t build_callback;
+	map_delta_cb_t delta_callback;
 	void **user_data;
 	struct ev_loop *event_loop;
 	struct rspamd_worker *wrk;
@@ -151,6 +201,7 @@ struct rspamd_map {
 	gpointer lua_map;
 	gsize nelts;
 	guint64 digest;
+	gdouble build_time; /* Time spent to build the current data */
 	/* Should we check HTTP or just load cached data */
 	ev_tstamp timeout;
 	gdouble poll_timeout;
@@ -160,8 +211,16 @@ struct rspamd_map {
 	bool file_only; /* No HTTP backends found */
 	bool static_only; /* No need to check */
 	bool no_file_read; /* Do not read files */
+	bool bg_build; /* Parse data in a separate thread */
+	/* Data being built in a separate thread and its thread */
+	struct rspamd_map_build_cbdata *bg_cbd;
+	GThread *bg_thread;
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	gint *locked;
+	/* Immutable data built by one process and attached by others */
+	struct rspamd_map_shared_storage *shared;
+	rspamd_map_shared_export_t shared_export;
+	rspamd_map_shared_attach_t shared_attach;
 	gchar tag[MEMPOOL_UID_LEN];
 };
 
@@ -179,6 +238,10 @@ struct map_periodic_cbdata {
 	gboolean need_modify;
 	gboolean errored;
 	gboolean locked;
+	gboolean shared_attached;
+	gboolean background;
+	GPtrArray *bg_data; /* Data to be parsed in a separate thread */
+	gdouble build_time;
 	guint cur_backend;
 	ref_entry_t ref;
 };
@@ -207,6 +270,7 @@ struct http_callback_data {
 	struct rspamd_storage_shmem *shmem_data;
 	gsize data_len;
 	gboolean check;
+	gboolean delta; /* Delta has been requested */
 	enum rspamd_map_http_stage stage;
 	ev_tstamp timeout;
 
@@ -2102,6 +2102,10 @@ rspamd_protocol_write_reply (struct rspamd_task *task, ev_tstamp timeout)
 	ev_now_update (task->event_loop);
 	msg->date = ev_time ();
 
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
+
 	rspamd_http_connection_reset (task->http_conn);
 	rspamd_http_connection_write_message (task->http_conn, msg, NULL,
 		ctype, task, timeout);
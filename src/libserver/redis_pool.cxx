@@ -25,6 +25,8 @@
 #include "logger.h"
 
 #include <list>
+#include <vector>
+#include <algorithm>
 #include "contrib/robin-hood/robin_hood.h"
 
 namespace rspamd {
@@ -41,7 +43,22 @@ INIT_LOG_MODULE(redis_pool)
 enum class rspamd_redis_pool_connection_state : std::uint8_t {
 	RSPAMD_REDIS_POOL_CONN_INACTIVE = 0,
 	RSPAMD_REDIS_POOL_CONN_ACTIVE,
-	RSPAMD_REDIS_POOL_CONN_FINALISING
+	RSPAMD_REDIS_POOL_CONN_FINALISING,
+	RSPAMD_REDIS_POOL_CONN_SHARED
+};
+
+struct redis_pool_connection;
+
+/*
+ * Pending command on a shared connection: hiredis calls our trampoline and
+ * we forward the reply to the real callback unless the owner has gone away
+ */
+struct redis_pool_command {
+	redisCallbackFn *fn;
+	void *privdata;
+	const void *owner;
+	redis_pool_connection *conn;
+	std::list<redis_pool_command>::iterator pos;
 };
 
 struct redis_pool_connection {
@@ -54,8 +71,24 @@ struct redis_pool_connection {
 	ev_timer timeout;
 	gchar tag[MEMPOOL_UID_LEN];
 	rspamd_redis_pool_connection_state state;
+	/* Shared connections only */
+	std::list<redis_pool_command> pending;
+	unsigned users = 0;
+	bool draining = false;
+	/* Output buffer is flushed before the next poll */
+	bool flush_queued = false;
 
 	auto schedule_timeout() -> void;
+	auto make_shared() -> void;
+	auto schedule_shared_timeout() -> void;
+	auto is_usable() const -> bool
+	{
+		return ctx != nullptr && !draining && ctx->err == REDIS_OK &&
+			   !(ctx->c.flags & (REDIS_DISCONNECTING|REDIS_FREEING));
+	}
+	auto command_argv(const void *owner, redisCallbackFn *fn, void *privdata,
+					  int argc, const char **argv, const size_t *argvlen) -> int;
+	auto cancel_commands(const void *owner) -> void;
 	~redis_pool_connection();
 
 	explicit redis_pool_connection(redis_pool *_pool,
@@ -68,6 +101,11 @@ private:
 	static auto redis_conn_timeout_cb(EV_P_ ev_timer *w, int revents) -> void;
 	static auto redis_quit_cb(redisAsyncContext *c, void *r, void *priv) -> void;
 	static auto redis_on_disconnect(const struct redisAsyncContext *ac, int status) -> auto;
+	static auto redis_on_connect(const struct redisAsyncContext *ac, int status) -> void;
+	static auto redis_shared_timeout_cb(EV_P_ ev_timer *w, int revents) -> void;
+	static auto redis_shared_cb(redisAsyncContext *c, void *r, void *priv) -> void;
+	static auto redis_add_write(void *privdata) -> void;
+	auto detach_context() -> void;
 };
 
 
@@ -84,6 +122,8 @@ class redis_pool_elt {
 	std::list<redis_pool_connection_ptr> active;
 	std::list<redis_pool_connection_ptr> inactive;
 	std::list<redis_pool_connection_ptr> terminating;
+	/* Multiplexed connections shared by many users */
+	std::list<redis_pool_connection_ptr> shared;
 	std::string ip;
 	std::string db;
 	std::string password;
@@ -108,6 +148,7 @@ public:
 	}
 
 	auto new_connection() -> redisAsyncContext *;
+	auto new_shared_connection() -> redis_pool_connection *;
 
 	auto release_connection(const redis_pool_connection *conn) -> void
 	{
@@ -121,6 +162,9 @@ public:
 		case rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_FINALISING:
 			terminating.erase(conn->elt_pos);
 			break;
+		case rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED:
+			shared.erase(conn->elt_pos);
+			break;
 		}
 	}
 
@@ -192,15 +236,23 @@ private:
 class redis_pool final {
 	static constexpr const double default_timeout = 10.0;
 	static constexpr const unsigned default_max_conns = 100;
+	static constexpr const unsigned default_max_inflight = 64;
 
 	/* We want to have references integrity */
 	robin_hood::unordered_flat_map<redisAsyncContext *,
 			redis_pool_connection *> conns_by_ctx;
+	/* Connections with commands issued during the current loop iteration */
+	std::vector<redis_pool_connection *> flush_queue;
+	ev_prepare flush_ev;
 	robin_hood::unordered_node_map<redis_pool_key_t, redis_pool_elt> elts_by_key;
 	bool wanna_die = false; /* Hiredis is 'clever' so we can call ourselves from destructor */
 public:
 	double timeout = default_timeout;
 	unsigned max_conns = default_max_conns;
+	/* Number of multiplexed connections per server, 0 disables multiplexing */
+	unsigned max_shared_conns = 0;
+	unsigned max_inflight = default_max_inflight;
+	bool coalesce_writes = true;
 	struct ev_loop *event_loop;
 	struct rspamd_config *cfg;
 
@@ -208,6 +260,8 @@ public:
 	explicit redis_pool() : event_loop(nullptr), cfg(nullptr)
 	{
 		conns_by_ctx.reserve(max_conns);
+		ev_prepare_init(&flush_ev, redis_pool::flush_cb);
+		flush_ev.data = this;
 	}
 
 	/* Legacy stuff */
@@ -215,6 +269,15 @@ public:
 	{
 		event_loop = _loop;
 		cfg = _cfg;
+
+		if (cfg) {
+			max_shared_conns = cfg->redis_pool_shared_conns;
+			coalesce_writes = cfg->redis_pool_coalesce_writes;
+
+			if (cfg->redis_pool_max_inflight > 0) {
+				max_inflight = cfg->redis_pool_max_inflight;
+			}
+		}
 	}
 
 	auto new_connection(const gchar *db, const gchar *password,
@@ -223,6 +286,11 @@ public:
 	auto release_connection(redisAsyncContext *ctx,
 							enum rspamd_redis_pool_release_type how) -> void;
 
+	auto new_shared_connection(const gchar *db, const gchar *password,
+							   const char *ip, int port) -> redis_pool_connection *;
+	auto release_shared_connection(redis_pool_connection *conn, const void *owner,
+								   enum rspamd_redis_pool_release_type how) -> void;
+
 	auto unregister_context(redisAsyncContext *ctx) -> void
 	{
 		conns_by_ctx.erase(ctx);
@@ -233,13 +301,41 @@ public:
 		conns_by_ctx.emplace(ctx, conn);
 	}
 
+	auto schedule_flush(redis_pool_connection *conn) -> void
+	{
+		if (!conn->flush_queued) {
+			conn->flush_queued = true;
+			flush_queue.push_back(conn);
+
+			if (!ev_is_active(&flush_ev)) {
+				ev_prepare_start(event_loop, &flush_ev);
+			}
+		}
+	}
+
+	auto unschedule_flush(redis_pool_connection *conn) -> void
+	{
+		if (conn->flush_queued) {
+			conn->flush_queued = false;
+			std::replace(flush_queue.begin(), flush_queue.end(), conn,
+					(redis_pool_connection *)nullptr);
+		}
+	}
+
 	~redis_pool() {
 		/*
 		 * XXX: this will prevent hiredis to unregister connections that
 		 * are already destroyed during redisAsyncFree...
 		 */
 		wanna_die = true;
+
+		if (event_loop) {
+			ev_prepare_stop(event_loop, &flush_ev);
+		}
 	}
+
+private:
+	static auto flush_cb(EV_P_ ev_prepare *w, int revents) -> void;
 };
 
 
@@ -247,6 +343,8 @@ redis_pool_connection::~redis_pool_connection()
 {
 	const auto *conn = this; /* For debug */
 
+	pool->unschedule_flush(this);
+
 	if (state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE) {
 		msg_debug_rpool ("active connection destructed: %p", ctx);
 
@@ -273,6 +371,7 @@ redis_pool_connection::~redis_pool_connection()
 				/* To prevent on_disconnect here */
 				ctx = nullptr;
 				ac->onDisconnect = nullptr;
+				ac->onConnect = nullptr;
 				redisAsyncFree(ac);
 			}
 		}
@@ -341,7 +440,11 @@ redis_pool_connection::redis_on_disconnect(const struct redisAsyncContext *ac, i
 	 * Here, we know that redis itself will free this connection
 	 * so, we need to do something very clever about it
 	 */
-	if (conn->state != rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE) {
+	if (conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED) {
+		/* Users still hold this connection, so just forget the context */
+		conn->detach_context();
+	}
+	else if (conn->state != rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE) {
 		/* Do nothing for active connections as it is already handled somewhere */
 		if (conn->ctx) {
 			msg_debug_rpool("inactive connection terminated: %s",
@@ -383,6 +486,161 @@ redis_pool_connection::schedule_timeout() -> void
 }
 
 
+auto
+redis_pool_connection::redis_on_connect(const struct redisAsyncContext *ac, int status) -> void
+{
+	auto *conn = (struct redis_pool_connection *) ac->data;
+
+	/* Hiredis frees a context that failed to connect without on_disconnect */
+	if (status != REDIS_OK &&
+		conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED) {
+		conn->detach_context();
+	}
+}
+
+auto
+redis_pool_connection::detach_context() -> void
+{
+	const auto *conn = this; /* For debug */
+
+	if (ctx) {
+		msg_debug_rpool("shared connection %p terminated: %s, %d users left",
+				ctx, ctx->errstr, users);
+		pool->unregister_context(ctx);
+		ctx = nullptr;
+	}
+
+	draining = true;
+
+	if (users == 0) {
+		schedule_shared_timeout();
+	}
+}
+
+/*
+ * Converts a newly created connection to the multiplexed one
+ */
+auto
+redis_pool_connection::make_shared() -> void
+{
+	state = rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED;
+	timeout.data = this;
+	ev_timer_init(&timeout,
+			redis_pool_connection::redis_shared_timeout_cb, 0.0, 0.0);
+	redisAsyncSetConnectCallback(ctx, redis_pool_connection::redis_on_connect);
+}
+
+/*
+ * Called when the last user has released a shared connection: keep it open
+ * for a while to be reused or close it on the next loop iteration if it
+ * cannot be reused anymore
+ */
+auto
+redis_pool_connection::schedule_shared_timeout() -> void
+{
+	const auto *conn = this; /* For debug */
+	double real_timeout = 0.0;
+
+	if (!draining && ctx) {
+		real_timeout = rspamd_time_jitter(pool->timeout, pool->timeout / 2.0);
+	}
+
+	msg_debug_rpool("scheduled shared connection %p cleanup in %.1f seconds",
+			ctx, real_timeout);
+	ev_timer_stop(pool->event_loop, &timeout);
+	ev_timer_set(&timeout, real_timeout, 0.0);
+	ev_timer_start(pool->event_loop, &timeout);
+}
+
+auto
+redis_pool_connection::redis_shared_timeout_cb(EV_P_ ev_timer *w, int revents) -> void
+{
+	auto *conn = (struct redis_pool_connection *) w->data;
+
+	ev_timer_stop(EV_A_ w);
+
+	if (conn->users == 0) {
+		msg_debug_rpool("removal of the shared connection %p, %d commands pending",
+				conn->ctx, (int)conn->pending.size());
+		/* Erasure of shared pointer will cause it to be removed */
+		conn->elt->release_connection(conn);
+	}
+}
+
+auto
+redis_pool_connection::redis_shared_cb(redisAsyncContext *c, void *r, void *priv) -> void
+{
+	auto *cmd = (struct redis_pool_command *) priv;
+	auto *fn = cmd->fn;
+	auto *privdata = cmd->privdata;
+
+	/* Replies come in order, so we can just drop this command */
+	cmd->conn->pending.erase(cmd->pos);
+
+	if (fn) {
+		fn(c, r, privdata);
+	}
+}
+
+/*
+ * Hiredis asks to start the write watcher for each new command, so we also
+ * schedule a flush of the output buffer right before the next poll: all
+ * commands issued during the current loop iteration are sent in a single
+ * write and we save a poll cycle waiting for the socket to become writable
+ */
+auto
+redis_pool_connection::redis_add_write(void *privdata) -> void
+{
+	auto *e = (redisLibevEvents *) privdata;
+	auto *conn = (struct redis_pool_connection *) e->context->data;
+
+	/* Keep the watcher as a fallback if we cannot write everything at once */
+	redisLibevAddWrite(privdata);
+	conn->pool->schedule_flush(conn);
+}
+
+auto
+redis_pool_connection::command_argv(const void *owner,
+									redisCallbackFn *fn, void *privdata,
+									int argc, const char **argv,
+									const size_t *argvlen) -> int
+{
+	if (!ctx || ctx->err != REDIS_OK) {
+		return REDIS_ERR;
+	}
+
+	auto &cmd = pending.emplace_back(redis_pool_command{fn, privdata, owner, this, {}});
+	cmd.pos = std::prev(std::end(pending));
+
+	/*
+	 * Hiredis appends commands to the output buffer and writes it when the
+	 * socket is writable, so all commands issued on the same event loop
+	 * iteration are sent in a single batch
+	 */
+	auto ret = redisAsyncCommandArgv(ctx, redis_pool_connection::redis_shared_cb,
+			&cmd, argc, argv, argvlen);
+
+	if (ret != REDIS_OK) {
+		pending.erase(cmd.pos);
+	}
+
+	return ret;
+}
+
+auto
+redis_pool_connection::cancel_commands(const void *owner) -> void
+{
+	for (auto &cmd : pending) {
+		if (cmd.owner == owner) {
+			/* The reply will still be read but ignored */
+			cmd.fn = nullptr;
+			cmd.privdata = nullptr;
+			cmd.owner = nullptr;
+		}
+	}
+}
+
+
 redis_pool_connection::redis_pool_connection(redis_pool *_pool,
 											 redis_pool_elt *_elt,
 											 const std::string &db,
@@ -401,6 +659,10 @@ redis_pool_connection::redis_pool_connection(redis_pool *_pool,
 	redisLibevAttach(pool->event_loop, ctx);
 	redisAsyncSetDisconnectCallback(ctx, redis_pool_connection::redis_on_disconnect);
 
+	if (pool->coalesce_writes) {
+		ctx->ev.addWrite = redis_pool_connection::redis_add_write;
+	}
+
 	if (!password.empty()) {
 		redisAsyncCommand(ctx, nullptr, nullptr,
 				"AUTH %s", password.c_str());
@@ -474,6 +736,81 @@ redis_pool_elt::new_connection() -> redisAsyncContext *
 	RSPAMD_UNREACHABLE;
 }
 
+/*
+ * Selects the least loaded multiplexed connection, or opens a new one if
+ * all of them have reached the in-flight limit
+ */
+auto
+redis_pool_elt::new_shared_connection() -> redis_pool_connection *
+{
+	redis_pool_connection *selected = nullptr;
+
+	for (auto &conn : shared) {
+		if (conn->is_usable() && conn->pending.size() < pool->max_inflight) {
+			if (selected == nullptr || conn->pending.size() < selected->pending.size()) {
+				selected = conn.get();
+			}
+		}
+	}
+
+	if (selected == nullptr && shared.size() < pool->max_shared_conns) {
+		auto *nctx = redis_async_new();
+
+		if (nctx) {
+			shared.emplace_front(std::make_unique<redis_pool_connection>(pool, this,
+					db.c_str(), password.c_str(), nctx));
+			selected = shared.front().get();
+			selected->elt_pos = shared.begin();
+			selected->make_shared();
+		}
+	}
+
+	if (selected) {
+		const auto *conn = selected; /* For debug */
+
+		ev_timer_stop(pool->event_loop, &selected->timeout);
+		selected->users++;
+		msg_debug_rpool("use shared connection to %s:%d: %p, %d users, %d pending",
+				ip.c_str(), port, selected->ctx, selected->users,
+				(int)selected->pending.size());
+	}
+
+	/* Caller falls back to an exclusive connection if we return nothing */
+	return selected;
+}
+
+auto
+redis_pool::flush_cb(EV_P_ ev_prepare *w, int revents) -> void
+{
+	auto *pool = (class redis_pool *) w->data;
+
+	ev_prepare_stop(EV_A_ w);
+
+	/*
+	 * Writing may fail and call user callbacks that issue new commands
+	 * or destroy queued connections, so we iterate by index and the
+	 * destructed connections are replaced with nullptr
+	 */
+	for (auto i = 0u; i < pool->flush_queue.size(); i ++) {
+		auto *conn = pool->flush_queue[i];
+
+		if (conn == nullptr) {
+			continue;
+		}
+
+		conn->flush_queued = false;
+
+		if (conn->ctx && (conn->ctx->c.flags & REDIS_CONNECTED) &&
+			!(conn->ctx->c.flags & REDIS_FREEING)) {
+			msg_debug_rpool("flush commands for connection %p", conn->ctx);
+			/* Stops write watcher if everything has been written */
+			redisAsyncHandleWrite(conn->ctx);
+		}
+	}
+
+	pool->flush_queue.clear();
+}
+
 auto
 redis_pool::new_connection(const gchar *db, const gchar *password,
 						   const char *ip, int port) -> redisAsyncContext *
@@ -501,6 +838,59 @@ redis_pool::new_connection(const gchar *db, const gchar *password,
 	return nullptr;
 }
 
+auto
+redis_pool::new_shared_connection(const gchar *db, const gchar *password,
+								  const char *ip, int port) -> redis_pool_connection *
+{
+	if (!wanna_die && max_shared_conns > 0) {
+		auto key = redis_pool_elt::make_key(db, password, ip, port);
+		auto found_elt = elts_by_key.find(key);
+
+		if (found_elt != elts_by_key.end()) {
+			return found_elt->second.new_shared_connection();
+		}
+		else {
+			auto nelt = elts_by_key.emplace(std::piecewise_construct,
+					std::forward_as_tuple(key),
+					std::forward_as_tuple(this, db, password, ip, port));
+
+			return nelt.first->second.new_shared_connection();
+		}
+	}
+
+	return nullptr;
+}
+
+auto
+redis_pool::release_shared_connection(redis_pool_connection *conn,
+									  const void *owner,
+									  enum rspamd_redis_pool_release_type how) -> void
+{
+	if (!wanna_die) {
+		g_assert (conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED);
+		g_assert (conn->users > 0);
+
+		/* Other users are still waiting for their replies on this connection */
+		conn->cancel_commands(owner);
+		conn->users--;
+
+		if (how != RSPAMD_REDIS_RELEASE_DEFAULT && !conn->draining) {
+			/*
+			 * Likely a timeout, so we do not give this connection to the new
+			 * users and close it once the current ones are done
+			 */
+			msg_debug_rpool("stop using shared connection %p due to %s termination",
+					conn->ctx,
+					how == RSPAMD_REDIS_RELEASE_FATAL ? "fatal" : "explicit");
+			conn->draining = true;
+		}
+
+		if (conn->users == 0) {
+			conn->schedule_shared_timeout();
+		}
+	}
+}
+
 auto redis_pool::release_connection(redisAsyncContext *ctx,
 									enum rspamd_redis_pool_release_type how) -> void
 {
@@ -597,6 +987,41 @@ rspamd_redis_pool_release_connection(void *p,
 }
 
 
+void *
+rspamd_redis_pool_connect_shared(void *p,
+								 const gchar *db, const gchar *password,
+								 const char *ip, int port)
+{
+	g_assert (p != NULL);
+	auto *pool = reinterpret_cast<class rspamd::redis_pool *>(p);
+
+	return pool->new_shared_connection(db, password, ip, port);
+}
+
+int
+rspamd_redis_pool_shared_command_argv(void *shared, const void *owner,
+									  redisCallbackFn *fn, void *privdata,
+									  int argc, const char **argv,
+									  const size_t *argvlen)
+{
+	g_assert (shared != NULL);
+	auto *conn = reinterpret_cast<struct rspamd::redis_pool_connection *>(shared);
+
+	return conn->command_argv(owner, fn, privdata, argc, argv, argvlen);
+}
+
+void
+rspamd_redis_pool_release_shared(void *p, void *shared, const void *owner,
+								 enum rspamd_redis_pool_release_type how)
+{
+	g_assert (p != NULL);
+	g_assert (shared != NULL);
+	auto *pool = reinterpret_cast<class rspamd::redis_pool *>(p);
+	auto *conn = reinterpret_cast<struct rspamd::redis_pool_connection *>(shared);
+
+	pool->release_shared_connection(conn, owner, how);
+}
+
 void
 rspamd_redis_pool_destroy(void *p)
 {
@@ -70,6 +70,49 @@ void rspamd_redis_pool_release_connection (void *pool,
 										   struct redisAsyncContext *ctx,
 										   enum rspamd_redis_pool_release_type how);
 
+/**
+ * Get a multiplexed connection shared with other users of the same server,
+ * commands on such a connection are pipelined and must be sent via
+ * `rspamd_redis_pool_shared_command_argv`. Subscription commands are not
+ * allowed on shared connections.
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return opaque shared connection or NULL if multiplexing is disabled or
+ * all shared connections have reached the in-flight limit
+ */
+void *rspamd_redis_pool_connect_shared (void *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
+/**
+ * Send command over a shared connection
+ * @param shared
+ * @param owner identifies the caller to cancel its callbacks on release
+ * @param fn
+ * @param privdata
+ * @param argc
+ * @param argv
+ * @param argvlen
+ * @return REDIS_OK if a command has been scheduled
+ */
+int rspamd_redis_pool_shared_command_argv (void *shared, const void *owner,
+		void (*fn)(struct redisAsyncContext *, void *, void *), void *privdata,
+		int argc, const char **argv, const size_t *argvlen);
+
+/**
+ * Release a shared connection, callbacks for the commands of the specified
+ * owner that are still pending will never be called
+ * @param pool
+ * @param shared
+ * @param owner
+ * @param how non-default release stops giving this connection to the new users
+ */
+void rspamd_redis_pool_release_shared (void *pool, void *shared,
+		const void *owner, enum rspamd_redis_pool_release_type how);
+
 /**
  * Stops redis pool and destroys it
  * @param pool
@@ -1953,7 +1953,20 @@ rspamd_worker_guard_handler (EV_P_ ev_io *w, int revents)
 	gchar fake_buf[1024];
 	gssize r;
 
-	r = read (w->fd, fake_buf, sizeof (fake_buf));
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE) {
+		/* The next request can be sent before reply, it must not be consumed */
+		r = recv (w->fd, fake_buf, 1, MSG_PEEK);
+
+		if (r > 0) {
+			msg_debug_task ("next request is received on keep-alive connection");
+			ev_io_stop (task->event_loop, &task->guard_ev);
+
+			return;
+		}
+	}
+	else {
+		r = read (w->fd, fake_buf, sizeof (fake_buf));
+	}
 
 	if (r > 0) {
 		msg_warn_task ("received extra data after task is loaded, ignoring");
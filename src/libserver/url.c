@@ -45,6 +45,7 @@
 #include "rspamd.h"
 #include "message.h"
 #include "multipattern.h"
+#include "libutil/hash.h"
 #include "contrib/uthash/utlist.h"
 #include "contrib/http-parser/http_parser.h"
 #include <unicode/utf8.h>
@@ -52,6 +53,13 @@
 #include <unicode/usprep.h>
 #include <unicode/ucnv.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RSPAMD_URL_NEON 1
+#endif
+
 typedef struct url_match_s {
 	const gchar *m_begin;
 	gsize m_len;
@@ -249,6 +257,8 @@ struct rspamd_url_flag_name {
 
 
 static inline khint_t rspamd_url_hash (struct rspamd_url *u);
+static guint rspamd_url_cache_key_hash (gconstpointer k);
+static gboolean rspamd_url_cache_key_equal (gconstpointer k1, gconstpointer k2);
 
 static inline khint_t rspamd_url_host_hash (struct rspamd_url * u);
 static inline bool rspamd_urls_cmp (struct rspamd_url *a, struct rspamd_url *b);
@@ -283,6 +293,29 @@ struct url_match_scanner {
 	GArray *matchers_strict;
 	struct rspamd_multipattern *search_trie_full;
 	struct rspamd_multipattern *search_trie_strict;
+	rspamd_lru_hash_t *parse_cache;
+	guint max_pattern_len;
+};
+
+/* Number of parsed urls kept per process */
+#define URL_PARSE_CACHE_SIZE 8192
+/* Do not cache long urls, they are likely unique */
+#define URL_PARSE_CACHE_MAX_LEN 1024
+
+struct rspamd_url_cache_key {
+	const gchar *begin;
+	gsize len;
+	guint parse_flags;
+};
+
+/*
+ * Result of parsing of some input string: url fields with `string` pointing to
+ * the normalised url stored after the input string in the same allocation
+ */
+struct rspamd_url_cache_elt {
+	struct rspamd_url_cache_key key;
+	struct rspamd_url url;
+	gint rc;
 };
 
 struct url_match_scanner *url_scanner = NULL;
@@ -509,6 +542,8 @@ rspamd_url_parse_tld_file (const gchar *fname,
 		m.flags = flags;
 		rspamd_multipattern_add_pattern (url_scanner->search_trie_full, p,
 				RSPAMD_MULTIPATTERN_TLD|RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_UTF8);
+		/* Leading dot is added to TLD patterns */
+		scanner->max_pattern_len = MAX (scanner->max_pattern_len, strlen (p) + 1);
 		m.pattern = rspamd_multipattern_get_pattern (url_scanner->search_trie_full,
 				rspamd_multipattern_get_npatterns (url_scanner->search_trie_full) - 1);
 
@@ -527,6 +562,9 @@ rspamd_url_add_static_matchers (struct url_match_scanner *sc)
 	gint n = G_N_ELEMENTS (static_matchers), i;
 
 	for (i = 0; i < n; i++) {
+		sc->max_pattern_len = MAX (sc->max_pattern_len,
+				strlen (static_matchers[i].pattern));
+
 		if (static_matchers[i].flags & URL_FLAG_REGEXP) {
 			rspamd_multipattern_add_pattern (url_scanner->search_trie_strict,
 					static_matchers[i].pattern,
@@ -571,6 +609,7 @@ rspamd_url_deinit (void)
 
 		rspamd_multipattern_destroy (url_scanner->search_trie_strict);
 		g_array_free (url_scanner->matchers_strict, TRUE);
+		rspamd_lru_hash_destroy (url_scanner->parse_cache);
 		g_free (url_scanner);
 
 		url_scanner = NULL;
@@ -588,6 +627,11 @@ rspamd_url_init (const gchar *tld_file)
 	}
 
 	url_scanner = g_malloc (sizeof (struct url_match_scanner));
+	url_scanner->max_pattern_len = 0;
+	/* Key is a part of the element */
+	url_scanner->parse_cache = rspamd_lru_hash_new_full (URL_PARSE_CACHE_SIZE,
+			NULL, g_free,
+			rspamd_url_cache_key_hash, rspamd_url_cache_key_equal);
 
 	url_scanner->matchers_strict = g_array_sized_new (FALSE, TRUE,
 			sizeof (struct url_matcher), G_N_ELEMENTS (static_matchers));
@@ -2204,8 +2248,8 @@ rspamd_url_remove_dots (struct rspamd_url *uri)
 	return ret;
 }
 
-enum uri_errno
-rspamd_url_parse (struct rspamd_url *uri,
+static enum uri_errno
+rspamd_url_parse_uncached (struct rspamd_url *uri,
 				  gchar *uristring, gsize len,
 				  rspamd_mempool_t *pool,
 				  enum rspamd_url_parse_flags parse_flags)
@@ -2530,6 +2574,98 @@ rspamd_url_parse (struct rspamd_url *uri,
 	return URI_ERRNO_OK;
 }
 
+static guint
+rspamd_url_cache_key_hash (gconstpointer k)
+{
+	const struct rspamd_url_cache_key *key = k;
+
+	return (guint)rspamd_cryptobox_fast_hash (key->begin, key->len,
+			rspamd_hash_seed () ^ key->parse_flags);
+}
+
+static gboolean
+rspamd_url_cache_key_equal (gconstpointer k1, gconstpointer k2)
+{
+	const struct rspamd_url_cache_key *key1 = k1, *key2 = k2;
+
+	return key1->len == key2->len && key1->parse_flags == key2->parse_flags &&
+		   memcmp (key1->begin, key2->begin, key1->len) == 0;
+}
+
+static void
+rspamd_url_cache_store (const struct rspamd_url_cache_key *key,
+		const struct rspamd_url *uri, gint rc)
+{
+	struct rspamd_url_cache_elt *elt;
+	gsize slen = uri->string ? uri->urllen : 0;
+	gchar *p;
+
+	elt = g_malloc (sizeof (*elt) + key->len + slen + 1);
+	p = (gchar *)(elt + 1);
+	memcpy (p, key->begin, key->len);
+	elt->key.begin = p;
+	elt->key.len = key->len;
+	elt->key.parse_flags = key->parse_flags;
+	elt->url = *uri;
+	elt->rc = rc;
+
+	if (uri->string) {
+		p += key->len;
+		memcpy (p, uri->string, slen);
+		p[slen] = '\0';
+		elt->url.string = p;
+	}
+
+	rspamd_lru_hash_insert (url_scanner->parse_cache, &elt->key, elt,
+			(time_t)rspamd_get_calendar_ticks (), 0);
+}
+
+enum uri_errno
+rspamd_url_parse (struct rspamd_url *uri,
+				  gchar *uristring, gsize len,
+				  rspamd_mempool_t *pool,
+				  enum rspamd_url_parse_flags parse_flags)
+{
+	struct rspamd_url_cache_key key;
+	struct rspamd_url_cache_elt *elt;
+	gint rc;
+
+	if (url_scanner == NULL || len == 0 || len > URL_PARSE_CACHE_MAX_LEN) {
+		return rspamd_url_parse_uncached (uri, uristring, len, pool,
+				parse_flags);
+	}
+
+	/*
+	 * The same urls are met in many messages, so we keep the results of
+	 * parsing as parsing is deterministic for the same input
+	 */
+	key.begin = uristring;
+	key.len = len;
+	key.parse_flags = parse_flags;
+	elt = rspamd_lru_hash_lookup (url_scanner->parse_cache, &key,
+			(time_t)rspamd_get_calendar_ticks ());
+
+	if (elt != NULL) {
+		*uri = elt->url;
+
+		if (elt->url.string) {
+			uri->string = rspamd_mempool_alloc (pool, elt->url.urllen + 1);
+			memcpy (uri->string, elt->url.string, elt->url.urllen + 1);
+		}
+
+		if (elt->url.raw) {
+			uri->raw = uristring;
+		}
+
+		return elt->rc;
+	}
+
+	rc = rspamd_url_parse_uncached (uri, uristring, len, pool, parse_flags);
+	rspamd_url_cache_store (&key, uri, rc);
+
+	return rc;
+}
+
 struct tld_trie_cbdata {
 	const gchar *begin;
 	gsize len;
@@ -3180,6 +3316,178 @@ rspamd_url_trie_callback (struct rspamd_multipattern *mp,
 	return 0;
 }
 
+/*
+ * Each url pattern contains either ':', '@' or a dot adjacent to a domain
+ * character (`.com`, `www.`), so a text is scanned for such anchors first and
+ * the tries are executed merely in windows around them
+ */
+static inline gboolean
+rspamd_url_is_anchor (const gchar *p, const gchar *begin, const gchar *end)
+{
+	if (*p != '.') {
+		return TRUE;
+	}
+
+	if (p + 1 < end && (g_ascii_isalnum (p[1]) || (guchar)p[1] >= 0x80)) {
+		return TRUE;
+	}
+
+	if (p > begin && (g_ascii_isalnum (p[-1]) || (guchar)p[-1] >= 0x80)) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+#define is_url_anchor_char(c) ((c) == ':' || (c) == '@' || (c) == '.')
+
+static const gchar *
+rspamd_url_next_anchor (const gchar *p, const gchar *begin, const gchar *end)
+{
+#if defined(__SSE2__)
+	const __m128i colon = _mm_set1_epi8 (':'), at = _mm_set1_epi8 ('@'),
+			dot = _mm_set1_epi8 ('.');
+
+	while (end - p >= 16) {
+		__m128i in = _mm_loadu_si128 ((const __m128i *)p);
+		guint mask = _mm_movemask_epi8 (_mm_or_si128 (
+				_mm_or_si128 (_mm_cmpeq_epi8 (in, colon), _mm_cmpeq_epi8 (in, at)),
+				_mm_cmpeq_epi8 (in, dot)));
+
+		while (mask != 0) {
+			const gchar *c = p + __builtin_ctz (mask);
+
+			if (rspamd_url_is_anchor (c, begin, end)) {
+				return c;
+			}
+
+			mask &= mask - 1;
+		}
+
+		p += 16;
+	}
+#elif defined(RSPAMD_URL_NEON)
+	const uint8x16_t colon = vdupq_n_u8 (':'), at = vdupq_n_u8 ('@'),
+			dot = vdupq_n_u8 ('.');
+
+	while (end - p >= 16) {
+		uint8x16_t in = vld1q_u8 ((const guint8 *)p);
+		uint8x16_t m = vorrq_u8 (vorrq_u8 (vceqq_u8 (in, colon),
+				vceqq_u8 (in, at)), vceqq_u8 (in, dot));
+		/* Four bits per input byte */
+		guint64 mask = vget_lane_u64 (vreinterpret_u64_u8 (
+				vshrn_n_u16 (vreinterpretq_u16_u8 (m), 4)), 0);
+
+		while (mask != 0) {
+			const gchar *c = p + (__builtin_ctzll (mask) >> 2u);
+
+			if (rspamd_url_is_anchor (c, begin, end)) {
+				return c;
+			}
+
+			mask &= ~(0xfULL << (__builtin_ctzll (mask) & ~3u));
+		}
+
+		p += 16;
+	}
+#endif
+
+	for (; p < end; p ++) {
+		if (is_url_anchor_char (*p) && rspamd_url_is_anchor (p, begin, end)) {
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+#undef is_url_anchor_char
+
+struct rspamd_url_window_cbdata {
+	rspamd_multipattern_cb_t cb;
+	gpointer ud;
+	const gchar *in;
+	gsize len;
+	gint offset;
+};
+
+static gint
+rspamd_url_window_callback (struct rspamd_multipattern *mp,
+							guint strnum,
+							gint match_start,
+							gint match_pos,
+							const gchar *text,
+							gsize len,
+							void *context)
+{
+	struct rspamd_url_window_cbdata *wcbd = context;
+
+	/* Callbacks always work with offsets in the whole text */
+	return wcbd->cb (mp, strnum, match_start + wcbd->offset,
+			match_pos + wcbd->offset, wcbd->in, wcbd->len, wcbd->ud);
+}
+
+/*
+ * Runs url trie over all windows around anchors in the text, adjacent
+ * windows are merged. A match cannot be longer than the longest pattern, so it
+ * is always within a window of its anchor; two more characters are added to
+ * the window end for an optional colon and word boundary checks that follow
+ * TLD patterns in hyperscan
+ */
+static gint
+rspamd_url_trie_lookup (struct rspamd_multipattern *mp,
+						const gchar *in, gsize inlen,
+						rspamd_multipattern_cb_t cb, gpointer ud)
+{
+	struct rspamd_url_window_cbdata wcbd;
+	const gchar *p = in, *end = in + inlen, *a, *ws = NULL, *we = NULL,
+			*nws, *nwe;
+	gsize margin = url_scanner->max_pattern_len;
+	gint ret = 0;
+
+	wcbd.cb = cb;
+	wcbd.ud = ud;
+	wcbd.in = in;
+	wcbd.len = inlen;
+
+	while ((a = rspamd_url_next_anchor (p, in, end)) != NULL) {
+		nws = (gsize)(a - in) > margin ? a - margin : in;
+		nwe = (gsize)(end - a) > margin + 2 ? a + margin + 2 : end;
+
+		if (ws != NULL && nws <= we) {
+			we = nwe;
+		}
+		else {
+			if (ws != NULL) {
+				wcbd.offset = ws - in;
+				ret = rspamd_multipattern_lookup (mp, ws, we - ws,
+						rspamd_url_window_callback, &wcbd, NULL);
+
+				if (ret != 0) {
+					return ret;
+				}
+			}
+
+			ws = nws;
+			we = nwe;
+		}
+
+		if (we == end) {
+			break;
+		}
+
+		p = a + 1;
+	}
+
+	if (ws != NULL) {
+		wcbd.offset = ws - in;
+		ret = rspamd_multipattern_lookup (mp, ws, we - ws,
+				rspamd_url_window_callback, &wcbd, NULL);
+	}
+
+	return ret;
+}
+
 gboolean
 rspamd_url_find (rspamd_mempool_t *pool,
 				 const gchar *begin, gsize len,
@@ -3200,22 +3508,22 @@ rspamd_url_find (rspamd_mempool_t *pool,
 	if (how == RSPAMD_URL_FIND_ALL) {
 		if (url_scanner->search_trie_full) {
 			cb.matchers = url_scanner->matchers_full;
-			ret = rspamd_multipattern_lookup (url_scanner->search_trie_full,
+			ret = rspamd_url_trie_lookup (url_scanner->search_trie_full,
 					begin, len,
-					rspamd_url_trie_callback, &cb, NULL);
+					rspamd_url_trie_callback, &cb);
 		}
 		else {
 			cb.matchers = url_scanner->matchers_strict;
-			ret = rspamd_multipattern_lookup (url_scanner->search_trie_strict,
+			ret = rspamd_url_trie_lookup (url_scanner->search_trie_strict,
 					begin, len,
-					rspamd_url_trie_callback, &cb, NULL);
+					rspamd_url_trie_callback, &cb);
 		}
 	}
 	else {
 		cb.matchers = url_scanner->matchers_strict;
-		ret = rspamd_multipattern_lookup (url_scanner->search_trie_strict,
+		ret = rspamd_url_trie_lookup (url_scanner->search_trie_strict,
 				begin, len,
-				rspamd_url_trie_callback, &cb, NULL);
+				rspamd_url_trie_callback, &cb);
 	}
 
 	if (ret) {
@@ -3555,22 +3863,22 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool,
 	if (how == RSPAMD_URL_FIND_ALL) {
 		if (url_scanner->search_trie_full) {
 			cb.matchers = url_scanner->matchers_full;
-			rspamd_multipattern_lookup (url_scanner->search_trie_full,
+			rspamd_url_trie_lookup (url_scanner->search_trie_full,
 					in, inlen,
-					rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+					rspamd_url_trie_generic_callback_multiple, &cb);
 		}
 		else {
 			cb.matchers = url_scanner->matchers_strict;
-			rspamd_multipattern_lookup (url_scanner->search_trie_strict,
+			rspamd_url_trie_lookup (url_scanner->search_trie_strict,
 					in, inlen,
-					rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+					rspamd_url_trie_generic_callback_multiple, &cb);
 		}
 	}
 	else {
 		cb.matchers = url_scanner->matchers_strict;
-		rspamd_multipattern_lookup (url_scanner->search_trie_strict,
+		rspamd_url_trie_lookup (url_scanner->search_trie_strict,
 				in, inlen,
-				rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+				rspamd_url_trie_generic_callback_multiple, &cb);
 	}
 }
 
@@ -3602,22 +3910,22 @@ rspamd_url_find_single (rspamd_mempool_t *pool,
 	if (how == RSPAMD_URL_FIND_ALL) {
 		if (url_scanner->search_trie_full) {
 			cb.matchers = url_scanner->matchers_full;
-			rspamd_multipattern_lookup (url_scanner->search_trie_full,
+			rspamd_url_trie_lookup (url_scanner->search_trie_full,
 					in, inlen,
-					rspamd_url_trie_generic_callback_single, &cb, NULL);
+					rspamd_url_trie_generic_callback_single, &cb);
 		}
 		else {
 			cb.matchers = url_scanner->matchers_strict;
-			rspamd_multipattern_lookup (url_scanner->search_trie_strict,
+			rspamd_url_trie_lookup (url_scanner->search_trie_strict,
 					in, inlen,
-					rspamd_url_trie_generic_callback_single, &cb, NULL);
+					rspamd_url_trie_generic_callback_single, &cb);
 		}
 	}
 	else {
 		cb.matchers = url_scanner->matchers_strict;
-		rspamd_multipattern_lookup (url_scanner->search_trie_strict,
+		rspamd_url_trie_lookup (url_scanner->search_trie_strict,
 				in, inlen,
-				rspamd_url_trie_generic_callback_single, &cb, NULL);
+				rspamd_url_trie_generic_callback_single, &cb);
 	}
 }
 
@@ -475,11 +475,25 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	GList *cur;
 	struct rspamd_worker_listen_socket *ls;
 	struct rspamd_worker_accept_event *accept_ev;
+	gint ev_backend_flags;
 
 	worker->signal_events = g_hash_table_new_full (g_direct_hash, g_direct_equal,
 			NULL, rspamd_sigh_free);
 
-	event_loop = ev_loop_new (rspamd_config_ev_backend_get (worker->srv->cfg));
+	ev_backend_flags = rspamd_config_ev_backend_get (worker->srv->cfg);
+	event_loop = ev_loop_new (ev_backend_flags);
+
+	if (event_loop == NULL) {
+		msg_err ("cannot init event loop for %s worker! exiting", name);
+		exit (EXIT_FAILURE);
+	}
+
+	if ((ev_backend_flags & EVBACKEND_IOURING) &&
+			!(ev_backend (event_loop) & EVBACKEND_IOURING)) {
+		msg_warn ("io_uring is unavailable, %s worker uses %s events backend",
+				name,
+				rspamd_config_ev_backend_to_string (ev_backend (event_loop), NULL));
+	}
 
 	worker->srv->event_loop = event_loop;
 
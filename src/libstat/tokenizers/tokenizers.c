@@ -692,6 +692,55 @@ rspamd_tokenize_meta_words (struct rspamd_task *task)
 	}
 }
 
+#define RSPAMD_TOKENIZER_CHAR_KEEP (1u << 0)
+#define RSPAMD_TOKENIZER_CHAR_EMOJI (1u << 1)
+#define RSPAMD_TOKENIZER_CHAR_INVISIBLE (1u << 2)
+
+/*
+ * Returns how a character is treated in the normalised form of a word
+ */
+static inline guint
+rspamd_tokenizer_char_props (UChar32 t)
+{
+	guint props = 0;
+
+	if (u_isgraph (t)) {
+		UCharCategory cat;
+
+		cat = u_charType (t);
+#if U_ICU_VERSION_MAJOR_NUM >= 57
+		if (u_hasBinaryProperty (t, UCHAR_EMOJI)) {
+			props |= RSPAMD_TOKENIZER_CHAR_EMOJI;
+		}
+#endif
+
+		if ((cat >= U_UPPERCASE_LETTER && cat <= U_OTHER_NUMBER) ||
+				cat == U_CONNECTOR_PUNCTUATION ||
+				cat == U_MATH_SYMBOL ||
+				cat == U_CURRENCY_SYMBOL) {
+			props |= RSPAMD_TOKENIZER_CHAR_KEEP;
+		}
+	}
+	else {
+		/* Invisible spaces ! */
+		props |= RSPAMD_TOKENIZER_CHAR_INVISIBLE;
+	}
+
+	return props;
+}
+
+static inline void
+rspamd_tokenizer_apply_char_props (rspamd_stat_token_t *tok, guint props)
+{
+	if (props & RSPAMD_TOKENIZER_CHAR_EMOJI) {
+		tok->flags |= RSPAMD_STAT_TOKEN_FLAG_EMOJI;
+	}
+
+	if (props & RSPAMD_TOKENIZER_CHAR_INVISIBLE) {
+		tok->flags |= RSPAMD_STAT_TOKEN_FLAG_INVISIBLE_SPACES;
+	}
+}
+
 static inline void
 rspamd_uchars_to_ucs32 (const UChar *src, gsize srclen,
 						rspamd_stat_token_t *tok,
@@ -699,38 +748,67 @@ rspamd_uchars_to_ucs32 (const UChar *src, gsize srclen,
 {
 	UChar32 *dest, t, *d;
 	gint32 i = 0;
+	guint props;
 
 	dest = rspamd_mempool_alloc (pool, srclen * sizeof (UChar32));
 	d = dest;
 
 	while (i < srclen) {
 		U16_NEXT_UNSAFE (src, i, t);
+		props = rspamd_tokenizer_char_props (t);
+		rspamd_tokenizer_apply_char_props (tok, props);
 
-		if (u_isgraph (t)) {
-			UCharCategory cat;
+		if (props & RSPAMD_TOKENIZER_CHAR_KEEP) {
+			*d++ = u_tolower (t);
+		}
+	}
 
-			cat = u_charType (t);
-#if U_ICU_VERSION_MAJOR_NUM >= 57
-			if (u_hasBinaryProperty (t, UCHAR_EMOJI)) {
-				tok->flags |= RSPAMD_STAT_TOKEN_FLAG_EMOJI;
-			}
-#endif
+	tok->unicode.begin = dest;
+	tok->unicode.len = d - dest;
+}
 
-			if ((cat >= U_UPPERCASE_LETTER && cat <= U_OTHER_NUMBER) ||
-					cat == U_CONNECTOR_PUNCTUATION ||
-					cat == U_MATH_SYMBOL ||
-					cat == U_CURRENCY_SYMBOL) {
-				*d++ = u_tolower (t);
-			}
+/*
+ * ASCII words are always normalised, so we can skip conversion to UChar
+ * and normalisation checks, producing exactly the same output as ICU path
+ */
+static void
+rspamd_normalize_ascii_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
+{
+	static guchar ascii_props[128];
+	static gboolean ascii_props_init = FALSE;
+	const guchar *p = (const guchar *)tok->original.begin;
+	UChar32 *dest;
+	gchar *ndest;
+	gsize i, dlen = 0;
+
+	if (!ascii_props_init) {
+		for (i = 0; i < G_N_ELEMENTS (ascii_props); i ++) {
+			ascii_props[i] = rspamd_tokenizer_char_props ((UChar32)i);
 		}
-		else {
-			/* Invisible spaces ! */
-			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_INVISIBLE_SPACES;
+
+		ascii_props_init = TRUE;
+	}
+
+	dest = rspamd_mempool_alloc (pool, tok->original.len * sizeof (UChar32));
+	ndest = rspamd_mempool_alloc (pool, tok->original.len + 1);
+
+	for (i = 0; i < tok->original.len; i ++) {
+		guint props = ascii_props[p[i]];
+
+		rspamd_tokenizer_apply_char_props (tok, props);
+
+		if (props & RSPAMD_TOKENIZER_CHAR_KEEP) {
+			ndest[dlen] = lc_map[p[i]];
+			dest[dlen] = (UChar32)ndest[dlen];
+			dlen ++;
 		}
 	}
 
+	ndest[dlen] = '\0';
 	tok->unicode.begin = dest;
-	tok->unicode.len = d - dest;
+	tok->unicode.len = dlen;
+	tok->normalized.begin = ndest;
+	tok->normalized.len = dlen;
 }
 
 static inline void
@@ -768,6 +846,16 @@ rspamd_normalize_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
 	UChar tmpbuf[1024]; /* Assume that we have no longer words... */
 	gsize ulen;
 
+	if ((tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) &&
+			tok->original.len < G_N_ELEMENTS (tmpbuf) &&
+			!rspamd_str_has_8bit ((const guchar *)tok->original.begin,
+					tok->original.len)) {
+		/* Most of the words are ascii, so we do not need ICU for them */
+		rspamd_normalize_ascii_word (tok, pool);
+
+		return;
+	}
+
 	utf8_converter = rspamd_get_utf8_converter ();
 
 	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
@@ -919,11 +1007,28 @@ rspamd_stem_words (GArray *words, rspamd_mempool_t *pool,
 		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
 			if (stem) {
 				const gchar *stemmed = NULL;
+				const rspamd_ftok_t *cached = NULL;
 
-				stemmed = sb_stemmer_stem (stem,
-						tok->normalized.begin, tok->normalized.len);
+				if (d != NULL && tok->normalized.len > 0) {
+					cached = rspamd_language_detector_stem_cache_lookup (d,
+							language, tok->normalized.begin, tok->normalized.len);
+				}
 
-				dlen = stemmed ? strlen (stemmed) : 0;
+				if (cached) {
+					stemmed = cached->begin;
+					dlen = cached->len;
+				}
+				else {
+					stemmed = sb_stemmer_stem (stem,
+							tok->normalized.begin, tok->normalized.len);
+					dlen = stemmed ? strlen (stemmed) : 0;
+
+					if (d != NULL && tok->normalized.len > 0) {
+						rspamd_language_detector_stem_cache_insert (d, language,
+								tok->normalized.begin, tok->normalized.len,
+								stemmed, dlen);
+					}
+				}
 
 				if (dlen > 0) {
 					dest = rspamd_mempool_alloc (pool, dlen + 1);
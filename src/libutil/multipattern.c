@@ -19,16 +19,29 @@
 #include "libutil/str_util.h"
 #include "libcryptobox/cryptobox.h"
 
-#ifdef WITH_HYPERSCAN
+#include "libutil/util.h"
 #include "logger.h"
 #include "unix-std.h"
+#ifdef WITH_HYPERSCAN
 #include "hs.h"
 #endif
 #include "acism.h"
 #include "libutil/regexp.h"
 #include <stdalign.h>
+#include <sys/time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RSPAMD_MULTIPATTERN_NEON 1
+#endif
 
 #define MAX_SCRATCH 4
+/* Do not bother with prefilter if patterns start with too many characters */
+#define PREFILTER_MAX_START 32
+/* How many bytes are fed to the trie before checking if it is in root state */
+#define PREFILTER_WINDOW 64
 
 enum rspamd_hs_check_state {
 	RSPAMD_HS_UNCHECKED = 0,
@@ -38,6 +51,21 @@ enum rspamd_hs_check_state {
 
 static const char *hs_cache_dir = NULL;
 static enum rspamd_hs_check_state hs_suitable_cpu = RSPAMD_HS_UNCHECKED;
+static gboolean hs_disabled = FALSE;
+
+/*
+ * Literal prefilter for acism: the trie stays in its root state while input
+ * contains no beginning of any pattern, so such regions are skipped by
+ * scanning for the first characters of patterns (and pairs of the first two
+ * characters) before the text is fed to the trie
+ */
+struct rspamd_multipattern_prefilter {
+	guint64 start[256 / 64];
+	guint64 pairs[65536 / 64];
+	guchar start_chars[3];
+	guint nstart;
+	gboolean has_short; /* Patterns with one character disable pairs check */
+};
 
 
 struct RSPAMD_ALIGNED(64) rspamd_multipattern {
@@ -51,6 +79,7 @@ struct RSPAMD_ALIGNED(64) rspamd_multipattern {
 	guint scratch_used;
 #endif
 	ac_trie_t *t;
+	struct rspamd_multipattern_prefilter *pf;
 	GArray *pats;
 	GArray *res;
 
@@ -68,6 +97,10 @@ rspamd_multipattern_quark (void)
 static inline gboolean
 rspamd_hs_check (void)
 {
+	if (G_UNLIKELY (hs_disabled)) {
+		return FALSE;
+	}
+
 #ifdef WITH_HYPERSCAN
 	if (G_UNLIKELY (hs_suitable_cpu == RSPAMD_HS_UNCHECKED)) {
 		if (hs_valid_platform () == HS_SUCCESS) {
@@ -91,6 +124,12 @@ rspamd_multipattern_library_init (const gchar *cache_dir)
 #endif
 }
 
+void
+rspamd_multipattern_library_disable_hyperscan (gboolean disable)
+{
+	hs_disabled = disable;
+}
+
 #ifdef WITH_HYPERSCAN
 static gchar *
 rspamd_multipattern_escape_tld_hyperscan (const gchar *pattern, gsize slen,
@@ -474,6 +513,267 @@ rspamd_multipattern_try_save_hs (struct rspamd_multipattern *mp,
 }
 #endif
 
+static void
+rspamd_multipattern_acism_hash (struct rspamd_multipattern *mp, guchar *hash)
+{
+	rspamd_cryptobox_hash_state_t st;
+	const ac_trie_pat_t *pat;
+	static const gchar acism_version[] = "acism2";
+	guint64 sz = sizeof (gpointer);
+	guint i;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)acism_version,
+			sizeof (acism_version));
+	/* Layout of the trie header depends on the platform */
+	rspamd_cryptobox_hash_update (&st, (const guchar *)&sz, sizeof (sz));
+
+	for (i = 0; i < mp->cnt; i ++) {
+		pat = &g_array_index (mp->pats, ac_trie_pat_t, i);
+		sz = pat->len;
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&sz, sizeof (sz));
+		rspamd_cryptobox_hash_update (&st, (const guchar *)pat->ptr, pat->len);
+	}
+
+	rspamd_cryptobox_hash_final (&st, hash);
+}
+
+static gboolean
+rspamd_multipattern_try_load_acism (struct rspamd_multipattern *mp,
+		const guchar *hash)
+{
+	gchar fp[PATH_MAX];
+	gpointer map;
+	gsize len;
+
+	if (hs_cache_dir == NULL) {
+		return FALSE;
+	}
+
+	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.acmp", hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+	if ((map = rspamd_file_xmap (fp, PROT_READ, &len, TRUE)) != NULL) {
+		if ((mp->t = acism_mmap (map, len, hash, rspamd_cryptobox_HASHBYTES,
+				mp->cnt)) != NULL) {
+			/* Used files are not removed when cache dir is cleaned */
+			(void)utimes (fp, NULL);
+
+			return TRUE;
+		}
+
+		msg_info ("invalid or stale acism cache %s, recompile it", fp);
+		munmap (map, len);
+		/* Remove stale file */
+		(void)unlink (fp);
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_multipattern_try_save_acism (struct rspamd_multipattern *mp,
+		const guchar *hash)
+{
+	gchar fp[PATH_MAX], np[PATH_MAX];
+	gint fd;
+
+	if (hs_cache_dir == NULL || mp->t == NULL) {
+		return;
+	}
+
+	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.acmp.tmp", hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) != -1) {
+		if (acism_dump (mp->t, fd, hash, rspamd_cryptobox_HASHBYTES) == -1) {
+			msg_warn ("cannot write acism cache to %s: %s",
+					fp, strerror (errno));
+			unlink (fp);
+		}
+		else {
+			fsync (fd);
+
+			rspamd_snprintf (np, sizeof (np), "%s/%*xs.acmp", hs_cache_dir,
+					(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+			if (rename (fp, np) == -1) {
+				msg_warn ("cannot rename acism cache from %s to %s: %s",
+						fp, np, strerror (errno));
+				unlink (fp);
+			}
+		}
+
+		close (fd);
+	}
+}
+
+#define PF_SET(bits, c) ((bits)[(c) >> 6u] |= (1ULL << ((c) & 63u)))
+#define PF_ISSET(bits, c) ((bits)[(c) >> 6u] & (1ULL << ((c) & 63u)))
+
+static void
+rspamd_multipattern_build_prefilter (struct rspamd_multipattern *mp)
+{
+	struct rspamd_multipattern_prefilter *pf;
+	const ac_trie_pat_t *pat;
+	gboolean icase = (mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+	guint i, j, k, c;
+	guchar c1[2], c2[2];
+
+	if (mp->t == NULL) {
+		return;
+	}
+
+	pf = g_malloc0 (sizeof (*pf));
+
+	for (i = 0; i < mp->cnt; i ++) {
+		pat = &g_array_index (mp->pats, ac_trie_pat_t, i);
+
+		if (pat->len == 0) {
+			/* Matches everywhere, nothing to filter */
+			g_free (pf);
+
+			return;
+		}
+
+		c1[0] = pat->ptr[0];
+		c1[1] = icase ? g_ascii_toupper (c1[0]) : c1[0];
+		c1[0] = icase ? g_ascii_tolower (c1[0]) : c1[0];
+
+		for (j = 0; j < 2; j ++) {
+			if (!PF_ISSET (pf->start, c1[j])) {
+				PF_SET (pf->start, c1[j]);
+
+				if (pf->nstart < G_N_ELEMENTS (pf->start_chars)) {
+					pf->start_chars[pf->nstart] = c1[j];
+				}
+
+				pf->nstart ++;
+			}
+		}
+
+		if (pat->len == 1) {
+			pf->has_short = TRUE;
+			continue;
+		}
+
+		c2[0] = pat->ptr[1];
+		c2[1] = icase ? g_ascii_toupper (c2[0]) : c2[0];
+		c2[0] = icase ? g_ascii_tolower (c2[0]) : c2[0];
+
+		for (j = 0; j < 2; j ++) {
+			for (k = 0; k < 2; k ++) {
+				c = ((guint)c1[j] << 8u) | c2[k];
+				PF_SET (pf->pairs, c);
+			}
+		}
+	}
+
+	if (pf->nstart > PREFILTER_MAX_START) {
+		g_free (pf);
+
+		return;
+	}
+
+	mp->pf = pf;
+}
+
+/*
+ * Returns the first position in text where some pattern might start or `end`
+ */
+static const gchar *
+rspamd_multipattern_prefilter_next (const struct rspamd_multipattern_prefilter *pf,
+		const gchar *p, const gchar *end)
+{
+	guint c;
+
+	while (p < end) {
+		if (pf->nstart == 1) {
+			p = memchr (p, pf->start_chars[0], end - p);
+
+			if (p == NULL) {
+				return end;
+			}
+		}
+		else {
+#if defined(__SSE2__) || defined(RSPAMD_MULTIPATTERN_NEON)
+			if (pf->nstart <= G_N_ELEMENTS (pf->start_chars)) {
+				/* Unused slots duplicate the first character */
+				guchar c0 = pf->start_chars[0],
+						cc1 = pf->nstart > 1 ? pf->start_chars[1] : c0,
+						cc2 = pf->nstart > 2 ? pf->start_chars[2] : c0;
+#if defined(__SSE2__)
+				const __m128i v0 = _mm_set1_epi8 ((gchar)c0),
+						v1 = _mm_set1_epi8 ((gchar)cc1),
+						v2 = _mm_set1_epi8 ((gchar)cc2);
+
+				while (end - p >= 16) {
+					__m128i in = _mm_loadu_si128 ((const __m128i *)p);
+					gint mask = _mm_movemask_epi8 (_mm_or_si128 (
+							_mm_or_si128 (_mm_cmpeq_epi8 (in, v0),
+									_mm_cmpeq_epi8 (in, v1)),
+							_mm_cmpeq_epi8 (in, v2)));
+
+					if (mask != 0) {
+						p += __builtin_ctz (mask);
+						break;
+					}
+
+					p += 16;
+				}
+#else
+				const uint8x16_t v0 = vdupq_n_u8 (c0),
+						v1 = vdupq_n_u8 (cc1),
+						v2 = vdupq_n_u8 (cc2);
+
+				while (end - p >= 16) {
+					uint8x16_t in = vld1q_u8 ((const guint8 *)p);
+					uint8x16_t m = vorrq_u8 (vorrq_u8 (vceqq_u8 (in, v0),
+							vceqq_u8 (in, v1)), vceqq_u8 (in, v2));
+
+					if (vmaxvq_u8 (m) != 0) {
+						/* Found within this block, the scalar loop stops there */
+						break;
+					}
+
+					p += 16;
+				}
+#endif
+			}
+#endif
+			while (p < end && !PF_ISSET (pf->start, (guchar)*p)) {
+				p ++;
+			}
+
+			if (p == end) {
+				return end;
+			}
+		}
+
+		if (pf->has_short) {
+			return p;
+		}
+
+		if (p + 1 == end) {
+			/* No room for any pattern */
+			return end;
+		}
+
+		c = ((guint)(guchar)p[0] << 8u) | (guchar)p[1];
+
+		if (PF_ISSET (pf->pairs, c)) {
+			return p;
+		}
+
+		p ++;
+	}
+
+	return end;
+}
+
+#undef PF_SET
+#undef PF_ISSET
+
 gboolean
 rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 {
@@ -552,7 +852,17 @@ rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 			}
 		}
 		else {
-			mp->t = acism_create ((const ac_trie_pat_t *) mp->pats->data, mp->cnt);
+			guchar hash[rspamd_cryptobox_HASHBYTES];
+
+			rspamd_multipattern_acism_hash (mp, hash);
+
+			if (!rspamd_multipattern_try_load_acism (mp, hash)) {
+				mp->t = acism_create ((const ac_trie_pat_t *) mp->pats->data,
+						mp->cnt);
+				rspamd_multipattern_try_save_acism (mp, hash);
+			}
+
+			rspamd_multipattern_build_prefilter (mp);
 		}
 	}
 
@@ -567,6 +877,7 @@ struct rspamd_multipattern_cbdata {
 	gsize len;
 	rspamd_multipattern_cb_t cb;
 	gpointer ud;
+	gsize offset; /* Offset of the text passed to acism */
 	guint nfound;
 	gint ret;
 };
@@ -606,6 +917,7 @@ rspamd_multipattern_acism_cb (int strnum, int textpos, void *context)
 	ac_trie_pat_t pat;
 
 	pat = g_array_index (cbd->mp->pats, ac_trie_pat_t, strnum);
+	textpos += cbd->offset;
 	ret = cbd->cb (cbd->mp, strnum, textpos - pat.len,
 			textpos, cbd->in, cbd->len, cbd->ud);
 
@@ -634,6 +946,7 @@ rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 	cbd.len = len;
 	cbd.cb = cb;
 	cbd.ud = ud;
+	cbd.offset = 0;
 	cbd.nfound = 0;
 	cbd.ret = 0;
 
@@ -699,6 +1012,36 @@ out:
 			*pnfound = cbd.nfound;
 		}
 	}
+	else if (mp->pf) {
+		/* Trie with prefilter: skip text while the trie is in its root state */
+		const gchar *p = in, *end = in + len, *wend;
+
+		while (p < end) {
+			if (state == 0) {
+				p = rspamd_multipattern_prefilter_next (mp->pf, p, end);
+
+				if (p == end) {
+					break;
+				}
+			}
+
+			wend = end - p > PREFILTER_WINDOW ? p + PREFILTER_WINDOW : end;
+			cbd.offset = p - in;
+			ret = acism_lookup (mp->t, p, wend - p,
+					rspamd_multipattern_acism_cb, &cbd,
+					&state, mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+
+			if (ret != 0) {
+				break;
+			}
+
+			p = wend;
+		}
+
+		if (pnfound) {
+			*pnfound = cbd.nfound;
+		}
+	}
 	else {
 		/* Plain trie */
 		ret = acism_lookup (mp->t, in, len, rspamd_multipattern_acism_cb, &cbd,
@@ -750,6 +1093,10 @@ rspamd_multipattern_destroy (struct rspamd_multipattern *mp)
 			acism_destroy (mp->t);
 		}
 
+		if (mp->pf) {
+			g_free (mp->pf);
+		}
+
 		for (i = 0; i < mp->cnt; i ++) {
 			pat = g_array_index (mp->pats, ac_trie_pat_t, i);
 			g_free ((gchar *)pat.ptr);
@@ -70,6 +70,13 @@ typedef gint (*rspamd_multipattern_cb_t) (struct rspamd_multipattern *mp,
  */
 void rspamd_multipattern_library_init (const gchar *cache_dir);
 
+/**
+ * Makes multipatterns use acism even if hyperscan is supported, it must be
+ * called when no multipatterns exist (used by tests)
+ * @param disable
+ */
+void rspamd_multipattern_library_disable_hyperscan (gboolean disable);
+
 /**
  * Creates empty multipattern structure
  * @param flags
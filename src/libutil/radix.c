@@ -38,6 +38,33 @@
 
 INIT_LOG_MODULE(radix)
 
+/*
+ * Flat multibit trie for IPv4 addresses (16-8-8 strides): the first level is
+ * indexed directly by the upper 16 bits of an address, each entry is either
+ * a value index or, if RADIX_FLAT_CHUNK bit is set, an index of a chunk of
+ * 256 entries for the next 8 bits. Each lookup costs at most 3 memory reads
+ * instead of walking btrie nodes.
+ */
+#define RADIX_FLAT_CHUNK (1u << 31u)
+#define RADIX_FLAT_L1_SIZE (1u << 16u)
+#define RADIX_FLAT_MIN_SIZE 64
+#define RADIX_FLAT_CHUNK_SIZE (256 * sizeof (guint32))
+/*
+ * Flat tables are built only if they cost less than this amount of bytes per
+ * IPv4 prefix (first level table is 256Kb and each chunk is 1Kb)
+ */
+#define RADIX_FLAT_MAX_BYTES_PER_PREFIX 4096
+
+struct radix_flat_v4 {
+	guint32 *l1;
+	guint32 *chunks;
+	guint nchunks;
+	guint chunks_allocated;
+	uintptr_t *values;
+	guint nvalues;
+	guint values_allocated;
+};
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	struct btrie *tree;
@@ -45,8 +72,52 @@ struct radix_tree_compressed {
 	size_t size;
 	guint duplicates;
 	gboolean own_pool;
+	gboolean has_flat_dtor;
+	struct radix_flat_v4 *flat;
 };
 
+static const guint8 radix_v4_mapped_prefix[12] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xffu, 0xffu
+};
+
+static void
+radix_flat_free (struct radix_flat_v4 *flat)
+{
+	if (flat) {
+		g_free (flat->l1);
+		g_free (flat->chunks);
+		g_free (flat->values);
+		g_free (flat);
+	}
+}
+
+static void
+radix_flat_dtor (gpointer p)
+{
+	radix_compressed_t *tree = (radix_compressed_t *)p;
+
+	radix_flat_free (tree->flat);
+	tree->flat = NULL;
+}
+
+static inline uintptr_t
+radix_flat_lookup (const struct radix_flat_v4 *flat, guint32 a)
+{
+	guint32 e;
+
+	e = flat->l1[a >> 16u];
+
+	if (e & RADIX_FLAT_CHUNK) {
+		e = flat->chunks[((e & ~RADIX_FLAT_CHUNK) << 8u) | ((a >> 8u) & 0xffu)];
+
+		if (e & RADIX_FLAT_CHUNK) {
+			e = flat->chunks[((e & ~RADIX_FLAT_CHUNK) << 8u) | (a & 0xffu)];
+		}
+	}
+
+	return e ? flat->values[e - 1] : RADIX_NO_VALUE;
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keylen)
 {
@@ -84,6 +155,12 @@ radix_insert_compressed (radix_compressed_t * tree,
 
 	old = radix_find_compressed (tree, key, keylen);
 
+	if (tree->flat) {
+		/* Flat tables are not updated incrementally */
+		radix_flat_free (tree->flat);
+		tree->flat = NULL;
+	}
+
 	ret = btrie_add_prefix (tree->tree, key, keybits - masklen,
 			(gconstpointer)value);
 
@@ -142,6 +219,8 @@ radix_create_compressed (const gchar *tree_name)
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = TRUE;
 	tree->name = tree_name;
+	tree->has_flat_dtor = FALSE;
+	tree->flat = NULL;
 
 	return tree;
 }
@@ -158,6 +237,8 @@ radix_create_compressed_with_pool (rspamd_mempool_t *pool, const gchar *tree_nam
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = FALSE;
 	tree->name = tree_name;
+	tree->has_flat_dtor = FALSE;
+	tree->flat = NULL;
 
 	return tree;
 }
@@ -188,6 +269,12 @@ radix_find_compressed_addr (radix_compressed_t *tree,
 	key = rspamd_inet_address_get_hash_key (addr, &klen);
 
 	if (key && klen) {
+		if (klen == 4 && tree->flat) {
+			return radix_flat_lookup (tree->flat,
+					((guint32)key[0] << 24u) | ((guint32)key[1] << 16u) |
+					((guint32)key[2] << 8u) | (guint32)key[3]);
+		}
+
 		if (klen == 4) {
 			/* Map to ipv6 */
 			memset (buf, 0, 10);
@@ -423,6 +510,244 @@ radix_get_pool (radix_compressed_t *tree)
 	return NULL;
 }
 
+void
+radix_find_compressed_addr_batch (radix_compressed_t *tree,
+		const rspamd_inet_addr_t * const *addrs, gsize naddrs,
+		uintptr_t *results)
+{
+	const guchar *key;
+	guint klen;
+	gsize i, j, blk;
+	guint32 v4[32];
+	gboolean is_v4[32];
+
+	if (tree->flat == NULL) {
+		for (i = 0; i < naddrs; i ++) {
+			results[i] = radix_find_compressed_addr (tree, addrs[i]);
+		}
+
+		return;
+	}
+
+	/*
+	 * Load the first level entries for a block of IPv4 addresses at once, so
+	 * they are fetched in parallel instead of waiting for each lookup in turn
+	 */
+	for (i = 0; i < naddrs; i += G_N_ELEMENTS (v4)) {
+		blk = MIN (naddrs - i, G_N_ELEMENTS (v4));
+
+		for (j = 0; j < blk; j ++) {
+			klen = 0;
+			key = addrs[i + j] ?
+					rspamd_inet_address_get_hash_key (addrs[i + j], &klen) : NULL;
+			is_v4[j] = (key != NULL && klen == 4);
+
+			if (is_v4[j]) {
+				v4[j] = ((guint32)key[0] << 24u) | ((guint32)key[1] << 16u) |
+						((guint32)key[2] << 8u) | (guint32)key[3];
+				__builtin_prefetch (&tree->flat->l1[v4[j] >> 16u]);
+			}
+		}
+
+		for (j = 0; j < blk; j ++) {
+			if (is_v4[j]) {
+				results[i + j] = radix_flat_lookup (tree->flat, v4[j]);
+			}
+			else {
+				results[i + j] = radix_find_compressed_addr (tree, addrs[i + j]);
+			}
+		}
+	}
+}
+
+struct radix_flat_build_cbdata {
+	struct radix_flat_v4 *flat;
+	GHashTable *values_idx;
+	gsize nprefixes;
+	gsize max_chunks;
+	gboolean overflow;
+};
+
+static guint32
+radix_flat_new_chunk (struct radix_flat_v4 *flat, guint32 fill)
+{
+	guint i;
+	guint32 *chunk;
+
+	if (flat->nchunks == flat->chunks_allocated) {
+		flat->chunks_allocated = MAX (16, flat->chunks_allocated * 2);
+		flat->chunks = g_realloc (flat->chunks,
+				flat->chunks_allocated * 256 * sizeof (guint32));
+	}
+
+	chunk = &flat->chunks[flat->nchunks * 256];
+
+	for (i = 0; i < 256; i ++) {
+		chunk[i] = fill;
+	}
+
+	return (flat->nchunks ++) | RADIX_FLAT_CHUNK;
+}
+
+static void
+radix_flat_fill (struct radix_flat_v4 *flat, guint32 a, guint len, guint32 v)
+{
+	guint32 i, start, n, *e;
+
+	if (len <= 16) {
+		start = len ? (a >> 16u) & ~((1u << (16 - len)) - 1) : 0;
+		n = 1u << (16 - len);
+
+		for (i = start; i < start + n; i ++) {
+			flat->l1[i] = v;
+		}
+
+		return;
+	}
+
+	e = &flat->l1[a >> 16u];
+
+	if (!(*e & RADIX_FLAT_CHUNK)) {
+		*e = radix_flat_new_chunk (flat, *e);
+	}
+
+	if (len <= 24) {
+		start = ((a >> 8u) & 0xffu) & ~((1u << (24 - len)) - 1);
+		n = 1u << (24 - len);
+
+		for (i = start; i < start + n; i ++) {
+			flat->chunks[((flat->l1[a >> 16u] & ~RADIX_FLAT_CHUNK) << 8u) | i] = v;
+		}
+
+		return;
+	}
+
+	/* Do not keep pointer to chunks as they might be reallocated */
+	i = ((flat->l1[a >> 16u] & ~RADIX_FLAT_CHUNK) << 8u) | ((a >> 8u) & 0xffu);
+
+	if (!(flat->chunks[i] & RADIX_FLAT_CHUNK)) {
+		guint32 c = radix_flat_new_chunk (flat, flat->chunks[i]);
+
+		flat->chunks[i] = c;
+	}
+
+	start = (a & 0xffu) & ~((1u << (32 - len)) - 1);
+	n = 1u << (32 - len);
+	i = (flat->chunks[i] & ~RADIX_FLAT_CHUNK) << 8u;
+
+	for (n += start; start < n; start ++) {
+		flat->chunks[i | start] = v;
+	}
+}
+
+static void
+radix_flat_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_flat_build_cbdata *cbd = user_data;
+	struct radix_flat_v4 *flat = cbd->flat;
+	guint32 a = 0, v;
+	guint i, v4len;
+
+	if (post || cbd->overflow) {
+		return;
+	}
+
+	/* Only IPv4 mapped part of the address space is stored in flat tables */
+	for (i = 0; i < sizeof (radix_v4_mapped_prefix) * NBBY && i < len; i ++) {
+		if ((prefix[i / NBBY] ^ radix_v4_mapped_prefix[i / NBBY]) &
+				(0x80u >> (i % NBBY))) {
+			return;
+		}
+	}
+
+	if (len > 96) {
+		v4len = len - 96;
+		a = ((guint32)prefix[12] << 24u) | ((guint32)prefix[13] << 16u) |
+			((guint32)prefix[14] << 8u) | (guint32)prefix[15];
+	}
+	else {
+		v4len = 0;
+	}
+
+	v = GPOINTER_TO_UINT (g_hash_table_lookup (cbd->values_idx, data));
+
+	if (v == 0) {
+		if (flat->nvalues == flat->values_allocated) {
+			flat->values_allocated = MAX (16, flat->values_allocated * 2);
+			flat->values = g_realloc (flat->values,
+					flat->values_allocated * sizeof (uintptr_t));
+		}
+
+		flat->values[flat->nvalues ++] = (uintptr_t)data;
+		v = flat->nvalues;
+		g_hash_table_insert (cbd->values_idx, (gpointer)data, GUINT_TO_POINTER (v));
+	}
+
+	/* Prefixes are walked in preorder, so more specific ones are filled later */
+	radix_flat_fill (flat, a, v4len, v);
+	cbd->nprefixes ++;
+
+	if (flat->nchunks > cbd->max_chunks) {
+		/* Too many sparse long prefixes, flat tables are not worth it */
+		cbd->overflow = TRUE;
+	}
+}
+
+void
+radix_build_flat_compressed (radix_compressed_t *tree)
+{
+	struct radix_flat_build_cbdata cbd;
+
+	g_assert (tree != NULL);
+
+	if (tree->flat || tree->size < RADIX_FLAT_MIN_SIZE) {
+		return;
+	}
+
+	cbd.flat = g_malloc0 (sizeof (*cbd.flat));
+	cbd.flat->l1 = g_malloc0 (RADIX_FLAT_L1_SIZE * sizeof (guint32));
+	cbd.values_idx = g_hash_table_new (g_direct_hash, g_direct_equal);
+	cbd.nprefixes = 0;
+	cbd.overflow = FALSE;
+	/* Tree size includes IPv6 prefixes, so it is an upper limit here */
+	cbd.max_chunks = MIN (RADIX_FLAT_CHUNK - 1,
+			tree->size * RADIX_FLAT_MAX_BYTES_PER_PREFIX / RADIX_FLAT_CHUNK_SIZE);
+
+	btrie_walk (tree->tree, radix_flat_walk_cb, &cbd);
+	g_hash_table_unref (cbd.values_idx);
+
+	if (cbd.overflow || cbd.nprefixes < RADIX_FLAT_MIN_SIZE ||
+			RADIX_FLAT_L1_SIZE * sizeof (guint32) +
+			cbd.flat->nchunks * RADIX_FLAT_CHUNK_SIZE >
+			cbd.nprefixes * RADIX_FLAT_MAX_BYTES_PER_PREFIX) {
+		/* Flat tables are too large for this set, use btrie lookups */
+		msg_debug_radix ("%s: do not build flat IPv4 tables: %z prefixes, "
+				"%ud chunks", tree->name, cbd.nprefixes, cbd.flat->nchunks);
+		radix_flat_free (cbd.flat);
+
+		return;
+	}
+
+	tree->flat = cbd.flat;
+
+	if (!tree->has_flat_dtor) {
+		rspamd_mempool_add_destructor (tree->pool, radix_flat_dtor, tree);
+		tree->has_flat_dtor = TRUE;
+	}
+
+	msg_debug_radix ("%s: built flat IPv4 tables: %ud chunks, %ud values",
+			tree->name, tree->flat->nchunks, tree->flat->nvalues);
+}
+
+gboolean
+radix_has_flat_compressed (radix_compressed_t *tree)
+{
+	g_assert (tree != NULL);
+
+	return tree->flat != NULL;
+}
+
 const gchar *
 radix_get_info (radix_compressed_t *tree)
 {
@@ -62,6 +62,31 @@ uintptr_t radix_find_compressed (radix_compressed_t *tree, const guint8 *key,
 uintptr_t radix_find_compressed_addr (radix_compressed_t *tree,
 									  const rspamd_inet_addr_t *addr);
 
+/**
+ * Find many addresses in tree at once (works for IPv4 or IPv6 addresses)
+ * @param tree
+ * @param addrs array of addresses
+ * @param naddrs number of addresses
+ * @param results array of `naddrs` values, `RADIX_NO_VALUE` for not found
+ */
+void radix_find_compressed_addr_batch (radix_compressed_t *tree,
+									   const rspamd_inet_addr_t * const *addrs,
+									   gsize naddrs,
+									   uintptr_t *results);
+
+/**
+ * Builds flat tables for faster IPv4 lookups, should be called when all
+ * elements are inserted (further insertions drop the tables)
+ * @param tree
+ */
+void radix_build_flat_compressed (radix_compressed_t *tree);
+
+/**
+ * Returns TRUE if flat IPv4 tables are built for the tree
+ * @param tree
+ */
+gboolean radix_has_flat_compressed (radix_compressed_t *tree);
+
 /**
  * Destroy the complete radix trie
  * @param tree
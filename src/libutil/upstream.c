@@ -60,6 +60,10 @@ struct upstream {
 	ev_timer ev;
 	gdouble last_fail;
 	gdouble last_resolve;
+	gdouble latency;
+	gdouble latency_ts;
+	gdouble inflight; /* Decaying estimate of requests in flight */
+	gdouble inflight_ts;
 	gpointer ud;
 	enum rspamd_upstream_flag flags;
 	struct upstream_list *ls;
@@ -90,12 +94,20 @@ struct upstream_limits {
 	guint dns_retransmits;
 };
 
+struct upstream_ring_point {
+	guint64 hash;
+	struct upstream *up;
+};
+
 struct upstream_list {
 	gchar *ups_line;
 	struct upstream_ctx *ctx;
 	GPtrArray *ups;
 	GPtrArray *alive;
 	struct upstream_list_watcher *watchers;
+	struct upstream_ring_point *ring; /* for bounded hashing */
+	guint ring_len;
+	guint ring_ups;
 	guint64 hash_seed;
 	const struct upstream_limits *limits;
 	enum rspamd_upstream_flag flags;
@@ -761,6 +773,43 @@ rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *upstrea
 	RSPAMD_UPSTREAM_UNLOCK (ls);
 }
 
+/* Smoothing factor for latency EWMA */
+#define LATENCY_EWMA_ALPHA 0.3
+/* Time constant to forget old measurements, so slow upstreams are probed again */
+#define LATENCY_DECAY_TIME 10.0
+/*
+ * Time constant to forget requests in flight: not all users release selected
+ * upstreams via ok or fail, so the estimate decays instead of leaking
+ */
+#define INFLIGHT_DECAY_TIME 5.0
+
+static inline gdouble
+rspamd_upstream_decayed_latency (struct upstream *up, gdouble now)
+{
+	if (up->latency > 0 && now > up->latency_ts) {
+		return up->latency * exp (-(now - up->latency_ts) / LATENCY_DECAY_TIME);
+	}
+
+	return up->latency;
+}
+
+static inline gdouble
+rspamd_upstream_inflight (struct upstream *up, gdouble now)
+{
+	if (up->inflight > 0 && now > up->inflight_ts) {
+		return up->inflight * exp (-(now - up->inflight_ts) / INFLIGHT_DECAY_TIME);
+	}
+
+	return up->inflight;
+}
+
+static inline void
+rspamd_upstream_inflight_add (struct upstream *up, gdouble now, gdouble delta)
+{
+	up->inflight = MAX (rspamd_upstream_inflight (up, now) + delta, 0.0);
+	up->inflight_ts = now;
+}
+
 void
 rspamd_upstream_fail (struct upstream *upstream,
 					  gboolean addr_failure,
@@ -775,6 +824,19 @@ rspamd_upstream_fail (struct upstream *upstream,
 			upstream->name,
 			reason);
 
+	sec_cur = rspamd_get_ticks (FALSE);
+	RSPAMD_UPSTREAM_LOCK (upstream);
+	rspamd_upstream_inflight_add (upstream, sec_cur, -1.0);
+
+	/* Failures are penalised as slow replies */
+	if (upstream->ls && upstream->ls->rot_alg == RSPAMD_UPSTREAM_LATENCY) {
+		upstream->latency = MAX (
+				rspamd_upstream_decayed_latency (upstream, sec_cur) * 2.0,
+				upstream->ls->limits->dns_timeout);
+		upstream->latency_ts = sec_cur;
+	}
+	RSPAMD_UPSTREAM_UNLOCK (upstream);
+
 	if (upstream->ctx && upstream->active_idx != -1 && upstream->ls) {
 		sec_cur = rspamd_get_ticks (FALSE);
 
@@ -885,6 +947,8 @@ rspamd_upstream_ok (struct upstream *upstream)
 	struct upstream_list_watcher *w;
 
 	RSPAMD_UPSTREAM_LOCK (upstream);
+	rspamd_upstream_inflight_add (upstream, rspamd_get_ticks (FALSE), -1.0);
+
 	if (upstream->errors > 0 && upstream->active_idx != -1 && upstream->ls) {
 		/* We touch upstream if and only if it is active */
 		msg_debug_upstream ("reset errors on upstream %s (was %ud)", upstream->name, upstream->errors);
@@ -905,11 +969,42 @@ rspamd_upstream_ok (struct upstream *upstream)
 	RSPAMD_UPSTREAM_UNLOCK (upstream);
 }
 
+void
+rspamd_upstream_latency (struct upstream *up, gdouble latency)
+{
+	gdouble now;
+
+	if (latency < 0) {
+		return;
+	}
+
+	now = rspamd_get_ticks (FALSE);
+	RSPAMD_UPSTREAM_LOCK (up);
+	if (up->latency == 0) {
+		/* The first measurement */
+		up->latency = latency;
+	}
+	else {
+		/* Blend with the value used for selection, so it does not drift */
+		up->latency = LATENCY_EWMA_ALPHA * latency +
+				(1.0 - LATENCY_EWMA_ALPHA) *
+				rspamd_upstream_decayed_latency (up, now);
+	}
+
+	up->latency_ts = now;
+	RSPAMD_UPSTREAM_UNLOCK (up);
+}
+
 void
 rspamd_upstream_set_weight (struct upstream *up, guint weight)
 {
 	RSPAMD_UPSTREAM_LOCK (up);
 	up->weight = weight;
+
+	if (up->ls) {
+		/* Virtual nodes depend on weight */
+		up->ls->ring_ups = 0;
+	}
 	RSPAMD_UPSTREAM_UNLOCK (up);
 }
 
@@ -1236,6 +1331,14 @@ rspamd_upstreams_parse_line_len (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "latency:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof ("latency:") - 1;
+	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "bounded-hash:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_HASHED_BOUNDED;
+		p += sizeof ("bounded-hash:") - 1;
+	}
 
 	while (p < end) {
 		span_len = rspamd_memcspn (p, separators, end - p);
@@ -1323,6 +1426,7 @@ rspamd_upstreams_destroy (struct upstream_list *ups)
 		}
 
 		g_free (ups->ups_line);
+		g_free (ups->ring);
 		g_ptr_array_free (ups->ups, TRUE);
 #ifdef UPSTREAMS_THREAD_SAFE
 		rspamd_mutex_free (ups->lock);
@@ -1449,6 +1553,76 @@ rspamd_upstream_get_round_robin (struct upstream_list *ups,
 	return selected;
 }
 
+/*
+ * Returns TRUE if the first upstream is cheaper than the second one: latency
+ * multiplied by the number of requests in flight if both latencies are known
+ * and just the number of requests in flight otherwise, so upstreams that
+ * are not measured (or those users do not report latency for) are still
+ * balanced by load
+ */
+static inline gboolean
+rspamd_upstream_latency_cheaper (struct upstream *first, struct upstream *second,
+		gdouble now)
+{
+	gdouble lat1 = rspamd_upstream_decayed_latency (first, now),
+		lat2 = rspamd_upstream_decayed_latency (second, now),
+		inflight1 = rspamd_upstream_inflight (first, now),
+		inflight2 = rspamd_upstream_inflight (second, now);
+
+	if (lat1 > 0 && lat2 > 0) {
+		return lat1 * (inflight1 + 1.0) < lat2 * (inflight2 + 1.0);
+	}
+
+	return inflight1 < inflight2;
+}
+
+/*
+ * Power of two choices: select two random alive upstreams and use the one
+ * with the lower latency multiplied by the number of requests in flight
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups,
+							 struct upstream *except)
+{
+	struct upstream *first, *second, *selected;
+	guint nalive = ups->alive->len, i1, i2;
+	gdouble now = rspamd_get_ticks (FALSE);
+
+	RSPAMD_UPSTREAM_LOCK (ups);
+
+	if (nalive == 2 && except != NULL) {
+		/* Only one choice */
+		selected = g_ptr_array_index (ups->alive, 0);
+
+		if (selected == except) {
+			selected = g_ptr_array_index (ups->alive, 1);
+		}
+	}
+	else {
+		do {
+			i1 = ottery_rand_range (nalive - 1);
+			first = g_ptr_array_index (ups->alive, i1);
+		} while (except && first == except);
+
+		do {
+			i2 = ottery_rand_range (nalive - 1);
+			second = g_ptr_array_index (ups->alive, i2);
+		} while (i2 == i1 || (except && second == except));
+
+		if (rspamd_upstream_latency_cheaper (second, first, now)) {
+			selected = second;
+		}
+		else {
+			selected = first;
+		}
+	}
+
+	rspamd_upstream_inflight_add (selected, now, 1.0);
+	RSPAMD_UPSTREAM_UNLOCK (ups);
+
+	return selected;
+}
+
 /*
  * The key idea of this function is obtained from the following paper:
  * A Fast, Minimal Memory, Consistent Hash Algorithm
@@ -1514,6 +1688,152 @@ rspamd_upstream_get_hashed (struct upstream_list *ups,
 	return up;
 }
 
+/*
+ * Consistent hashing with bounded loads:
+ * Vahab Mirrokni, Mikkel Thorup, Morteza Zadimoghaddam
+ *
+ * https://arxiv.org/abs/1608.01350
+ *
+ * Each upstream has a number of virtual nodes on the ring proportional to
+ * its weight. A key is assigned to the first node clockwise whose upstream
+ * has less than (1 + eps) * average requests in flight.
+ */
+#define UPSTREAM_RING_VNODES 40
+#define UPSTREAM_RING_MAX_WEIGHT 16
+#define UPSTREAM_BOUNDED_LOAD_FACTOR 1.25
+
+static gint
+rspamd_upstream_ring_cmp (const void *a, const void *b)
+{
+	const struct upstream_ring_point *p1 = a, *p2 = b;
+
+	if (p1->hash < p2->hash) {
+		return -1;
+	}
+	else if (p1->hash > p2->hash) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_upstream_build_ring (struct upstream_list *ups)
+{
+	struct upstream *up;
+	guint i, j, nvnodes, npoints = 0;
+
+	for (i = 0; i < ups->ups->len; i ++) {
+		up = g_ptr_array_index (ups->ups, i);
+		npoints += UPSTREAM_RING_VNODES *
+				MIN (MAX (up->weight, 1), UPSTREAM_RING_MAX_WEIGHT);
+	}
+
+	g_free (ups->ring);
+	ups->ring = g_malloc (sizeof (*ups->ring) * MAX (npoints, 1));
+	ups->ring_len = 0;
+
+	for (i = 0; i < ups->ups->len; i ++) {
+		up = g_ptr_array_index (ups->ups, i);
+		nvnodes = UPSTREAM_RING_VNODES *
+				MIN (MAX (up->weight, 1), UPSTREAM_RING_MAX_WEIGHT);
+
+		for (j = 0; j < nvnodes; j ++) {
+			/* Points depend on name only to be stable across lists */
+			ups->ring[ups->ring_len].hash = rspamd_cryptobox_fast_hash_specific (
+					RSPAMD_CRYPTOBOX_XXHASH64, up->name, strlen (up->name),
+					ups->hash_seed + j);
+			ups->ring[ups->ring_len].up = up;
+			ups->ring_len ++;
+		}
+	}
+
+	qsort (ups->ring, ups->ring_len, sizeof (*ups->ring),
+			rspamd_upstream_ring_cmp);
+	ups->ring_ups = ups->ups->len;
+}
+
+static struct upstream*
+rspamd_upstream_get_hashed_bounded (struct upstream_list *ups,
+									struct upstream *except,
+									const guint8 *key, guint keylen)
+{
+	guint64 k;
+	guint i, lo, hi, mid;
+	gdouble total_inflight = 0, max_load, now = rspamd_get_ticks (FALSE);
+	struct upstream *up, *selected = NULL, *fallback = NULL;
+
+	k = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			key, keylen, ups->hash_seed);
+
+	RSPAMD_UPSTREAM_LOCK (ups);
+
+	if (ups->ring == NULL || ups->ring_ups != ups->ups->len) {
+		rspamd_upstream_build_ring (ups);
+	}
+
+	for (i = 0; i < ups->alive->len; i ++) {
+		up = g_ptr_array_index (ups->alive, i);
+		total_inflight += rspamd_upstream_inflight (up, now);
+	}
+
+	max_load = ceil (UPSTREAM_BOUNDED_LOAD_FACTOR * (total_inflight + 1) /
+			(gdouble)ups->alive->len);
+
+	/* Find the first point that is not less than k */
+	lo = 0;
+	hi = ups->ring_len;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (ups->ring[mid].hash < k) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (i = 0; i < ups->ring_len; i ++) {
+		up = ups->ring[(lo + i) % ups->ring_len].up;
+
+		if (up->active_idx < 0 || (except != NULL && up == except)) {
+			continue;
+		}
+
+		if (fallback == NULL) {
+			fallback = up;
+		}
+
+		if (rspamd_upstream_inflight (up, now) + 1.0 <= max_load) {
+			selected = up;
+			break;
+		}
+	}
+
+	if (selected == NULL) {
+		selected = fallback;
+	}
+
+	if (selected) {
+		rspamd_upstream_inflight_add (selected, now, 1.0);
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK (ups);
+
+	if (selected) {
+		return selected;
+	}
+
+	/* We failed to find any active upstream */
+	up = rspamd_upstream_get_random (ups, except);
+	msg_info ("failed to find hashed upstream for %s, fallback to random: %s",
+			ups->ups_line, up->name);
+
+	return up;
+}
+
 static struct upstream*
 rspamd_upstream_get_common (struct upstream_list *ups,
 							struct upstream* except,
@@ -1546,7 +1866,8 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		type = default_type != RSPAMD_UPSTREAM_UNDEF ? default_type : ups->rot_alg;
 	}
 
-	if (type == RSPAMD_UPSTREAM_HASHED && (keylen == 0 || key == NULL)) {
+	if ((type == RSPAMD_UPSTREAM_HASHED || type == RSPAMD_UPSTREAM_HASHED_BOUNDED) &&
+			(keylen == 0 || key == NULL)) {
 		/* Cannot use hashed rotation when no key is specified, switch to random */
 		type = RSPAMD_UPSTREAM_RANDOM;
 	}
@@ -1565,6 +1886,12 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		up = rspamd_upstream_get_round_robin (ups, except, FALSE);
 		break;
+	case RSPAMD_UPSTREAM_LATENCY:
+		up = rspamd_upstream_get_latency (ups, except);
+		break;
+	case RSPAMD_UPSTREAM_HASHED_BOUNDED:
+		up = rspamd_upstream_get_hashed_bounded (ups, except, key, keylen);
+		break;
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
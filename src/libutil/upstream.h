@@ -16,6 +16,8 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
+	RSPAMD_UPSTREAM_HASHED_BOUNDED,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -67,6 +69,14 @@ void rspamd_upstream_fail (struct upstream *upstream, gboolean addr_failure, con
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Report observed latency of a request to an upstream, it is used by
+ * `RSPAMD_UPSTREAM_LATENCY` rotation. Should be called before `rspamd_upstream_ok`
+ * @param up
+ * @param latency latency in seconds
+ */
+void rspamd_upstream_latency (struct upstream *up, gdouble latency);
+
 /**
  * Set weight for an upstream
  * @param up
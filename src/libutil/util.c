@@ -1298,6 +1298,35 @@ rspamd_thread_func (gpointer ud)
 	return ud;
 }
 
+GThread *
+rspamd_create_thread (const gchar *name,
+		GThreadFunc func,
+		gpointer data,
+		GError **err)
+{
+	GThread *new;
+	struct rspamd_thread_data *td;
+	static gint32 id;
+	gsize r;
+
+	r = strlen (name) + sizeof ("-4294967296");
+	td = g_malloc (sizeof (struct rspamd_thread_data));
+	td->id = g_atomic_int_add (&id, 1) + 1;
+	td->name = g_malloc (r);
+	rspamd_snprintf (td->name, r, "%s-%d", name, td->id);
+	td->func = func;
+	td->data = data;
+
+	new = g_thread_try_new (td->name, rspamd_thread_func, td, err);
+
+	if (new == NULL) {
+		g_free (td->name);
+		g_free (td);
+	}
+
+	return new;
+}
+
 struct hash_copy_callback_data {
 	gpointer (*key_copy_func)(gconstpointer data, gpointer ud);
 	gpointer (*value_copy_func)(gconstpointer data, gpointer ud);
@@ -263,6 +263,19 @@ void rspamd_mutex_unlock (rspamd_mutex_t *mtx);
  */
 void rspamd_mutex_free (rspamd_mutex_t *mtx);
 
+/**
+ * Create generic thread with signals blocked
+ * @param name name of the thread
+ * @param func thread function
+ * @param data thread data
+ * @param err error pointer
+ * @return new thread or NULL
+ */
+GThread *rspamd_create_thread (const gchar *name,
+							   GThreadFunc func,
+							   gpointer data,
+							   GError **err);
+
 /**
  * Deep copy of one hash table to another
  * @param src source hash
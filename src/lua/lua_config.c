@@ -20,6 +20,7 @@
 #include "libserver/cfg_file_private.h"
 #include "libmime/lang_detection.h"
 #include "lua/lua_map.h"
+#include "libserver/maps/map.h"
 #include "lua/lua_thread_pool.h"
 #include "utlist.h"
 #include <math.h>
@@ -819,6 +820,7 @@ LUA_FUNCTION_DEF (config, init_modules);
  * - `modules` - init modules
  * - `langdet` - language detector
  * - `dns` - DNS resolver
+ * - `maps` - synchronously load static and file maps
  * - TODO: add more
  */
 LUA_FUNCTION_DEF (config, init_subsystem);
@@ -4416,6 +4418,9 @@ lua_config_init_subsystem (lua_State *L)
 			else if (strcmp (parts[i], "symcache") == 0) {
 				rspamd_symcache_init (cfg->cache);
 			}
+			else if (strcmp (parts[i], "maps") == 0) {
+				rspamd_map_preload (cfg);
+			}
 			else {
 				int ret = luaL_error (L, "invalid param: %s", parts[i]);
 				g_strfreev (parts);
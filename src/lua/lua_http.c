@@ -49,9 +49,11 @@ local function symbol_callback(task)
 static const gchar *M = "rspamd lua http";
 
 LUA_FUNCTION_DEF (http, request);
+LUA_FUNCTION_DEF (http, keepalive_stat);
 
 static const struct luaL_reg httplib_m[] = {
 	LUA_INTERFACE_DEF (http, request),
+	LUA_INTERFACE_DEF (http, keepalive_stat),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -83,6 +85,7 @@ struct lua_http_cbdata {
 	gint fd;
 	gint cbref;
 	struct thread_entry *thread;
+	struct rspamd_http_keepalive_waiter *waiter;
 	ref_entry_t ref;
 };
 
@@ -109,6 +112,11 @@ lua_http_fin (gpointer arg)
 		luaL_unref (cbd->cfg->lua_state, LUA_REGISTRYINDEX, cbd->cbref);
 	}
 
+	if (cbd->waiter) {
+		/* Request is still waiting for a keepalive connection */
+		rspamd_http_connection_cancel_keepalive_waiter (cbd->waiter);
+	}
+
 	if (cbd->conn) {
 		/* Here we already have a connection, so we need to unref it */
 		rspamd_http_connection_unref (cbd->conn);
@@ -190,32 +198,39 @@ lua_http_push_error (struct lua_http_cbdata *cbd, const char *err)
 	lua_thread_pool_restore_callback (&lcbd);
 }
 
-static void lua_http_resume_handler (struct rspamd_http_connection *conn,
+static void lua_http_resume_handler (struct lua_http_cbdata *cbd,
 						 struct rspamd_http_message *msg, const char *err);
 
 static void
-lua_http_error_handler (struct rspamd_http_connection *conn, GError *err)
+lua_http_fail (struct lua_http_cbdata *cbd, const char *err)
 {
-	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
 	if (cbd->cbref == -1) {
 		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_YIELDED) {
 			cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_YIELDED;
-			lua_http_resume_handler (conn, NULL, err->message);
+			lua_http_resume_handler (cbd, NULL, err);
 		}
 		else {
 			/* TODO: kill me please */
 			msg_info ("lost HTTP error from %s in coroutines mess: %s",
 					rspamd_inet_address_to_string_pretty (cbd->addr),
-					err->message);
+					err);
 		}
 	}
 	else {
-		lua_http_push_error (cbd, err->message);
+		lua_http_push_error (cbd, err);
 	}
 
 	REF_RELEASE (cbd);
 }
 
+static void
+lua_http_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
+
+	lua_http_fail (cbd, err->message);
+}
+
 static int
 lua_http_finish_handler (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg)
@@ -231,7 +246,7 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 	if (cbd->cbref == -1) {
 		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_YIELDED) {
 			cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_YIELDED;
-			lua_http_resume_handler (conn, msg, NULL);
+			lua_http_resume_handler (cbd, msg, NULL);
 		}
 		else {
 			/* TODO: kill me please */
@@ -306,10 +321,9 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
  * resumes yielded thread
  */
 static void
-lua_http_resume_handler (struct rspamd_http_connection *conn,
+lua_http_resume_handler (struct lua_http_cbdata *cbd,
 						 struct rspamd_http_message *msg, const char *err)
 {
-	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)conn->ud;
 	lua_State *L = cbd->thread->lua_state;
 	const gchar *body;
 	gsize body_len;
@@ -384,6 +398,66 @@ lua_http_resume_handler (struct rspamd_http_connection *conn,
 	lua_thread_resume (cbd->thread, 2);
 }
 
+static gboolean
+lua_http_start_request (struct lua_http_cbdata *cbd)
+{
+	if (cbd->local_kp) {
+		rspamd_http_connection_set_key (cbd->conn, cbd->local_kp);
+	}
+
+	if (cbd->peer_pk) {
+		rspamd_http_message_set_peer_key (cbd->msg, cbd->peer_pk);
+	}
+
+	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_NOVERIFY) {
+		cbd->msg->flags |= RSPAMD_HTTP_FLAG_SSL_NOVERIFY;
+	}
+
+	if (cbd->max_size) {
+		rspamd_http_connection_set_max_size (cbd->conn, cbd->max_size);
+	}
+
+	if (cbd->auth) {
+		rspamd_http_message_add_header (cbd->msg, "Authorization",
+				cbd->auth);
+	}
+
+	if (cbd->task) {
+		cbd->conn->log_tag = cbd->task->task_pool->tag.uid;
+	}
+	else if (cbd->cfg) {
+		cbd->conn->log_tag = cbd->cfg->cfg_pool->tag.uid;
+	}
+
+	struct rspamd_http_message *msg = cbd->msg;
+
+	/* Message is now owned by a connection object */
+	cbd->msg = NULL;
+
+	return rspamd_http_connection_write_message (cbd->conn, msg,
+			cbd->host, cbd->mime_type, cbd,
+			cbd->timeout);
+}
+
+static void
+lua_http_keepalive_ready (struct rspamd_http_connection *conn,
+						  const gchar *err, gpointer ud)
+{
+	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)ud;
+
+	cbd->waiter = NULL;
+
+	if (conn == NULL) {
+		lua_http_fail (cbd, err);
+
+		return;
+	}
+
+	cbd->conn = conn;
+	/* Error handler is called on failure */
+	lua_http_start_request (cbd);
+}
+
 static gboolean
 lua_http_make_connection (struct lua_http_cbdata *cbd)
 {
@@ -391,13 +465,17 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 
 	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_KEEP_ALIVE) {
 		cbd->fd = -1; /* FD is owned by keepalive connection */
-		cbd->conn = rspamd_http_connection_new_keepalive (
+		cbd->conn = rspamd_http_connection_new_keepalive_queued (
 				NULL, /* Default context */
 				NULL,
 				lua_http_error_handler,
 				lua_http_finish_handler,
 				cbd->addr,
-				cbd->host);
+				cbd->host,
+				cbd->timeout,
+				lua_http_keepalive_ready,
+				cbd,
+				&cbd->waiter);
 	}
 	else {
 		cbd->fd = -1;
@@ -410,28 +488,7 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 				cbd->addr);
 	}
 
-	if (cbd->conn) {
-		if (cbd->local_kp) {
-			rspamd_http_connection_set_key (cbd->conn, cbd->local_kp);
-		}
-
-		if (cbd->peer_pk) {
-			rspamd_http_message_set_peer_key (cbd->msg, cbd->peer_pk);
-		}
-
-		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_NOVERIFY) {
-			cbd->msg->flags |= RSPAMD_HTTP_FLAG_SSL_NOVERIFY;
-		}
-
-		if (cbd->max_size) {
-			rspamd_http_connection_set_max_size (cbd->conn, cbd->max_size);
-		}
-
-		if (cbd->auth) {
-			rspamd_http_message_add_header (cbd->msg, "Authorization",
-					cbd->auth);
-		}
-
+	if (cbd->conn || cbd->waiter) {
 		if (cbd->session) {
 			rspamd_session_add_event (cbd->session,
 					(event_finalizer_t) lua_http_fin, cbd,
@@ -439,25 +496,16 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 			cbd->flags |= RSPAMD_LUA_HTTP_FLAG_RESOLVED;
 		}
 
-		if (cbd->task) {
-			cbd->conn->log_tag = cbd->task->task_pool->tag.uid;
-
-			if (cbd->item) {
-				rspamd_symcache_item_async_inc (cbd->task, cbd->item, M);
-			}
+		if (cbd->task && cbd->item) {
+			rspamd_symcache_item_async_inc (cbd->task, cbd->item, M);
 		}
-		else if (cbd->cfg) {
-			cbd->conn->log_tag = cbd->cfg->cfg_pool->tag.uid;
-		}
-
-		struct rspamd_http_message *msg = cbd->msg;
 
-		/* Message is now owned by a connection object */
-		cbd->msg = NULL;
+		if (cbd->waiter) {
+			/* Request is started when a keepalive connection is available */
+			return TRUE;
+		}
 
-		return rspamd_http_connection_write_message (cbd->conn, msg,
-				cbd->host, cbd->mime_type, cbd,
-				cbd->timeout);
+		return lua_http_start_request (cbd);
 	}
 
 	return FALSE;
@@ -1141,6 +1189,26 @@ lua_http_request (lua_State *L)
 	return 1;
 }
 
+/***
+ * @function rspamd_http.keepalive_stat()
+ * Returns statistics of the keepalive connections pool: counters of the
+ * created, reused and evicted connections, queued and timed out requests,
+ * and the current state of each destination
+ * @return {table} pool statistics
+ */
+static gint
+lua_http_keepalive_stat (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	ucl_object_t *stat;
+
+	stat = rspamd_http_context_keepalive_stat (rspamd_http_context_default ());
+	ucl_object_push_lua (L, stat, true);
+	ucl_object_unref (stat);
+
+	return 1;
+}
+
 static gint
 lua_load_http (lua_State * L)
 {
@@ -42,6 +42,17 @@
  */
 LUA_FUNCTION_DEF (map, get_key);
 
+/***
+ * @method map:get_keys(keys)
+ * Checks many keys at once, this is faster than calling `get_key` in a loop
+ * for hash, kv and radix maps as lookups are done in batches. Other map types
+ * are processed key by key.
+ *
+ * @param {table} keys array of inputs to check, the same types as for `get_key`
+ * @return {table} array with the same indexes as `keys` where each element is what `get_key` would return for the corresponding key
+ */
+LUA_FUNCTION_DEF (map, get_keys);
+
 
 /***
  * @method map:is_signed()
@@ -111,8 +122,16 @@ LUA_FUNCTION_DEF (map, get_data_digest);
  */
 LUA_FUNCTION_DEF (map, get_nelts);
 
+/***
+ * @method map:get_build_time()
+ * Get time spent to parse and build the last version of the map
+ * @return {number} build time in seconds
+ */
+LUA_FUNCTION_DEF (map, get_build_time);
+
 static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF (map, get_key),
+	LUA_INTERFACE_DEF (map, get_keys),
 	LUA_INTERFACE_DEF (map, is_signed),
 	LUA_INTERFACE_DEF (map, get_proto),
 	LUA_INTERFACE_DEF (map, get_sign_key),
@@ -122,6 +141,7 @@ static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF (map, get_stats),
 	LUA_INTERFACE_DEF (map, get_data_digest),
 	LUA_INTERFACE_DEF (map, get_nelts),
+	LUA_INTERFACE_DEF (map, get_build_time),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -980,6 +1000,167 @@ lua_map_get_key (lua_State * L)
 	return 1;
 }
 
+static void
+lua_map_get_keys_hash (lua_State *L, struct rspamd_lua_map *map, gsize nkeys)
+{
+	rspamd_ftok_t *keys;
+	gconstpointer *results;
+	gsize i;
+
+	keys = g_malloc (sizeof (*keys) * nkeys);
+	results = g_malloc (sizeof (*results) * nkeys);
+
+	/* Keys are owned by the input table that stays on the stack */
+	for (i = 0; i < nkeys; i ++) {
+		lua_rawgeti (L, 2, i + 1);
+		keys[i].begin = lua_map_process_string_key (L, -1, &keys[i].len);
+		lua_pop (L, 1);
+
+		if (keys[i].begin == NULL) {
+			keys[i].begin = "";
+			keys[i].len = 0;
+		}
+	}
+
+	rspamd_match_hash_map_batch (map->data.hash, keys, nkeys, results);
+
+	for (i = 0; i < nkeys; i ++) {
+		if (results[i] != NULL) {
+			if (map->type == RSPAMD_LUA_MAP_SET) {
+				lua_pushboolean (L, TRUE);
+			}
+			else {
+				lua_pushstring (L, results[i]);
+			}
+		}
+		else {
+			lua_pushboolean (L, FALSE);
+		}
+
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	g_free (keys);
+	g_free (results);
+}
+
+static void
+lua_map_get_keys_radix (lua_State *L, struct rspamd_lua_map *map, gsize nkeys)
+{
+	const rspamd_inet_addr_t **addrs;
+	gconstpointer *results;
+	guchar *storage;
+	struct rspamd_lua_ip *ip;
+	const gchar *addr_str;
+	gpointer ud;
+	gsize i, len, slen;
+	guint32 key_num;
+
+	slen = rspamd_inet_address_storage_size ();
+	addrs = g_malloc0 (sizeof (*addrs) * nkeys);
+	results = g_malloc (sizeof (*results) * nkeys);
+	storage = g_malloc (slen * nkeys);
+
+	for (i = 0; i < nkeys; i ++) {
+		lua_rawgeti (L, 2, i + 1);
+
+		if (lua_type (L, -1) == LUA_TSTRING) {
+			addr_str = lua_tolstring (L, -1, &len);
+
+			if (rspamd_parse_inet_address_ip (addr_str, len,
+					(rspamd_inet_addr_t *)(storage + i * slen))) {
+				addrs[i] = (rspamd_inet_addr_t *)(storage + i * slen);
+			}
+		}
+		else if (lua_type (L, -1) == LUA_TUSERDATA) {
+			ud = rspamd_lua_check_udata (L, -1, "rspamd{ip}");
+
+			if (ud != NULL) {
+				ip = *((struct rspamd_lua_ip **)ud);
+				addrs[i] = ip->addr;
+			}
+			else {
+				msg_err ("invalid userdata type provided, rspamd{ip} expected");
+			}
+		}
+
+		lua_pop (L, 1);
+	}
+
+	rspamd_match_radix_map_addr_batch (map->data.radix,
+			(const rspamd_inet_addr_t * const *)addrs, nkeys, results);
+
+	for (i = 0; i < nkeys; i ++) {
+		if (addrs[i] == NULL) {
+			/* Numeric keys are not covered by the batch lookup */
+			results[i] = NULL;
+			lua_rawgeti (L, 2, i + 1);
+
+			if (lua_type (L, -1) == LUA_TNUMBER) {
+				key_num = htonl ((guint32)lua_tointeger (L, -1));
+
+				if (key_num != 0 && map->data.radix) {
+					results[i] = rspamd_match_radix_map (map->data.radix,
+							(guint8 *)&key_num, sizeof (key_num));
+				}
+			}
+
+			lua_pop (L, 1);
+		}
+
+		if (results[i] != NULL) {
+			lua_pushstring (L, results[i]);
+		}
+		else {
+			lua_pushboolean (L, FALSE);
+		}
+
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	g_free (addrs);
+	g_free (results);
+	g_free (storage);
+}
+
+static gint
+lua_map_get_keys (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map (L, 1);
+	gsize nkeys, i;
+
+	if (map == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	nkeys = rspamd_lua_table_size (L, 2);
+	lua_createtable (L, nkeys, 0);
+
+	if (nkeys == 0) {
+		return 1;
+	}
+
+	if ((map->type == RSPAMD_LUA_MAP_SET || map->type == RSPAMD_LUA_MAP_HASH)
+			&& map->data.hash) {
+		lua_map_get_keys_hash (L, map, nkeys);
+	}
+	else if (map->type == RSPAMD_LUA_MAP_RADIX && map->data.radix) {
+		lua_map_get_keys_radix (L, map, nkeys);
+	}
+	else {
+		for (i = 0; i < nkeys; i ++) {
+			lua_pushcfunction (L, lua_map_get_key);
+			lua_pushvalue (L, 1);
+			lua_rawgeti (L, 2, i + 1);
+			lua_call (L, 2, 1);
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+
+	return 1;
+}
+
 static gboolean
 lua_map_traverse_cb (gconstpointer key,
 		gconstpointer value, gsize hits, gpointer ud)
@@ -1052,6 +1233,22 @@ lua_map_get_nelts (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_map_get_build_time (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map (L, 1);
+
+	if (map != NULL) {
+		lua_pushnumber (L, map->map->build_time);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static int
 lua_map_is_signed (lua_State *L)
 {
@@ -96,6 +96,7 @@ struct lua_redis_request_specific_userdata;
  */
 struct lua_redis_userdata {
 	redisAsyncContext *ctx;
+	void *shared; /* multiplexed connection from the pool, used instead of ctx */
 	struct rspamd_task *task;
 	struct rspamd_symcache_item *item;
 	struct rspamd_async_session *s;
@@ -187,11 +188,12 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 	struct lua_redis_request_specific_userdata *cur, *tmp;
 	gboolean is_successful = TRUE;
 	struct redisAsyncContext *ac;
+	void *shared;
 
 	ud = &ctx->async;
 	msg_debug_lua_redis ("desctructing %p", ctx);
 
-	if (ud->ctx) {
+	if (ud->ctx || ud->shared) {
 
 		LL_FOREACH_SAFE (ud->specific, cur, tmp) {
 			ev_timer_stop (ud->event_loop, &cur->timeout_ev);
@@ -209,7 +211,15 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 		ac = ud->ctx;
 		ud->ctx = NULL;
 
-		if (!is_successful) {
+		if (ud->shared) {
+			shared = ud->shared;
+			ud->shared = NULL;
+			/* Pending callbacks are cancelled, other users are not affected */
+			rspamd_redis_pool_release_shared (ud->pool, shared, ud,
+					is_successful ? RSPAMD_REDIS_RELEASE_DEFAULT :
+					RSPAMD_REDIS_RELEASE_FATAL);
+		}
+		else if (!is_successful) {
 			rspamd_redis_pool_release_connection (ud->pool, ac,
 					RSPAMD_REDIS_RELEASE_FATAL);
 		}
@@ -457,6 +467,7 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_userdata *ud;
 	redisAsyncContext *ac;
+	void *shared;
 
 	ctx = sp_ud->ctx;
 	ud = sp_ud->c;
@@ -506,7 +517,15 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 			ac = ud->ctx;
 			ud->ctx = NULL;
 
-			if (ac) {
+			if (ud->shared) {
+				shared = ud->shared;
+				ud->shared = NULL;
+				msg_debug_lua_redis ("release shared redis connection ud=%p; ctx=%p; refcount=%d",
+						ud, ctx, ctx->ref.refcount);
+				rspamd_redis_pool_release_shared (ud->pool, shared, ud,
+						RSPAMD_REDIS_RELEASE_DEFAULT);
+			}
+			else if (ac) {
 				msg_debug_lua_redis ("release redis connection ud=%p; ctx=%p; refcount=%d",
 						ud, ctx, ctx->ref.refcount);
 				rspamd_redis_pool_release_connection (ud->pool, ac,
@@ -738,6 +757,7 @@ lua_redis_timeout (EV_P_ ev_timer *w, int revents)
 	struct lua_redis_userdata *ud;
 	struct lua_redis_ctx *ctx;
 	redisAsyncContext *ac;
+	void *shared;
 
 	if (sp_ud->flags & LUA_REDIS_SPECIFIC_FINISHED) {
 		return;
@@ -764,6 +784,17 @@ lua_redis_timeout (EV_P_ ev_timer *w, int revents)
 		rspamd_redis_pool_release_connection (sp_ud->c->pool, ac,
 				RSPAMD_REDIS_RELEASE_FATAL);
 	}
+	else if (sp_ud->c->shared) {
+		shared = sp_ud->c->shared;
+		sp_ud->c->shared = NULL;
+		ud->terminated = 1;
+		/*
+		 * We cannot break a connection used by other requests, so just
+		 * forget about our pending command
+		 */
+		rspamd_redis_pool_release_shared (sp_ud->c->pool, shared, ud,
+				RSPAMD_REDIS_RELEASE_FATAL);
+	}
 
 	REDIS_RELEASE (ctx);
 }
@@ -865,8 +896,37 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 	*nargs = top;
 }
 
+/*
+ * Commands that block a connection or change its state cannot be pipelined
+ * with the requests of other users
+ */
+static gboolean
+lua_redis_cmd_can_share (const gchar *cmd)
+{
+	static const gchar *exclusive_cmds[] = {
+		"subscribe", "psubscribe", "ssubscribe", "monitor", "select", "auth",
+		"quit", "reset", "client", "multi", "watch", "wait", "blpop", "brpop",
+		"brpoplpush", "blmove", "blmpop", "bzpopmin", "bzpopmax", "bzmpop",
+		"xread", "xreadgroup", NULL
+	};
+	const gchar **p;
+
+	if (cmd == NULL) {
+		return FALSE;
+	}
+
+	for (p = exclusive_cmds; *p != NULL; p ++) {
+		if (g_ascii_strcasecmp (cmd, *p) == 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static struct lua_redis_ctx *
-rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_async)
+rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_async,
+		gboolean can_share)
 {
 	struct lua_redis_ctx *ctx = NULL;
 	rspamd_inet_addr_t *ip = NULL;
@@ -1053,6 +1113,25 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 
 	if (ret) {
 		ud->terminated = 0;
+
+		if (can_share && !(flags & LUA_REDIS_NO_POOL)) {
+			ud->shared = rspamd_redis_pool_connect_shared (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+
+			if (ud->shared) {
+				if (ip) {
+					rspamd_inet_address_free (ip);
+				}
+
+				msg_debug_lua_redis ("use shared redis connection host=%s; ctx=%p; ud=%p",
+						host, ctx, ud);
+
+				return ctx;
+			}
+		}
+
 		ud->ctx = rspamd_redis_pool_connect (ud->pool,
 				dbname, password,
 				rspamd_inet_address_to_string (addr->addr),
@@ -1116,7 +1195,15 @@ lua_redis_make_request (lua_State *L)
 	gint cbref = -1;
 	gboolean ret = FALSE;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, TRUE);
+	if (lua_istable (L, 1)) {
+		lua_pushstring (L, "cmd");
+		lua_gettable (L, 1);
+		cmd = lua_tostring (L, -1);
+		lua_pop (L, 1);
+	}
+
+	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, TRUE,
+			lua_redis_cmd_can_share (cmd));
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1125,11 +1212,6 @@ lua_redis_make_request (lua_State *L)
 		sp_ud->c = ud;
 		sp_ud->ctx = ctx;
 
-		lua_pushstring (L, "cmd");
-		lua_gettable (L, -2);
-		cmd = lua_tostring (L, -1);
-		lua_pop (L, 1);
-
 		lua_pushstring (L, "timeout");
 		lua_gettable (L, 1);
 		if (lua_type (L, -1) == LUA_TNUMBER) {
@@ -1146,12 +1228,22 @@ lua_redis_make_request (lua_State *L)
 		lua_pop (L, 1);
 		LL_PREPEND (ud->specific, sp_ud);
 
-		ret = redisAsyncCommandArgv (ud->ctx,
-				lua_redis_callback,
-				sp_ud,
-				sp_ud->nargs,
-				(const gchar **)sp_ud->args,
-				sp_ud->arglens);
+		if (ud->shared) {
+			ret = rspamd_redis_pool_shared_command_argv (ud->shared, ud,
+					lua_redis_callback,
+					sp_ud,
+					sp_ud->nargs,
+					(const gchar **)sp_ud->args,
+					sp_ud->arglens);
+		}
+		else {
+			ret = redisAsyncCommandArgv (ud->ctx,
+					lua_redis_callback,
+					sp_ud,
+					sp_ud->nargs,
+					(const gchar **)sp_ud->args,
+					sp_ud->arglens);
+		}
 
 		if (ret == REDIS_OK) {
 			if (ud->s) {
@@ -1167,7 +1259,7 @@ lua_redis_make_request (lua_State *L)
 			REDIS_RETAIN (ctx); /* Cleared by fin event */
 			ctx->cmds_pending ++;
 
-			if (ud->ctx->c.flags & REDIS_SUBSCRIBED) {
+			if (ud->ctx && (ud->ctx->c.flags & REDIS_SUBSCRIBED)) {
 				msg_debug_lua_redis ("subscribe command, never unref/timeout");
 				sp_ud->flags |= LUA_REDIS_SUBSCRIBED;
 			}
@@ -1180,10 +1272,19 @@ lua_redis_make_request (lua_State *L)
 			ret = TRUE;
 		}
 		else {
-			msg_info ("call to redis failed: %s", ud->ctx->errstr);
-			rspamd_redis_pool_release_connection (ud->pool, ud->ctx,
-					RSPAMD_REDIS_RELEASE_FATAL);
-			ud->ctx = NULL;
+			if (ud->shared) {
+				msg_info ("call to redis failed: shared connection is broken");
+				rspamd_redis_pool_release_shared (ud->pool, ud->shared, ud,
+						RSPAMD_REDIS_RELEASE_FATAL);
+				ud->shared = NULL;
+			}
+			else {
+				msg_info ("call to redis failed: %s", ud->ctx->errstr);
+				rspamd_redis_pool_release_connection (ud->pool, ud->ctx,
+						RSPAMD_REDIS_RELEASE_FATAL);
+				ud->ctx = NULL;
+			}
+
 			REDIS_RELEASE (ctx);
 			ret = FALSE;
 		}
@@ -1372,7 +1473,7 @@ lua_redis_connect (lua_State *L)
 	struct lua_redis_ctx *ctx, **pctx;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, TRUE, FALSE);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1415,7 +1516,7 @@ lua_redis_connect_sync (lua_State *L)
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 	struct lua_redis_ctx *ctx, **pctx;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL, FALSE);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, FALSE, FALSE);
 
 	if (ctx) {
 		if (lua_istable (L, 1)) {
@@ -1462,7 +1563,11 @@ lua_redis_add_cmd (lua_State *L)
 	gint cbref = -1, ret;
 
 	if (ctx) {
-		if (ctx->flags & LUA_REDIS_TERMINATED) {
+		ud = &ctx->async;
+
+		/* Connection is released when all pending commands are replied */
+		if ((ctx->flags & LUA_REDIS_TERMINATED) || ud->terminated ||
+				(ud->ctx == NULL && ud->shared == NULL)) {
 			lua_pushboolean (L, FALSE);
 			lua_pushstring (L, "Connection is terminated");
 
@@ -1485,6 +1590,17 @@ lua_redis_add_cmd (lua_State *L)
 			return luaL_error (L, "invalid arguments");
 		}
 
+		if (ud->shared && !lua_redis_cmd_can_share (cmd)) {
+			if (cbref != -1) {
+				luaL_unref (L, LUA_REGISTRYINDEX, cbref);
+			}
+
+			lua_pushboolean (L, FALSE);
+			lua_pushstring (L, "command cannot be sent via shared connection");
+
+			return 2;
+		}
+
 		sp_ud = g_malloc0 (sizeof (*sp_ud));
 		if (IS_ASYNC (ctx)) {
 			sp_ud->c = &ctx->async;
@@ -1509,7 +1625,16 @@ lua_redis_add_cmd (lua_State *L)
 			return 2;
 		}
 
-		if (IS_ASYNC (ctx)) {
+		if (ud->shared) {
+			/* Shared connections are used by async requests only */
+			ret = rspamd_redis_pool_shared_command_argv (ud->shared, ud,
+					lua_redis_callback,
+					sp_ud,
+					sp_ud->nargs,
+					(const gchar **)sp_ud->args,
+					sp_ud->arglens);
+		}
+		else if (IS_ASYNC (ctx)) {
 			ret = redisAsyncCommandArgv (sp_ud->c->ctx,
 					lua_redis_callback,
 					sp_ud,
@@ -1553,6 +1678,13 @@ lua_redis_add_cmd (lua_State *L)
 			REDIS_RETAIN (ctx);
 			ctx->cmds_pending ++;
 		}
+		else if (ud->shared) {
+			msg_info ("call to redis failed: shared connection is broken");
+			lua_pushboolean (L, 0);
+			lua_pushstring (L, "shared connection is broken");
+
+			return 2;
+		}
 		else {
 			msg_info ("call to redis failed: %s",
 					sp_ud->c->ctx->errstr);
@@ -96,6 +96,7 @@ static const struct luaL_reg upstream_m[] = {
 struct rspamd_lua_upstream {
 	struct upstream *up;
 	gint upref;
+	gdouble select_ts; /* when upstream has been selected for a request */
 };
 
 static struct rspamd_lua_upstream *
@@ -174,6 +175,7 @@ lua_upstream_fail (lua_State *L)
 			reason = lua_tostring (L, 2);
 		}
 
+		up->select_ts = 0;
 		rspamd_upstream_fail (up->up, fail_addr, reason);
 	}
 
@@ -181,8 +183,10 @@ lua_upstream_fail (lua_State *L)
 }
 
 /***
- * @method upstream:ok()
+ * @method upstream:ok([latency])
  * Indicates upstream success. Resets errors count for an upstream.
+ * @param {number} latency optional observed latency of the request in seconds (used by `latency` rotation),
+ * by default it is the time passed since the upstream has been selected
  */
 static gint
 lua_upstream_ok (lua_State *L)
@@ -191,6 +195,16 @@ lua_upstream_ok (lua_State *L)
 	struct rspamd_lua_upstream *up = lua_check_upstream (L);
 
 	if (up) {
+		if (lua_isnumber (L, 2)) {
+			rspamd_upstream_latency (up->up, lua_tonumber (L, 2));
+		}
+		else if (up->select_ts > 0) {
+			rspamd_upstream_latency (up->up,
+					rspamd_get_ticks (FALSE) - up->select_ts);
+		}
+
+		/* Measure the request once */
+		up->select_ts = 0;
 		rspamd_upstream_ok (up->up);
 	}
 
@@ -234,6 +248,7 @@ lua_push_upstream (lua_State * L, gint up_idx, struct upstream *up)
 
 	lua_ups = lua_newuserdata (L, sizeof (*lua_ups));
 	lua_ups->up = up;
+	lua_ups->select_ts = 0;
 	rspamd_lua_setclass (L, "rspamd{upstream}", -1);
 	/* Store parent in the upstream to prevent gc */
 	lua_pushvalue (L, up_idx);
@@ -352,7 +367,8 @@ lua_upstream_list_get_upstream_by_hash (lua_State *L)
 					(guint)keyl);
 
 			if (selected) {
-				lua_push_upstream (L, 1, selected);
+				lua_push_upstream (L, 1, selected)->select_ts =
+						rspamd_get_ticks (FALSE);
 			}
 			else {
 				lua_pushnil (L);
@@ -386,7 +402,8 @@ lua_upstream_list_get_upstream_round_robin (lua_State *L)
 
 		selected = rspamd_upstream_get (upl, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
 		if (selected) {
-			lua_push_upstream (L, 1, selected);
+			lua_push_upstream (L, 1, selected)->select_ts =
+					rspamd_get_ticks (FALSE);
 		}
 		else {
 			lua_pushnil (L);
@@ -418,7 +435,8 @@ lua_upstream_list_get_upstream_master_slave (lua_State *L)
 				NULL,
 				0);
 		if (selected) {
-			lua_push_upstream (L, 1, selected);
+			lua_push_upstream (L, 1, selected)->select_ts =
+					rspamd_get_ticks (FALSE);
 		}
 		else {
 			lua_pushnil (L);
@@ -548,6 +566,7 @@ lua_upstream_watch_func (struct upstream *up,
 
 	struct rspamd_lua_upstream *lua_ups = lua_newuserdata (L, sizeof (*lua_ups));
 	lua_ups->up = up;
+	lua_ups->select_ts = 0;
 	rspamd_lua_setclass (L, "rspamd{upstream}", -1);
 	/* Store parent in the upstream to prevent gc */
 	lua_rawgeti (L, LUA_REGISTRYINDEX, cdata->parent_cbref);
@@ -137,6 +137,7 @@ struct fuzzy_client_session {
 	struct fuzzy_rule *rule;
 	struct ev_loop *event_loop;
 	struct rspamd_io_ev ev;
+	ev_tstamp start;
 	gint state;
 	gint fd;
 	guint retransmits;
@@ -2521,8 +2522,6 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	struct fuzzy_cmd_io *io;
 	guint nreplied = 0, i;
 
-	rspamd_upstream_ok (session->server);
-
 	for (i = 0; i < session->commands->len; i++) {
 		io = g_ptr_array_index (session->commands, i);
 
@@ -2532,6 +2531,10 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	}
 
 	if (nreplied == session->commands->len) {
+		/* Report the session once, when all replies are received */
+		rspamd_upstream_latency (session->server,
+				ev_now (session->event_loop) - session->start);
+		rspamd_upstream_ok (session->server);
 		fuzzy_insert_metric_results (session->task, session->rule, session->results);
 
 		if (session->item) {
@@ -3195,6 +3198,7 @@ register_fuzzy_client_call (struct rspamd_task *task,
 				session->rule = rule;
 				session->results = g_ptr_array_sized_new (32);
 				session->event_loop = task->event_loop;
+				session->start = ev_now (session->event_loop);
 
 				rspamd_ev_watcher_init (&session->ev,
 						sock,
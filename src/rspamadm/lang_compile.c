@@ -0,0 +1,136 @@
+/*-
+ * Copyright 2021 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "rspamd.h"
+#include "libmime/lang_detection.h"
+
+static gchar *languages_dir = NULL;
+static gchar *output = NULL;
+static gboolean quiet = FALSE;
+
+static void rspamadm_lang_compile (gint argc, gchar **argv,
+								   const struct rspamadm_command *cmd);
+static const char *rspamadm_lang_compile_help (gboolean full_help,
+											   const struct rspamadm_command *cmd);
+
+struct rspamadm_command lang_compile_command = {
+		.name = "lang_compile",
+		.flags = 0,
+		.help = rspamadm_lang_compile_help,
+		.run = rspamadm_lang_compile,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"languages", 'l', 0, G_OPTION_ARG_FILENAME, &languages_dir,
+				"Directory with languages data", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+				"Output compiled file", NULL},
+		{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+				"Suppress output", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_lang_compile_help (gboolean full_help, const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile languages data for the language detector\n\n"
+				"Usage: rspamadm lang_compile [-l <languages_dir>] -o <output>\n"
+				"Where options are:\n\n"
+				"-l: directory with languages data (" RSPAMD_SHAREDIR "/languages by default)\n"
+				"-o: output compiled file\n"
+				"-q: quiet output\n"
+				"--help: shows available options and commands\n\n"
+				"Compiled file is used by setting `languages_compiled` option\n"
+				"in `lang_detection` section";
+	}
+	else {
+		help_str = "Compile languages data for the language detector";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_lang_compile (gint argc, gchar **argv, const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_lang_detector *d;
+	ucl_object_t *top, *section;
+
+	context = g_option_context_new (
+			"lang_compile - compile languages data for the language detector");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		g_option_context_free (context);
+		exit (EXIT_FAILURE);
+	}
+
+	g_option_context_free (context);
+
+	if (output == NULL) {
+		rspamd_fprintf (stderr, "output file is missing\n");
+		exit (EXIT_FAILURE);
+	}
+
+	/* Compile from json sources only */
+	top = ucl_object_typed_new (UCL_OBJECT);
+	section = ucl_object_typed_new (UCL_OBJECT);
+
+	if (languages_dir) {
+		ucl_object_insert_key (section, ucl_object_fromstring (languages_dir),
+				"languages", 0, false);
+	}
+
+	ucl_object_insert_key (top, section, "lang_detection", 0, false);
+
+	if (cfg->rcl_obj) {
+		ucl_object_unref (cfg->rcl_obj);
+	}
+
+	cfg->rcl_obj = top;
+	d = rspamd_language_detector_init (cfg);
+
+	if (d == NULL) {
+		rspamd_fprintf (stderr, "cannot load languages data\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (!rspamd_language_detector_save (d, output, &error)) {
+		rspamd_fprintf (stderr, "cannot save compiled languages: %e\n", error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (!quiet) {
+		rspamd_printf ("compiled languages saved to %s\n", output);
+	}
+}
@@ -33,6 +33,7 @@
 #include "worker_private.h"
 #include "libserver/http/http_private.h"
 #include "libserver/cfg_file_private.h"
+#include "utlist.h"
 #include <math.h>
 #include "unix-std.h"
 
@@ -74,7 +75,38 @@ struct rspamd_worker_session {
 	struct rspamd_worker_ctx *ctx;
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_worker *worker;
+	gboolean keepalive;
+	/* Idle keep-alive sessions list */
+	struct rspamd_worker_session *prev, *next;
 };
+
+/*
+ * Removes a keep-alive session from the idle sessions list
+ */
+static void
+rspamd_worker_session_detach (struct rspamd_worker_session *session)
+{
+	if (session->prev) {
+		DL_DELETE (session->ctx->keepalive_sessions, session);
+		session->prev = NULL;
+		session->next = NULL;
+	}
+}
+
+/*
+ * Closes a session that has no task
+ */
+static void
+rspamd_worker_session_free (struct rspamd_worker_session *session)
+{
+	rspamd_worker_session_detach (session);
+	rspamd_inet_address_free (session->addr);
+	rspamd_http_connection_reset (session->http_conn);
+	rspamd_http_connection_unref (session->http_conn);
+	close (session->fd);
+	g_free (session);
+}
+
 /*
  * Reduce number of tasks proceeded
  */
@@ -115,6 +147,19 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 
 	ctx = session->ctx;
 
+	/* Keep-alive session is no longer idle */
+	rspamd_worker_session_detach (session);
+
+	if (session->keepalive &&
+			session->worker->state != rspamd_worker_state_running) {
+		/* Do not start new tasks in a terminating worker, close connection */
+		msg_info ("refuse request from %s on keep-alive connection: "
+				"worker is terminating",
+				rspamd_inet_address_to_string_pretty (session->addr));
+
+		return -1;
+	}
+
 	/* Check debug */
 	if ((hv_tok = rspamd_http_message_find_header (msg, "Memory")) != NULL) {
 		rspamd_ftok_t cmp;
@@ -183,6 +228,23 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 				task->flags |= RSPAMD_TASK_FLAG_SKIP;
 			}
 		}
+
+		/*
+		 * Legacy protocols and encrypted connections are not kept alive,
+		 * as keys are negotiated per message
+		 */
+		if (ctx->keepalive && task->cmd != CMD_CHECK_SPAMC &&
+				task->cmd != CMD_CHECK_RSPAMC &&
+				!rspamd_http_connection_is_encrypted (conn) &&
+				(hv_tok = rspamd_http_message_find_header (msg, "Connection")) != NULL) {
+			rspamd_ftok_t cmp;
+
+			RSPAMD_FTOK_ASSIGN (&cmp, "keep-alive");
+
+			if (rspamd_ftok_casecmp (hv_tok, &cmp) == 0) {
+				task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE;
+			}
+		}
 	}
 
 	/* Set global timeout for the task */
@@ -282,16 +344,53 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info ("no data received from: %s, error: %e",
-				rspamd_inet_address_to_string_pretty (session->addr), err);
-		rspamd_http_connection_reset (session->http_conn);
-		rspamd_http_connection_unref (session->http_conn);
-		rspamd_inet_address_free (session->addr);
-		close (session->fd);
-		g_free (session);
+		if (session->keepalive) {
+			msg_debug ("keep-alive connection from: %s is closed: %e",
+					rspamd_inet_address_to_string_pretty (session->addr), err);
+		}
+		else {
+			msg_info ("no data received from: %s, error: %e",
+					rspamd_inet_address_to_string_pretty (session->addr), err);
+		}
+
+		rspamd_worker_session_free (session);
 	}
 }
 
+/*
+ * Moves socket and connection of the replied task to a new session that waits
+ * for the next request from the same client
+ */
+static void
+rspamd_worker_keepalive_session (struct rspamd_task *task)
+{
+	struct rspamd_worker_session *session;
+
+	session = g_malloc0 (sizeof (*session));
+	session->magic = G_MAXINT64;
+	session->addr = rspamd_inet_address_copy (task->client_addr);
+	session->fd = task->sock;
+	session->ctx = task->worker->ctx;
+	session->worker = task->worker;
+	session->http_conn = task->http_conn;
+	session->keepalive = TRUE;
+
+	/* Task must not close them on destruction */
+	ev_io_stop (task->event_loop, &task->guard_ev);
+	task->sock = -1;
+	task->http_conn = NULL;
+
+	msg_debug_task ("keep connection from %s alive",
+			rspamd_inet_address_to_string (session->addr));
+
+	/* Idle sessions are closed on worker termination */
+	DL_APPEND (session->ctx->keepalive_sessions, session);
+	rspamd_http_connection_reset (session->http_conn);
+	rspamd_http_connection_read_message (session->http_conn,
+			session,
+			session->ctx->timeout);
+}
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -311,8 +410,15 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	if (task) {
 		if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 			/* We are done here */
-			msg_debug_task ("normally closing connection from: %s",
-					rspamd_inet_address_to_string (task->client_addr));
+			if ((task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE) &&
+					task->worker->state == rspamd_worker_state_running) {
+				rspamd_worker_keepalive_session (task);
+			}
+			else {
+				msg_debug_task ("normally closing connection from: %s",
+						rspamd_inet_address_to_string (task->client_addr));
+			}
+
 			rspamd_session_destroy (task->s);
 		}
 		else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
@@ -321,18 +427,44 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info ("no data received from: %s, closing connection",
-				rspamd_inet_address_to_string_pretty (session->addr));
-		rspamd_inet_address_free (session->addr);
-		rspamd_http_connection_reset (session->http_conn);
-		rspamd_http_connection_unref (session->http_conn);
-		close (session->fd);
-		g_free (session);
+		if (session->keepalive) {
+			msg_debug ("keep-alive connection from: %s is closed",
+					rspamd_inet_address_to_string_pretty (session->addr));
+		}
+		else {
+			msg_info ("no data received from: %s, closing connection",
+					rspamd_inet_address_to_string_pretty (session->addr));
+		}
+
+		rspamd_worker_session_free (session);
 	}
 
 	return 0;
 }
 
+/*
+ * Closes idle keep-alive connections when worker is terminating
+ */
+static gboolean
+rspamd_worker_keepalive_term_handler (struct rspamd_worker_signal_handler *sigh,
+		void *arg)
+{
+	struct rspamd_worker_ctx *ctx = (struct rspamd_worker_ctx *)arg;
+	struct rspamd_worker_session *session, *tmp;
+
+	if (sigh->worker->state == rspamd_worker_state_running) {
+		return TRUE;
+	}
+
+	DL_FOREACH_SAFE (ctx->keepalive_sessions, session, tmp) {
+		msg_debug ("close idle keep-alive connection from: %s",
+				rspamd_inet_address_to_string_pretty (session->addr));
+		rspamd_worker_session_free (session);
+	}
+
+	return FALSE;
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -414,6 +546,7 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = NAN;
+	ctx->keepalive = TRUE;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -433,6 +566,16 @@ init_worker (struct rspamd_config *cfg)
 			0,
 			"Allow only encrypted connections");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keepalive),
+			0,
+			"Keep connection alive after reply if a client asks so "
+			"(`Connection: keep-alive`), default: true");
+
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -490,6 +633,15 @@ start_worker (struct rspamd_worker *worker)
 	g_assert (rspamd_worker_check_context (worker->ctx, rspamd_worker_magic));
 	ctx->cfg = worker->srv->cfg;
 	ctx->event_loop = rspamd_prepare_worker (worker, "normal", accept_socket);
+	/* Called after the default handlers that change worker's state */
+	rspamd_worker_set_signal_handler (SIGTERM, worker, ctx->event_loop,
+			rspamd_worker_keepalive_term_handler, ctx);
+	rspamd_worker_set_signal_handler (SIGINT, worker, ctx->event_loop,
+			rspamd_worker_keepalive_term_handler, ctx);
+	rspamd_worker_set_signal_handler (SIGHUP, worker, ctx->event_loop,
+			rspamd_worker_keepalive_term_handler, ctx);
+	rspamd_worker_set_signal_handler (SIGUSR2, worker, ctx->event_loop,
+			rspamd_worker_keepalive_term_handler, ctx);
 	rspamd_symcache_start_refresh (worker->srv->cfg->cache, ctx->event_loop,
 			worker);
 
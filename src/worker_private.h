@@ -30,6 +30,7 @@ extern "C" {
 static const guint64 rspamd_worker_magic = 0xb48abc69d601dc1dULL;
 
 struct rspamd_lang_detector;
+struct rspamd_worker_session;
 
 struct rspamd_worker_ctx {
 	guint64 magic;
@@ -45,6 +46,8 @@ struct rspamd_worker_ctx {
 	gboolean is_mime;
 	/* Allow encrypted requests only using network */
 	gboolean encrypted_only;
+	/* Allow clients to send several requests over a connection */
+	gboolean keepalive;
 	/* Limit of tasks */
 	guint32 max_tasks;
 	/* Maximum time for task processing */
@@ -55,6 +58,8 @@ struct rspamd_worker_ctx {
 	struct rspamd_http_context *http_ctx;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Keep-alive connections waiting for the next request */
+	struct rspamd_worker_session *keepalive_sessions;
 };
 
 /*
@@ -152,6 +152,50 @@ def Scan_File(filename, **headers):
     BuiltIn().set_test_variable("${SCAN_RESULT}", d)
     return
 
+def _read_http_reply(f):
+    status = f.readline().split(None, 2)
+    headers = {}
+    while True:
+        line = f.readline().strip()
+        if not line:
+            break
+        k, v = line.split(b':', 1)
+        headers[k.strip().lower()] = v.strip()
+    body = f.read(int(headers[b'content-length']))
+    return [int(status[1]), headers, body]
+
+def Scan_File_Keepalive(filename, count=2, pipelined=False, **headers):
+    """Scans a file several times over one keep-alive connection
+
+    If `pipelined` is true, all requests are sent before reading replies
+    """
+    addr = BuiltIn().get_variable_value("${RSPAMD_LOCAL_ADDR}")
+    port = BuiltIn().get_variable_value("${RSPAMD_PORT_NORMAL}")
+    headers["Queue-Id"] = BuiltIn().get_variable_value("${TEST_NAME}")
+    headers["Connection"] = "keep-alive"
+    goo = open(filename, 'rb').read()
+    req = b"POST /checkv2 HTTP/1.1\r\n"
+    for k, v in headers.items():
+        req += ("%s: %s\r\n" % (k, v)).encode('utf-8')
+    req += ("Content-Length: %d\r\n\r\n" % len(goo)).encode('utf-8') + goo
+    s = socket.create_connection((addr, int(port)), timeout=10)
+    f = s.makefile('rb')
+    replies = []
+    if pipelined:
+        s.sendall(req * int(count))
+    for i in range(int(count)):
+        if not pipelined:
+            s.sendall(req)
+        replies.append(_read_http_reply(f))
+    f.close()
+    s.close()
+    for status, hdrs, _ in replies:
+        assert status == 200
+        assert hdrs[b'connection'].lower() == b'keep-alive'
+    d = demjson.decode(replies[-1][2])
+    BuiltIn().set_test_variable("${SCAN_RESULT}", d)
+    return
+
 def Send_SIGUSR1(pid):
     pid = int(pid)
     os.kill(pid, signal.SIGUSR1)
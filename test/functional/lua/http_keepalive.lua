@@ -0,0 +1,217 @@
+--[[[
+-- Tests for keepalive connections pool limits: keepalive_max_conns = 1 and
+-- keepalive_max_idle = 1 are set in the config
+--]]
+
+local rspamd_http = require "rspamd_http"
+local rspamd_logger = require "rspamd_logger"
+
+local base_url = 'http://127.0.0.1:18080'
+-- Result of a request made without task session, reported by the next task
+local sessionless_result = 'none'
+
+local function ka_dest(stat, host)
+  for _, d in ipairs(stat.destinations or {}) do
+    if d.host == host then
+      return d
+    end
+  end
+
+  return {active = 0, idle = 0, queued = 0}
+end
+
+local function ka_delta(before, after, what)
+  return (after[what] or 0) - (before[what] or 0)
+end
+
+-- Two concurrent requests, the second one times out in the queue
+local function http_ka_queue_timeout(task)
+  local before = rspamd_http.keepalive_stat()
+
+  rspamd_http.request({
+    url = base_url .. '/timeout',
+    task = task,
+    keepalive = true,
+    timeout = 1.5,
+    callback = function(err, _, _)
+      rspamd_logger.infox(task, 'first keepalive request: %s', err)
+    end,
+  })
+
+  rspamd_http.request({
+    url = base_url .. '/request',
+    task = task,
+    keepalive = true,
+    timeout = 0.5,
+    callback = function(err, code, _)
+      local after = rspamd_http.keepalive_stat()
+
+      if err then
+        task:insert_result('HTTP_KA_QUEUE_TIMEOUT', 1.0, err)
+      else
+        task:insert_result('HTTP_KA_NOT_QUEUED', 1.0, tostring(code))
+      end
+
+      if ka_delta(before, after, 'requests_queued') == 1 and
+          ka_delta(before, after, 'queue_timeouts') == 1 then
+        task:insert_result('HTTP_KA_QUEUE_TIMEOUT_STAT', 1.0)
+      end
+    end,
+  })
+end
+
+-- Two concurrent requests cancelled by the task timeout while the second
+-- one is queued
+local function http_ka_queue_cancel(task)
+  for _, path in ipairs({'/slow', '/request'}) do
+    rspamd_http.request({
+      url = base_url .. path,
+      task = task,
+      keepalive = true,
+      timeout = 10,
+      callback = function(err, code, _)
+        task:insert_result('HTTP_KA_NOT_CANCELLED', 1.0, err or tostring(code))
+      end,
+    })
+  end
+end
+
+-- The second request is woken by the release of the first one and cancelled
+-- at the same time, it must pass its slot to the third (sessionless) one
+local function http_ka_wake_cancel(task)
+  sessionless_result = 'pending'
+
+  for _, path in ipairs({'/slow', '/request'}) do
+    rspamd_http.request({
+      url = base_url .. path,
+      task = task,
+      keepalive = true,
+      timeout = 10,
+      callback = function(err, code, _)
+        task:insert_result('HTTP_KA_NOT_CANCELLED', 1.0, err or tostring(code))
+      end,
+    })
+  end
+
+  rspamd_http.request({
+    url = base_url .. '/request',
+    ev_base = task:get_ev_base(),
+    config = rspamd_config,
+    keepalive = true,
+    timeout = 10,
+    callback = function(err, code, _)
+      if err then
+        sessionless_result = err
+      else
+        sessionless_result = tostring(code)
+      end
+    end,
+  })
+end
+
+-- Reports the pool state left by the previous tasks
+local function http_ka_stat(task)
+  local stat = rspamd_http.keepalive_stat()
+  local d = ka_dest(stat, '127.0.0.1')
+
+  task:insert_result('HTTP_KA_STAT', 1.0, {
+    string.format('active=%d', d.active),
+    string.format('queued=%d', d.queued),
+    string.format('sessionless=%s', sessionless_result),
+  })
+end
+
+-- Idle connections over keepalive_max_idle are evicted in LRU order: the
+-- connections are pushed to the pool after the callbacks, so the pool state
+-- is checked by the next task
+local evict_before
+
+local function http_ka_evict(task)
+  evict_before = rspamd_http.keepalive_stat()
+
+  for _, url in ipairs({base_url .. '/request',
+                        'http://site.resolveme:18080/request'}) do
+    local err = rspamd_http.request({
+      url = url,
+      task = task,
+      keepalive = true,
+      timeout = 1,
+    })
+
+    if err then
+      task:insert_result('HTTP_KA_EVICT_ERROR', 1.0, err)
+      return
+    end
+  end
+end
+
+local function http_ka_evict_check(task)
+  local after = rspamd_http.keepalive_stat()
+  local first, second = ka_dest(after, '127.0.0.1'), ka_dest(after, 'site.resolveme')
+
+  -- The last used connection is reused
+  local err = rspamd_http.request({
+    url = 'http://site.resolveme:18080/request',
+    task = task,
+    keepalive = true,
+    timeout = 1,
+  })
+
+  if err then
+    task:insert_result('HTTP_KA_EVICT_ERROR', 1.0, err)
+    return
+  end
+
+  local reused = rspamd_http.keepalive_stat()
+
+  task:insert_result('HTTP_KA_EVICT', 1.0, {
+    string.format('evicted=%d', ka_delta(evict_before or {}, after, 'connections_evicted')),
+    string.format('first_idle=%d', first.idle),
+    string.format('second_idle=%d', second.idle),
+    string.format('reused=%d', ka_delta(after, reused, 'connections_reused')),
+  })
+end
+
+rspamd_config:register_symbol({
+  name = 'HTTP_KA_QUEUE_TIMEOUT_TEST',
+  score = 1.0,
+  callback = http_ka_queue_timeout,
+  no_squeeze = true,
+})
+
+rspamd_config:register_symbol({
+  name = 'HTTP_KA_QUEUE_CANCEL_TEST',
+  score = 1.0,
+  callback = http_ka_queue_cancel,
+  no_squeeze = true,
+})
+
+rspamd_config:register_symbol({
+  name = 'HTTP_KA_WAKE_CANCEL_TEST',
+  score = 1.0,
+  callback = http_ka_wake_cancel,
+  no_squeeze = true,
+})
+
+rspamd_config:register_symbol({
+  name = 'HTTP_KA_STAT_TEST',
+  score = 1.0,
+  callback = http_ka_stat,
+  no_squeeze = true,
+})
+
+rspamd_config:register_symbol({
+  name = 'HTTP_KA_EVICT_TEST',
+  score = 1.0,
+  callback = http_ka_evict,
+  no_squeeze = true,
+  flags = 'coro'
+})
+
+rspamd_config:register_symbol({
+  name = 'HTTP_KA_EVICT_CHECK_TEST',
+  score = 1.0,
+  callback = http_ka_evict_check,
+  no_squeeze = true,
+  flags = 'coro'
+})
@@ -53,6 +53,44 @@ local function redis_simple_async_api201809(task)
   redis_lua.request(redis_params, attrs, request)
 end
 
+local function redis_pipeline_async(task)
+  local replies = {}
+
+  local function redis_cb(err, data)
+    if err then
+      task:insert_result('REDIS_PIPELINE_ERROR', 1.0, err)
+    else
+      table.insert(replies, tostring(data))
+
+      if #replies == 2 then
+        task:insert_result('REDIS_PIPELINE', 1.0, replies)
+      end
+    end
+  end
+
+  local ret, conn = redis_lua.rspamd_redis_make_request(
+    task,
+    redis_params,
+    "test_key",
+    false,
+    redis_cb,
+    'GET',
+    {'test_key'}
+  )
+
+  if not ret or not conn then
+    task:insert_result('REDIS_PIPELINE_ERROR', 1.0, 'cannot make request')
+    return
+  end
+
+  -- Uses the same (possibly shared) connection as the first request
+  local is_ok, err = conn:add_cmd(redis_cb, 'STRLEN', {'test_key'})
+
+  if not is_ok then
+    task:insert_result('REDIS_PIPELINE_ERROR', 1.0, err)
+  end
+end
+
 local function redis_symbol(task)
 
   local attrs = {task = task}
@@ -104,6 +142,13 @@ rspamd_config:register_symbol({
   no_squeeze = true
 })
 
+rspamd_config:register_symbol({
+  name = 'SIMPLE_REDIS_PIPELINE_TEST',
+  score = 1.0,
+  callback = redis_pipeline_async,
+  no_squeeze = true
+})
+
 rspamd_config:register_symbol({
   name = 'REDIS_TEST',
   score = 1.0,
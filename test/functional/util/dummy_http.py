@@ -51,20 +51,27 @@ class MyHandler(http.server.BaseHTTPRequestHandler):
         if self.path == "/timeout":
             time.sleep(2)
 
+        if self.path == "/slow":
+            time.sleep(4)
+
         if self.path == "/error_403":
             self.send_response(403)
         else:
             self.send_response(200)
 
-        if self.path == "/content-length":
+        conntype = self.headers.get('Connection', "").lower()
+
+        if self.path == "/content-length" or conntype == 'keep-alive':
             self.send_header("Content-Length", str(len(response)))
 
+        if conntype == 'keep-alive':
+            self.send_header("Connection", "keep-alive")
+
         self.send_header("Content-type", "text/plain")
         self.end_headers()
         self.wfile.write(response)
         self.log_message("to be closed: %d, headers: %s, conn:'%s'" % (self.close_connection, str(self.headers), self.headers.get('Connection', "").lower()))
 
-        conntype = self.headers.get('Connection', "").lower()
         if conntype != 'keep-alive':
             self.close_connection = True
 
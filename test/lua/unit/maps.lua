@@ -0,0 +1,113 @@
+-- Batched map lookups
+
+context("Map get_keys function", function()
+  local rspamd_ip = require "rspamd_ip"
+
+  local hash_data = {}
+  for i = 1, 100 do
+    table.insert(hash_data, string.format('key%d value%d', i, i))
+  end
+
+  local hash_map = rspamd_config:add_map{
+    type = 'hash',
+    description = 'test hash map',
+    url = {
+      url = 'static',
+      data = hash_data,
+    }
+  }
+  local set_map = rspamd_config:add_map{
+    type = 'set',
+    description = 'test set map',
+    url = {
+      url = 'static',
+      data = {'example.com', 'example.net'},
+    }
+  }
+  local radix_map = rspamd_config:add_map{
+    type = 'radix',
+    description = 'test radix map',
+    url = {
+      url = 'static',
+      data = {
+        '192.168.0.0/16 net',
+        '10.0.0.1 host',
+        '2001:db8::/32 net6',
+      },
+    }
+  }
+
+  rspamd_config:init_subsystem('maps')
+
+  test("Hash map batch lookup", function()
+    assert_not_nil(hash_map)
+    assert_rspamd_table_eq({
+      expect = {'value1', false, 'value100', false},
+      actual = hash_map:get_keys({'key1', 'key101', 'key100', ''})
+    })
+  end)
+
+  test("Set map batch lookup", function()
+    assert_not_nil(set_map)
+    assert_rspamd_table_eq({
+      expect = {true, false, true},
+      actual = set_map:get_keys({'example.com', 'example.org', 'example.net'})
+    })
+  end)
+
+  test("Radix map batch lookup", function()
+    assert_not_nil(radix_map)
+    assert_rspamd_table_eq({
+      expect = {'net', 'host', false, 'net6', 'net', false},
+      actual = radix_map:get_keys({
+        '192.168.1.1',
+        rspamd_ip.from_string('10.0.0.1'),
+        '10.0.0.2',
+        '2001:db8::1',
+        rspamd_ip.from_string('192.168.255.255'),
+        'not an ip',
+      })
+    })
+  end)
+
+  test("Empty batch lookup", function()
+    assert_rspamd_table_eq({
+      expect = {},
+      actual = hash_map:get_keys({})
+    })
+    assert_rspamd_table_eq({
+      expect = {},
+      actual = radix_map:get_keys({})
+    })
+  end)
+
+  -- Lookups are processed in blocks, so check sizes around block boundaries
+  for _,nkeys in ipairs({1, 31, 32, 33, 64, 65, 200}) do
+    test("Batch lookup of " .. nkeys .. " keys", function()
+      local keys, addrs = {}, {}
+      local expect_keys, expect_addrs = {}, {}
+
+      for i = 1, nkeys do
+        keys[i] = 'key' .. tostring(i)
+        expect_keys[i] = hash_map:get_key(keys[i])
+        addrs[i] = string.format('%s.%d', i % 2 == 0 and '10.0.0' or '192.168.0',
+            i % 256)
+        expect_addrs[i] = radix_map:get_key(addrs[i])
+      end
+
+      local res = hash_map:get_keys(keys)
+      assert_equal(#res, nkeys)
+      assert_rspamd_table_eq({
+        expect = expect_keys,
+        actual = res
+      })
+
+      res = radix_map:get_keys(addrs)
+      assert_equal(#res, nkeys)
+      assert_rspamd_table_eq({
+        expect = expect_addrs,
+        actual = res
+      })
+    end)
+  end
+end)
@@ -22,6 +22,8 @@
 #include "doctest/doctest.h"
 
 #include "rspamd_cxx_unit_utils.hxx"
+#include "rspamd_cxx_unit_multipattern.hxx"
+#include "rspamd_cxx_unit_http.hxx"
 #include "rspamd_cxx_local_ptr.hxx"
 
 static gboolean verbose = false;
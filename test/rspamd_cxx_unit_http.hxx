@@ -0,0 +1,406 @@
+/*-
+ * Copyright 2021 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Detached unit tests for http messages, streamed bodies and keepalive connections pool */
+
+#ifndef RSPAMD_RSPAMD_CXX_UNIT_HTTP_HXX
+#define RSPAMD_RSPAMD_CXX_UNIT_HTTP_HXX
+
+#define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
+#include "doctest/doctest.h"
+
+#include "libserver/http/http_context.h"
+#include "libserver/http/http_connection.h"
+#include "libserver/http/http_message.h"
+#include "libcryptobox/keypair.h"
+#include "unix-std.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <vector>
+#include <string>
+
+TEST_SUITE("rspamd_http") {
+
+struct http_ka_test_request {
+	struct rspamd_http_keepalive_waiter *waiter = nullptr;
+	struct rspamd_http_connection *conn = nullptr;
+	const gchar *err = nullptr;
+	gint ready = 0;
+};
+
+static void
+http_test_error(struct rspamd_http_connection *conn, GError *err)
+{
+}
+
+static gint
+http_test_finish(struct rspamd_http_connection *conn,
+					struct rspamd_http_message *msg)
+{
+	return 0;
+}
+
+static void
+http_ka_test_ready(struct rspamd_http_connection *conn,
+				   const gchar *err, gpointer ud)
+{
+	auto *req = (struct http_ka_test_request *) ud;
+
+	req->waiter = nullptr;
+	req->conn = conn;
+	req->err = err;
+	req->ready++;
+}
+
+/* Runs the loop until the request is ready or timed out in the queue */
+static void
+http_ka_test_run(struct ev_loop *loop, const struct http_ka_test_request &req)
+{
+	while (req.ready == 0) {
+		ev_run(loop, EVRUN_ONCE);
+	}
+}
+
+static gint64
+http_ka_test_stat(struct rspamd_http_context *ctx, const gchar *what)
+{
+	auto *top = rspamd_http_context_keepalive_stat(ctx);
+	auto res = ucl_object_toint(ucl_object_lookup(top, what));
+
+	ucl_object_unref(top);
+
+	return res;
+}
+
+static std::string
+http_test_body(struct rspamd_http_message *msg)
+{
+	gsize len;
+	auto *body = rspamd_http_message_get_body(msg, &len);
+
+	return std::string{body, len};
+}
+
+TEST_CASE("copied message shares body")
+{
+	GError *err = nullptr;
+	const std::string body{"hello world"};
+	auto *msg = rspamd_http_message_from_url("http://127.0.0.1/check");
+
+	REQUIRE(msg != nullptr);
+	REQUIRE(rspamd_http_message_set_body(msg, body.data(), body.size()));
+
+	auto *copy = rspamd_http_connection_copy_msg(msg, &err);
+	REQUIRE(copy != nullptr);
+
+	gsize orig_len, copy_len;
+	auto *orig_body = rspamd_http_message_get_body(msg, &orig_len);
+
+	CHECK(rspamd_http_message_get_body(copy, &copy_len) == orig_body);
+	CHECK(copy_len == orig_len);
+
+	SUBCASE("copy of a copy") {
+		auto *copy2 = rspamd_http_connection_copy_msg(copy, &err);
+		REQUIRE(copy2 != nullptr);
+		CHECK(rspamd_http_message_get_body(copy2, &copy_len) == orig_body);
+
+		/* Body is alive while any of the copies is alive */
+		rspamd_http_message_unref(copy);
+		rspamd_http_message_unref(msg);
+		CHECK(http_test_body(copy2) == body);
+		rspamd_http_message_unref(copy2);
+	}
+
+	SUBCASE("modified copy is detached") {
+		REQUIRE(rspamd_http_message_append_body(copy, "!", 1));
+		CHECK(rspamd_http_message_get_body(copy, &copy_len) != orig_body);
+		CHECK(http_test_body(copy) == body + "!");
+		CHECK(http_test_body(msg) == body);
+		rspamd_http_message_unref(copy);
+		rspamd_http_message_unref(msg);
+	}
+
+	SUBCASE("encrypted copy is detached") {
+		struct rspamd_http_context_cfg cfg;
+		gint sv[2];
+		guint pklen;
+
+		REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+		auto *loop = ev_loop_new(EVFLAG_AUTO);
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.user_agent = "rspamd-test";
+		cfg.server_hdr = "rspamd-test";
+		auto *ctx = rspamd_http_context_create_config(&cfg, loop, nullptr);
+
+		auto *kp = rspamd_keypair_new(RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+		auto *pk_data = rspamd_keypair_component(kp,
+				RSPAMD_KEYPAIR_COMPONENT_PK, &pklen);
+		auto *pk = rspamd_pubkey_from_bin(pk_data, pklen,
+				RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
+		REQUIRE(pk != nullptr);
+		rspamd_http_message_set_peer_key(copy, pk);
+
+		auto *conn = rspamd_http_connection_new_client_socket(ctx,
+				nullptr, http_test_error, http_test_finish,
+				RSPAMD_HTTP_CLIENT_SIMPLE, sv[0]);
+		REQUIRE(conn != nullptr);
+		/* Body is encrypted in place when the message is written */
+		REQUIRE(rspamd_http_connection_write_message(conn, copy,
+				nullptr, nullptr, nullptr, 1.0));
+
+		CHECK(rspamd_http_message_get_body(copy, &copy_len) != orig_body);
+		CHECK(http_test_body(msg) == body);
+
+		/* Connection owns the copy */
+		rspamd_http_connection_unref(conn);
+		rspamd_http_message_unref(msg);
+		rspamd_pubkey_unref(pk);
+		rspamd_keypair_unref(kp);
+		rspamd_http_context_free(ctx);
+		ev_loop_destroy(loop);
+		close(sv[0]);
+		close(sv[1]);
+	}
+}
+
+struct http_stream_test_request {
+	std::string body;
+	gint chunks = 0;
+	gint finished = 0;
+	gint err_code = 0;
+	gsize msg_body_len = 0;
+};
+
+static gint
+http_stream_test_body(struct rspamd_http_connection *conn,
+					  struct rspamd_http_message *msg,
+					  const gchar *chunk, gsize len)
+{
+	auto *req = (struct http_stream_test_request *) conn->ud;
+
+	req->body.append(chunk, len);
+
+	if (req->chunks++ == 0) {
+		/* Do not read more until the first portion is consumed */
+		rspamd_http_connection_pause_reading(conn);
+	}
+
+	return 0;
+}
+
+static void
+http_stream_test_error(struct rspamd_http_connection *conn, GError *err)
+{
+	auto *req = (struct http_stream_test_request *) conn->ud;
+
+	req->err_code = err->code;
+}
+
+static gint
+http_stream_test_finish(struct rspamd_http_connection *conn,
+						struct rspamd_http_message *msg)
+{
+	auto *req = (struct http_stream_test_request *) conn->ud;
+
+	rspamd_http_message_get_body(msg, &req->msg_body_len);
+	req->finished++;
+
+	return 0;
+}
+
+TEST_CASE("streamed body")
+{
+	struct rspamd_http_context_cfg cfg;
+	struct http_stream_test_request req;
+	gint sv[2];
+
+	REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	auto *loop = ev_loop_new(EVFLAG_AUTO);
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.user_agent = "rspamd-test";
+	cfg.server_hdr = "rspamd-test";
+	auto *ctx = rspamd_http_context_create_config(&cfg, loop, nullptr);
+
+	auto *conn = rspamd_http_connection_new_server(ctx, sv[0],
+			http_stream_test_body, http_stream_test_error,
+			http_stream_test_finish, RSPAMD_HTTP_BODY_STREAM);
+	REQUIRE(conn != nullptr);
+
+	const std::string head{"POST /checkv2 HTTP/1.1\r\n"
+						   "Transfer-Encoding: chunked\r\n\r\n"
+						   "6\r\nhello \r\n"};
+	const std::string tail{"5\r\nworld\r\n0\r\n\r\n"};
+
+	SUBCASE("body is passed by portions with back-pressure") {
+		rspamd_http_connection_read_message(conn, &req, 5.0);
+		REQUIRE(write(sv[1], head.data(), head.size()) == (gssize) head.size());
+
+		while (req.chunks == 0 && req.err_code == 0) {
+			ev_run(loop, EVRUN_ONCE);
+		}
+
+		REQUIRE(req.chunks == 1);
+		CHECK(req.body == "hello ");
+
+		/* Reading is paused, so the rest is not consumed */
+		REQUIRE(write(sv[1], tail.data(), tail.size()) == (gssize) tail.size());
+
+		for (auto i = 0; i < 10; i++) {
+			ev_run(loop, EVRUN_NOWAIT);
+		}
+
+		CHECK(req.chunks == 1);
+		CHECK(req.finished == 0);
+
+		rspamd_http_connection_resume_reading(conn);
+
+		while (req.finished == 0 && req.err_code == 0) {
+			ev_run(loop, EVRUN_ONCE);
+		}
+
+		CHECK(req.err_code == 0);
+		CHECK(req.finished == 1);
+		CHECK(req.chunks == 2);
+		CHECK(req.body == "hello world");
+		/* Body is not accumulated in the message */
+		CHECK(req.msg_body_len == 0);
+	}
+
+	SUBCASE("streamed body is limited by max size") {
+		rspamd_http_connection_set_max_size(conn, 8);
+		rspamd_http_connection_read_message(conn, &req, 5.0);
+		REQUIRE(write(sv[1], head.data(), head.size()) == (gssize) head.size());
+		REQUIRE(write(sv[1], tail.data(), tail.size()) == (gssize) tail.size());
+
+		while (req.chunks == 0 && req.err_code == 0) {
+			ev_run(loop, EVRUN_ONCE);
+		}
+
+		if (req.err_code == 0) {
+			/* Limit has not been reached within the first read */
+			rspamd_http_connection_resume_reading(conn);
+		}
+
+		while (req.finished == 0 && req.err_code == 0) {
+			ev_run(loop, EVRUN_ONCE);
+		}
+
+		CHECK(req.err_code == 413);
+		CHECK(req.finished == 0);
+		CHECK(req.body == "hello ");
+	}
+
+	rspamd_http_connection_unref(conn);
+	rspamd_http_context_free(ctx);
+	ev_loop_destroy(loop);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+TEST_CASE("keepalive queue")
+{
+	struct rspamd_http_context_cfg cfg;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+
+	/* Connections are not served, the listener merely accepts connect */
+	auto lfd = socket(AF_INET, SOCK_STREAM, 0);
+	REQUIRE(lfd != -1);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	REQUIRE(bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	REQUIRE(listen(lfd, 16) == 0);
+	REQUIRE(getsockname(lfd, (struct sockaddr *) &sin, &slen) == 0);
+
+	auto *addr = rspamd_inet_address_from_sa((struct sockaddr *) &sin, slen);
+	auto *loop = ev_loop_new(EVFLAG_AUTO);
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.keepalive_interval = 65;
+	cfg.keepalive_max_conns = 1;
+	cfg.user_agent = "rspamd-test";
+	cfg.server_hdr = "rspamd-test";
+	auto *ctx = rspamd_http_context_create_config(&cfg, loop, nullptr);
+
+	std::vector<struct http_ka_test_request> reqs(3);
+
+	for (auto &req : reqs) {
+		req.conn = rspamd_http_connection_new_keepalive_queued(ctx,
+				nullptr, http_test_error, http_test_finish,
+				addr, "localhost", 10.0,
+				http_ka_test_ready, &req, &req.waiter);
+	}
+
+	/* The first request gets a connection, others are queued */
+	REQUIRE(reqs[0].conn != nullptr);
+	CHECK(reqs[1].waiter != nullptr);
+	CHECK(reqs[2].waiter != nullptr);
+	CHECK(http_ka_test_stat(ctx, "requests_queued") == 2);
+
+	SUBCASE("woken waiter gets the slot") {
+		rspamd_http_connection_unref(reqs[0].conn);
+		http_ka_test_run(loop, reqs[1]);
+
+		CHECK(reqs[1].ready == 1);
+		CHECK(reqs[1].conn != nullptr);
+		CHECK(reqs[2].ready == 0);
+
+		rspamd_http_connection_unref(reqs[1].conn);
+		http_ka_test_run(loop, reqs[2]);
+
+		CHECK(reqs[2].ready == 1);
+		CHECK(reqs[2].conn != nullptr);
+		rspamd_http_connection_unref(reqs[2].conn);
+	}
+
+	SUBCASE("woken and cancelled waiter passes the slot") {
+		rspamd_http_connection_unref(reqs[0].conn);
+		/* Second request is woken but not called yet */
+		rspamd_http_connection_cancel_keepalive_waiter(reqs[1].waiter);
+		http_ka_test_run(loop, reqs[2]);
+
+		CHECK(reqs[1].ready == 0);
+		CHECK(reqs[2].err == nullptr);
+		REQUIRE(reqs[2].conn != nullptr);
+		rspamd_http_connection_unref(reqs[2].conn);
+	}
+
+	SUBCASE("cancelled waiter keeps the order") {
+		rspamd_http_connection_cancel_keepalive_waiter(reqs[1].waiter);
+		rspamd_http_connection_unref(reqs[0].conn);
+		http_ka_test_run(loop, reqs[2]);
+
+		CHECK(reqs[1].ready == 0);
+		CHECK(reqs[2].err == nullptr);
+		REQUIRE(reqs[2].conn != nullptr);
+		rspamd_http_connection_unref(reqs[2].conn);
+	}
+
+	CHECK(http_ka_test_stat(ctx, "queue_timeouts") == 0);
+
+	rspamd_http_context_free(ctx);
+	ev_loop_destroy(loop);
+	rspamd_inet_address_free(addr);
+	close(lfd);
+}
+
+}
+
+#endif
@@ -0,0 +1,275 @@
+/*-
+ * Copyright 2021 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Detached unit tests for acism tries and multipattern prefilter */
+
+#ifndef RSPAMD_RSPAMD_CXX_UNIT_MULTIPATTERN_HXX
+#define RSPAMD_RSPAMD_CXX_UNIT_MULTIPATTERN_HXX
+
+#define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
+#include "doctest/doctest.h"
+
+#include "libutil/multipattern.h"
+extern "C" {
+#include "contrib/aho-corasick/acism.h"
+}
+#include "unix-std.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <vector>
+#include <utility>
+#include <string>
+#include <algorithm>
+
+TEST_SUITE("rspamd_multipattern") {
+
+static const std::vector<std::string> mp_test_patterns{
+		"abc", "bcd", "xyz", "zz", "hello world", "a",
+};
+
+static std::string
+mp_test_text()
+{
+	std::string text;
+
+	/* Matches inside, at the edges and across prefilter windows */
+	text += "abcd";
+
+	for (auto i = 0; i < 61; i++) {
+		text += '-';
+	}
+
+	text += "hello world";
+
+	for (auto i = 0; i < 200; i++) {
+		text += (i % 37 == 0) ? 'x' : '.';
+	}
+
+	text += "xyzz";
+
+	return text;
+}
+
+static std::vector<std::pair<guint, gint>>
+mp_naive_lookup(const std::string &text)
+{
+	std::vector<std::pair<guint, gint>> res;
+
+	for (guint i = 0; i < mp_test_patterns.size(); i++) {
+		const auto &pat = mp_test_patterns[i];
+
+		for (auto pos = text.find(pat); pos != std::string::npos;
+			 pos = text.find(pat, pos + 1)) {
+			res.emplace_back(i, (gint) (pos + pat.size()));
+		}
+	}
+
+	std::sort(res.begin(), res.end());
+
+	return res;
+}
+
+static gint
+mp_test_cb(struct rspamd_multipattern *mp, guint strnum, gint match_start,
+		   gint match_pos, const gchar *text, gsize len, void *context)
+{
+	auto *res = (std::vector<std::pair<guint, gint>> *) context;
+
+	res->emplace_back(strnum, match_pos);
+
+	return 0;
+}
+
+/* Makes multipatterns use acism while alive, as hyperscan is preferred */
+struct mp_acism_guard {
+	mp_acism_guard()
+	{
+		rspamd_multipattern_library_disable_hyperscan(TRUE);
+	}
+
+	~mp_acism_guard()
+	{
+		rspamd_multipattern_library_disable_hyperscan(FALSE);
+	}
+};
+
+static std::vector<std::pair<guint, gint>>
+mp_test_lookup(const std::string &text)
+{
+	std::vector<std::pair<guint, gint>> res;
+	auto *mp = rspamd_multipattern_create(RSPAMD_MULTIPATTERN_DEFAULT);
+
+	for (const auto &pat : mp_test_patterns) {
+		rspamd_multipattern_add_pattern_len(mp, pat.data(), pat.size(),
+				RSPAMD_MULTIPATTERN_DEFAULT);
+	}
+
+	REQUIRE(rspamd_multipattern_compile(mp, nullptr));
+	rspamd_multipattern_lookup(mp, text.data(), text.size(),
+			mp_test_cb, &res, nullptr);
+	rspamd_multipattern_destroy(mp);
+	std::sort(res.begin(), res.end());
+
+	return res;
+}
+
+static int
+mp_acism_cb(int strnum, int textpos, void *context)
+{
+	auto *res = (std::vector<std::pair<guint, gint>> *) context;
+
+	res->emplace_back(strnum, textpos);
+
+	return 0;
+}
+
+TEST_CASE("acism dump and mmap")
+{
+	std::vector<ac_trie_pat_t> pats;
+	const guchar id[] = "patterns set id", other_id[] = "patterns set ie";
+	gchar fname[PATH_MAX];
+	struct stat st;
+
+	for (const auto &pat : mp_test_patterns) {
+		pats.push_back({pat.data(), pat.size()});
+	}
+
+	auto *trie = acism_create(pats.data(), pats.size());
+	REQUIRE(trie != nullptr);
+
+	g_snprintf(fname, sizeof(fname), "%s/acism-test-XXXXXX",
+			g_get_tmp_dir());
+	auto fd = mkstemp(fname);
+	REQUIRE(fd != -1);
+	REQUIRE(acism_dump(trie, fd, id, sizeof(id)) == 0);
+	REQUIRE(fstat(fd, &st) != -1);
+
+	auto len = (gsize) st.st_size;
+	auto *map = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+	REQUIRE(map != MAP_FAILED);
+	close(fd);
+	unlink(fname);
+
+	SUBCASE("header mismatch") {
+		CHECK(acism_mmap(map, len, other_id, sizeof(other_id), pats.size()) == nullptr);
+		CHECK(acism_mmap(map, len, id, sizeof(id) - 1, pats.size()) == nullptr);
+		CHECK(acism_mmap(map, len, id, sizeof(id), pats.size() - 1) == nullptr);
+		CHECK(acism_mmap(map, len - 1, id, sizeof(id), pats.size()) == nullptr);
+		CHECK(acism_mmap(map, 16, id, sizeof(id), pats.size()) == nullptr);
+		munmap(map, len);
+	}
+
+	SUBCASE("mapped trie lookup") {
+		auto *mapped = acism_mmap(map, len, id, sizeof(id), pats.size());
+		REQUIRE(mapped != nullptr);
+
+		auto text = mp_test_text();
+		std::vector<std::pair<guint, gint>> orig_res, mapped_res;
+		gint state = 0;
+
+		acism_lookup(trie, text.data(), text.size(), mp_acism_cb, &orig_res,
+				&state, false);
+		state = 0;
+		acism_lookup(mapped, text.data(), text.size(), mp_acism_cb, &mapped_res,
+				&state, false);
+		std::sort(orig_res.begin(), orig_res.end());
+		std::sort(mapped_res.begin(), mapped_res.end());
+
+		CHECK(mapped_res == mp_naive_lookup(text));
+		CHECK(mapped_res == orig_res);
+		/* Unmaps the file */
+		acism_destroy(mapped);
+	}
+
+	acism_destroy(trie);
+}
+
+TEST_CASE("multipattern prefilter")
+{
+	mp_acism_guard guard;
+	auto text = mp_test_text();
+
+	CHECK(mp_test_lookup(text) == mp_naive_lookup(text));
+
+	/* Text with no first characters of the patterns */
+	std::string empty_text(1000, '.');
+	CHECK(mp_test_lookup(empty_text).empty());
+
+	/* Patterns at the very end of the text */
+	auto tail_text = empty_text + "xyz";
+	CHECK(mp_test_lookup(tail_text) == mp_naive_lookup(tail_text));
+}
+
+TEST_CASE("multipattern acism cache")
+{
+	mp_acism_guard guard;
+	auto *cache_dir = g_dir_make_tmp("rspamd-mp-XXXXXX", nullptr);
+	REQUIRE(cache_dir != nullptr);
+	auto text = mp_test_text();
+	auto expected = mp_naive_lookup(text);
+
+	rspamd_multipattern_library_init(cache_dir);
+
+	/* Compile and save, then load from the cache */
+	CHECK(mp_test_lookup(text) == expected);
+	CHECK(mp_test_lookup(text) == expected);
+
+	/* Corrupt cached tries, they must be recompiled */
+	auto *dir = g_dir_open(cache_dir, 0, nullptr);
+	REQUIRE(dir != nullptr);
+	const gchar *fname;
+	auto ncached = 0;
+
+	while ((fname = g_dir_read_name(dir)) != nullptr) {
+		auto *path = g_build_filename(cache_dir, fname, nullptr);
+		auto fd = open(path, O_WRONLY);
+
+		CHECK(g_str_has_suffix(fname, ".acmp"));
+
+		if (fd != -1) {
+			CHECK(write(fd, "garbage!", 8) == 8);
+			close(fd);
+			ncached++;
+		}
+
+		g_free(path);
+	}
+
+	/* Trie has been saved */
+	CHECK(ncached == 1);
+
+	CHECK(mp_test_lookup(text) == expected);
+	CHECK(mp_test_lookup(text) == expected);
+
+	g_dir_rewind(dir);
+
+	while ((fname = g_dir_read_name(dir)) != nullptr) {
+		auto *path = g_build_filename(cache_dir, fname, nullptr);
+		unlink(path);
+		g_free(path);
+	}
+
+	g_dir_close(dir);
+	rmdir(cache_dir);
+	g_free(cache_dir);
+	rspamd_multipattern_library_init(nullptr);
+}
+
+}
+
+#endif
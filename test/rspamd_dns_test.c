@@ -6,6 +6,7 @@
 #include "rspamd.h"
 #include "async_session.h"
 #include "cfg_file.h"
+#include "utlist.h"
 
 static guint requests = 0;
 extern struct ev_loop *event_loop;
@@ -102,3 +103,209 @@ rspamd_dns_test_func ()
 
 	ev_run (event_loop, 0);
 }
+
+struct dns_inflight_test_cbdata {
+	struct rspamd_async_session *other_session;
+	rspamd_mempool_t *other_pool;
+	guint ncalls;
+};
+
+static gboolean
+inflight_session_fin (gpointer unused)
+{
+	return TRUE;
+}
+
+static void
+test_dns_inflight_destroy_cb (struct rdns_reply *reply, gpointer arg)
+{
+	struct dns_inflight_test_cbdata *cbd = arg;
+
+	cbd->ncalls ++;
+
+	if (cbd->other_session) {
+		/* Destroys the second coalesced request before it is replied */
+		rspamd_session_destroy (cbd->other_session);
+		rspamd_mempool_delete (cbd->other_pool);
+		cbd->other_session = NULL;
+		cbd->other_pool = NULL;
+	}
+
+	ev_break (event_loop, EVBREAK_ALL);
+}
+
+static void
+test_dns_inflight_cb (struct rdns_reply *reply, gpointer arg)
+{
+	struct dns_inflight_test_cbdata *cbd = arg;
+
+	cbd->ncalls ++;
+}
+
+void
+rspamd_dns_inflight_test_func ()
+{
+	struct rspamd_config *cfg;
+	struct rspamd_dns_resolver *inflight_resolver;
+	rspamd_mempool_t *pool1, *pool2;
+	struct rspamd_async_session *s1, *s2;
+	struct dns_inflight_test_cbdata cbd1, cbd2;
+
+	cfg = (struct rspamd_config *)g_malloc0 (sizeof (struct rspamd_config));
+	cfg->cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL, 0);
+	cfg->dns_retransmits = 1;
+	cfg->dns_timeout = 0.5;
+
+	pool1 = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL, 0);
+	pool2 = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL, 0);
+	s1 = rspamd_session_create (pool1, inflight_session_fin, NULL, NULL, NULL);
+	s2 = rspamd_session_create (pool2, inflight_session_fin, NULL, NULL, NULL);
+
+	inflight_resolver = rspamd_dns_resolver_init (NULL, event_loop, cfg);
+	g_assert (inflight_resolver != NULL);
+
+	memset (&cbd1, 0, sizeof (cbd1));
+	memset (&cbd2, 0, sizeof (cbd2));
+	cbd1.other_session = s2;
+	cbd1.other_pool = pool2;
+
+	/* Both requests share the same outstanding DNS request */
+	g_assert (rspamd_dns_resolver_request (inflight_resolver, s1, pool1,
+			test_dns_inflight_destroy_cb, &cbd1, RDNS_REQUEST_A, "google.com"));
+	g_assert (rspamd_dns_resolver_request (inflight_resolver, s2, pool2,
+			test_dns_inflight_cb, &cbd2, RDNS_REQUEST_A, "google.com"));
+
+	ev_run (event_loop, 0);
+
+	/* The second request is finalised once on its session destruction */
+	g_assert_cmpuint (cbd1.ncalls, ==, 1);
+	g_assert_cmpuint (cbd2.ncalls, ==, 1);
+	g_assert (cbd1.other_session == NULL);
+
+	/* The next request for the same name is not coalesced with the old one */
+	memset (&cbd2, 0, sizeof (cbd2));
+	g_assert (rspamd_dns_resolver_request (inflight_resolver, s1, pool1,
+			test_dns_inflight_destroy_cb, &cbd2, RDNS_REQUEST_A, "google.com"));
+	ev_run (event_loop, 0);
+	g_assert_cmpuint (cbd2.ncalls, ==, 1);
+
+	rspamd_session_destroy (s1);
+	rspamd_mempool_delete (pool1);
+}
+
+static void
+test_dns_cache_store_a (struct rspamd_dns_cache *cache, const gchar *name,
+		const gchar *addr, gint32 ttl)
+{
+	struct rdns_reply reply;
+	struct rdns_reply_entry entry;
+
+	memset (&reply, 0, sizeof (reply));
+	memset (&entry, 0, sizeof (entry));
+	entry.type = RDNS_REQUEST_A;
+	entry.ttl = ttl;
+	g_assert (inet_pton (AF_INET, addr, &entry.content.a.addr) == 1);
+	entry.prev = &entry;
+	reply.code = RDNS_RC_NOERROR;
+	reply.entries = &entry;
+
+	rspamd_dns_cache_store (name, strlen (name), RDNS_REQUEST_A, &reply, cache);
+}
+
+/* Returns reply code of a cached answer or RDNS_RC_INVALID if it is missing */
+static enum dns_rcode
+test_dns_cache_lookup (struct rspamd_dns_cache *cache, const gchar *name,
+		const gchar *expected_addr)
+{
+	struct rdns_reply_entry *entries = NULL, *cur, *tmp;
+	enum dns_rcode rcode;
+	bool authenticated;
+	gchar addr[INET_ADDRSTRLEN];
+
+	if (!rspamd_dns_cache_lookup (name, strlen (name), RDNS_REQUEST_A, &rcode,
+			&entries, &authenticated, cache)) {
+		return RDNS_RC_INVALID;
+	}
+
+	if (expected_addr) {
+		g_assert (entries != NULL && entries->next == NULL);
+		g_assert (inet_ntop (AF_INET, &entries->content.a.addr, addr,
+				sizeof (addr)) != NULL);
+		g_assert_cmpstr (addr, ==, expected_addr);
+	}
+	else {
+		g_assert (entries == NULL);
+	}
+
+	DL_FOREACH_SAFE (entries, cur, tmp) {
+		free (cur);
+	}
+
+	return rcode;
+}
+
+void
+rspamd_dns_cache_test_func ()
+{
+	struct rspamd_config *cfg;
+	struct rspamd_dns_cache *cache;
+	struct rdns_reply reply;
+	guint64 hits, misses, inserts;
+
+	cfg = (struct rspamd_config *)g_malloc0 (sizeof (struct rspamd_config));
+	cfg->cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL, 0);
+	cfg->dns_cache_size = 64;
+	cfg->dns_cache_max_ttl = 2.0;
+	cfg->dns_cache_negative_ttl = 1.0;
+
+	cache = rspamd_dns_cache_new (cfg);
+	g_assert (cache != NULL);
+
+	/* Record ttl is capped by the maximum ttl */
+	test_dns_cache_store_a (cache, "capped.example.com", "10.0.0.1", 1000);
+	/* Record ttl is lower than the maximum ttl */
+	test_dns_cache_store_a (cache, "short.example.com", "10.0.0.2", 1);
+	/* Negative reply */
+	memset (&reply, 0, sizeof (reply));
+	reply.code = RDNS_RC_NXDOMAIN;
+	rspamd_dns_cache_store ("nx.example.com", sizeof ("nx.example.com") - 1,
+			RDNS_REQUEST_A, &reply, cache);
+	/* Temporary failures are not cached */
+	reply.code = RDNS_RC_SERVFAIL;
+	rspamd_dns_cache_store ("fail.example.com", sizeof ("fail.example.com") - 1,
+			RDNS_REQUEST_A, &reply, cache);
+
+	g_assert_cmpint (test_dns_cache_lookup (cache, "capped.example.com", "10.0.0.1"),
+			==, RDNS_RC_NOERROR);
+	/* Names are case insensitive */
+	g_assert_cmpint (test_dns_cache_lookup (cache, "Short.Example.com", "10.0.0.2"),
+			==, RDNS_RC_NOERROR);
+	g_assert_cmpint (test_dns_cache_lookup (cache, "nx.example.com", NULL),
+			==, RDNS_RC_NXDOMAIN);
+	g_assert_cmpint (test_dns_cache_lookup (cache, "fail.example.com", NULL),
+			==, RDNS_RC_INVALID);
+	g_assert_cmpint (test_dns_cache_lookup (cache, "missing.example.com", NULL),
+			==, RDNS_RC_INVALID);
+
+	/* Record ttl and negative ttl are expired */
+	g_usleep (1200000);
+	g_assert_cmpint (test_dns_cache_lookup (cache, "short.example.com", NULL),
+			==, RDNS_RC_INVALID);
+	g_assert_cmpint (test_dns_cache_lookup (cache, "nx.example.com", NULL),
+			==, RDNS_RC_INVALID);
+	g_assert_cmpint (test_dns_cache_lookup (cache, "capped.example.com", "10.0.0.1"),
+			==, RDNS_RC_NOERROR);
+
+	/* Maximum ttl is expired */
+	g_usleep (1000000);
+	g_assert_cmpint (test_dns_cache_lookup (cache, "capped.example.com", NULL),
+			==, RDNS_RC_INVALID);
+
+	rspamd_dns_cache_stat (cache, &hits, &misses, &inserts);
+	g_assert_cmpuint (hits, ==, 4);
+	g_assert_cmpuint (misses, ==, 5);
+	g_assert_cmpuint (inserts, ==, 3);
+
+	rspamd_mempool_delete (cfg->cfg_pool);
+	g_free (cfg);
+}
@@ -204,6 +204,97 @@ rspamd_btrie_test_vec (void)
 	}
 }
 
+static void
+rspamd_radix_test_flat (void)
+{
+	radix_compressed_t *tree = radix_create_compressed ("flat");
+	const gsize nelts = 10000, nlookups = 100000;
+	guint8 (*keys)[16];
+	rspamd_inet_addr_t *addrs[64];
+	uintptr_t results[G_N_ELEMENTS (addrs)];
+	struct in_addr ina;
+	guint32 a;
+	guint klen;
+	gsize i, j;
+
+	keys = g_malloc (nelts * sizeof (keys[0]));
+
+	for (i = 0; i < nelts; i ++) {
+		memset (keys[i], 0, 10);
+		keys[i][10] = 0xffu;
+		keys[i][11] = 0xffu;
+		a = ottery_rand_uint32 ();
+		memcpy (keys[i] + 12, &a, sizeof (a));
+		radix_insert_compressed (tree, keys[i], sizeof (keys[i]),
+				32 - masks[ottery_rand_range (G_N_ELEMENTS (masks) - 1)], i + 1);
+	}
+
+	g_assert (!radix_has_flat_compressed (tree));
+	radix_build_flat_compressed (tree);
+	/* Lookups below must use flat tables */
+	g_assert (radix_has_flat_compressed (tree));
+
+	for (i = 0; i < nlookups; i += G_N_ELEMENTS (addrs)) {
+		for (j = 0; j < G_N_ELEMENTS (addrs); j ++) {
+			/* Half of addresses are near the inserted ones */
+			if (j % 2) {
+				memcpy (&a, keys[ottery_rand_range (nelts - 1)] + 12, sizeof (a));
+				a ^= htonl (ottery_rand_range (255));
+			}
+			else {
+				a = ottery_rand_uint32 ();
+			}
+
+			ina.s_addr = a;
+			addrs[j] = rspamd_inet_address_new (AF_INET, &ina);
+		}
+
+		radix_find_compressed_addr_batch (tree,
+				(const rspamd_inet_addr_t * const *)addrs,
+				G_N_ELEMENTS (addrs), results);
+
+		for (j = 0; j < G_N_ELEMENTS (addrs); j ++) {
+			guint8 key[16];
+
+			memset (key, 0, 10);
+			key[10] = 0xffu;
+			key[11] = 0xffu;
+			memcpy (key + 12, rspamd_inet_address_get_hash_key (addrs[j],
+					&klen), 4);
+
+			g_assert (radix_find_compressed_addr (tree, addrs[j]) ==
+					radix_find_compressed (tree, key, sizeof (key)));
+			g_assert (results[j] == radix_find_compressed (tree, key, sizeof (key)));
+			rspamd_inet_address_free (addrs[j]);
+		}
+	}
+
+	/* Insertion drops flat tables */
+	radix_insert_compressed (tree, keys[0], sizeof (keys[0]), 0, nelts + 1);
+	g_assert (!radix_has_flat_compressed (tree));
+
+	g_free (keys);
+	radix_destroy_compressed (tree);
+
+	/* Flat tables are not built for small trees */
+	tree = radix_create_compressed ("flat-small");
+
+	for (i = 0; i < 16; i ++) {
+		guint8 key[16];
+
+		memset (key, 0, 10);
+		key[10] = 0xffu;
+		key[11] = 0xffu;
+		a = ottery_rand_uint32 ();
+		memcpy (key + 12, &a, sizeof (a));
+		radix_insert_compressed (tree, key, sizeof (key), 8, i + 1);
+	}
+
+	radix_build_flat_compressed (tree);
+	g_assert (!radix_has_flat_compressed (tree));
+	radix_destroy_compressed (tree);
+}
+
 void
 rspamd_radix_test_func (void)
 {
@@ -227,6 +318,7 @@ rspamd_radix_test_func (void)
 
 	rspamd_btrie_test_vec ();
 	rspamd_radix_test_vec ();
+	rspamd_radix_test_flat ();
 	rspamd_random_seed_fast ();
 
 	nelts = max_elts;
@@ -76,6 +76,8 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/mem_pool", rspamd_mem_pool_test_func);
 	g_test_add_func ("/rspamd/radix", rspamd_radix_test_func);
 	g_test_add_func ("/rspamd/dns", rspamd_dns_test_func);
+	g_test_add_func ("/rspamd/dns/inflight", rspamd_dns_inflight_test_func);
+	g_test_add_func ("/rspamd/dns/cache", rspamd_dns_cache_test_func);
 	g_test_add_func ("/rspamd/dkim", rspamd_dkim_test_func);
 	g_test_add_func ("/rspamd/rrd", rspamd_rrd_test_func);
 	g_test_add_func ("/rspamd/upstream", rspamd_upstream_test_func);
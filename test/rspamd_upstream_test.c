@@ -162,6 +162,68 @@ rspamd_upstream_test_func (void)
 
 	rspamd_upstreams_destroy (nls);
 
+	/* Test latency aware rotation */
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (nls,
+			"latency:127.0.0.1,127.0.0.2,127.0.0.3", 443, NULL));
+	success = 0;
+
+	for (i = 0; i < 1000; i ++) {
+		up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_UNDEF, NULL, 0);
+		g_assert (up != NULL);
+
+		if (strcmp (rspamd_upstream_name (up), "127.0.0.1") == 0) {
+			rspamd_upstream_latency (up, 0.001);
+
+			if (i >= 100) {
+				success ++;
+			}
+		}
+		else {
+			rspamd_upstream_latency (up, 0.1);
+		}
+
+		rspamd_upstream_ok (up);
+	}
+
+	/* Fast upstream should win whenever it is one of two candidates */
+	msg_debug ("fast upstream selected %d times of 900", success);
+	g_assert (success > 500);
+	rspamd_upstreams_destroy (nls);
+
+	/* Test consistent hashing with bounded loads */
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (nls,
+			"bounded-hash:127.0.0.1,127.0.0.2,127.0.0.3", 443, NULL));
+	ottery_rand_bytes (test_key, sizeof (test_key));
+	up = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_HASHED, test_key,
+			sizeof (test_key));
+	g_assert (up != NULL);
+	rspamd_upstream_ok (up);
+
+	/* Without load the same key goes to the same upstream */
+	for (i = 0; i < 100; i ++) {
+		upn = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_HASHED, test_key,
+				sizeof (test_key));
+		g_assert (upn == up);
+		rspamd_upstream_ok (upn);
+	}
+
+	/* Hot key is spread when requests are in flight */
+	success = 0;
+
+	for (i = 0; i < 30; i ++) {
+		upn = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_HASHED, test_key,
+				sizeof (test_key));
+
+		if (upn == up) {
+			success ++;
+		}
+	}
+
+	g_assert (success <= 13);
+	rspamd_upstreams_destroy (nls);
+
 
 	/* Upstream fail test */
 	ev.data = resolver;
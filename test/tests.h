@@ -23,6 +23,8 @@ void rspamd_radix_test_func (void);
 
 /* DNS resolving */
 void rspamd_dns_test_func (void);
+void rspamd_dns_inflight_test_func (void);
+void rspamd_dns_cache_test_func (void);
 
 /* DKIM test */
 void rspamd_dkim_test_func (void);